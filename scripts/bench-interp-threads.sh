@@ -0,0 +1,55 @@
+#!/bin/bash
+#
+# Copyright 2017 WebAssembly Community Group participants
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# Measures how the throughput of wasm-interp scales when one module runs all
+# its exports on several threads at once, each thread with its own memories,
+# tables and globals.
+#
+# usage: bench-interp-threads.sh <module.wasm> [max threads] [wasm-interp args]
+
+set -o nounset
+set -o errexit
+
+SCRIPT_DIR="$(cd "$(dirname "$0")"; pwd -P)"
+ROOT_DIR=${SCRIPT_DIR}/..
+WASM_INTERP=${WASM_INTERP:-${ROOT_DIR}/out/clang/Release/wasm-interp}
+
+MODULE=$1
+MAX_THREADS=${2:-$(getconf _NPROCESSORS_ONLN)}
+shift $(( $# < 2 ? $# : 2 ))
+
+run_seconds() {
+  local threads=$1
+  shift
+  local start=$(date +%s.%N)
+  "${WASM_INTERP}" "${MODULE}" --run-all-exports --threads=${threads} "$@" \
+      > /dev/null
+  local end=$(date +%s.%N)
+  awk "BEGIN { print ${end} - ${start} }"
+}
+
+printf "%8s %10s %12s\n" threads seconds speedup
+BASE=$(run_seconds 1 "$@")
+printf "%8d %10.3f %12.2f\n" 1 ${BASE} 1
+THREADS=2
+while [ ${THREADS} -le ${MAX_THREADS} ]; do
+  SECONDS_TAKEN=$(run_seconds ${THREADS} "$@")
+  # each run does |threads| times the work of the single threaded run
+  SPEEDUP=$(awk "BEGIN { print ${THREADS} * ${BASE} / ${SECONDS_TAKEN} }")
+  printf "%8d %10.3f %12.2f\n" ${THREADS} ${SECONDS_TAKEN} ${SPEEDUP}
+  THREADS=$(( THREADS * 2 ))
+done
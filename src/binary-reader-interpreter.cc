@@ -16,10 +16,16 @@
 
 #include "binary-reader-interpreter.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cinttypes>
 #include <cstdarg>
 #include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include "binary-error-handler.h"
@@ -54,11 +60,426 @@ struct Label {
 Label::Label(IstreamOffset offset, IstreamOffset fixup_offset)
     : offset(offset), fixup_offset(fixup_offset) {}
 
+/* An instruction that can be fused with the instructions that follow it into
+ * a superinstruction. |offset| is where it starts in the istream, and |end| is
+ * where the next instruction starts. */
+struct FusibleInstr {
+  interpreter::Opcode opcode;
+  IstreamOffset offset;
+  IstreamOffset end;
+  uint32_t immediates[2];
+};
+
+static const Index kMaxFusibleInstrs = 2;
+
+/* The fuel cost of a function body or loop body, which is the number of
+ * instructions in it that aren't in a nested loop. It is written to the
+ * alloca or charge_fuel instruction at |fixup_offset| when the body ends. */
+struct FuelCharge {
+  FuelCharge(IstreamOffset fixup_offset)
+      : fixup_offset(fixup_offset), cost(0) {}
+
+  IstreamOffset fixup_offset;
+  uint32_t cost;
+};
+
+/* An instruction of a function body being optimized by
+ * OptimizeFunctionBody. |offset| and |size| are where it was emitted; the
+ * body is emitted again from these, so if |rewritten| is set |opcode| and
+ * |immediates| no longer match the code at |offset|. */
+struct PeepholeInstr {
+  interpreter::Opcode opcode;
+  IstreamOffset offset;
+  IstreamOffset size;
+  /* the target of a br, br_if or br_unless; the value of an i32.const; the
+   * drop and keep counts of a drop or drop_keep; the target count and table
+   * offset of a br_table; the table offset and entry count of its data */
+  uint32_t immediates[2];
+  bool rewritten;
+  /* A branch jumps here, so it can't be merged with the instruction before
+   * it. */
+  bool branch_target;
+};
+
+/* how many unconditional branches a branch is threaded through at most, which
+ * also stops it on a loop of branches */
+static const int kMaxThreadedBranches = 8;
+
+/* how many times OptimizeFunctionBody runs on a function body at most */
+static const int kMaxPeepholePasses = 3;
+
+typedef std::vector<std::pair<IstreamOffset, Index>> CallRelocVector;
+
+/* A function body compiled on its own, as if the istream started with it, so
+ * the module's function bodies can be compiled on several threads at once.
+ * It is moved to its place in the istream once they have all been
+ * compiled. */
+struct RelocatableFunctionBody {
+  std::vector<uint8_t> code;
+  /* where |code| holds an istream offset, which is relative to the start of
+   * |code| */
+  IstreamOffsetVector offset_relocs;
+  /* where |code| holds the offset of a function defined by the module, and
+   * the function's defined index */
+  CallRelocVector call_relocs;
+  /* Errors are saved instead of printed, since only the errors of the first
+   * body that fails are reported. */
+  std::vector<std::pair<Offset, std::string>> errors;
+  bool failed = false;
+};
+
+class BinaryErrorHandlerSave : public BinaryErrorHandler {
+ public:
+  bool OnError(Offset offset, const std::string& error) override {
+    errors.emplace_back(offset, error);
+    return true;
+  }
+
+  std::vector<std::pair<Offset, std::string>> errors;
+};
+
+/* Where a value on the operand stack is while a function body is lowered to
+ * register code: in a register, which is a param or local or the value's own
+ * slot on the stack, or a constant that hasn't been written to a register. */
+struct RegisterOperand {
+  bool is_const;
+  Index reg;
+  /* the type and bits of a constant */
+  Type type;
+  uint64_t bits;
+};
+
+static RegisterOperand make_register_operand(Index reg) {
+  RegisterOperand operand;
+  operand.is_const = false;
+  operand.reg = reg;
+  operand.type = Type::Void;
+  operand.bits = 0;
+  return operand;
+}
+
+static RegisterOperand make_const_operand(Type type, uint64_t bits) {
+  RegisterOperand operand;
+  operand.is_const = true;
+  operand.reg = kInvalidIndex;
+  operand.type = type;
+  operand.bits = bits;
+  return operand;
+}
+
+/* Returns the register code form of an i32 binop whose rhs is a constant,
+ * which takes the constant as an immediate. */
+static bool get_register_imm_binop(wabt::Opcode opcode,
+                                   interpreter::Opcode* out_opcode) {
+  switch (opcode) {
+#define V(Name)                                          \
+  case wabt::Opcode::Name:                               \
+    *out_opcode = interpreter::Opcode::Reg##Name##Imm;   \
+    return true;
+    V(I32Add)
+    V(I32Sub)
+    V(I32Mul)
+    V(I32And)
+    V(I32Or)
+    V(I32Xor)
+    V(I32Shl)
+    V(I32ShrS)
+    V(I32ShrU)
+#undef V
+
+    default:
+      return false;
+  }
+}
+
+/* Returns the size of the instruction at |pc| with its immediates; for data,
+ * that includes the bytes that follow it. */
+static IstreamOffset get_istream_instr_size(const uint8_t* pc) {
+  switch (static_cast<interpreter::Opcode>(*pc)) {
+    case interpreter::Opcode::Br:
+    case interpreter::Opcode::BrIf:
+    case interpreter::Opcode::BrUnless:
+    case interpreter::Opcode::I32Const:
+    case interpreter::Opcode::F32Const:
+    case interpreter::Opcode::GetLocal:
+    case interpreter::Opcode::SetLocal:
+    case interpreter::Opcode::TeeLocal:
+    case interpreter::Opcode::FrameGetLocal:
+    case interpreter::Opcode::FrameSetLocal:
+    case interpreter::Opcode::FrameTeeLocal:
+    case interpreter::Opcode::GetGlobal:
+    case interpreter::Opcode::SetGlobal:
+    case interpreter::Opcode::Call:
+    case interpreter::Opcode::CallHost:
+    case interpreter::Opcode::CurrentMemory:
+    case interpreter::Opcode::GrowMemory:
+    case interpreter::Opcode::ChargeFuel:
+    case interpreter::Opcode::CompileFunc:
+      return sizeof(uint8_t) + sizeof(uint32_t);
+
+    case interpreter::Opcode::I64Const:
+    case interpreter::Opcode::F64Const:
+      return sizeof(uint8_t) + sizeof(uint64_t);
+
+    case interpreter::Opcode::DropKeep:
+      return sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint8_t);
+
+    case interpreter::Opcode::BrTable:
+      return sizeof(uint8_t) + 3 * sizeof(uint32_t) + sizeof(uint8_t);
+
+    case interpreter::Opcode::BrTableDropKeep:
+    case interpreter::Opcode::CallIndirect:
+    case interpreter::Opcode::I32AddLocalLocal:
+    case interpreter::Opcode::I32AddLocalConst:
+    case interpreter::Opcode::I32Load8S:
+    case interpreter::Opcode::I32Load8U:
+    case interpreter::Opcode::I32Load16S:
+    case interpreter::Opcode::I32Load16U:
+    case interpreter::Opcode::I64Load8S:
+    case interpreter::Opcode::I64Load8U:
+    case interpreter::Opcode::I64Load16S:
+    case interpreter::Opcode::I64Load16U:
+    case interpreter::Opcode::I64Load32S:
+    case interpreter::Opcode::I64Load32U:
+    case interpreter::Opcode::I32Load:
+    case interpreter::Opcode::I64Load:
+    case interpreter::Opcode::F32Load:
+    case interpreter::Opcode::F64Load:
+    case interpreter::Opcode::I32Store8:
+    case interpreter::Opcode::I32Store16:
+    case interpreter::Opcode::I32Store:
+    case interpreter::Opcode::I64Store8:
+    case interpreter::Opcode::I64Store16:
+    case interpreter::Opcode::I64Store32:
+    case interpreter::Opcode::I64Store:
+    case interpreter::Opcode::F32Store:
+    case interpreter::Opcode::F64Store:
+      return sizeof(uint8_t) + 2 * sizeof(uint32_t);
+
+    case interpreter::Opcode::Alloca:
+    case interpreter::Opcode::I32LoadLocal:
+      return sizeof(uint8_t) + 3 * sizeof(uint32_t);
+
+    case interpreter::Opcode::FrameAlloca:
+      return sizeof(uint8_t) + 4 * sizeof(uint32_t);
+
+    case interpreter::Opcode::FrameReturn:
+      return sizeof(uint8_t) + 2 * sizeof(uint32_t) + sizeof(uint8_t);
+
+    case interpreter::Opcode::Data: {
+      uint32_t num_bytes;
+      memcpy(&num_bytes, pc + sizeof(uint8_t), sizeof(num_bytes));
+      return sizeof(uint8_t) + sizeof(uint32_t) + num_bytes;
+    }
+
+    default:
+      return sizeof(uint8_t);
+  }
+}
+
+/* Whether the instruction only pushes a value, so it can be removed along
+ * with a drop of that value. */
+static bool is_pure_push(interpreter::Opcode opcode) {
+  switch (opcode) {
+    case interpreter::Opcode::I32Const:
+    case interpreter::Opcode::I64Const:
+    case interpreter::Opcode::F32Const:
+    case interpreter::Opcode::F64Const:
+    case interpreter::Opcode::GetLocal:
+    case interpreter::Opcode::FrameGetLocal:
+    case interpreter::Opcode::GetGlobal:
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+/* Whether execution never continues with the next instruction. */
+static bool is_unconditional_branch(interpreter::Opcode opcode) {
+  switch (opcode) {
+    case interpreter::Opcode::Br:
+    case interpreter::Opcode::BrTable:
+    case interpreter::Opcode::BrTableDropKeep:
+    case interpreter::Opcode::Return:
+    case interpreter::Opcode::FrameReturn:
+    case interpreter::Opcode::Unreachable:
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+/* Returns the offset of the table of a br_table, given the offset of the data
+ * instruction that holds it. */
+static IstreamOffset get_br_table_offset(IstreamOffset data_offset) {
+  IstreamOffset begin = data_offset + sizeof(uint8_t) + sizeof(uint32_t);
+  return (begin + WABT_TABLE_ALIGNMENT - 1) & ~(WABT_TABLE_ALIGNMENT - 1);
+}
+
+/* Computes |opcode| on constant operands. Returns false if it can't be folded;
+ * division and remainder aren't, since they can trap. */
+static bool fold_i32_binop(interpreter::Opcode opcode,
+                           uint32_t lhs,
+                           uint32_t rhs,
+                           uint32_t* out_value) {
+  uint32_t shift = rhs & 31;
+  switch (opcode) {
+    case interpreter::Opcode::I32Add:
+      *out_value = lhs + rhs;
+      break;
+    case interpreter::Opcode::I32Sub:
+      *out_value = lhs - rhs;
+      break;
+    case interpreter::Opcode::I32Mul:
+      *out_value = lhs * rhs;
+      break;
+    case interpreter::Opcode::I32And:
+      *out_value = lhs & rhs;
+      break;
+    case interpreter::Opcode::I32Or:
+      *out_value = lhs | rhs;
+      break;
+    case interpreter::Opcode::I32Xor:
+      *out_value = lhs ^ rhs;
+      break;
+    case interpreter::Opcode::I32Shl:
+      *out_value = lhs << shift;
+      break;
+    case interpreter::Opcode::I32ShrU:
+      *out_value = lhs >> shift;
+      break;
+    case interpreter::Opcode::I32ShrS:
+      *out_value = static_cast<uint32_t>(static_cast<int32_t>(lhs) >> shift);
+      break;
+    case interpreter::Opcode::I32Rotl:
+      *out_value = (lhs << shift) | (lhs >> ((32 - shift) & 31));
+      break;
+    case interpreter::Opcode::I32Rotr:
+      *out_value = (lhs >> shift) | (lhs << ((32 - shift) & 31));
+      break;
+    case interpreter::Opcode::I32Eq:
+      *out_value = lhs == rhs;
+      break;
+    case interpreter::Opcode::I32Ne:
+      *out_value = lhs != rhs;
+      break;
+    case interpreter::Opcode::I32LtU:
+      *out_value = lhs < rhs;
+      break;
+    case interpreter::Opcode::I32LeU:
+      *out_value = lhs <= rhs;
+      break;
+    case interpreter::Opcode::I32GtU:
+      *out_value = lhs > rhs;
+      break;
+    case interpreter::Opcode::I32GeU:
+      *out_value = lhs >= rhs;
+      break;
+    case interpreter::Opcode::I32LtS:
+      *out_value = static_cast<int32_t>(lhs) < static_cast<int32_t>(rhs);
+      break;
+    case interpreter::Opcode::I32LeS:
+      *out_value = static_cast<int32_t>(lhs) <= static_cast<int32_t>(rhs);
+      break;
+    case interpreter::Opcode::I32GtS:
+      *out_value = static_cast<int32_t>(lhs) > static_cast<int32_t>(rhs);
+      break;
+    case interpreter::Opcode::I32GeS:
+      *out_value = static_cast<int32_t>(lhs) >= static_cast<int32_t>(rhs);
+      break;
+
+    default:
+      return false;
+  }
+  return true;
+}
+
+/* Merges |instr| with the instructions at the end of |out| where that saves
+ * dispatching an instruction. Returns false if nothing is left of |instr|. */
+static bool fold_peephole_instr(std::vector<PeepholeInstr>* out,
+                                PeepholeInstr* instr) {
+  while (!instr->branch_target && !out->empty()) {
+    PeepholeInstr& prev = out->back();
+    switch (instr->opcode) {
+      case interpreter::Opcode::Drop:
+      case interpreter::Opcode::DropKeep: {
+        uint32_t drop = instr->immediates[0];
+        uint32_t keep = instr->immediates[1];
+        if (keep == 0 && is_pure_push(prev.opcode)) {
+          /* the dropped value doesn't have to be pushed at all */
+          instr->branch_target = prev.branch_target;
+          instr->immediates[0] = --drop;
+          instr->rewritten = true;
+          out->pop_back();
+          if (drop == 0)
+            return false;
+          continue;
+        }
+        if ((prev.opcode == interpreter::Opcode::Drop ||
+             prev.opcode == interpreter::Opcode::DropKeep) &&
+            (keep == 0 || prev.immediates[1] == 1)) {
+          /* Dropping (d1, keep k1) and then (d2, keep k2) is the same as
+           * dropping (d1 + d2, keep k2), unless only the second keeps the
+           * top value. */
+          prev.immediates[0] += drop;
+          prev.immediates[1] = keep;
+          prev.rewritten = true;
+          return false;
+        }
+        return true;
+      }
+
+      case interpreter::Opcode::I32Eqz:
+        if (prev.opcode != interpreter::Opcode::I32Const)
+          return true;
+        prev.immediates[0] = prev.immediates[0] == 0;
+        prev.rewritten = true;
+        return false;
+
+      case interpreter::Opcode::BrIf:
+      case interpreter::Opcode::BrUnless: {
+        if (prev.opcode != interpreter::Opcode::I32Const)
+          return true;
+        bool taken = (prev.immediates[0] != 0) ==
+                     (instr->opcode == interpreter::Opcode::BrIf);
+        instr->branch_target = prev.branch_target;
+        out->pop_back();
+        if (!taken)
+          return false;
+        instr->opcode = interpreter::Opcode::Br;
+        instr->rewritten = true;
+        return true;
+      }
+
+      default: {
+        if (out->size() < 2 || prev.branch_target ||
+            prev.opcode != interpreter::Opcode::I32Const) {
+          return true;
+        }
+        PeepholeInstr& lhs = (*out)[out->size() - 2];
+        uint32_t value;
+        if (lhs.opcode != interpreter::Opcode::I32Const ||
+            !fold_i32_binop(instr->opcode, lhs.immediates[0],
+                            prev.immediates[0], &value)) {
+          return true;
+        }
+        lhs.immediates[0] = value;
+        lhs.rewritten = true;
+        out->pop_back();
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
 struct ElemSegmentInfo {
-  ElemSegmentInfo(Index* dst, Index func_index)
+  ElemSegmentInfo(TableEntry* dst, Index func_index)
       : dst(dst), func_index(func_index) {}
 
-  Index* dst;
+  TableEntry* dst;
   Index func_index;
 };
 
@@ -76,11 +497,32 @@ class BinaryReaderInterpreter : public BinaryReaderNop {
   BinaryReaderInterpreter(Environment* env,
                           DefinedModule* module,
                           IstreamOffset istream_offset,
+                          const ReadBinaryInterpreterOptions* options,
+                          BinaryErrorHandler* error_handler);
+  BinaryReaderInterpreter(Environment* env,
+                          DefinedModule* module,
+                          std::unique_ptr<OutputBuffer> istream,
+                          IstreamOffset istream_offset,
+                          const ReadBinaryInterpreterOptions* options,
                           BinaryErrorHandler* error_handler);
 
   std::unique_ptr<OutputBuffer> ReleaseOutputBuffer();
   IstreamOffset get_istream_offset() { return istream_offset; }
 
+  /* Saves the module's index mappings, for compiling its skipped function
+   * bodies later. */
+  std::unique_ptr<LazyModule> MakeLazyModule(const void* data, size_t size);
+  /* Restores the index mappings saved by MakeLazyModule. */
+  void InitFromLazyModule(const LazyModule* lazy);
+  /* Copies the index mappings of |reader|, to compile the function bodies it
+   * skipped as RelocatableFunctionBodies. */
+  void InitRelocatable(const BinaryReaderInterpreter* reader);
+  void CompileRelocatableFunctionBody(const void* data,
+                                      size_t size,
+                                      Offset body_offset,
+                                      Index func_index,
+                                      RelocatableFunctionBody* out_body);
+
   // Implement BinaryReader.
   bool OnError(const char* message) override;
 
@@ -140,7 +582,10 @@ class BinaryReaderInterpreter : public BinaryReaderNop {
 
   wabt::Result OnStartFunction(Index func_index) override;
 
+  wabt::Result OnOpcode(wabt::Opcode opcode) override;
+
   wabt::Result BeginFunctionBody(Index index) override;
+  wabt::Result OnSkippedFunctionBody(Index index, Offset offset) override;
   wabt::Result OnLocalDeclCount(Index count) override;
   wabt::Result OnLocalDecl(Index decl_index, Index count, Type type) override;
 
@@ -183,6 +628,7 @@ class BinaryReaderInterpreter : public BinaryReaderNop {
   wabt::Result OnUnaryExpr(wabt::Opcode opcode) override;
   wabt::Result OnUnreachableExpr() override;
   wabt::Result EndFunctionBody(Index index) override;
+  wabt::Result EndCodeSection() override;
 
   wabt::Result EndElemSegmentInitExpr(Index index) override;
   wabt::Result OnElemSegmentFunctionIndex(Index index,
@@ -192,6 +638,9 @@ class BinaryReaderInterpreter : public BinaryReaderNop {
                                  const void* data,
                                  Address size) override;
 
+  wabt::Result OnFunctionName(Index function_index,
+                              StringSlice function_name) override;
+
   wabt::Result OnInitExprF32ConstExpr(Index index, uint32_t value) override;
   wabt::Result OnInitExprF64ConstExpr(Index index, uint64_t value) override;
   wabt::Result OnInitExprGetGlobalExpr(Index index,
@@ -219,23 +668,34 @@ class BinaryReaderInterpreter : public BinaryReaderNop {
   Index TranslateGlobalIndexToEnv(Index global_index);
   Global* GetGlobalByEnvIndex(Index global_index);
   Global* GetGlobalByModuleIndex(Index global_index);
-  Type GetGlobalTypeByModuleIndex(Index global_index);
   Index TranslateLocalIndex(Index local_index);
   Type GetLocalTypeByIndex(Func* func, Index local_index);
 
   IstreamOffset GetIstreamOffset();
 
+  void ResetFusibleInstrs();
+  void PushFusibleInstr(interpreter::Opcode opcode,
+                        IstreamOffset offset,
+                        uint32_t immediate0 = 0,
+                        uint32_t immediate1 = 0);
+  const FusibleInstr* GetFusibleInstr(Index depth);
+  void RewindTo(IstreamOffset offset);
+
   wabt::Result EmitDataAt(IstreamOffset offset,
                           const void* data,
                           IstreamOffset size);
   wabt::Result EmitData(const void* data, IstreamOffset size);
+  void UpdateMaxStackHeight();
   wabt::Result EmitOpcode(wabt::Opcode opcode);
   wabt::Result EmitOpcode(interpreter::Opcode opcode);
   wabt::Result EmitI8(uint8_t value);
   wabt::Result EmitI32(uint32_t value);
   wabt::Result EmitI64(uint64_t value);
   wabt::Result EmitI32At(IstreamOffset offset, uint32_t value);
+  wabt::Result EmitIstreamOffset(IstreamOffset value);
+  wabt::Result EmitIstreamOffsetAt(IstreamOffset offset, IstreamOffset value);
   wabt::Result EmitDropKeep(uint32_t drop, uint8_t keep);
+  wabt::Result EmitReturn(uint32_t drop, uint8_t keep);
   wabt::Result AppendFixup(IstreamOffsetVectorVector* fixups_vector,
                            Index index);
   wabt::Result EmitBrOffset(Index depth, IstreamOffset offset);
@@ -245,9 +705,35 @@ class BinaryReaderInterpreter : public BinaryReaderNop {
   wabt::Result GetReturnDropKeepCount(Index* out_drop_count,
                                       Index* out_keep_count);
   wabt::Result EmitBr(Index depth, Index drop_count, Index keep_count);
-  wabt::Result EmitBrTableOffset(Index depth);
   wabt::Result FixupTopLabel();
+  wabt::Result EmitFusedI32Add(bool* out_fused);
   wabt::Result EmitFuncOffset(DefinedFunc* func, Index func_index);
+  wabt::Result CompileSkippedFunctionBodies();
+  wabt::Result OptimizeFunctionBody();
+
+  Index GetStackRegister(Index depth);
+  void SyncRegisterOperands();
+  wabt::Result EmitMoveToRegister(Index dst, const RegisterOperand& value);
+  wabt::Result GetOperandRegister(Index depth, Index* out_reg);
+  wabt::Result FlushRegisterOperands();
+  wabt::Result SpillLocal(Index reg);
+  wabt::Result EmitRegisterResult(interpreter::Opcode opcode,
+                                  IstreamOffset offset,
+                                  Index depth,
+                                  uint32_t immediate = 0);
+  bool FuseRegisterEqz(Index* out_cond_reg);
+  wabt::Result EmitRegisterReturn(bool has_value);
+  wabt::Result EmitRegisterBr(Index depth, Index limit, bool keep);
+  wabt::Result EmitRegisterCall(interpreter::Opcode opcode,
+                                Index index,
+                                const FuncSignature* sig);
+  wabt::Result EmitRegisterUnary(wabt::Opcode opcode);
+  wabt::Result EmitRegisterBinary(wabt::Opcode opcode);
+  wabt::Result EmitRegisterSetLocal(Index reg, bool tee);
+  wabt::Result EmitRegisterBrIf(Index depth, Index limit, bool keep);
+  wabt::Result EmitRegisterBrTable(Index num_targets,
+                                   Index* target_depths,
+                                   Index default_target_depth);
 
   wabt::Result CheckLocal(Index local_index);
   wabt::Result CheckGlobal(Index global_index);
@@ -265,6 +751,7 @@ class BinaryReaderInterpreter : public BinaryReaderNop {
   PrintErrorCallback MakePrintErrorCallback();
   static void OnHostImportPrintError(const char* msg, void* user_data);
 
+  const ReadBinaryInterpreterOptions* options = nullptr;
   BinaryErrorHandler* error_handler = nullptr;
   Environment* env = nullptr;
   DefinedModule* module = nullptr;
@@ -273,18 +760,49 @@ class BinaryReaderInterpreter : public BinaryReaderNop {
   TypeChecker typechecker;
   std::vector<Label> label_stack;
   IstreamOffsetVectorVector func_fixups;
+  /* the defined indexes of the functions in func_fixups that the current body
+   * calls, so its fixups can be moved when it is optimized */
+  IndexVector body_func_fixups;
   IstreamOffsetVectorVector depth_fixups;
   MemoryWriter istream_writer;
   IstreamOffset istream_offset = 0;
+  /* the most recently emitted instructions that can still be fused into a
+   * superinstruction, oldest first. This is cleared whenever the current
+   * offset becomes a branch target, so a superinstruction never spans one. */
+  FusibleInstr fusible_instrs[kMaxFusibleInstrs];
+  Index num_fusible_instrs = 0;
+  /* With register_machine, where each value on the typechecker's stack is
+   * while the current body is lowered; the value at depth d has register
+   * GetStackRegister(d) as its own. */
+  std::vector<RegisterOperand> register_operands;
+  /* the function body, and each loop body it is currently in */
+  std::vector<FuelCharge> fuel_charges;
   /* mappings from module index space to env index space; this won't just be a
    * translation, because imported values will be resolved as well */
   IndexVector sig_index_mapping;
   IndexVector func_index_mapping;
   IndexVector global_index_mapping;
+  /* Whether the value of each global in the module index space is known
+   * when the module is compiled, so get_global can be folded to a constant:
+   * the module defines it as immutable, and doesn't initialize it from an
+   * import. Imported values can change when a cached module is loaded. */
+  std::vector<bool> constant_globals;
+  /* set when the init expr being read is a get_global */
+  bool init_expr_is_import = false;
 
   Index num_func_imports = 0;
   Index num_global_imports = 0;
 
+  /* where each skipped function body starts, with lazy compilation or
+   * compile_threads */
+  std::vector<Offset> skipped_body_offsets;
+
+  /* Set when compiling RelocatableFunctionBodies; the relocations of the
+   * body being compiled. */
+  bool relocatable = false;
+  IstreamOffsetVector offset_relocs;
+  CallRelocVector call_relocs;
+
   // Changes to linear memory and tables should not apply if a validation error
   // occurs; these vectors cache the changes that must be applied after we know
   // that there are no validation errors.
@@ -303,11 +821,27 @@ BinaryReaderInterpreter::BinaryReaderInterpreter(
     Environment* env,
     DefinedModule* module,
     IstreamOffset istream_offset,
+    const ReadBinaryInterpreterOptions* options,
+    BinaryErrorHandler* error_handler)
+    : BinaryReaderInterpreter(env,
+                              module,
+                              std::move(env->istream),
+                              istream_offset,
+                              options,
+                              error_handler) {}
+
+BinaryReaderInterpreter::BinaryReaderInterpreter(
+    Environment* env,
+    DefinedModule* module,
+    std::unique_ptr<OutputBuffer> istream,
+    IstreamOffset istream_offset,
+    const ReadBinaryInterpreterOptions* options,
     BinaryErrorHandler* error_handler)
-    : error_handler(error_handler),
+    : options(options),
+      error_handler(error_handler),
       env(env),
       module(module),
-      istream_writer(std::move(env->istream)),
+      istream_writer(std::move(istream)),
       istream_offset(istream_offset) {
   tc_error_handler.on_error = OnTypecheckerError;
   tc_error_handler.user_data = this;
@@ -318,6 +852,69 @@ std::unique_ptr<OutputBuffer> BinaryReaderInterpreter::ReleaseOutputBuffer() {
   return istream_writer.ReleaseOutputBuffer();
 }
 
+std::unique_ptr<LazyModule> BinaryReaderInterpreter::MakeLazyModule(
+    const void* data,
+    size_t size) {
+  std::unique_ptr<LazyModule> lazy(new LazyModule());
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  lazy->binary.assign(bytes, bytes + size);
+  lazy->body_offsets = std::move(skipped_body_offsets);
+  lazy->sig_index_mapping = sig_index_mapping;
+  lazy->func_index_mapping = func_index_mapping;
+  lazy->global_index_mapping = global_index_mapping;
+  lazy->constant_globals = constant_globals;
+  lazy->num_func_imports = num_func_imports;
+  lazy->num_global_imports = num_global_imports;
+  lazy->register_machine = options->register_machine;
+  lazy->frame_locals = options->frame_locals;
+  return lazy;
+}
+
+void BinaryReaderInterpreter::InitFromLazyModule(const LazyModule* lazy) {
+  sig_index_mapping = lazy->sig_index_mapping;
+  func_index_mapping = lazy->func_index_mapping;
+  global_index_mapping = lazy->global_index_mapping;
+  constant_globals = lazy->constant_globals;
+  num_func_imports = lazy->num_func_imports;
+  num_global_imports = lazy->num_global_imports;
+  func_fixups.resize(lazy->body_offsets.size());
+}
+
+void BinaryReaderInterpreter::InitRelocatable(
+    const BinaryReaderInterpreter* reader) {
+  sig_index_mapping = reader->sig_index_mapping;
+  func_index_mapping = reader->func_index_mapping;
+  global_index_mapping = reader->global_index_mapping;
+  constant_globals = reader->constant_globals;
+  num_func_imports = reader->num_func_imports;
+  num_global_imports = reader->num_global_imports;
+  func_fixups.resize(reader->func_fixups.size());
+  relocatable = true;
+}
+
+void BinaryReaderInterpreter::CompileRelocatableFunctionBody(
+    const void* data,
+    size_t size,
+    Offset body_offset,
+    Index func_index,
+    RelocatableFunctionBody* out_body) {
+  istream_offset = 0;
+  offset_relocs.clear();
+  call_relocs.clear();
+  ReadBinaryOptions read_options = WABT_READ_BINARY_OPTIONS_DEFAULT;
+  wabt::Result result = read_binary_function_body(
+      data, size, body_offset, func_index, func_index_mapping.size(),
+      sig_index_mapping.size(), this, &read_options);
+  if (WABT_FAILED(result)) {
+    out_body->failed = true;
+    return;
+  }
+  const std::vector<uint8_t>& code = istream_writer.output_buffer().data;
+  out_body->code.assign(code.begin(), code.begin() + istream_offset);
+  out_body->offset_relocs = offset_relocs;
+  out_body->call_relocs = call_relocs;
+}
+
 Label* BinaryReaderInterpreter::GetLabel(Index depth) {
   assert(depth < label_stack.size());
   return &label_stack[label_stack.size() - depth - 1];
@@ -389,10 +986,6 @@ Global* BinaryReaderInterpreter::GetGlobalByModuleIndex(Index global_index) {
   return GetGlobalByEnvIndex(TranslateGlobalIndexToEnv(global_index));
 }
 
-Type BinaryReaderInterpreter::GetGlobalTypeByModuleIndex(Index global_index) {
-  return GetGlobalByModuleIndex(global_index)->typed_value.type;
-}
-
 Type BinaryReaderInterpreter::GetLocalTypeByIndex(Func* func,
                                                   Index local_index) {
   assert(!func->is_host);
@@ -403,6 +996,47 @@ IstreamOffset BinaryReaderInterpreter::GetIstreamOffset() {
   return istream_offset;
 }
 
+void BinaryReaderInterpreter::ResetFusibleInstrs() {
+  num_fusible_instrs = 0;
+}
+
+void BinaryReaderInterpreter::PushFusibleInstr(interpreter::Opcode opcode,
+                                               IstreamOffset offset,
+                                               uint32_t immediate0,
+                                               uint32_t immediate1) {
+  /* only keep instructions that are contiguous in the istream; anything else
+   * emitted in between breaks the sequence */
+  if (num_fusible_instrs > 0 &&
+      fusible_instrs[num_fusible_instrs - 1].end != offset) {
+    ResetFusibleInstrs();
+  }
+  if (num_fusible_instrs == kMaxFusibleInstrs) {
+    std::move(fusible_instrs + 1, fusible_instrs + kMaxFusibleInstrs,
+              fusible_instrs);
+    --num_fusible_instrs;
+  }
+  FusibleInstr& instr = fusible_instrs[num_fusible_instrs++];
+  instr.opcode = opcode;
+  instr.offset = offset;
+  instr.end = GetIstreamOffset();
+  instr.immediates[0] = immediate0;
+  instr.immediates[1] = immediate1;
+}
+
+const FusibleInstr* BinaryReaderInterpreter::GetFusibleInstr(Index depth) {
+  if (depth >= num_fusible_instrs ||
+      fusible_instrs[num_fusible_instrs - 1].end != GetIstreamOffset()) {
+    return nullptr;
+  }
+  return &fusible_instrs[num_fusible_instrs - depth - 1];
+}
+
+void BinaryReaderInterpreter::RewindTo(IstreamOffset offset) {
+  assert(offset <= istream_offset);
+  istream_offset = offset;
+  ResetFusibleInstrs();
+}
+
 wabt::Result BinaryReaderInterpreter::EmitDataAt(IstreamOffset offset,
                                                  const void* data,
                                                  IstreamOffset size) {
@@ -416,11 +1050,24 @@ wabt::Result BinaryReaderInterpreter::EmitData(const void* data,
   return wabt::Result::Ok;
 }
 
+void BinaryReaderInterpreter::UpdateMaxStackHeight() {
+  /* Every opcode is emitted after the typechecker has been updated, so this
+   * sees the height of the stack after each instruction. Register code counts
+   * its temporaries in GetStackRegister instead. */
+  if (current_func && !options->register_machine) {
+    current_func->max_stack_height =
+        std::max<Index>(current_func->max_stack_height,
+                        typechecker.type_stack.size());
+  }
+}
+
 wabt::Result BinaryReaderInterpreter::EmitOpcode(wabt::Opcode opcode) {
+  UpdateMaxStackHeight();
   return EmitData(&opcode, sizeof(uint8_t));
 }
 
 wabt::Result BinaryReaderInterpreter::EmitOpcode(interpreter::Opcode opcode) {
+  UpdateMaxStackHeight();
   return EmitData(&opcode, sizeof(uint8_t));
 }
 
@@ -441,6 +1088,20 @@ wabt::Result BinaryReaderInterpreter::EmitI32At(IstreamOffset offset,
   return EmitDataAt(offset, &value, sizeof(value));
 }
 
+wabt::Result BinaryReaderInterpreter::EmitIstreamOffset(IstreamOffset value) {
+  if (relocatable)
+    offset_relocs.push_back(GetIstreamOffset());
+  return EmitI32(value);
+}
+
+wabt::Result BinaryReaderInterpreter::EmitIstreamOffsetAt(
+    IstreamOffset offset,
+    IstreamOffset value) {
+  if (relocatable)
+    offset_relocs.push_back(offset);
+  return EmitI32At(offset, value);
+}
+
 wabt::Result BinaryReaderInterpreter::EmitDropKeep(uint32_t drop,
                                                    uint8_t keep) {
   assert(drop != UINT32_MAX);
@@ -457,6 +1118,20 @@ wabt::Result BinaryReaderInterpreter::EmitDropKeep(uint32_t drop,
   return wabt::Result::Ok;
 }
 
+wabt::Result BinaryReaderInterpreter::EmitReturn(uint32_t drop, uint8_t keep) {
+  if (options->frame_locals) {
+    /* the caller's frame is in the slot above the locals */
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::FrameReturn));
+    CHECK_RESULT(EmitI32(current_func->param_and_local_types.size()));
+    CHECK_RESULT(EmitI32(drop));
+    CHECK_RESULT(EmitI8(keep));
+  } else {
+    CHECK_RESULT(EmitDropKeep(drop, keep));
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::Return));
+  }
+  return wabt::Result::Ok;
+}
+
 wabt::Result BinaryReaderInterpreter::AppendFixup(
     IstreamOffsetVectorVector* fixups_vector,
     Index index) {
@@ -473,8 +1148,10 @@ wabt::Result BinaryReaderInterpreter::EmitBrOffset(Index depth,
      * top-level function scope. */
     depth = label_stack.size() - 1 - depth;
     CHECK_RESULT(AppendFixup(&depth_fixups, depth));
+    CHECK_RESULT(EmitI32(offset));
+  } else {
+    CHECK_RESULT(EmitIstreamOffset(offset));
   }
-  CHECK_RESULT(EmitI32(offset));
   return wabt::Result::Ok;
 }
 
@@ -505,6 +1182,10 @@ wabt::Result BinaryReaderInterpreter::GetReturnDropKeepCount(
   }
 
   *out_drop_count += current_func->param_and_local_types.size();
+  if (options->frame_locals) {
+    /* the slot holding the caller's frame */
+    ++*out_drop_count;
+  }
   return wabt::Result::Ok;
 }
 
@@ -517,15 +1198,6 @@ wabt::Result BinaryReaderInterpreter::EmitBr(Index depth,
   return wabt::Result::Ok;
 }
 
-wabt::Result BinaryReaderInterpreter::EmitBrTableOffset(Index depth) {
-  Index drop_count, keep_count;
-  CHECK_RESULT(GetBrDropKeepCount(depth, &drop_count, &keep_count));
-  CHECK_RESULT(EmitBrOffset(depth, GetLabel(depth)->offset));
-  CHECK_RESULT(EmitI32(drop_count));
-  CHECK_RESULT(EmitI8(keep_count));
-  return wabt::Result::Ok;
-}
-
 wabt::Result BinaryReaderInterpreter::FixupTopLabel() {
   IstreamOffset offset = GetIstreamOffset();
   Index top = label_stack.size() - 1;
@@ -535,22 +1207,420 @@ wabt::Result BinaryReaderInterpreter::FixupTopLabel() {
   }
 
   IstreamOffsetVector& fixups = depth_fixups[top];
+  if (!fixups.empty())
+    ResetFusibleInstrs();
   for (IstreamOffset fixup : fixups)
-    CHECK_RESULT(EmitI32At(fixup, offset));
+    CHECK_RESULT(EmitIstreamOffsetAt(fixup, offset));
   fixups.clear();
   return wabt::Result::Ok;
 }
 
 wabt::Result BinaryReaderInterpreter::EmitFuncOffset(DefinedFunc* func,
                                                      Index func_index) {
+  if (relocatable && func_index >= num_func_imports) {
+    /* The function may be being compiled on another thread, so its offset
+     * isn't known until the bodies are moved to the istream. */
+    call_relocs.emplace_back(GetIstreamOffset(),
+                             TranslateModuleFuncIndexToDefined(func_index));
+    return EmitI32(kInvalidIstreamOffset);
+  }
   if (func->offset == kInvalidIstreamOffset) {
     Index defined_index = TranslateModuleFuncIndexToDefined(func_index);
     CHECK_RESULT(AppendFixup(&func_fixups, defined_index));
+    body_func_fixups.push_back(defined_index);
   }
   CHECK_RESULT(EmitI32(func->offset));
   return wabt::Result::Ok;
 }
 
+Index BinaryReaderInterpreter::GetStackRegister(Index depth) {
+  /* The temporaries follow the params, the locals and the slot holding the
+   * caller's frame. */
+  current_func->max_stack_height =
+      std::max<Index>(current_func->max_stack_height, depth + 1);
+  return current_func->param_and_local_types.size() + 1 + depth;
+}
+
+void BinaryReaderInterpreter::SyncRegisterOperands() {
+  /* In unreachable code nothing is emitted, but the operands follow the
+   * typechecker, so they match again when the code is reachable. */
+  Index size = typechecker.type_stack.size();
+  while (register_operands.size() > size)
+    register_operands.pop_back();
+  while (register_operands.size() < size) {
+    register_operands.push_back(
+        make_register_operand(GetStackRegister(register_operands.size())));
+  }
+}
+
+wabt::Result BinaryReaderInterpreter::EmitMoveToRegister(
+    Index dst,
+    const RegisterOperand& value) {
+  if (!value.is_const) {
+    if (value.reg == dst)
+      return wabt::Result::Ok;
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::Move));
+    CHECK_RESULT(EmitI32(value.reg));
+    CHECK_RESULT(EmitI32(dst));
+    return wabt::Result::Ok;
+  }
+
+  switch (value.type) {
+    case Type::I32:
+      CHECK_RESULT(EmitOpcode(interpreter::Opcode::I32Const));
+      CHECK_RESULT(EmitI32(value.bits));
+      break;
+    case Type::I64:
+      CHECK_RESULT(EmitOpcode(interpreter::Opcode::I64Const));
+      CHECK_RESULT(EmitI64(value.bits));
+      break;
+    case Type::F32:
+      CHECK_RESULT(EmitOpcode(interpreter::Opcode::F32Const));
+      CHECK_RESULT(EmitI32(value.bits));
+      break;
+    case Type::F64:
+      CHECK_RESULT(EmitOpcode(interpreter::Opcode::F64Const));
+      CHECK_RESULT(EmitI64(value.bits));
+      break;
+    default:
+      WABT_UNREACHABLE;
+  }
+  CHECK_RESULT(EmitI32(dst));
+  return wabt::Result::Ok;
+}
+
+wabt::Result BinaryReaderInterpreter::GetOperandRegister(Index depth,
+                                                         Index* out_reg) {
+  RegisterOperand* operand = &register_operands[depth];
+  if (operand->is_const) {
+    Index reg = GetStackRegister(depth);
+    CHECK_RESULT(EmitMoveToRegister(reg, *operand));
+    *operand = make_register_operand(reg);
+  }
+  *out_reg = operand->reg;
+  return wabt::Result::Ok;
+}
+
+wabt::Result BinaryReaderInterpreter::FlushRegisterOperands() {
+  /* Code that is reached from more than one place can't know which locals
+   * the values on the stack were read from, so they are copied to their own
+   * registers. Constants are the same on every path. */
+  for (Index depth = 0; depth < register_operands.size(); ++depth) {
+    const RegisterOperand& operand = register_operands[depth];
+    Index reg = GetStackRegister(depth);
+    if (!operand.is_const && operand.reg != reg) {
+      CHECK_RESULT(EmitMoveToRegister(reg, operand));
+      register_operands[depth] = make_register_operand(reg);
+    }
+  }
+  return wabt::Result::Ok;
+}
+
+wabt::Result BinaryReaderInterpreter::SpillLocal(Index reg) {
+  /* Copies the values read from a local before it is written. */
+  for (Index depth = 0; depth < register_operands.size(); ++depth) {
+    const RegisterOperand& operand = register_operands[depth];
+    if (!operand.is_const && operand.reg == reg) {
+      Index stack_reg = GetStackRegister(depth);
+      CHECK_RESULT(EmitMoveToRegister(stack_reg, operand));
+      register_operands[depth] = make_register_operand(stack_reg);
+    }
+  }
+  return wabt::Result::Ok;
+}
+
+wabt::Result BinaryReaderInterpreter::EmitRegisterResult(
+    interpreter::Opcode opcode,
+    IstreamOffset offset,
+    Index depth,
+    uint32_t immediate) {
+  /* The result is the last operand of every instruction, so a set_local that
+   * follows can retarget it. */
+  Index reg = GetStackRegister(depth);
+  CHECK_RESULT(EmitI32(reg));
+  register_operands.resize(depth);
+  register_operands.push_back(make_register_operand(reg));
+  PushFusibleInstr(opcode, offset, reg, immediate);
+  return wabt::Result::Ok;
+}
+
+bool BinaryReaderInterpreter::FuseRegisterEqz(Index* out_cond_reg) {
+  /* An i32.eqz that computed the condition is removed, and the branch that
+   * tests it is inverted. */
+  Index depth = register_operands.size() - 1;
+  const RegisterOperand& cond = register_operands[depth];
+  const FusibleInstr* eqz = GetFusibleInstr(0);
+  if (cond.is_const || cond.reg != GetStackRegister(depth) || !eqz ||
+      eqz->opcode != interpreter::Opcode::I32Eqz ||
+      eqz->immediates[0] != cond.reg) {
+    return false;
+  }
+  *out_cond_reg = eqz->immediates[1];
+  RewindTo(eqz->offset);
+  return true;
+}
+
+wabt::Result BinaryReaderInterpreter::EmitRegisterReturn(bool has_value) {
+  /* This doesn't change the operands, since it can be emitted on a branch
+   * that isn't taken. */
+  Index src = kInvalidIndex;
+  if (has_value) {
+    Index depth = register_operands.size() - 1;
+    const RegisterOperand& value = register_operands[depth];
+    if (value.is_const) {
+      src = GetStackRegister(depth);
+      CHECK_RESULT(EmitMoveToRegister(src, value));
+    } else {
+      src = value.reg;
+    }
+  }
+  CHECK_RESULT(EmitOpcode(interpreter::Opcode::Return));
+  CHECK_RESULT(EmitI32(current_func->param_and_local_types.size()));
+  CHECK_RESULT(EmitI32(src));
+  return wabt::Result::Ok;
+}
+
+wabt::Result BinaryReaderInterpreter::EmitRegisterBr(Index depth,
+                                                     Index limit,
+                                                     bool keep) {
+  /* A branch to the function's label returns; any other branch leaves its
+   * value in the register of the label's result. Like EmitRegisterReturn,
+   * this doesn't change the operands. */
+  if (depth == label_stack.size() - 1)
+    return EmitRegisterReturn(keep);
+  if (keep) {
+    CHECK_RESULT(EmitMoveToRegister(GetStackRegister(limit),
+                                    register_operands.back()));
+  }
+  CHECK_RESULT(EmitOpcode(interpreter::Opcode::Br));
+  CHECK_RESULT(EmitBrOffset(depth, GetLabel(depth)->offset));
+  return wabt::Result::Ok;
+}
+
+wabt::Result BinaryReaderInterpreter::EmitRegisterCall(
+    interpreter::Opcode opcode,
+    Index index,
+    const FuncSignature* sig) {
+  /* The args are copied to their own registers, which start the callee's
+   * frame; for call_indirect the key is above them. */
+  Index num_params = sig->param_types.size();
+  Index top = register_operands.size();
+  Index key_reg = kInvalidIndex;
+  if (opcode == interpreter::Opcode::CallIndirect) {
+    --top;
+    CHECK_RESULT(GetOperandRegister(top, &key_reg));
+  }
+  Index params = top - num_params;
+  for (Index depth = params; depth < top; ++depth) {
+    Index reg = GetStackRegister(depth);
+    CHECK_RESULT(EmitMoveToRegister(reg, register_operands[depth]));
+  }
+  Index top_reg = GetStackRegister(top);
+
+  CHECK_RESULT(EmitOpcode(opcode));
+  if (opcode == interpreter::Opcode::Call) {
+    CHECK_RESULT(EmitFuncOffset(GetFuncByModuleIndex(index)->as_defined(),
+                                index));
+  } else if (opcode == interpreter::Opcode::CallIndirect) {
+    CHECK_RESULT(EmitI32(module->table_index));
+    CHECK_RESULT(EmitI32(index));
+    CHECK_RESULT(EmitI32(key_reg));
+  } else {
+    CHECK_RESULT(EmitI32(index));
+  }
+  CHECK_RESULT(EmitI32(top_reg));
+
+  register_operands.resize(params);
+  for (Index i = 0; i < sig->result_types.size(); ++i) {
+    register_operands.push_back(
+        make_register_operand(GetStackRegister(params + i)));
+  }
+  ResetFusibleInstrs();
+  return wabt::Result::Ok;
+}
+
+wabt::Result BinaryReaderInterpreter::EmitRegisterUnary(wabt::Opcode opcode) {
+  if (typechecker_is_unreachable(&typechecker)) {
+    SyncRegisterOperands();
+    return wabt::Result::Ok;
+  }
+  Index depth = register_operands.size() - 1;
+  Index src;
+  CHECK_RESULT(GetOperandRegister(depth, &src));
+  IstreamOffset offset = GetIstreamOffset();
+  CHECK_RESULT(EmitOpcode(opcode));
+  CHECK_RESULT(EmitI32(src));
+  return EmitRegisterResult(static_cast<interpreter::Opcode>(opcode), offset,
+                            depth, src);
+}
+
+wabt::Result BinaryReaderInterpreter::EmitRegisterBinary(wabt::Opcode opcode) {
+  if (typechecker_is_unreachable(&typechecker)) {
+    SyncRegisterOperands();
+    return wabt::Result::Ok;
+  }
+  Index depth = register_operands.size() - 2;
+  RegisterOperand lhs = register_operands[depth];
+  RegisterOperand rhs = register_operands[depth + 1];
+  interpreter::Opcode istream_opcode = static_cast<interpreter::Opcode>(opcode);
+  uint32_t folded;
+  if (lhs.is_const && rhs.is_const && lhs.type == Type::I32 &&
+      fold_i32_binop(istream_opcode, lhs.bits, rhs.bits, &folded)) {
+    register_operands.resize(depth);
+    register_operands.push_back(make_const_operand(Type::I32, folded));
+    return wabt::Result::Ok;
+  }
+
+  Index lhs_reg;
+  CHECK_RESULT(GetOperandRegister(depth, &lhs_reg));
+  IstreamOffset offset;
+  interpreter::Opcode imm_opcode;
+  if (rhs.is_const && get_register_imm_binop(opcode, &imm_opcode)) {
+    offset = GetIstreamOffset();
+    CHECK_RESULT(EmitOpcode(imm_opcode));
+    CHECK_RESULT(EmitI32(lhs_reg));
+    CHECK_RESULT(EmitI32(rhs.bits));
+  } else {
+    Index rhs_reg;
+    CHECK_RESULT(GetOperandRegister(depth + 1, &rhs_reg));
+    offset = GetIstreamOffset();
+    CHECK_RESULT(EmitOpcode(opcode));
+    CHECK_RESULT(EmitI32(rhs_reg));
+    CHECK_RESULT(EmitI32(lhs_reg));
+  }
+  return EmitRegisterResult(istream_opcode, offset, depth);
+}
+
+wabt::Result BinaryReaderInterpreter::EmitRegisterSetLocal(Index reg,
+                                                           bool tee) {
+  if (typechecker_is_unreachable(&typechecker)) {
+    SyncRegisterOperands();
+    return wabt::Result::Ok;
+  }
+  Index depth = register_operands.size() - 1;
+  RegisterOperand value = register_operands[depth];
+  CHECK_RESULT(SpillLocal(reg));
+  const FusibleInstr* instr = GetFusibleInstr(0);
+  if (!value.is_const && value.reg == GetStackRegister(depth) && instr &&
+      instr->immediates[0] == value.reg) {
+    /* The instruction that computed the value writes the local instead. */
+    CHECK_RESULT(EmitI32At(instr->end - sizeof(uint32_t), reg));
+  } else {
+    CHECK_RESULT(EmitMoveToRegister(reg, value));
+  }
+  ResetFusibleInstrs();
+  register_operands.pop_back();
+  if (tee)
+    register_operands.push_back(value.is_const ? value
+                                               : make_register_operand(reg));
+  return wabt::Result::Ok;
+}
+
+wabt::Result BinaryReaderInterpreter::EmitRegisterBrIf(Index depth,
+                                                       Index limit,
+                                                       bool keep) {
+  Index top = register_operands.size() - 1;
+  const RegisterOperand& cond = register_operands[top];
+  if (cond.is_const) {
+    bool taken = static_cast<uint32_t>(cond.bits) != 0;
+    register_operands.pop_back();
+    if (taken)
+      CHECK_RESULT(EmitRegisterBr(depth, limit, keep));
+    return wabt::Result::Ok;
+  }
+
+  Index cond_reg = cond.reg;
+  bool inverted = FuseRegisterEqz(&cond_reg);
+  register_operands.pop_back();
+  bool direct = depth != label_stack.size() - 1 &&
+                (!keep || (!register_operands.back().is_const &&
+                           register_operands.back().reg ==
+                               GetStackRegister(limit)));
+  if (direct) {
+    CHECK_RESULT(EmitOpcode(inverted ? interpreter::Opcode::BrUnless
+                                     : interpreter::Opcode::BrIf));
+    CHECK_RESULT(EmitBrOffset(depth, GetLabel(depth)->offset));
+    CHECK_RESULT(EmitI32(cond_reg));
+  } else {
+    /* The branch has to move its value or return, so the instructions that
+     * do are skipped when the condition doesn't hold. */
+    CHECK_RESULT(EmitOpcode(inverted ? interpreter::Opcode::BrIf
+                                     : interpreter::Opcode::BrUnless));
+    IstreamOffset fixup_offset = GetIstreamOffset();
+    CHECK_RESULT(EmitI32(kInvalidIstreamOffset));
+    CHECK_RESULT(EmitI32(cond_reg));
+    CHECK_RESULT(EmitRegisterBr(depth, limit, keep));
+    CHECK_RESULT(EmitIstreamOffsetAt(fixup_offset, GetIstreamOffset()));
+  }
+  ResetFusibleInstrs();
+  return wabt::Result::Ok;
+}
+
+wabt::Result BinaryReaderInterpreter::EmitRegisterBrTable(
+    Index num_targets,
+    Index* target_depths,
+    Index default_target_depth) {
+  Index key_reg;
+  CHECK_RESULT(GetOperandRegister(register_operands.size() - 1, &key_reg));
+  register_operands.pop_back();
+
+  CHECK_RESULT(EmitOpcode(interpreter::Opcode::BrTable));
+  CHECK_RESULT(EmitI32(key_reg));
+  CHECK_RESULT(EmitI32(num_targets));
+  IstreamOffset fixup_table_offset = GetIstreamOffset();
+  CHECK_RESULT(EmitI32(kInvalidIstreamOffset));
+  /* as in OnBrTableExpr, with a table that only holds the offsets */
+  IstreamOffset table_offset = get_br_table_offset(GetIstreamOffset());
+  IstreamOffset table_end =
+      table_offset + (num_targets + 1) * sizeof(IstreamOffset);
+  CHECK_RESULT(EmitOpcode(interpreter::Opcode::Data));
+  CHECK_RESULT(EmitI32(table_end - GetIstreamOffset() - sizeof(uint32_t)));
+  while (GetIstreamOffset() < table_offset)
+    CHECK_RESULT(EmitI8(0));
+  CHECK_RESULT(EmitIstreamOffsetAt(fixup_table_offset, table_offset));
+
+  /* Targets that need a move or a return branch to a stub after the table
+   * that does it; targets with the same depth share a stub. */
+  std::vector<std::pair<Index, IstreamOffset>> stub_entries;
+  for (Index i = 0; i <= num_targets; ++i) {
+    Index depth = i != num_targets ? target_depths[i] : default_target_depth;
+    TypeCheckerLabel* label;
+    CHECK_RESULT(typechecker_get_label(&typechecker, depth, &label));
+    bool keep = label->label_type != LabelType::Loop && !label->sig.empty();
+    bool direct = depth != label_stack.size() - 1 &&
+                  (!keep || (!register_operands.back().is_const &&
+                             register_operands.back().reg ==
+                                 GetStackRegister(label->type_stack_limit)));
+    if (direct) {
+      CHECK_RESULT(EmitBrOffset(depth, GetLabel(depth)->offset));
+    } else {
+      stub_entries.emplace_back(depth, GetIstreamOffset());
+      CHECK_RESULT(EmitI32(kInvalidIstreamOffset));
+    }
+  }
+
+  std::vector<std::pair<Index, IstreamOffset>> stubs;
+  for (const std::pair<Index, IstreamOffset>& entry : stub_entries) {
+    IstreamOffset stub_offset = kInvalidIstreamOffset;
+    for (const std::pair<Index, IstreamOffset>& stub : stubs) {
+      if (stub.first == entry.first)
+        stub_offset = stub.second;
+    }
+    if (stub_offset == kInvalidIstreamOffset) {
+      TypeCheckerLabel* label;
+      CHECK_RESULT(typechecker_get_label(&typechecker, entry.first, &label));
+      stub_offset = GetIstreamOffset();
+      stubs.emplace_back(entry.first, stub_offset);
+      CHECK_RESULT(EmitRegisterBr(entry.first, label->type_stack_limit,
+                                  label->label_type != LabelType::Loop &&
+                                      !label->sig.empty()));
+    }
+    CHECK_RESULT(EmitIstreamOffsetAt(entry.second, stub_offset));
+  }
+  ResetFusibleInstrs();
+  return wabt::Result::Ok;
+}
+
 bool BinaryReaderInterpreter::OnError(const char* message) {
   return HandleError(state->offset, message);
 }
@@ -573,6 +1643,7 @@ wabt::Result BinaryReaderInterpreter::OnType(Index index,
                           param_types + param_count);
   sig->result_types.insert(sig->result_types.end(), result_types,
                            result_types + result_count);
+  intern_func_signature(env, TranslateSigIndexToEnv(index));
   return wabt::Result::Ok;
 }
 
@@ -716,6 +1787,7 @@ wabt::Result BinaryReaderInterpreter::OnImportFunc(Index import_index,
 
   Index func_env_index;
   if (is_host_import) {
+    import->kind = ExternalKind::Func;
     HostFunc* func = new HostFunc(import->module_name, import->field_name,
                                   import->func.sig_index);
 
@@ -725,7 +1797,7 @@ wabt::Result BinaryReaderInterpreter::OnImportFunc(Index import_index,
     FuncSignature* sig = &env->sigs[func->sig_index];
     CHECK_RESULT(host_delegate->import_func(
         import, func, sig, MakePrintErrorCallback(), host_delegate->user_data));
-    assert(func->callback);
+    assert(func->callback || func->trampoline);
 
     func_env_index = env->funcs.size() - 1;
     AppendExport(host_import_module, ExternalKind::Func, func_env_index,
@@ -760,8 +1832,10 @@ wabt::Result BinaryReaderInterpreter::OnImportTable(Index import_index,
   Import* import = &module->imports[import_index];
 
   if (is_host_import) {
-    env->tables.emplace_back(*elem_limits);
-    Table* table = &env->tables.back();
+    import->kind = ExternalKind::Table;
+    import->table.limits = *elem_limits;
+    env->instance.tables.emplace_back(*elem_limits);
+    Table* table = &env->instance.tables.back();
 
     HostImportDelegate* host_delegate = &host_import_module->import_delegate;
     CHECK_RESULT(host_delegate->import_table(
@@ -769,12 +1843,12 @@ wabt::Result BinaryReaderInterpreter::OnImportTable(Index import_index,
 
     CHECK_RESULT(CheckImportLimits(elem_limits, &table->limits));
 
-    module->table_index = env->tables.size() - 1;
+    module->table_index = env->instance.tables.size() - 1;
     AppendExport(host_import_module, ExternalKind::Table, module->table_index,
                  import->field_name);
   } else {
     CHECK_RESULT(CheckImportKind(import, ExternalKind::Table));
-    Table* table = &env->tables[import_env_index];
+    Table* table = &env->instance.tables[import_env_index];
     CHECK_RESULT(CheckImportLimits(elem_limits, &table->limits));
 
     import->table.limits = *elem_limits;
@@ -797,8 +1871,10 @@ wabt::Result BinaryReaderInterpreter::OnImportMemory(
   Import* import = &module->imports[import_index];
 
   if (is_host_import) {
-    env->memories.emplace_back();
-    Memory* memory = &env->memories.back();
+    import->kind = ExternalKind::Memory;
+    import->memory.limits = *page_limits;
+    env->instance.memories.emplace_back();
+    Memory* memory = &env->instance.memories.back();
 
     HostImportDelegate* host_delegate = &host_import_module->import_delegate;
     CHECK_RESULT(host_delegate->import_memory(
@@ -806,12 +1882,12 @@ wabt::Result BinaryReaderInterpreter::OnImportMemory(
 
     CHECK_RESULT(CheckImportLimits(page_limits, &memory->page_limits));
 
-    module->memory_index = env->memories.size() - 1;
+    module->memory_index = env->instance.memories.size() - 1;
     AppendExport(host_import_module, ExternalKind::Memory, module->memory_index,
                  import->field_name);
   } else {
     CHECK_RESULT(CheckImportKind(import, ExternalKind::Memory));
-    Memory* memory = &env->memories[import_env_index];
+    Memory* memory = &env->instance.memories[import_env_index];
     CHECK_RESULT(CheckImportLimits(page_limits, &memory->page_limits));
 
     import->memory.limits = *page_limits;
@@ -830,6 +1906,9 @@ wabt::Result BinaryReaderInterpreter::OnImportGlobal(Index import_index,
 
   Index global_env_index = env->globals.size() - 1;
   if (is_host_import) {
+    import->kind = ExternalKind::Global;
+    import->global.type = type;
+    import->global.mutable_ = mutable_;
     env->globals.emplace_back(TypedValue(type), mutable_);
     Global* global = &env->globals.back();
 
@@ -848,6 +1927,7 @@ wabt::Result BinaryReaderInterpreter::OnImportGlobal(Index import_index,
     global_env_index = import_env_index;
   }
   global_index_mapping.push_back(global_env_index);
+  constant_globals.push_back(false);
   num_global_imports++;
   return wabt::Result::Ok;
 }
@@ -873,8 +1953,8 @@ wabt::Result BinaryReaderInterpreter::OnTable(Index index,
     PrintError("only one table allowed");
     return wabt::Result::Error;
   }
-  env->tables.emplace_back(*elem_limits);
-  module->table_index = env->tables.size() - 1;
+  env->instance.tables.emplace_back(*elem_limits);
+  module->table_index = env->instance.tables.size() - 1;
   return wabt::Result::Ok;
 }
 
@@ -884,14 +1964,15 @@ wabt::Result BinaryReaderInterpreter::OnMemory(Index index,
     PrintError("only one memory allowed");
     return wabt::Result::Error;
   }
-  env->memories.emplace_back(*page_limits);
-  module->memory_index = env->memories.size() - 1;
+  env->instance.memories.emplace_back(*page_limits);
+  module->memory_index = env->instance.memories.size() - 1;
   return wabt::Result::Ok;
 }
 
 wabt::Result BinaryReaderInterpreter::OnGlobalCount(Index count) {
   for (Index i = 0; i < count; ++i)
     global_index_mapping.push_back(env->globals.size() + i);
+  constant_globals.resize(constant_globals.size() + count, false);
   env->globals.resize(env->globals.size() + count);
   return wabt::Result::Ok;
 }
@@ -903,6 +1984,7 @@ wabt::Result BinaryReaderInterpreter::BeginGlobal(Index index,
   global->typed_value.type = type;
   global->mutable_ = mutable_;
   init_expr_value.type = Type::Void;
+  init_expr_is_import = false;
   return wabt::Result::Ok;
 }
 
@@ -915,6 +1997,7 @@ wabt::Result BinaryReaderInterpreter::EndGlobalInitExpr(Index index) {
     return wabt::Result::Error;
   }
   global->typed_value = init_expr_value;
+  constant_globals[index] = !global->mutable_ && !init_expr_is_import;
   return wabt::Result::Ok;
 }
 
@@ -947,6 +2030,7 @@ wabt::Result BinaryReaderInterpreter::OnInitExprGetGlobalExpr(
     return wabt::Result::Error;
   }
   init_expr_value = ref_global->typed_value;
+  init_expr_is_import = true;
   return wabt::Result::Ok;
 }
 
@@ -1024,10 +2108,10 @@ wabt::Result BinaryReaderInterpreter::OnElemSegmentFunctionIndex(
     Index index,
     Index func_index) {
   assert(module->table_index != kInvalidIndex);
-  Table* table = &env->tables[module->table_index];
-  if (table_offset >= table->func_indexes.size()) {
+  Table* table = &env->instance.tables[module->table_index];
+  if (table_offset >= table->entries.size()) {
     PrintError("elem segment offset is out of bounds: %u >= max value %" PRIzd,
-               table_offset, table->func_indexes.size());
+               table_offset, table->entries.size());
     return wabt::Result::Error;
   }
 
@@ -1038,7 +2122,7 @@ wabt::Result BinaryReaderInterpreter::OnElemSegmentFunctionIndex(
     return wabt::Result::Error;
   }
 
-  elem_segment_infos.emplace_back(&table->func_indexes[table_offset++],
+  elem_segment_infos.emplace_back(&table->entries[table_offset++],
                                   TranslateFuncIndexToEnv(func_index));
   return wabt::Result::Ok;
 }
@@ -1047,7 +2131,7 @@ wabt::Result BinaryReaderInterpreter::OnDataSegmentData(Index index,
                                                         const void* src_data,
                                                         Address size) {
   assert(module->memory_index != kInvalidIndex);
-  Memory* memory = &env->memories[module->memory_index];
+  Memory* memory = &env->instance.memories[module->memory_index];
   if (init_expr_value.type != Type::I32) {
     PrintError("type mismatch in data segment, expected i32 but got %s",
                get_type_name(init_expr_value.type));
@@ -1069,6 +2153,18 @@ wabt::Result BinaryReaderInterpreter::OnDataSegmentData(Index index,
   return wabt::Result::Ok;
 }
 
+wabt::Result BinaryReaderInterpreter::OnFunctionName(
+    Index function_index,
+    StringSlice function_name) {
+  /* Imported functions keep the names given by the modules defining them. */
+  if (function_index >= num_func_imports &&
+      function_index < func_index_mapping.size()) {
+    GetFuncByModuleIndex(function_index)->as_defined()->name =
+        string_slice_to_string(function_name);
+  }
+  return wabt::Result::Ok;
+}
+
 void BinaryReaderInterpreter::PushLabel(IstreamOffset offset,
                                         IstreamOffset fixup_offset) {
   label_stack.emplace_back(offset, fixup_offset);
@@ -1091,10 +2187,14 @@ wabt::Result BinaryReaderInterpreter::BeginFunctionBody(Index index) {
   func->offset = GetIstreamOffset();
   func->local_decl_count = 0;
   func->local_count = 0;
+  func->max_stack_height = 0;
 
   current_func = func;
   depth_fixups.clear();
+  body_func_fixups.clear();
   label_stack.clear();
+  register_operands.clear();
+  ResetFusibleInstrs();
 
   /* fixup function references */
   Index defined_index = TranslateModuleFuncIndexToDefined(index);
@@ -1110,21 +2210,520 @@ wabt::Result BinaryReaderInterpreter::BeginFunctionBody(Index index) {
 
   /* push implicit func label (equivalent to return) */
   PushLabel(kInvalidIstreamOffset, kInvalidIstreamOffset);
+
+  /* Every function starts with an alloca, which allocates space for the
+   * locals and checks that there is room on the value stack for the rest of
+   * the function. Both counts are fixed up in EndFunctionBody. */
+  bool frame_alloca = options->frame_locals || options->register_machine;
+  CHECK_RESULT(EmitOpcode(frame_alloca ? interpreter::Opcode::FrameAlloca
+                                       : interpreter::Opcode::Alloca));
+  CHECK_RESULT(EmitI32(0));
+  CHECK_RESULT(EmitI32(0));
+  /* The alloca also charges the fuel for the function body. */
+  fuel_charges.clear();
+  fuel_charges.emplace_back(GetIstreamOffset());
+  CHECK_RESULT(EmitI32(0));
+  /* frame_alloca sets the frame to where the params start. */
+  if (frame_alloca)
+    CHECK_RESULT(EmitI32(sig->param_types.size()));
+  return wabt::Result::Ok;
+}
+
+wabt::Result BinaryReaderInterpreter::OnSkippedFunctionBody(Index index,
+                                                           Offset offset) {
+  skipped_body_offsets.push_back(offset);
+  if (!options->lazy_compile)
+    return wabt::Result::Ok;
+
+  DefinedFunc* func = GetFuncByModuleIndex(index)->as_defined();
+  func->offset = GetIstreamOffset();
+  func->lazy_module = module;
+  func->lazy_func_index = index;
+  func->lazy_stub_offset = func->offset;
+
+  /* Nothing has been compiled yet, so nothing needs fixing up; every call to
+   * the function will go through the stub. */
+  CHECK_RESULT(EmitOpcode(interpreter::Opcode::CompileFunc));
+  CHECK_RESULT(EmitI32(TranslateFuncIndexToEnv(index)));
   return wabt::Result::Ok;
 }
 
 wabt::Result BinaryReaderInterpreter::EndFunctionBody(Index index) {
   FixupTopLabel();
-  Index drop_count, keep_count;
-  CHECK_RESULT(GetReturnDropKeepCount(&drop_count, &keep_count));
-  CHECK_RESULT(typechecker_end_function(&typechecker));
-  CHECK_RESULT(EmitDropKeep(drop_count, keep_count));
-  CHECK_RESULT(EmitOpcode(interpreter::Opcode::Return));
+  if (options->register_machine) {
+    bool reachable = !typechecker_is_unreachable(&typechecker);
+    bool has_result = !typechecker.label_stack[0].sig.empty();
+    CHECK_RESULT(typechecker_end_function(&typechecker));
+    if (reachable)
+      CHECK_RESULT(EmitRegisterReturn(has_result));
+  } else {
+    Index drop_count, keep_count;
+    CHECK_RESULT(GetReturnDropKeepCount(&drop_count, &keep_count));
+    CHECK_RESULT(typechecker_end_function(&typechecker));
+    CHECK_RESULT(EmitReturn(drop_count, keep_count));
+  }
+  IstreamOffset alloca_offset = current_func->offset + sizeof(uint8_t);
+  CHECK_RESULT(EmitI32At(alloca_offset, current_func->local_count));
+  CHECK_RESULT(EmitI32At(alloca_offset + sizeof(uint32_t),
+                         current_func->max_stack_height));
+  assert(fuel_charges.size() == 1);
+  CHECK_RESULT(EmitI32At(fuel_charges.back().fixup_offset,
+                         fuel_charges.back().cost));
+  fuel_charges.clear();
+  /* Optimizing can leave more to optimize, like code that was only reached
+   * by a branch that was folded away, so repeat while the body shrinks. The
+   * peephole optimizer only knows the stack form. */
+  for (int i = 0; i < kMaxPeepholePasses && !options->register_machine;
+       ++i) {
+    IstreamOffset size = GetIstreamOffset() - current_func->offset;
+    CHECK_RESULT(OptimizeFunctionBody());
+    if (GetIstreamOffset() - current_func->offset == size)
+      break;
+  }
   PopLabel();
   current_func = nullptr;
   return wabt::Result::Ok;
 }
 
+/* The function body is emitted one instruction at a time, so it has
+ * instructions that a look at the whole body shows aren't needed: branches to
+ * branches, branches to the next instruction, drops that could be one
+ * drop_keep, constant operands and code that can't be reached. This removes
+ * them, then moves the rest of the body together and updates every offset
+ * into it. */
+wabt::Result BinaryReaderInterpreter::OptimizeFunctionBody() {
+  IstreamOffset begin = current_func->offset;
+  IstreamOffset end = GetIstreamOffset();
+  const uint8_t* code = istream_writer.output_buffer().data.data();
+  auto read_u32_at = [code](IstreamOffset offset) {
+    uint32_t value;
+    memcpy(&value, &code[offset], sizeof(value));
+    return value;
+  };
+
+  std::vector<PeepholeInstr> instrs;
+  instrs.reserve((end - begin) / 4);
+  for (IstreamOffset offset = begin; offset < end;) {
+    PeepholeInstr instr;
+    instr.opcode = static_cast<interpreter::Opcode>(code[offset]);
+    instr.offset = offset;
+    instr.size = get_istream_instr_size(&code[offset]);
+    instr.immediates[0] = instr.immediates[1] = 0;
+    instr.rewritten = false;
+    instr.branch_target = false;
+    switch (instr.opcode) {
+      case interpreter::Opcode::Br:
+      case interpreter::Opcode::BrIf:
+      case interpreter::Opcode::BrUnless:
+      case interpreter::Opcode::I32Const:
+        instr.immediates[0] = read_u32_at(offset + 1);
+        break;
+
+      case interpreter::Opcode::Drop:
+        instr.immediates[0] = 1;
+        break;
+
+      case interpreter::Opcode::DropKeep:
+        instr.immediates[0] = read_u32_at(offset + 1);
+        instr.immediates[1] = code[offset + 1 + sizeof(uint32_t)];
+        break;
+
+      case interpreter::Opcode::BrTable:
+      case interpreter::Opcode::BrTableDropKeep:
+        instr.immediates[0] = read_u32_at(offset + 1);
+        instr.immediates[1] = read_u32_at(offset + 1 + sizeof(uint32_t));
+        break;
+
+      case interpreter::Opcode::Data:
+        /* the data always follows a br_table */
+        instr.immediates[0] = instrs.back().immediates[1];
+        instr.immediates[1] = instrs.back().immediates[0] + 1;
+        break;
+
+      default:
+        break;
+    }
+    instrs.push_back(instr);
+    offset += instr.size;
+  }
+
+  auto find_instr = [](std::vector<PeepholeInstr>& instrs,
+                       IstreamOffset offset) {
+    return std::lower_bound(instrs.begin(), instrs.end(), offset,
+                            [](const PeepholeInstr& instr,
+                               IstreamOffset offset) {
+                              return instr.offset < offset;
+                            }) -
+           instrs.begin();
+  };
+  auto thread_branch = [&](IstreamOffset target) {
+    for (int i = 0; i < kMaxThreadedBranches; ++i) {
+      size_t index = find_instr(instrs, target);
+      if (index == instrs.size() ||
+          instrs[index].opcode != interpreter::Opcode::Br ||
+          instrs[index].immediates[0] == target) {
+        break;
+      }
+      target = instrs[index].immediates[0];
+    }
+    return target;
+  };
+  auto get_table_entry = [](const PeepholeInstr& data, Index index) {
+    return data.immediates[0] + index * sizeof(IstreamOffset);
+  };
+  auto get_table_end = [](const PeepholeInstr& data) {
+    return data.offset + data.size;
+  };
+
+  /* Most bodies have nothing to optimize; they are left as they are. */
+  bool changed = false;
+
+  /* Thread each branch through the unconditional branches it jumps to. A br
+   * to a return is a return. */
+  for (PeepholeInstr& instr : instrs) {
+    IstreamOffset target = instr.immediates[0];
+    switch (instr.opcode) {
+      case interpreter::Opcode::Br: {
+        instr.immediates[0] = thread_branch(target);
+        changed |= instr.immediates[0] != target;
+        size_t index = find_instr(instrs, instr.immediates[0]);
+        if (index < instrs.size() &&
+            instrs[index].opcode == interpreter::Opcode::Return) {
+          instr.opcode = interpreter::Opcode::Return;
+          instr.rewritten = true;
+          changed = true;
+        }
+        break;
+      }
+
+      case interpreter::Opcode::BrIf:
+      case interpreter::Opcode::BrUnless:
+        instr.immediates[0] = thread_branch(target);
+        changed |= instr.immediates[0] != target;
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  std::vector<bool> is_branch_target(end - begin);
+  for (const PeepholeInstr& instr : instrs) {
+    switch (instr.opcode) {
+      case interpreter::Opcode::Br:
+      case interpreter::Opcode::BrIf:
+      case interpreter::Opcode::BrUnless:
+        is_branch_target[instr.immediates[0] - begin] = true;
+        break;
+
+      case interpreter::Opcode::Data:
+        for (Index i = 0; i < instr.immediates[1]; ++i) {
+          IstreamOffset entry = get_table_entry(instr, i);
+          IstreamOffset target = thread_branch(read_u32_at(entry));
+          changed |= target != read_u32_at(entry);
+          is_branch_target[target - begin] = true;
+        }
+        break;
+
+      default:
+        break;
+    }
+  }
+  /* The body has to end with its return, even if it is never reached; the
+   * jit looks for it to find the end of the function. */
+  is_branch_target[instrs.back().offset - begin] = true;
+
+  /* Skip the instructions that can't be reached, and fold each of the others
+   * into the instructions before it where possible. */
+  std::vector<PeepholeInstr> out;
+  out.reserve(instrs.size());
+  bool reachable = true;
+  bool pending_branch_target = false;
+  for (size_t i = 0; i < instrs.size(); ++i) {
+    PeepholeInstr instr = instrs[i];
+    instr.branch_target = is_branch_target[instr.offset - begin];
+    if (!reachable && !instr.branch_target)
+      continue;
+    /* A branch to an instruction that was folded away goes to the next
+     * one. */
+    instr.branch_target |= pending_branch_target;
+    pending_branch_target = false;
+    reachable = true;
+    if (!fold_peephole_instr(&out, &instr)) {
+      pending_branch_target = instr.branch_target;
+      continue;
+    }
+    out.push_back(instr);
+    if (instr.opcode == interpreter::Opcode::BrTable ||
+        instr.opcode == interpreter::Opcode::BrTableDropKeep) {
+      out.push_back(instrs[++i]);
+    }
+    reachable = !is_unconditional_branch(instr.opcode);
+  }
+  changed |= out.size() != instrs.size();
+
+  /* Remove the branches to the next instruction. Removing one can make
+   * another branch jump to the next instruction, so repeat until none do. */
+  bool removed;
+  do {
+    removed = false;
+    size_t num_out = 0;
+    for (size_t i = 0; i < out.size(); ++i) {
+      PeepholeInstr& instr = out[i];
+      if ((instr.opcode == interpreter::Opcode::Br ||
+           instr.opcode == interpreter::Opcode::BrIf ||
+           instr.opcode == interpreter::Opcode::BrUnless) &&
+          static_cast<size_t>(find_instr(out, instr.immediates[0])) == i + 1) {
+        changed = true;
+        if (instr.opcode == interpreter::Opcode::Br) {
+          removed = true;
+          continue;
+        }
+        /* the condition still has to be dropped */
+        instr.opcode = interpreter::Opcode::Drop;
+        instr.immediates[0] = 1;
+        instr.immediates[1] = 0;
+        instr.rewritten = true;
+      }
+      out[num_out++] = instr;
+    }
+    out.resize(num_out);
+  } while (removed);
+  if (!changed)
+    return wabt::Result::Ok;
+
+  std::vector<IstreamOffset> new_offsets(out.size());
+  IstreamOffset new_end = begin;
+  for (size_t i = 0; i < out.size(); ++i) {
+    const PeepholeInstr& instr = out[i];
+    new_offsets[i] = new_end;
+    if (instr.opcode == interpreter::Opcode::Data) {
+      /* the table may need different padding to stay aligned */
+      new_end = get_br_table_offset(new_end) + get_table_end(instr) -
+                get_table_entry(instr, 0);
+    } else if (!instr.rewritten) {
+      new_end += instr.size;
+    } else if (instr.opcode == interpreter::Opcode::Drop ||
+               instr.opcode == interpreter::Opcode::DropKeep) {
+      new_end += instr.immediates[0] == 1 && instr.immediates[1] == 0
+                     ? sizeof(uint8_t)
+                     : sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint8_t);
+    } else if (instr.opcode == interpreter::Opcode::Return) {
+      new_end += sizeof(uint8_t);
+    } else {
+      new_end += sizeof(uint8_t) + sizeof(uint32_t);
+    }
+  }
+  auto remap_branch_target = [&](IstreamOffset target) {
+    size_t index = find_instr(out, target);
+    return index < out.size() ? new_offsets[index] : new_end;
+  };
+  /* Returns kInvalidIstreamOffset if the instruction holding |offset| was
+   * removed or rewritten. */
+  auto remap_offset = [&](IstreamOffset offset) {
+    size_t index = find_instr(out, offset + 1);
+    if (index == 0)
+      return kInvalidIstreamOffset;
+    const PeepholeInstr& instr = out[index - 1];
+    if (instr.rewritten || offset >= instr.offset + instr.size)
+      return kInvalidIstreamOffset;
+    return new_offsets[index - 1] + (offset - instr.offset);
+  };
+
+  std::vector<uint8_t> body;
+  body.reserve(new_end - begin);
+  auto append = [&body](const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    body.insert(body.end(), bytes, bytes + size);
+  };
+  auto append_istream_offset = [&](IstreamOffset value) {
+    if (relocatable)
+      offset_relocs.push_back(begin + body.size());
+    append(&value, sizeof(value));
+  };
+  if (relocatable)
+    offset_relocs.clear();
+  for (size_t i = 0; i < out.size(); ++i) {
+    const PeepholeInstr& instr = out[i];
+    uint8_t opcode = static_cast<uint8_t>(instr.opcode);
+    switch (instr.opcode) {
+      case interpreter::Opcode::Br:
+      case interpreter::Opcode::BrIf:
+      case interpreter::Opcode::BrUnless:
+        append(&opcode, sizeof(opcode));
+        append_istream_offset(remap_branch_target(instr.immediates[0]));
+        break;
+
+      case interpreter::Opcode::BrTable:
+      case interpreter::Opcode::BrTableDropKeep: {
+        /* the table is in the data that always follows */
+        IstreamOffset table = get_br_table_offset(new_offsets[i + 1]);
+        append(&code[instr.offset], sizeof(uint8_t) + sizeof(uint32_t));
+        append_istream_offset(table);
+        IstreamOffset immediates = instr.offset + sizeof(uint8_t) +
+                                   2 * sizeof(uint32_t);
+        append(&code[immediates], instr.offset + instr.size - immediates);
+        break;
+      }
+
+      case interpreter::Opcode::Data: {
+        IstreamOffset table = get_br_table_offset(new_offsets[i]);
+        IstreamOffset table_size =
+            get_table_end(instr) - get_table_entry(instr, 0);
+        uint32_t num_bytes = table + table_size - new_offsets[i] -
+                             sizeof(uint8_t) - sizeof(uint32_t);
+        append(&opcode, sizeof(opcode));
+        append(&num_bytes, sizeof(num_bytes));
+        body.resize(table - begin);
+        for (Index entry = 0; entry < instr.immediates[1]; ++entry) {
+          IstreamOffset target =
+              read_u32_at(get_table_entry(instr, entry));
+          append_istream_offset(remap_branch_target(thread_branch(target)));
+        }
+        /* the drop and keep counts of a br_table.drop_keep */
+        IstreamOffset counts = get_table_entry(instr, instr.immediates[1]);
+        append(&code[counts], get_table_end(instr) - counts);
+        break;
+      }
+
+      default:
+        if (!instr.rewritten) {
+          append(&code[instr.offset], instr.size);
+        } else if (instr.opcode == interpreter::Opcode::Drop ||
+                   instr.opcode == interpreter::Opcode::DropKeep) {
+          if (instr.immediates[0] == 1 && instr.immediates[1] == 0) {
+            opcode = static_cast<uint8_t>(interpreter::Opcode::Drop);
+            append(&opcode, sizeof(opcode));
+          } else {
+            uint8_t keep = instr.immediates[1];
+            opcode = static_cast<uint8_t>(interpreter::Opcode::DropKeep);
+            append(&opcode, sizeof(opcode));
+            append(&instr.immediates[0], sizeof(uint32_t));
+            append(&keep, sizeof(keep));
+          }
+        } else if (instr.opcode == interpreter::Opcode::Return) {
+          append(&opcode, sizeof(opcode));
+        } else {
+          assert(instr.opcode == interpreter::Opcode::I32Const);
+          append(&opcode, sizeof(opcode));
+          append(&instr.immediates[0], sizeof(uint32_t));
+        }
+        break;
+    }
+  }
+  assert(begin + body.size() == new_end);
+
+  /* Move the calls to functions whose offsets aren't known yet, and forget
+   * the ones that were removed. */
+  for (auto& reloc : call_relocs)
+    reloc.first = remap_offset(reloc.first);
+  call_relocs.erase(
+      std::remove_if(call_relocs.begin(), call_relocs.end(),
+                     [](const std::pair<IstreamOffset, Index>& reloc) {
+                       return reloc.first == kInvalidIstreamOffset;
+                     }),
+      call_relocs.end());
+  std::sort(body_func_fixups.begin(), body_func_fixups.end());
+  body_func_fixups.erase(
+      std::unique(body_func_fixups.begin(), body_func_fixups.end()),
+      body_func_fixups.end());
+  for (Index defined_index : body_func_fixups) {
+    /* the fixups are appended in istream order, so this body's are last */
+    IstreamOffsetVector& fixups = func_fixups[defined_index];
+    auto first = std::lower_bound(fixups.begin(), fixups.end(), begin);
+    for (auto iter = first; iter != fixups.end(); ++iter)
+      *iter = remap_offset(*iter);
+    fixups.erase(std::remove(first, fixups.end(), kInvalidIstreamOffset),
+                 fixups.end());
+  }
+
+  CHECK_RESULT(EmitDataAt(begin, body.data(), body.size()));
+  RewindTo(new_end);
+  return wabt::Result::Ok;
+}
+
+wabt::Result BinaryReaderInterpreter::EndCodeSection() {
+  if (!options->lazy_compile && !skipped_body_offsets.empty())
+    CHECK_RESULT(CompileSkippedFunctionBodies());
+  return wabt::Result::Ok;
+}
+
+wabt::Result BinaryReaderInterpreter::CompileSkippedFunctionBodies() {
+  const void* data = state->data;
+  size_t size = state->size;
+  Index num_bodies = skipped_body_offsets.size();
+  std::vector<RelocatableFunctionBody> bodies(num_bodies);
+
+  /* Each thread takes the next body that hasn't been taken yet, so a thread
+   * that gets small bodies just compiles more of them. */
+  std::atomic<Index> next_body(0);
+  auto compile_bodies = [&]() {
+    BinaryErrorHandlerSave body_error_handler;
+    BinaryReaderInterpreter reader(env, module,
+                                   std::unique_ptr<OutputBuffer>(
+                                       new OutputBuffer()),
+                                   0, options, &body_error_handler);
+    reader.InitRelocatable(this);
+    for (Index i = next_body++; i < num_bodies; i = next_body++) {
+      reader.CompileRelocatableFunctionBody(data, size, skipped_body_offsets[i],
+                                            num_func_imports + i, &bodies[i]);
+      bodies[i].errors = std::move(body_error_handler.errors);
+      body_error_handler.errors.clear();
+    }
+  };
+
+  Index num_threads =
+      std::min(static_cast<Index>(options->compile_threads), num_bodies);
+  std::vector<std::thread> threads;
+  for (Index i = 1; i < num_threads; ++i)
+    threads.emplace_back(compile_bodies);
+  compile_bodies();
+  for (std::thread& thread : threads)
+    thread.join();
+
+  for (const RelocatableFunctionBody& body : bodies) {
+    if (body.failed) {
+      for (const auto& error : body.errors)
+        HandleError(error.first, error.second.c_str());
+      return wabt::Result::Error;
+    }
+  }
+
+  /* Move the bodies to the istream in order, then point the calls at the
+   * functions' final offsets. Each body was compiled at offset 0, so it is
+   * moved to an aligned offset to keep its br_table tables aligned. */
+  for (Index i = 0; i < num_bodies; ++i) {
+    RelocatableFunctionBody& body = bodies[i];
+    while (GetIstreamOffset() % WABT_TABLE_ALIGNMENT != 0)
+      CHECK_RESULT(EmitOpcode(interpreter::Opcode::Nop));
+    IstreamOffset base = GetIstreamOffset();
+    for (IstreamOffset reloc : body.offset_relocs) {
+      IstreamOffset value;
+      memcpy(&value, &body.code[reloc], sizeof(value));
+      value += base;
+      memcpy(&body.code[reloc], &value, sizeof(value));
+    }
+    CHECK_RESULT(EmitData(body.code.data(), body.code.size()));
+    GetFuncByModuleIndex(num_func_imports + i)->as_defined()->offset = base;
+  }
+  for (Index i = 0; i < num_bodies; ++i) {
+    IstreamOffset base =
+        GetFuncByModuleIndex(num_func_imports + i)->as_defined()->offset;
+    for (const auto& reloc : bodies[i].call_relocs) {
+      Func* callee = GetFuncByModuleIndex(num_func_imports + reloc.second);
+      CHECK_RESULT(
+          EmitI32At(base + reloc.first, callee->as_defined()->offset));
+    }
+  }
+  return wabt::Result::Ok;
+}
+
+wabt::Result BinaryReaderInterpreter::OnOpcode(wabt::Opcode opcode) {
+  if (!fuel_charges.empty())
+    fuel_charges.back().cost++;
+  return wabt::Result::Ok;
+}
+
 wabt::Result BinaryReaderInterpreter::OnLocalDeclCount(Index count) {
   current_func->local_decl_count = count;
   return wabt::Result::Ok;
@@ -1137,12 +2736,6 @@ wabt::Result BinaryReaderInterpreter::OnLocalDecl(Index decl_index,
 
   for (Index i = 0; i < count; ++i)
     current_func->param_and_local_types.push_back(type);
-
-  if (decl_index == current_func->local_decl_count - 1) {
-    /* last local declaration, allocate space for all locals. */
-    CHECK_RESULT(EmitOpcode(interpreter::Opcode::Alloca));
-    CHECK_RESULT(EmitI32(current_func->local_count));
-  }
   return wabt::Result::Ok;
 }
 
@@ -1167,12 +2760,64 @@ wabt::Result BinaryReaderInterpreter::CheckAlign(uint32_t alignment_log2,
 
 wabt::Result BinaryReaderInterpreter::OnUnaryExpr(wabt::Opcode opcode) {
   CHECK_RESULT(typechecker_on_unary(&typechecker, opcode));
+  if (options->register_machine)
+    return EmitRegisterUnary(opcode);
+  IstreamOffset offset = GetIstreamOffset();
   CHECK_RESULT(EmitOpcode(opcode));
+  if (opcode == wabt::Opcode::I32Eqz)
+    PushFusibleInstr(interpreter::Opcode::I32Eqz, offset);
+  return wabt::Result::Ok;
+}
+
+wabt::Result BinaryReaderInterpreter::EmitFusedI32Add(bool* out_fused) {
+  *out_fused = false;
+  const FusibleInstr* lhs = GetFusibleInstr(1);
+  const FusibleInstr* rhs = GetFusibleInstr(0);
+  if (!lhs)
+    return wabt::Result::Ok;
+
+  /* The fused instruction runs at the stack height of the first get_local, so
+   * the depth of a get_local that was emitted second is one less. */
+  IstreamOffset offset = lhs->offset;
+  interpreter::Opcode lhs_opcode = lhs->opcode;
+  interpreter::Opcode rhs_opcode = rhs->opcode;
+  uint32_t lhs_immediate = lhs->immediates[0];
+  uint32_t rhs_immediate = rhs->immediates[0];
+  if (lhs_opcode == interpreter::Opcode::GetLocal &&
+      rhs_opcode == interpreter::Opcode::GetLocal) {
+    RewindTo(offset);
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::I32AddLocalLocal));
+    CHECK_RESULT(EmitI32(lhs_immediate));
+    CHECK_RESULT(EmitI32(rhs_immediate - 1));
+    *out_fused = true;
+  } else if (lhs_opcode == interpreter::Opcode::GetLocal &&
+             rhs_opcode == interpreter::Opcode::I32Const) {
+    RewindTo(offset);
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::I32AddLocalConst));
+    CHECK_RESULT(EmitI32(lhs_immediate));
+    CHECK_RESULT(EmitI32(rhs_immediate));
+    *out_fused = true;
+  } else if (lhs_opcode == interpreter::Opcode::I32Const &&
+             rhs_opcode == interpreter::Opcode::GetLocal) {
+    RewindTo(offset);
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::I32AddLocalConst));
+    CHECK_RESULT(EmitI32(rhs_immediate - 1));
+    CHECK_RESULT(EmitI32(lhs_immediate));
+    *out_fused = true;
+  }
   return wabt::Result::Ok;
 }
 
 wabt::Result BinaryReaderInterpreter::OnBinaryExpr(wabt::Opcode opcode) {
   CHECK_RESULT(typechecker_on_binary(&typechecker, opcode));
+  if (options->register_machine)
+    return EmitRegisterBinary(opcode);
+  if (opcode == wabt::Opcode::I32Add) {
+    bool fused;
+    CHECK_RESULT(EmitFusedI32Add(&fused));
+    if (fused)
+      return wabt::Result::Ok;
+  }
   CHECK_RESULT(EmitOpcode(opcode));
   return wabt::Result::Ok;
 }
@@ -1180,7 +2825,10 @@ wabt::Result BinaryReaderInterpreter::OnBinaryExpr(wabt::Opcode opcode) {
 wabt::Result BinaryReaderInterpreter::OnBlockExpr(Index num_types,
                                                   Type* sig_types) {
   TypeVector sig(sig_types, sig_types + num_types);
+  bool reachable = !typechecker_is_unreachable(&typechecker);
   CHECK_RESULT(typechecker_on_block(&typechecker, &sig));
+  if (options->register_machine && reachable)
+    CHECK_RESULT(FlushRegisterOperands());
   PushLabel(kInvalidIstreamOffset, kInvalidIstreamOffset);
   return wabt::Result::Ok;
 }
@@ -1188,16 +2836,54 @@ wabt::Result BinaryReaderInterpreter::OnBlockExpr(Index num_types,
 wabt::Result BinaryReaderInterpreter::OnLoopExpr(Index num_types,
                                                  Type* sig_types) {
   TypeVector sig(sig_types, sig_types + num_types);
+  bool reachable = !typechecker_is_unreachable(&typechecker);
   CHECK_RESULT(typechecker_on_loop(&typechecker, &sig));
+  if (options->register_machine && reachable)
+    CHECK_RESULT(FlushRegisterOperands());
+  /* Branches back to the loop go through the charge_fuel, so the thread can
+   * run out of fuel or be interrupted once per iteration. */
   PushLabel(GetIstreamOffset(), kInvalidIstreamOffset);
+  CHECK_RESULT(EmitOpcode(interpreter::Opcode::ChargeFuel));
+  fuel_charges.emplace_back(GetIstreamOffset());
+  CHECK_RESULT(EmitI32(0));
+  ResetFusibleInstrs();
   return wabt::Result::Ok;
 }
 
 wabt::Result BinaryReaderInterpreter::OnIfExpr(Index num_types,
                                                Type* sig_types) {
   TypeVector sig(sig_types, sig_types + num_types);
+  bool reachable = !typechecker_is_unreachable(&typechecker);
   CHECK_RESULT(typechecker_on_if(&typechecker, &sig));
-  CHECK_RESULT(EmitOpcode(interpreter::Opcode::BrUnless));
+  if (options->register_machine) {
+    if (!reachable) {
+      /* nothing is emitted for the if, so there is no branch to fix up */
+      SyncRegisterOperands();
+      PushLabel(kInvalidIstreamOffset, kInvalidIstreamOffset);
+      return wabt::Result::Ok;
+    }
+    Index cond_reg;
+    bool inverted = FuseRegisterEqz(&cond_reg);
+    if (!inverted)
+      CHECK_RESULT(GetOperandRegister(register_operands.size() - 1, &cond_reg));
+    register_operands.pop_back();
+    CHECK_RESULT(FlushRegisterOperands());
+    CHECK_RESULT(EmitOpcode(inverted ? interpreter::Opcode::BrIf
+                                     : interpreter::Opcode::BrUnless));
+    IstreamOffset fixup_offset = GetIstreamOffset();
+    CHECK_RESULT(EmitI32(kInvalidIstreamOffset));
+    CHECK_RESULT(EmitI32(cond_reg));
+    PushLabel(kInvalidIstreamOffset, fixup_offset);
+    return wabt::Result::Ok;
+  }
+  /* i32.eqz followed by if just inverts the branch to the false arm */
+  const FusibleInstr* cond = GetFusibleInstr(0);
+  if (cond && cond->opcode == interpreter::Opcode::I32Eqz) {
+    RewindTo(cond->offset);
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::BrIf));
+  } else {
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::BrUnless));
+  }
   IstreamOffset fixup_offset = GetIstreamOffset();
   CHECK_RESULT(EmitI32(kInvalidIstreamOffset));
   PushLabel(kInvalidIstreamOffset, fixup_offset);
@@ -1205,13 +2891,29 @@ wabt::Result BinaryReaderInterpreter::OnIfExpr(Index num_types,
 }
 
 wabt::Result BinaryReaderInterpreter::OnElseExpr() {
+  TypeCheckerLabel* tc_label;
+  CHECK_RESULT(typechecker_get_label(&typechecker, 0, &tc_label));
+  bool reachable = !tc_label->unreachable;
+  Index limit = tc_label->type_stack_limit;
+  bool has_result = !tc_label->sig.empty();
   CHECK_RESULT(typechecker_on_else(&typechecker));
+  if (options->register_machine) {
+    /* the true arm leaves its result where the label's result is */
+    if (reachable && has_result) {
+      CHECK_RESULT(EmitMoveToRegister(GetStackRegister(limit),
+                                      register_operands.back()));
+    }
+    SyncRegisterOperands();
+  }
   Label* label = TopLabel();
   IstreamOffset fixup_cond_offset = label->fixup_offset;
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::Br));
   label->fixup_offset = GetIstreamOffset();
   CHECK_RESULT(EmitI32(kInvalidIstreamOffset));
-  CHECK_RESULT(EmitI32At(fixup_cond_offset, GetIstreamOffset()));
+  if (fixup_cond_offset != kInvalidIstreamOffset) {
+    CHECK_RESULT(EmitIstreamOffsetAt(fixup_cond_offset, GetIstreamOffset()));
+  }
+  ResetFusibleInstrs();
   return wabt::Result::Ok;
 }
 
@@ -1219,9 +2921,33 @@ wabt::Result BinaryReaderInterpreter::OnEndExpr() {
   TypeCheckerLabel* label;
   CHECK_RESULT(typechecker_get_label(&typechecker, 0, &label));
   LabelType label_type = label->label_type;
+  bool reachable = !label->unreachable;
+  Index limit = label->type_stack_limit;
+  bool has_result = !label->sig.empty();
   CHECK_RESULT(typechecker_on_end(&typechecker));
+  if (options->register_machine) {
+    /* every path into the end leaves the result in the same register */
+    if (reachable && has_result) {
+      CHECK_RESULT(EmitMoveToRegister(GetStackRegister(limit),
+                                      register_operands.back()));
+    }
+    register_operands.resize(limit);
+    if (has_result) {
+      register_operands.push_back(
+          make_register_operand(GetStackRegister(limit)));
+    }
+  }
   if (label_type == LabelType::If || label_type == LabelType::Else) {
-    CHECK_RESULT(EmitI32At(TopLabel()->fixup_offset, GetIstreamOffset()));
+    if (TopLabel()->fixup_offset != kInvalidIstreamOffset) {
+      CHECK_RESULT(
+          EmitIstreamOffsetAt(TopLabel()->fixup_offset, GetIstreamOffset()));
+    }
+    ResetFusibleInstrs();
+  }
+  if (label_type == LabelType::Loop) {
+    CHECK_RESULT(EmitI32At(fuel_charges.back().fixup_offset,
+                           fuel_charges.back().cost));
+    fuel_charges.pop_back();
   }
   FixupTopLabel();
   PopLabel();
@@ -1229,6 +2955,18 @@ wabt::Result BinaryReaderInterpreter::OnEndExpr() {
 }
 
 wabt::Result BinaryReaderInterpreter::OnBrExpr(Index depth) {
+  if (options->register_machine) {
+    TypeCheckerLabel* label;
+    CHECK_RESULT(typechecker_get_label(&typechecker, depth, &label));
+    bool reachable = !typechecker_is_unreachable(&typechecker);
+    Index limit = label->type_stack_limit;
+    bool keep = label->label_type != LabelType::Loop && !label->sig.empty();
+    CHECK_RESULT(typechecker_on_br(&typechecker, depth));
+    if (reachable)
+      CHECK_RESULT(EmitRegisterBr(depth, limit, keep));
+    SyncRegisterOperands();
+    return wabt::Result::Ok;
+  }
   Index drop_count, keep_count;
   CHECK_RESULT(GetBrDropKeepCount(depth, &drop_count, &keep_count));
   CHECK_RESULT(typechecker_on_br(&typechecker, depth));
@@ -1238,14 +2976,43 @@ wabt::Result BinaryReaderInterpreter::OnBrExpr(Index depth) {
 
 wabt::Result BinaryReaderInterpreter::OnBrIfExpr(Index depth) {
   Index drop_count, keep_count;
+  if (options->register_machine) {
+    bool reachable = !typechecker_is_unreachable(&typechecker);
+    CHECK_RESULT(typechecker_on_br_if(&typechecker, depth));
+    if (!reachable) {
+      SyncRegisterOperands();
+      return wabt::Result::Ok;
+    }
+    TypeCheckerLabel* label;
+    CHECK_RESULT(typechecker_get_label(&typechecker, depth, &label));
+    return EmitRegisterBrIf(
+        depth, label->type_stack_limit,
+        label->label_type != LabelType::Loop && !label->sig.empty());
+  }
   CHECK_RESULT(typechecker_on_br_if(&typechecker, depth));
   CHECK_RESULT(GetBrDropKeepCount(depth, &drop_count, &keep_count));
-  /* flip the br_if so if <cond> is true it can drop values from the stack */
-  CHECK_RESULT(EmitOpcode(interpreter::Opcode::BrUnless));
-  IstreamOffset fixup_br_offset = GetIstreamOffset();
-  CHECK_RESULT(EmitI32(kInvalidIstreamOffset));
-  CHECK_RESULT(EmitBr(depth, drop_count, keep_count));
-  CHECK_RESULT(EmitI32At(fixup_br_offset, GetIstreamOffset()));
+  /* i32.eqz followed by br_if just inverts the branch condition */
+  bool invert = false;
+  const FusibleInstr* cond = GetFusibleInstr(0);
+  if (cond && cond->opcode == interpreter::Opcode::I32Eqz) {
+    RewindTo(cond->offset);
+    invert = true;
+  }
+  if (drop_count == 0) {
+    /* nothing to drop, so branch directly to the target */
+    CHECK_RESULT(EmitOpcode(invert ? interpreter::Opcode::BrUnless
+                                   : interpreter::Opcode::BrIf));
+    CHECK_RESULT(EmitBrOffset(depth, GetLabel(depth)->offset));
+  } else {
+    /* flip the br_if so if <cond> is true it can drop values from the stack */
+    CHECK_RESULT(EmitOpcode(invert ? interpreter::Opcode::BrIf
+                                   : interpreter::Opcode::BrUnless));
+    IstreamOffset fixup_br_offset = GetIstreamOffset();
+    CHECK_RESULT(EmitI32(kInvalidIstreamOffset));
+    CHECK_RESULT(EmitBr(depth, drop_count, keep_count));
+    CHECK_RESULT(EmitIstreamOffsetAt(fixup_br_offset, GetIstreamOffset()));
+    ResetFusibleInstrs();
+  }
   return wabt::Result::Ok;
 }
 
@@ -1253,21 +3020,68 @@ wabt::Result BinaryReaderInterpreter::OnBrTableExpr(
     Index num_targets,
     Index* target_depths,
     Index default_target_depth) {
+  if (options->register_machine) {
+    bool reachable = !typechecker_is_unreachable(&typechecker);
+    CHECK_RESULT(typechecker_begin_br_table(&typechecker));
+    for (Index i = 0; i <= num_targets; ++i) {
+      Index depth = i != num_targets ? target_depths[i] : default_target_depth;
+      CHECK_RESULT(typechecker_on_br_table_target(&typechecker, depth));
+    }
+    CHECK_RESULT(typechecker_end_br_table(&typechecker));
+    if (reachable) {
+      CHECK_RESULT(EmitRegisterBrTable(num_targets, target_depths,
+                                       default_target_depth));
+    }
+    SyncRegisterOperands();
+    return wabt::Result::Ok;
+  }
   CHECK_RESULT(typechecker_begin_br_table(&typechecker));
-  CHECK_RESULT(EmitOpcode(interpreter::Opcode::BrTable));
+  Index num_entries = num_targets + 1;
+  IndexVector drop_counts(num_entries);
+  IndexVector keep_counts(num_entries);
+  bool same_drop_keep = true;
+  for (Index i = 0; i < num_entries; ++i) {
+    Index depth = i != num_targets ? target_depths[i] : default_target_depth;
+    CHECK_RESULT(typechecker_on_br_table_target(&typechecker, depth));
+    CHECK_RESULT(GetBrDropKeepCount(depth, &drop_counts[i], &keep_counts[i]));
+    same_drop_keep &=
+        drop_counts[i] == drop_counts[0] && keep_counts[i] == keep_counts[0];
+  }
+
+  /* When every target drops and keeps the same values, the counts are
+   * immediates and the table only holds the offsets. */
+  CHECK_RESULT(EmitOpcode(same_drop_keep
+                              ? interpreter::Opcode::BrTable
+                              : interpreter::Opcode::BrTableDropKeep));
   CHECK_RESULT(EmitI32(num_targets));
   IstreamOffset fixup_table_offset = GetIstreamOffset();
   CHECK_RESULT(EmitI32(kInvalidIstreamOffset));
+  if (same_drop_keep) {
+    CHECK_RESULT(EmitI32(drop_counts[0]));
+    CHECK_RESULT(EmitI8(keep_counts[0]));
+  }
   /* not necessary for the interpreter, but it makes it easier to disassemble.
-   * This opcode specifies how many bytes of data follow. */
+   * This opcode specifies how many bytes of data follow, including the
+   * padding that aligns the table. */
+  IstreamOffset table_offset = get_br_table_offset(GetIstreamOffset());
+  IstreamOffset table_end = table_offset + num_entries * sizeof(IstreamOffset);
+  if (!same_drop_keep)
+    table_end += num_entries * (sizeof(uint32_t) + sizeof(uint8_t));
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::Data));
-  CHECK_RESULT(EmitI32((num_targets + 1) * WABT_TABLE_ENTRY_SIZE));
-  CHECK_RESULT(EmitI32At(fixup_table_offset, GetIstreamOffset()));
+  CHECK_RESULT(EmitI32(table_end - GetIstreamOffset() - sizeof(uint32_t)));
+  while (GetIstreamOffset() < table_offset)
+    CHECK_RESULT(EmitI8(0));
+  CHECK_RESULT(EmitIstreamOffsetAt(fixup_table_offset, table_offset));
 
-  for (Index i = 0; i <= num_targets; ++i) {
+  for (Index i = 0; i < num_entries; ++i) {
     Index depth = i != num_targets ? target_depths[i] : default_target_depth;
-    CHECK_RESULT(typechecker_on_br_table_target(&typechecker, depth));
-    CHECK_RESULT(EmitBrTableOffset(depth));
+    CHECK_RESULT(EmitBrOffset(depth, GetLabel(depth)->offset));
+  }
+  if (!same_drop_keep) {
+    for (Index drop_count : drop_counts)
+      CHECK_RESULT(EmitI32(drop_count));
+    for (Index keep_count : keep_counts)
+      CHECK_RESULT(EmitI8(keep_count));
   }
 
   CHECK_RESULT(typechecker_end_br_table(&typechecker));
@@ -1279,6 +3093,17 @@ wabt::Result BinaryReaderInterpreter::OnCallExpr(Index func_index) {
   FuncSignature* sig = GetSignatureByEnvIndex(func->sig_index);
   CHECK_RESULT(
       typechecker_on_call(&typechecker, &sig->param_types, &sig->result_types));
+  if (options->register_machine) {
+    if (typechecker_is_unreachable(&typechecker)) {
+      SyncRegisterOperands();
+      return wabt::Result::Ok;
+    }
+    if (func->is_host) {
+      return EmitRegisterCall(interpreter::Opcode::CallHost,
+                              TranslateFuncIndexToEnv(func_index), sig);
+    }
+    return EmitRegisterCall(interpreter::Opcode::Call, func_index, sig);
+  }
 
   if (func->is_host) {
     CHECK_RESULT(EmitOpcode(interpreter::Opcode::CallHost));
@@ -1299,10 +3124,17 @@ wabt::Result BinaryReaderInterpreter::OnCallIndirectExpr(Index sig_index) {
   FuncSignature* sig = GetSignatureByModuleIndex(sig_index);
   CHECK_RESULT(typechecker_on_call_indirect(&typechecker, &sig->param_types,
                                             &sig->result_types));
+  if (options->register_machine) {
+    if (typechecker_is_unreachable(&typechecker)) {
+      SyncRegisterOperands();
+      return wabt::Result::Ok;
+    }
+    return EmitRegisterCall(interpreter::Opcode::CallIndirect, sig->id, sig);
+  }
 
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::CallIndirect));
   CHECK_RESULT(EmitI32(module->table_index));
-  CHECK_RESULT(EmitI32(TranslateSigIndexToEnv(sig_index)));
+  CHECK_RESULT(EmitI32(sig->id));
   return wabt::Result::Ok;
 }
 
@@ -1316,19 +3148,36 @@ wabt::Result BinaryReaderInterpreter::OnConvertExpr(wabt::Opcode opcode) {
 
 wabt::Result BinaryReaderInterpreter::OnDropExpr() {
   CHECK_RESULT(typechecker_on_drop(&typechecker));
+  if (options->register_machine) {
+    SyncRegisterOperands();
+    return wabt::Result::Ok;
+  }
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::Drop));
   return wabt::Result::Ok;
 }
 
 wabt::Result BinaryReaderInterpreter::OnI32ConstExpr(uint32_t value) {
   CHECK_RESULT(typechecker_on_const(&typechecker, Type::I32));
+  if (options->register_machine) {
+    /* constants are written to a register only where one is needed */
+    register_operands.push_back(make_const_operand(Type::I32, value));
+    SyncRegisterOperands();
+    return wabt::Result::Ok;
+  }
+  IstreamOffset offset = GetIstreamOffset();
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::I32Const));
   CHECK_RESULT(EmitI32(value));
+  PushFusibleInstr(interpreter::Opcode::I32Const, offset, value);
   return wabt::Result::Ok;
 }
 
 wabt::Result BinaryReaderInterpreter::OnI64ConstExpr(uint64_t value) {
   CHECK_RESULT(typechecker_on_const(&typechecker, Type::I64));
+  if (options->register_machine) {
+    register_operands.push_back(make_const_operand(Type::I64, value));
+    SyncRegisterOperands();
+    return wabt::Result::Ok;
+  }
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::I64Const));
   CHECK_RESULT(EmitI64(value));
   return wabt::Result::Ok;
@@ -1336,6 +3185,11 @@ wabt::Result BinaryReaderInterpreter::OnI64ConstExpr(uint64_t value) {
 
 wabt::Result BinaryReaderInterpreter::OnF32ConstExpr(uint32_t value_bits) {
   CHECK_RESULT(typechecker_on_const(&typechecker, Type::F32));
+  if (options->register_machine) {
+    register_operands.push_back(make_const_operand(Type::F32, value_bits));
+    SyncRegisterOperands();
+    return wabt::Result::Ok;
+  }
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::F32Const));
   CHECK_RESULT(EmitI32(value_bits));
   return wabt::Result::Ok;
@@ -1343,6 +3197,11 @@ wabt::Result BinaryReaderInterpreter::OnF32ConstExpr(uint32_t value_bits) {
 
 wabt::Result BinaryReaderInterpreter::OnF64ConstExpr(uint64_t value_bits) {
   CHECK_RESULT(typechecker_on_const(&typechecker, Type::F64));
+  if (options->register_machine) {
+    register_operands.push_back(make_const_operand(Type::F64, value_bits));
+    SyncRegisterOperands();
+    return wabt::Result::Ok;
+  }
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::F64Const));
   CHECK_RESULT(EmitI64(value_bits));
   return wabt::Result::Ok;
@@ -1350,8 +3209,37 @@ wabt::Result BinaryReaderInterpreter::OnF64ConstExpr(uint64_t value_bits) {
 
 wabt::Result BinaryReaderInterpreter::OnGetGlobalExpr(Index global_index) {
   CHECK_RESULT(CheckGlobal(global_index));
-  Type type = GetGlobalTypeByModuleIndex(global_index);
+  Global* global = GetGlobalByModuleIndex(global_index);
+  Type type = global->typed_value.type;
+  if (constant_globals[global_index]) {
+    /* The global is initialized before any function body is read, so its
+     * value can be used as a constant. */
+    const Value& value = global->typed_value.value;
+    switch (type) {
+      case Type::I32:
+        return OnI32ConstExpr(value.i32);
+      case Type::I64:
+        return OnI64ConstExpr(value.i64);
+      case Type::F32:
+        return OnF32ConstExpr(value.f32_bits);
+      case Type::F64:
+        return OnF64ConstExpr(value.f64_bits);
+      default:
+        break;
+    }
+  }
   CHECK_RESULT(typechecker_on_get_global(&typechecker, type));
+  if (options->register_machine) {
+    if (typechecker_is_unreachable(&typechecker)) {
+      SyncRegisterOperands();
+      return wabt::Result::Ok;
+    }
+    IstreamOffset offset = GetIstreamOffset();
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::GetGlobal));
+    CHECK_RESULT(EmitI32(TranslateGlobalIndexToEnv(global_index)));
+    return EmitRegisterResult(interpreter::Opcode::GetGlobal, offset,
+                              register_operands.size());
+  }
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::GetGlobal));
   CHECK_RESULT(EmitI32(TranslateGlobalIndexToEnv(global_index)));
   return wabt::Result::Ok;
@@ -1367,6 +3255,19 @@ wabt::Result BinaryReaderInterpreter::OnSetGlobalExpr(Index global_index) {
   }
   CHECK_RESULT(
       typechecker_on_set_global(&typechecker, global->typed_value.type));
+  if (options->register_machine) {
+    if (typechecker_is_unreachable(&typechecker)) {
+      SyncRegisterOperands();
+      return wabt::Result::Ok;
+    }
+    Index src;
+    CHECK_RESULT(GetOperandRegister(register_operands.size() - 1, &src));
+    register_operands.pop_back();
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::SetGlobal));
+    CHECK_RESULT(EmitI32(TranslateGlobalIndexToEnv(global_index)));
+    CHECK_RESULT(EmitI32(src));
+    return wabt::Result::Ok;
+  }
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::SetGlobal));
   CHECK_RESULT(EmitI32(TranslateGlobalIndexToEnv(global_index)));
   return wabt::Result::Ok;
@@ -1380,13 +3281,29 @@ Index BinaryReaderInterpreter::TranslateLocalIndex(Index local_index) {
 wabt::Result BinaryReaderInterpreter::OnGetLocalExpr(Index local_index) {
   CHECK_RESULT(CheckLocal(local_index));
   Type type = GetLocalTypeByIndex(current_func, local_index);
+  if (options->register_machine) {
+    /* the value stays in the local's register until it is written */
+    CHECK_RESULT(typechecker_on_get_local(&typechecker, type));
+    register_operands.push_back(make_register_operand(local_index));
+    SyncRegisterOperands();
+    return wabt::Result::Ok;
+  }
+  if (options->frame_locals) {
+    CHECK_RESULT(typechecker_on_get_local(&typechecker, type));
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::FrameGetLocal));
+    CHECK_RESULT(EmitI32(local_index));
+    return wabt::Result::Ok;
+  }
   /* Get the translated index before calling typechecker_on_get_local
    * because it will update the type stack size. We need the index to be
    * relative to the old stack size. */
   Index translated_local_index = TranslateLocalIndex(local_index);
   CHECK_RESULT(typechecker_on_get_local(&typechecker, type));
+  IstreamOffset offset = GetIstreamOffset();
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::GetLocal));
   CHECK_RESULT(EmitI32(translated_local_index));
+  PushFusibleInstr(interpreter::Opcode::GetLocal, offset,
+                   translated_local_index);
   return wabt::Result::Ok;
 }
 
@@ -1394,6 +3311,13 @@ wabt::Result BinaryReaderInterpreter::OnSetLocalExpr(Index local_index) {
   CHECK_RESULT(CheckLocal(local_index));
   Type type = GetLocalTypeByIndex(current_func, local_index);
   CHECK_RESULT(typechecker_on_set_local(&typechecker, type));
+  if (options->register_machine)
+    return EmitRegisterSetLocal(local_index, false);
+  if (options->frame_locals) {
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::FrameSetLocal));
+    CHECK_RESULT(EmitI32(local_index));
+    return wabt::Result::Ok;
+  }
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::SetLocal));
   CHECK_RESULT(EmitI32(TranslateLocalIndex(local_index)));
   return wabt::Result::Ok;
@@ -1403,6 +3327,13 @@ wabt::Result BinaryReaderInterpreter::OnTeeLocalExpr(Index local_index) {
   CHECK_RESULT(CheckLocal(local_index));
   Type type = GetLocalTypeByIndex(current_func, local_index);
   CHECK_RESULT(typechecker_on_tee_local(&typechecker, type));
+  if (options->register_machine)
+    return EmitRegisterSetLocal(local_index, true);
+  if (options->frame_locals) {
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::FrameTeeLocal));
+    CHECK_RESULT(EmitI32(local_index));
+    return wabt::Result::Ok;
+  }
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::TeeLocal));
   CHECK_RESULT(EmitI32(TranslateLocalIndex(local_index)));
   return wabt::Result::Ok;
@@ -1411,6 +3342,20 @@ wabt::Result BinaryReaderInterpreter::OnTeeLocalExpr(Index local_index) {
 wabt::Result BinaryReaderInterpreter::OnGrowMemoryExpr() {
   CHECK_RESULT(CheckHasMemory(wabt::Opcode::GrowMemory));
   CHECK_RESULT(typechecker_on_grow_memory(&typechecker));
+  if (options->register_machine) {
+    if (typechecker_is_unreachable(&typechecker)) {
+      SyncRegisterOperands();
+      return wabt::Result::Ok;
+    }
+    Index depth = register_operands.size() - 1;
+    Index pages;
+    CHECK_RESULT(GetOperandRegister(depth, &pages));
+    IstreamOffset offset = GetIstreamOffset();
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::GrowMemory));
+    CHECK_RESULT(EmitI32(module->memory_index));
+    CHECK_RESULT(EmitI32(pages));
+    return EmitRegisterResult(interpreter::Opcode::GrowMemory, offset, depth);
+  }
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::GrowMemory));
   CHECK_RESULT(EmitI32(module->memory_index));
   return wabt::Result::Ok;
@@ -1422,8 +3367,35 @@ wabt::Result BinaryReaderInterpreter::OnLoadExpr(wabt::Opcode opcode,
   CHECK_RESULT(CheckHasMemory(opcode));
   CHECK_RESULT(CheckAlign(alignment_log2, get_opcode_memory_size(opcode)));
   CHECK_RESULT(typechecker_on_load(&typechecker, opcode));
-  CHECK_RESULT(EmitOpcode(opcode));
-  CHECK_RESULT(EmitI32(module->memory_index));
+  if (options->register_machine) {
+    if (typechecker_is_unreachable(&typechecker)) {
+      SyncRegisterOperands();
+      return wabt::Result::Ok;
+    }
+    Index depth = register_operands.size() - 1;
+    Index addr;
+    CHECK_RESULT(GetOperandRegister(depth, &addr));
+    IstreamOffset instr_offset = GetIstreamOffset();
+    CHECK_RESULT(EmitOpcode(opcode));
+    CHECK_RESULT(EmitI32(module->memory_index));
+    CHECK_RESULT(EmitI32(addr));
+    CHECK_RESULT(EmitI32(offset));
+    return EmitRegisterResult(static_cast<interpreter::Opcode>(opcode),
+                              instr_offset, depth);
+  }
+  const FusibleInstr* base = GetFusibleInstr(0);
+  if (opcode == wabt::Opcode::I32Load && base &&
+      base->opcode == interpreter::Opcode::GetLocal) {
+    /* the fused load reads its address directly from the local */
+    uint32_t depth = base->immediates[0];
+    RewindTo(base->offset);
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::I32LoadLocal));
+    CHECK_RESULT(EmitI32(module->memory_index));
+    CHECK_RESULT(EmitI32(depth));
+  } else {
+    CHECK_RESULT(EmitOpcode(opcode));
+    CHECK_RESULT(EmitI32(module->memory_index));
+  }
   CHECK_RESULT(EmitI32(offset));
   return wabt::Result::Ok;
 }
@@ -1434,6 +3406,23 @@ wabt::Result BinaryReaderInterpreter::OnStoreExpr(wabt::Opcode opcode,
   CHECK_RESULT(CheckHasMemory(opcode));
   CHECK_RESULT(CheckAlign(alignment_log2, get_opcode_memory_size(opcode)));
   CHECK_RESULT(typechecker_on_store(&typechecker, opcode));
+  if (options->register_machine) {
+    if (typechecker_is_unreachable(&typechecker)) {
+      SyncRegisterOperands();
+      return wabt::Result::Ok;
+    }
+    Index depth = register_operands.size() - 2;
+    Index addr, value;
+    CHECK_RESULT(GetOperandRegister(depth, &addr));
+    CHECK_RESULT(GetOperandRegister(depth + 1, &value));
+    register_operands.resize(depth);
+    CHECK_RESULT(EmitOpcode(opcode));
+    CHECK_RESULT(EmitI32(module->memory_index));
+    CHECK_RESULT(EmitI32(value));
+    CHECK_RESULT(EmitI32(addr));
+    CHECK_RESULT(EmitI32(offset));
+    return wabt::Result::Ok;
+  }
   CHECK_RESULT(EmitOpcode(opcode));
   CHECK_RESULT(EmitI32(module->memory_index));
   CHECK_RESULT(EmitI32(offset));
@@ -1443,6 +3432,17 @@ wabt::Result BinaryReaderInterpreter::OnStoreExpr(wabt::Opcode opcode,
 wabt::Result BinaryReaderInterpreter::OnCurrentMemoryExpr() {
   CHECK_RESULT(CheckHasMemory(wabt::Opcode::CurrentMemory));
   CHECK_RESULT(typechecker_on_current_memory(&typechecker));
+  if (options->register_machine) {
+    if (typechecker_is_unreachable(&typechecker)) {
+      SyncRegisterOperands();
+      return wabt::Result::Ok;
+    }
+    IstreamOffset offset = GetIstreamOffset();
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::CurrentMemory));
+    CHECK_RESULT(EmitI32(module->memory_index));
+    return EmitRegisterResult(interpreter::Opcode::CurrentMemory, offset,
+                              register_operands.size());
+  }
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::CurrentMemory));
   CHECK_RESULT(EmitI32(module->memory_index));
   return wabt::Result::Ok;
@@ -1453,21 +3453,53 @@ wabt::Result BinaryReaderInterpreter::OnNopExpr() {
 }
 
 wabt::Result BinaryReaderInterpreter::OnReturnExpr() {
+  if (options->register_machine) {
+    bool reachable = !typechecker_is_unreachable(&typechecker);
+    CHECK_RESULT(typechecker_on_return(&typechecker));
+    if (reachable)
+      CHECK_RESULT(EmitRegisterReturn(!typechecker.label_stack[0].sig.empty()));
+    SyncRegisterOperands();
+    return wabt::Result::Ok;
+  }
   Index drop_count, keep_count;
   CHECK_RESULT(GetReturnDropKeepCount(&drop_count, &keep_count));
   CHECK_RESULT(typechecker_on_return(&typechecker));
-  CHECK_RESULT(EmitDropKeep(drop_count, keep_count));
-  CHECK_RESULT(EmitOpcode(interpreter::Opcode::Return));
+  CHECK_RESULT(EmitReturn(drop_count, keep_count));
   return wabt::Result::Ok;
 }
 
 wabt::Result BinaryReaderInterpreter::OnSelectExpr() {
   CHECK_RESULT(typechecker_on_select(&typechecker));
+  if (options->register_machine) {
+    if (typechecker_is_unreachable(&typechecker)) {
+      SyncRegisterOperands();
+      return wabt::Result::Ok;
+    }
+    Index depth = register_operands.size() - 3;
+    Index true_reg, false_reg, cond_reg;
+    CHECK_RESULT(GetOperandRegister(depth, &true_reg));
+    CHECK_RESULT(GetOperandRegister(depth + 1, &false_reg));
+    CHECK_RESULT(GetOperandRegister(depth + 2, &cond_reg));
+    IstreamOffset offset = GetIstreamOffset();
+    CHECK_RESULT(EmitOpcode(interpreter::Opcode::Select));
+    CHECK_RESULT(EmitI32(cond_reg));
+    CHECK_RESULT(EmitI32(false_reg));
+    CHECK_RESULT(EmitI32(true_reg));
+    return EmitRegisterResult(interpreter::Opcode::Select, offset, depth);
+  }
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::Select));
   return wabt::Result::Ok;
 }
 
 wabt::Result BinaryReaderInterpreter::OnUnreachableExpr() {
+  if (options->register_machine) {
+    bool reachable = !typechecker_is_unreachable(&typechecker);
+    CHECK_RESULT(typechecker_on_unreachable(&typechecker));
+    if (reachable)
+      CHECK_RESULT(EmitOpcode(interpreter::Opcode::Unreachable));
+    SyncRegisterOperands();
+    return wabt::Result::Ok;
+  }
   CHECK_RESULT(typechecker_on_unreachable(&typechecker));
   CHECK_RESULT(EmitOpcode(interpreter::Opcode::Unreachable));
   return wabt::Result::Ok;
@@ -1475,36 +3507,59 @@ wabt::Result BinaryReaderInterpreter::OnUnreachableExpr() {
 
 wabt::Result BinaryReaderInterpreter::EndModule() {
   for (ElemSegmentInfo& info : elem_segment_infos) {
-    *info.dst = info.func_index;
+    info.dst->func_index = info.func_index;
+    info.dst->sig_id = env->sigs[env->funcs[info.func_index]->sig_index].id;
   }
   for (DataSegmentInfo& info : data_segment_infos) {
     memcpy(info.dst_data, info.src_data, info.size);
   }
+  init_new_global_values(env);
+  /* The exports are looked up by name each time they are used, and no more
+   * are added. */
+  module->export_bindings.freeze();
   return wabt::Result::Ok;
 }
 
 }  // namespace
 
-wabt::Result read_binary_interpreter(Environment* env,
-                                     const void* data,
-                                     size_t size,
-                                     const ReadBinaryOptions* options,
-                                     BinaryErrorHandler* error_handler,
-                                     DefinedModule** out_module) {
+wabt::Result read_binary_interpreter(
+    Environment* env,
+    const void* data,
+    size_t size,
+    const ReadBinaryOptions* options,
+    const ReadBinaryInterpreterOptions* interpreter_options,
+    BinaryErrorHandler* error_handler,
+    DefinedModule** out_module) {
+  if (!can_add_module_code(env, interpreter_options->register_machine)) {
+    error_handler->OnError(kInvalidOffset,
+                           "register code and stack code can't be mixed in "
+                           "one environment");
+    *out_module = nullptr;
+    return wabt::Result::Error;
+  }
+
   IstreamOffset istream_offset = env->istream->data.size();
   DefinedModule* module = new DefinedModule(istream_offset);
 
   // Need to mark before constructing the reader since it takes ownership of
   // env->istream, which makes env->istream == nullptr.
   EnvironmentMark mark = mark_environment(env);
-  BinaryReaderInterpreter reader(env, module, istream_offset, error_handler);
+  BinaryReaderInterpreter reader(env, module, istream_offset,
+                                 interpreter_options, error_handler);
   env->modules.emplace_back(module);
 
-  wabt::Result result = read_binary(data, size, &reader, options);
+  ReadBinaryOptions read_options = *options;
+  read_options.skip_function_bodies =
+      interpreter_options->lazy_compile ||
+      interpreter_options->compile_threads > 1;
+  wabt::Result result = read_binary(data, size, &reader, &read_options);
   env->istream = reader.ReleaseOutputBuffer();
   if (WABT_SUCCEEDED(result)) {
     env->istream->data.resize(reader.get_istream_offset());
     module->istream_end = env->istream->data.size();
+    env->register_machine = interpreter_options->register_machine;
+    if (interpreter_options->lazy_compile)
+      module->lazy = reader.MakeLazyModule(data, size);
     *out_module = module;
   } else {
     reset_environment_to_mark(env, mark);
@@ -1513,4 +3568,44 @@ wabt::Result read_binary_interpreter(Environment* env,
   return result;
 }
 
+wabt::Result compile_lazy_function(Environment* env, DefinedFunc* func) {
+  if (!func->is_lazy_stub())
+    return wabt::Result::Ok;
+
+  DefinedModule* module = func->lazy_module;
+  const LazyModule* lazy = module->lazy.get();
+  ReadBinaryOptions read_options = WABT_READ_BINARY_OPTIONS_DEFAULT;
+  ReadBinaryInterpreterOptions options =
+      WABT_READ_BINARY_INTERPRETER_OPTIONS_DEFAULT;
+  options.register_machine = lazy->register_machine;
+  options.frame_locals = lazy->frame_locals;
+  BinaryErrorHandlerFile error_handler;
+
+  IstreamOffset istream_offset = env->istream->data.size();
+  BinaryReaderInterpreter reader(env, module, istream_offset, &options,
+                                 &error_handler);
+  reader.InitFromLazyModule(lazy);
+  Offset body_offset =
+      lazy->body_offsets[func->lazy_func_index - lazy->num_func_imports];
+  wabt::Result result = read_binary_function_body(
+      lazy->binary.data(), lazy->binary.size(), body_offset,
+      func->lazy_func_index, lazy->func_index_mapping.size(),
+      lazy->sig_index_mapping.size(), &reader, &read_options);
+  env->istream = reader.ReleaseOutputBuffer();
+  if (WABT_FAILED(result)) {
+    env->istream->data.resize(istream_offset);
+    func->offset = func->lazy_stub_offset;
+    func->param_and_local_types.clear();
+    return result;
+  }
+  env->istream->data.resize(reader.get_istream_offset());
+
+  /* Calls compiled before this one still go to the stub, so turn it into a
+   * branch to the body. */
+  uint8_t* stub = &env->istream->data[func->lazy_stub_offset];
+  stub[0] = static_cast<uint8_t>(interpreter::Opcode::Br);
+  memcpy(stub + 1, &func->offset, sizeof(IstreamOffset));
+  return wabt::Result::Ok;
+}
+
 }  // namespace wabt
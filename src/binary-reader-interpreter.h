@@ -19,10 +19,14 @@
 
 #include "common.h"
 
+#define WABT_READ_BINARY_INTERPRETER_OPTIONS_DEFAULT \
+  { false, false, 0, false }
+
 namespace wabt {
 
 namespace interpreter {
 
+struct DefinedFunc;
 struct DefinedModule;
 struct Environment;
 
@@ -31,12 +35,42 @@ struct Environment;
 class BinaryErrorHandler;
 struct ReadBinaryOptions;
 
-Result read_binary_interpreter(interpreter::Environment* env,
-                               const void* data,
-                               size_t size,
-                               const ReadBinaryOptions* options,
-                               BinaryErrorHandler*,
-                               interpreter::DefinedModule** out_module);
+struct ReadBinaryInterpreterOptions {
+  /* Lower each function to three-address register code, where the params,
+   * locals and operand stack slots of a call are registers at fixed offsets
+   * from its frame, and run it with a separate loop. Every module of an
+   * Environment has to be loaded with the same setting. */
+  bool register_machine;
+  /* Only check the size of each function body when the module is loaded,
+   * and compile it to the istream on the function's first call. Errors in a
+   * function body aren't reported until then. */
+  bool lazy_compile;
+  /* If greater than 1, compile the function bodies on this many threads at
+   * once. Ignored with lazy_compile. */
+  int compile_threads;
+  /* Address the params and locals of each call at fixed offsets from a
+   * frame pointer set when the function is entered, instead of at depths
+   * from the top of the value stack. The instructions fused from get_local
+   * aren't used then. Register code is always addressed this way, so this
+   * has no effect with register_machine. */
+  bool frame_locals;
+};
+
+Result read_binary_interpreter(
+    interpreter::Environment* env,
+    const void* data,
+    size_t size,
+    const ReadBinaryOptions* options,
+    const ReadBinaryInterpreterOptions* interpreter_options,
+    BinaryErrorHandler*,
+    interpreter::DefinedModule** out_module);
+
+/* Compiles a function of a module loaded with lazy_compile, if it is still a
+ * stub. The code is appended to env->istream, which may move it, so this
+ * can't be called while another thread is running code in |env|. Errors are
+ * printed to stderr. */
+Result compile_lazy_function(interpreter::Environment* env,
+                             interpreter::DefinedFunc* func);
 
 }  // namespace wabt
 
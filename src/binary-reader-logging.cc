@@ -231,6 +231,12 @@ Result BinaryReaderLogging::OnExport(Index index,
   return reader->OnExport(index, kind, item_index, name);
 }
 
+Result BinaryReaderLogging::OnSkippedFunctionBody(Index index, Offset offset) {
+  LOGF("OnSkippedFunctionBody(index: %" PRIindex ", offset: %" PRIzd ")\n",
+       index, offset);
+  return reader->OnSkippedFunctionBody(index, offset);
+}
+
 Result BinaryReaderLogging::OnLocalDecl(Index decl_index,
                                         Index count,
                                         Type type) {
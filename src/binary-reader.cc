@@ -152,6 +152,10 @@ class BinaryReader {
                const ReadBinaryOptions* options);
 
   Result ReadModule();
+  Result ReadFunctionAt(Offset offset,
+                        Index func_index,
+                        Index num_funcs,
+                        Index num_signatures);
 
  private:
   void WABT_PRINTF_FORMAT(2, 3) PrintError(const char* format, ...);
@@ -181,6 +185,7 @@ class BinaryReader {
   Result ReadMemory(Limits* out_page_limits) WABT_WARN_UNUSED;
   Result ReadGlobalHeader(Type* out_type, bool* out_mutable) WABT_WARN_UNUSED;
   Result ReadFunctionBody(Offset end_offset) WABT_WARN_UNUSED;
+  Result ReadFunction(Index func_index) WABT_WARN_UNUSED;
   Result ReadNamesSection(Offset section_size) WABT_WARN_UNUSED;
   Result ReadRelocSection(Offset section_size) WABT_WARN_UNUSED;
   Result ReadCustomSection(Offset section_size) WABT_WARN_UNUSED;
@@ -1411,6 +1416,31 @@ Result BinaryReader::ReadElemSection(Offset section_size) {
   return Result::Ok;
 }
 
+Result BinaryReader::ReadFunction(Index func_index) {
+  CALLBACK(BeginFunctionBody, func_index);
+  uint32_t body_size;
+  CHECK_RESULT(ReadU32Leb128(&body_size, "function body size"));
+  Offset body_start_offset = state_.offset;
+  Offset end_offset = body_start_offset + body_size;
+
+  Index num_local_decls;
+  CHECK_RESULT(ReadIndex(&num_local_decls, "local declaration count"));
+  CALLBACK(OnLocalDeclCount, num_local_decls);
+  for (Index k = 0; k < num_local_decls; ++k) {
+    Index num_local_types;
+    CHECK_RESULT(ReadIndex(&num_local_types, "local type count"));
+    Type local_type;
+    CHECK_RESULT(ReadType(&local_type, "local type"));
+    ERROR_UNLESS(is_concrete_type(local_type), "expected valid local type");
+    CALLBACK(OnLocalDecl, k, num_local_types, local_type);
+  }
+
+  CHECK_RESULT(ReadFunctionBody(end_offset));
+
+  CALLBACK(EndFunctionBody, func_index);
+  return Result::Ok;
+}
+
 Result BinaryReader::ReadCodeSection(Offset section_size) {
   CALLBACK(BeginCodeSection, section_size);
   CHECK_RESULT(ReadIndex(&num_function_bodies_, "function body count"));
@@ -1419,29 +1449,17 @@ Result BinaryReader::ReadCodeSection(Offset section_size) {
   CALLBACK(OnFunctionBodyCount, num_function_bodies_);
   for (Index i = 0; i < num_function_bodies_; ++i) {
     Index func_index = num_func_imports_ + i;
-    Offset func_offset = state_.offset;
-    state_.offset = func_offset;
-    CALLBACK(BeginFunctionBody, func_index);
-    uint32_t body_size;
-    CHECK_RESULT(ReadU32Leb128(&body_size, "function body size"));
-    Offset body_start_offset = state_.offset;
-    Offset end_offset = body_start_offset + body_size;
-
-    Index num_local_decls;
-    CHECK_RESULT(ReadIndex(&num_local_decls, "local declaration count"));
-    CALLBACK(OnLocalDeclCount, num_local_decls);
-    for (Index k = 0; k < num_local_decls; ++k) {
-      Index num_local_types;
-      CHECK_RESULT(ReadIndex(&num_local_types, "local type count"));
-      Type local_type;
-      CHECK_RESULT(ReadType(&local_type, "local type"));
-      ERROR_UNLESS(is_concrete_type(local_type), "expected valid local type");
-      CALLBACK(OnLocalDecl, k, num_local_types, local_type);
+    if (options_->skip_function_bodies) {
+      Offset func_offset = state_.offset;
+      uint32_t body_size;
+      CHECK_RESULT(ReadU32Leb128(&body_size, "function body size"));
+      ERROR_UNLESS(body_size <= read_end_ - state_.offset,
+                   "function body extends past end of section");
+      state_.offset += body_size;
+      CALLBACK(OnSkippedFunctionBody, func_index, func_offset);
+    } else {
+      CHECK_RESULT(ReadFunction(func_index));
     }
-
-    CHECK_RESULT(ReadFunctionBody(end_offset));
-
-    CALLBACK(EndFunctionBody, func_index);
   }
   CALLBACK0(EndCodeSection);
   return Result::Ok;
@@ -1541,6 +1559,17 @@ Result BinaryReader::ReadModule() {
   return Result::Ok;
 }
 
+Result BinaryReader::ReadFunctionAt(Offset offset,
+                                    Index func_index,
+                                    Index num_funcs,
+                                    Index num_signatures) {
+  /* Only the counts that instructions are checked against are needed. */
+  num_function_signatures_ = num_funcs;
+  num_signatures_ = num_signatures;
+  state_.offset = offset;
+  return ReadFunction(func_index);
+}
+
 }  // namespace
 
 Result read_binary(const void* data,
@@ -1551,4 +1580,16 @@ Result read_binary(const void* data,
   return reader.ReadModule();
 }
 
+Result read_binary_function_body(const void* data,
+                                 size_t size,
+                                 Offset offset,
+                                 Index func_index,
+                                 Index num_funcs,
+                                 Index num_signatures,
+                                 BinaryReaderDelegate* delegate,
+                                 const ReadBinaryOptions* options) {
+  BinaryReader reader(data, size, delegate, options);
+  return reader.ReadFunctionAt(offset, func_index, num_funcs, num_signatures);
+}
+
 }  // namespace wabt
@@ -25,7 +25,7 @@
 #include "opcode.h"
 
 #define WABT_READ_BINARY_OPTIONS_DEFAULT \
-  { nullptr, false }
+  { nullptr, false, false }
 
 namespace wabt {
 
@@ -34,6 +34,9 @@ class Stream;
 struct ReadBinaryOptions {
   Stream* log_stream;
   bool read_debug_names;
+  /* Call OnSkippedFunctionBody for each function body instead of reading
+   * it. The body can be read later with read_binary_function_body. */
+  bool skip_function_bodies;
 };
 
 class BinaryReaderDelegate {
@@ -149,6 +152,9 @@ class BinaryReaderDelegate {
   virtual Result BeginCodeSection(Offset size) = 0;
   virtual Result OnFunctionBodyCount(Index count) = 0;
   virtual Result BeginFunctionBody(Index index) = 0;
+  /* Called instead of BeginFunctionBody ... EndFunctionBody when
+   * skip_function_bodies is set. |offset| is where the body starts. */
+  virtual Result OnSkippedFunctionBody(Index index, Offset offset) = 0;
   virtual Result OnLocalDeclCount(Index count) = 0;
   virtual Result OnLocalDecl(Index decl_index, Index count, Type type) = 0;
 
@@ -274,6 +280,20 @@ Result read_binary(const void* data,
                    BinaryReaderDelegate* reader,
                    const ReadBinaryOptions* options);
 
+/* Reads the function body at |offset| in the code section of the module in
+ * |data|, as read_binary would, from BeginFunctionBody to EndFunctionBody.
+ * |num_funcs| and |num_signatures| are the number of functions (including
+ * imports) and signatures in the module, which the body is checked
+ * against. */
+Result read_binary_function_body(const void* data,
+                                 size_t size,
+                                 Offset offset,
+                                 Index func_index,
+                                 Index num_funcs,
+                                 Index num_signatures,
+                                 BinaryReaderDelegate* reader,
+                                 const ReadBinaryOptions* options);
+
 size_t read_u32_leb128(const uint8_t* ptr,
                        const uint8_t* end,
                        uint32_t* out_value);
@@ -21,6 +21,168 @@
 
 namespace wabt {
 
+namespace {
+
+/* The size of the table when the first binding is added. It doubles before
+ * it is more than 3/4 full. */
+static const size_t kMinSlots = 16;
+/* The perfect hash puts about this many names in each group, and tries up to
+ * kMaxSeeds seeds for a group before giving up. */
+static const size_t kNamesPerSeed = 4;
+static const uint32_t kMaxSeeds = 1 << 16;
+
+static uint64_t mix_hash(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static uint64_t hash_name(string_view name) {
+  /* FNV-1a */
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (char c : name) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 0x100000001b3ULL;
+  }
+  return mix_hash(hash);
+}
+
+static size_t get_seed_index(uint64_t hash, size_t num_seeds) {
+  return (hash >> 32) & (num_seeds - 1);
+}
+
+static size_t get_perfect_slot(uint64_t hash, uint32_t seed, size_t mask) {
+  return mix_hash(hash + seed * 0x9e3779b97f4a7c15ULL) & mask;
+}
+
+}  // namespace
+
+const uint32_t BindingHash::kNone;
+
+void BindingHash::emplace(std::string name, const Binding& binding) {
+  uint32_t index = entries_.size();
+  hashes_.push_back(hash_name(name));
+  prev_.push_back(kNone);
+  entries_.emplace_back(std::move(name), binding);
+  size_t num_slots = slots_.size();
+  if (entries_.size() * 4 > num_slots * 3)
+    num_slots = std::max(kMinSlots, num_slots * 2);
+  if (num_slots != slots_.size() || !seeds_.empty())
+    rehash(num_slots);
+  else
+    insert_slot(index);
+}
+
+const BindingHash::value_type* BindingHash::find(string_view name) const {
+  if (slots_.empty())
+    return nullptr;
+  uint64_t hash = hash_name(name);
+  size_t mask = slots_.size() - 1;
+  if (!seeds_.empty()) {
+    uint32_t seed = seeds_[get_seed_index(hash, seeds_.size())];
+    uint32_t index = slots_[get_perfect_slot(hash, seed, mask)];
+    if (index != kNone && hashes_[index] == hash &&
+        string_view(entries_[index].first) == name) {
+      return &entries_[index];
+    }
+    return nullptr;
+  }
+  for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    uint32_t index = slots_[slot];
+    if (index == kNone)
+      return nullptr;
+    if (hashes_[index] == hash && string_view(entries_[index].first) == name)
+      return &entries_[index];
+  }
+}
+
+void BindingHash::rehash(size_t num_slots) {
+  seeds_.clear();
+  slots_.assign(num_slots, kNone);
+  for (uint32_t i = 0; i < entries_.size(); ++i) {
+    prev_[i] = kNone;
+    insert_slot(i);
+  }
+}
+
+void BindingHash::insert_slot(uint32_t index) {
+  uint64_t hash = hashes_[index];
+  size_t mask = slots_.size() - 1;
+  for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    uint32_t other = slots_[slot];
+    if (other == kNone ||
+        (hashes_[other] == hash &&
+         entries_[other].first == entries_[index].first)) {
+      prev_[index] = other;
+      slots_[slot] = index;
+      return;
+    }
+  }
+}
+
+bool BindingHash::freeze() {
+  if (!seeds_.empty() || entries_.empty())
+    return true;
+
+  /* Hash and displace: the names are split into groups by hash, and each
+   * group, largest first, gets the first seed that puts all of its names in
+   * slots that are still free. */
+  size_t num_seeds = 1;
+  std::vector<uint32_t> newest;
+  for (uint32_t index : slots_) {
+    if (index != kNone)
+      newest.push_back(index);
+  }
+  while (num_seeds * kNamesPerSeed < newest.size())
+    num_seeds *= 2;
+  std::vector<std::vector<uint32_t>> groups(num_seeds);
+  for (uint32_t index : newest)
+    groups[get_seed_index(hashes_[index], num_seeds)].push_back(index);
+  std::vector<size_t> order(num_seeds);
+  for (size_t i = 0; i < num_seeds; ++i)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return groups[a].size() > groups[b].size();
+  });
+
+  size_t mask = slots_.size() - 1;
+  std::vector<uint32_t> slots(slots_.size(), kNone);
+  std::vector<uint32_t> seeds(num_seeds, 0);
+  std::vector<size_t> group_slots;
+  for (size_t group_index : order) {
+    const std::vector<uint32_t>& group = groups[group_index];
+    if (group.empty())
+      break;
+    uint32_t seed = 0;
+    for (; seed < kMaxSeeds; ++seed) {
+      group_slots.clear();
+      for (uint32_t index : group) {
+        size_t slot = get_perfect_slot(hashes_[index], seed, mask);
+        if (slots[slot] != kNone ||
+            std::find(group_slots.begin(), group_slots.end(), slot) !=
+                group_slots.end()) {
+          break;
+        }
+        group_slots.push_back(slot);
+      }
+      if (group_slots.size() == group.size())
+        break;
+    }
+    if (seed == kMaxSeeds)
+      return false;
+    for (size_t i = 0; i < group.size(); ++i)
+      slots[group_slots[i]] = group[i];
+    seeds[group_index] = seed;
+  }
+
+  slots_.swap(slots);
+  seeds_.swap(seeds);
+  return true;
+}
+
 void BindingHash::find_duplicates(DuplicateCallback callback,
                                   void* user_data) const {
   if (size() > 0) {
@@ -33,21 +195,19 @@ void BindingHash::find_duplicates(DuplicateCallback callback,
 
 void BindingHash::create_duplicates_vector(
     ValueTypeVector* out_duplicates) const {
-  // This relies on the fact that in an unordered_multimap, all values with the
-  // same key are adjacent in iteration order.
-  auto first = begin();
-  bool is_first = true;
-  for (auto iter = std::next(first); iter != end(); ++iter) {
-    if (first->first == iter->first) {
-      if (is_first)
-        out_duplicates->push_back(&*first);
-      out_duplicates->push_back(&*iter);
-      is_first = false;
-    } else {
-      is_first = true;
-      first = iter;
+  // An entry has a duplicate if it links to an older entry with the same
+  // name, or if a newer one links to it.
+  std::vector<bool> is_duplicate(entries_.size());
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    if (prev_[i] != kNone) {
+      is_duplicate[i] = true;
+      is_duplicate[prev_[i]] = true;
     }
   }
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    if (is_duplicate[i])
+      out_duplicates->push_back(&entries_[i]);
+  }
 }
 
 void BindingHash::sort_duplicates_vector_by_location(
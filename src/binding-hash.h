@@ -17,11 +17,14 @@
 #ifndef WABT_BINDING_HASH_H_
 #define WABT_BINDING_HASH_H_
 
+#include <stdint.h>
+
 #include <string>
+#include <utility>
 #include <vector>
-#include <unordered_map>
 
 #include "common.h"
+#include "string-view.h"
 
 namespace wabt {
 
@@ -35,32 +38,102 @@ struct Binding {
   int index;
 };
 
-// This class derives from a C++ container, which is usually not advisable
-// because they don't have virtual destructors. So don't delete a BindingHash
-// object through a pointer to std::unordered_multimap.
-class BindingHash : public std::unordered_multimap<std::string, Binding> {
+// A multimap from names to Bindings, iterated in insertion order. The
+// entries are kept in a vector, with the hash of each name, and an
+// open-addressing table of entry indexes, probed linearly, finds the newest
+// entry with a name. Lookups hash the name where it is, so they don't
+// allocate.
+class BindingHash {
  public:
+  typedef std::pair<std::string, Binding> value_type;
+  typedef std::vector<value_type>::const_iterator const_iterator;
   typedef void (*DuplicateCallback)(const value_type& a,
                                     const value_type& b,
                                     void* user_data);
 
-  void find_duplicates(DuplicateCallback callback, void* user_data) const;
+  const_iterator begin() const { return entries_.begin(); }
+  const_iterator end() const { return entries_.end(); }
+  size_t size() const { return entries_.size(); }
+  bool empty() const { return entries_.empty(); }
+
+  void emplace(std::string name, const Binding& binding);
+
+  // Returns the newest binding of |name|, or nullptr.
+  const value_type* find(string_view name) const;
+
+  int find_index(string_view name) const {
+    const value_type* binding = find(name);
+    return binding ? binding->second.index : -1;
+  }
 
   int find_index(const StringSlice& name) const {
-    auto iter = find(string_slice_to_string(name));
-    if (iter != end())
-      return iter->second.index;
-    return -1;
+    return find_index(string_view(name.start, name.length));
+  }
+
+  // Removes every binding of |name|.
+  void erase(string_view name) {
+    erase_if([name](const value_type& binding) -> bool {
+      return string_view(binding.first) == name;
+    });
   }
 
+  // Removes the bindings for which |pred| returns true. This rebuilds the
+  // table, so it is meant for undoing a batch of emplaces, not for removing
+  // bindings one at a time.
+  template <typename Pred>
+  void erase_if(Pred pred) {
+    size_t size = 0;
+    for (size_t i = 0; i < entries_.size(); ++i) {
+      if (pred(static_cast<const value_type&>(entries_[i])))
+        continue;
+      if (size != i) {
+        entries_[size] = std::move(entries_[i]);
+        hashes_[size] = hashes_[i];
+      }
+      ++size;
+    }
+    if (size == entries_.size())
+      return;
+    entries_.erase(entries_.begin() + size, entries_.end());
+    hashes_.resize(size);
+    prev_.resize(size);
+    rehash(slots_.size());
+  }
+
+  void find_duplicates(DuplicateCallback callback, void* user_data) const;
+
+  // Rebuilds the table around a perfect hash of the names in it, so that
+  // every lookup probes one slot. This is worth it for a table that is
+  // searched often and no longer changes, like the exports of a loaded
+  // module; emplacing or erasing afterward goes back to linear probing.
+  // Returns false, leaving the table as it was, if no perfect hash was
+  // found.
+  bool freeze();
+
  private:
   typedef std::vector<const value_type*> ValueTypeVector;
 
+  static const uint32_t kNone = UINT32_MAX;
+
+  void rehash(size_t num_slots);
+  void insert_slot(uint32_t index);
+
   void create_duplicates_vector(ValueTypeVector* out_duplicates) const;
   void sort_duplicates_vector_by_location(ValueTypeVector* duplicates) const;
   void call_callbacks(const ValueTypeVector& duplicates,
                       DuplicateCallback callback,
                       void* user_data) const;
+
+  std::vector<value_type> entries_;
+  // the hash of the name of each entry
+  std::vector<uint64_t> hashes_;
+  // the older entry with the same name as each entry, or kNone
+  std::vector<uint32_t> prev_;
+  // the newest entry with each name, or kNone; a power of two in size
+  std::vector<uint32_t> slots_;
+  // while frozen, the seed of the perfect hash for each group of names;
+  // otherwise empty
+  std::vector<uint32_t> seeds_;
 };
 
 }  // namespace wabt
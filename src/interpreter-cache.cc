@@ -0,0 +1,727 @@
+/*
+ * Copyright 2017 WebAssembly Community Group participants
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "interpreter-cache.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "binary-reader-interpreter.h"
+
+#define CHECK_RESULT(expr)        \
+  do {                            \
+    if (WABT_FAILED(expr))        \
+      return wabt::Result::Error; \
+  } while (0)
+
+namespace wabt {
+namespace interpreter {
+
+namespace {
+
+static const char kCacheMagic[] = "wabt-interp-cache";
+/* Bump this when the layout of the cache file or the encoding of the istream
+ * changes: the operands of an opcode, how branch targets and call offsets are
+ * written, or what the loader emits for an instruction. The key only covers
+ * the opcode table below, so these changes have to be caught here. */
+static const uint32_t kCacheVersion = 3;
+
+/* Every field of every istream opcode, hashed into the key, so that adding,
+ * renumbering or retyping an opcode makes older cache files miss. */
+static const char s_istream_opcodes[] =
+#define WABT_OPCODE(rtype, type1, type2, mem_size, code, Name, text) \
+  #rtype " " #type1 " " #type2 " " #mem_size " " #code " " text ";"
+#include "interpreter-opcode.def"
+#undef WABT_OPCODE
+    ;
+
+/* A run of zeroes at least this long ends a run of a memory's contents that
+ * is written to the cache file. */
+static const size_t kMemoryRunMinGap = 64;
+
+/* FNV-1a, which is simple and stable across platforms and runs. */
+static const uint64_t kHashOffsetBasis = 0xcbf29ce484222325ull;
+static const uint64_t kHashPrime = 0x100000001b3ull;
+
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= kHashPrime;
+  }
+  return hash;
+}
+
+class CacheWriter {
+ public:
+  void WriteData(const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    buffer.insert(buffer.end(), bytes, bytes + size);
+  }
+  void WriteU8(uint8_t value) { WriteData(&value, sizeof(value)); }
+  void WriteU32(uint32_t value) { WriteData(&value, sizeof(value)); }
+  void WriteU64(uint64_t value) { WriteData(&value, sizeof(value)); }
+  void WriteType(Type type) { WriteU32(static_cast<uint32_t>(type)); }
+  void WriteString(const StringSlice& str) {
+    WriteU32(str.length);
+    WriteData(str.start, str.length);
+  }
+  void WriteTypes(const std::vector<Type>& types) {
+    WriteU32(types.size());
+    for (Type type : types)
+      WriteType(type);
+  }
+  void WriteLimits(const Limits& limits) {
+    WriteU64(limits.initial);
+    WriteU64(limits.max);
+    WriteU8(limits.has_max);
+  }
+
+  std::vector<uint8_t> buffer;
+};
+
+class CacheReader {
+ public:
+  CacheReader(const uint8_t* data, size_t size)
+      : data_(data), end_(data + size) {}
+
+  bool at_end() const { return data_ == end_; }
+
+  wabt::Result ReadData(const uint8_t** out_data, size_t size) {
+    if (static_cast<size_t>(end_ - data_) < size)
+      return wabt::Result::Error;
+    *out_data = data_;
+    data_ += size;
+    return wabt::Result::Ok;
+  }
+  template <typename T>
+  wabt::Result ReadValue(T* out_value) {
+    const uint8_t* data;
+    CHECK_RESULT(ReadData(&data, sizeof(T)));
+    memcpy(out_value, data, sizeof(T));
+    return wabt::Result::Ok;
+  }
+  wabt::Result ReadU8(uint8_t* out_value) { return ReadValue(out_value); }
+  wabt::Result ReadU32(uint32_t* out_value) { return ReadValue(out_value); }
+  wabt::Result ReadU64(uint64_t* out_value) { return ReadValue(out_value); }
+  wabt::Result ReadBool(bool* out_value) {
+    uint8_t value;
+    CHECK_RESULT(ReadU8(&value));
+    *out_value = value != 0;
+    return wabt::Result::Ok;
+  }
+  wabt::Result ReadType(Type* out_type) {
+    uint32_t value;
+    CHECK_RESULT(ReadU32(&value));
+    *out_type = static_cast<Type>(value);
+    return wabt::Result::Ok;
+  }
+  wabt::Result ReadString(std::string* out_str) {
+    uint32_t length;
+    const uint8_t* data;
+    CHECK_RESULT(ReadU32(&length));
+    CHECK_RESULT(ReadData(&data, length));
+    out_str->assign(reinterpret_cast<const char*>(data), length);
+    return wabt::Result::Ok;
+  }
+  wabt::Result ReadStringSlice(StringSlice* out_str) {
+    std::string str;
+    CHECK_RESULT(ReadString(&str));
+    *out_str = dup_string_slice(string_to_string_slice(str));
+    return wabt::Result::Ok;
+  }
+  wabt::Result ReadTypes(std::vector<Type>* out_types) {
+    uint32_t count;
+    CHECK_RESULT(ReadU32(&count));
+    out_types->resize(count);
+    for (Type& type : *out_types)
+      CHECK_RESULT(ReadType(&type));
+    return wabt::Result::Ok;
+  }
+  wabt::Result ReadLimits(Limits* out_limits) {
+    CHECK_RESULT(ReadU64(&out_limits->initial));
+    CHECK_RESULT(ReadU64(&out_limits->max));
+    CHECK_RESULT(ReadBool(&out_limits->has_max));
+    return wabt::Result::Ok;
+  }
+
+ private:
+  const uint8_t* data_;
+  const uint8_t* end_;
+};
+
+static HostModule* find_host_module(Environment* env,
+                                    const StringSlice& name) {
+  int module_index = env->registered_module_bindings.find_index(name);
+  if (module_index < 0 || !env->modules[module_index]->is_host)
+    return nullptr;
+  return env->modules[module_index]->as_host();
+}
+
+static void write_mark(CacheWriter* writer, const EnvironmentMark& mark) {
+  writer->WriteU64(mark.modules_size);
+  writer->WriteU64(mark.sigs_size);
+  writer->WriteU64(mark.funcs_size);
+  writer->WriteU64(mark.memories_size);
+  writer->WriteU64(mark.tables_size);
+  writer->WriteU64(mark.globals_size);
+  writer->WriteU64(mark.istream_size);
+}
+
+static wabt::Result read_mark(CacheReader* reader, EnvironmentMark* out_mark) {
+  uint64_t sizes[7];
+  for (uint64_t& size : sizes)
+    CHECK_RESULT(reader->ReadU64(&size));
+  out_mark->modules_size = sizes[0];
+  out_mark->sigs_size = sizes[1];
+  out_mark->funcs_size = sizes[2];
+  out_mark->memories_size = sizes[3];
+  out_mark->tables_size = sizes[4];
+  out_mark->globals_size = sizes[5];
+  out_mark->istream_size = sizes[6];
+  return wabt::Result::Ok;
+}
+
+static void write_import(CacheWriter* writer, const Import& import) {
+  writer->WriteString(import.module_name);
+  writer->WriteString(import.field_name);
+  writer->WriteU8(static_cast<uint8_t>(import.kind));
+  switch (import.kind) {
+    case ExternalKind::Func:
+      writer->WriteU32(import.func.sig_index);
+      break;
+    case ExternalKind::Table:
+      writer->WriteLimits(import.table.limits);
+      break;
+    case ExternalKind::Memory:
+      writer->WriteLimits(import.memory.limits);
+      break;
+    case ExternalKind::Global:
+      writer->WriteType(import.global.type);
+      writer->WriteU8(import.global.mutable_);
+      break;
+  }
+}
+
+/* Writes the non-zero parts of |data|. A memory's initial contents are mostly
+ * zeroes, apart from its data segments. */
+static void write_memory_data(CacheWriter* writer, const MemoryData& data) {
+  std::vector<std::pair<size_t, size_t>> runs;
+  size_t size = data.size();
+  size_t i = 0;
+  while (i < size) {
+    while (i < size && data[i] == 0)
+      ++i;
+    if (i == size)
+      break;
+    size_t start = i;
+    size_t end = i;
+    while (i < size && i - end < kMemoryRunMinGap) {
+      if (data[i] != 0)
+        end = i + 1;
+      ++i;
+    }
+    runs.emplace_back(start, end);
+    i = end;
+  }
+
+  writer->WriteU64(size);
+  writer->WriteU32(runs.size());
+  for (const auto& run : runs) {
+    writer->WriteU64(run.first);
+    writer->WriteU64(run.second - run.first);
+    writer->WriteData(data.data() + run.first, run.second - run.first);
+  }
+}
+
+static void write_module(CacheWriter* writer,
+                         Environment* env,
+                         const EnvironmentMark& mark,
+                         DefinedModule* module) {
+  write_mark(writer, mark);
+  writer->WriteU8(env->register_machine);
+
+  writer->WriteU32(env->sigs.size() - mark.sigs_size);
+  for (size_t i = mark.sigs_size; i < env->sigs.size(); ++i) {
+    writer->WriteTypes(env->sigs[i].param_types);
+    writer->WriteTypes(env->sigs[i].result_types);
+  }
+
+  writer->WriteString(module->name);
+  writer->WriteU32(module->imports.size());
+  for (const Import& import : module->imports)
+    write_import(writer, import);
+
+  writer->WriteU32(env->funcs.size() - mark.funcs_size);
+  for (size_t i = mark.funcs_size; i < env->funcs.size(); ++i) {
+    Func* func = env->funcs[i].get();
+    writer->WriteU8(func->is_host);
+    /* host functions are made again by importing them */
+    if (func->is_host)
+      continue;
+    DefinedFunc* defined_func = func->as_defined();
+    writer->WriteU32(defined_func->sig_index);
+    writer->WriteU32(defined_func->offset);
+    writer->WriteU32(defined_func->local_decl_count);
+    writer->WriteU32(defined_func->local_count);
+    writer->WriteU32(defined_func->max_stack_height);
+    writer->WriteTypes(defined_func->param_and_local_types);
+    writer->WriteString(string_to_string_slice(defined_func->name));
+  }
+
+  writer->WriteU32(env->instance.tables.size() - mark.tables_size);
+  for (size_t i = mark.tables_size; i < env->instance.tables.size(); ++i) {
+    const Table& table = env->instance.tables[i];
+    writer->WriteLimits(table.limits);
+    writer->WriteU32(table.entries.size());
+    for (const TableEntry& entry : table.entries)
+      writer->WriteU32(entry.func_index);
+  }
+
+  writer->WriteU32(env->instance.memories.size() - mark.memories_size);
+  for (size_t i = mark.memories_size; i < env->instance.memories.size(); ++i) {
+    const Memory& memory = env->instance.memories[i];
+    writer->WriteLimits(memory.page_limits);
+    write_memory_data(writer, memory.data);
+  }
+
+  writer->WriteU32(env->globals.size() - mark.globals_size);
+  for (size_t i = mark.globals_size; i < env->globals.size(); ++i) {
+    const Global& global = env->globals[i];
+    writer->WriteType(global.typed_value.type);
+    writer->WriteU64(global.typed_value.value.i64);
+    writer->WriteU8(global.mutable_);
+  }
+
+  writer->WriteU32(module->exports.size());
+  for (const Export& export_ : module->exports) {
+    writer->WriteString(export_.name);
+    writer->WriteU8(static_cast<uint8_t>(export_.kind));
+    writer->WriteU32(export_.index);
+  }
+
+  writer->WriteU32(module->memory_index);
+  writer->WriteU32(module->table_index);
+  writer->WriteU32(module->start_func_index);
+
+  assert(module->istream_start == mark.istream_size);
+  writer->WriteU64(module->istream_end - module->istream_start);
+  writer->WriteData(env->istream->data.data() + module->istream_start,
+                    module->istream_end - module->istream_start);
+}
+
+static void ignore_host_import_error(const char* msg, void* user_data) {}
+
+/* Imports |import| from the host module again, as BinaryReaderInterpreter
+ * did when the module was loaded. */
+static wabt::Result read_import(CacheReader* reader,
+                                Environment* env,
+                                Import* import) {
+  uint8_t kind;
+  CHECK_RESULT(reader->ReadStringSlice(&import->module_name));
+  CHECK_RESULT(reader->ReadStringSlice(&import->field_name));
+  CHECK_RESULT(reader->ReadU8(&kind));
+  if (kind > static_cast<uint8_t>(ExternalKind::Last))
+    return wabt::Result::Error;
+  import->kind = static_cast<ExternalKind>(kind);
+
+  HostModule* host_module = find_host_module(env, import->module_name);
+  if (!host_module)
+    return wabt::Result::Error;
+  HostImportDelegate* host_delegate = &host_module->import_delegate;
+  PrintErrorCallback callback;
+  callback.print_error = ignore_host_import_error;
+  callback.user_data = nullptr;
+
+  Index env_index;
+  switch (import->kind) {
+    case ExternalKind::Func: {
+      CHECK_RESULT(reader->ReadU32(&import->func.sig_index));
+      if (import->func.sig_index >= env->sigs.size())
+        return wabt::Result::Error;
+      HostFunc* func = new HostFunc(import->module_name, import->field_name,
+                                    import->func.sig_index);
+      env->funcs.emplace_back(func);
+      CHECK_RESULT(host_delegate->import_func(import, func,
+                                              &env->sigs[func->sig_index],
+                                              callback,
+                                              host_delegate->user_data));
+      env_index = env->funcs.size() - 1;
+      break;
+    }
+
+    case ExternalKind::Table: {
+      CHECK_RESULT(reader->ReadLimits(&import->table.limits));
+      env->instance.tables.emplace_back(import->table.limits);
+      CHECK_RESULT(host_delegate->import_table(
+          import, &env->instance.tables.back(), callback,
+          host_delegate->user_data));
+      env_index = env->instance.tables.size() - 1;
+      break;
+    }
+
+    case ExternalKind::Memory: {
+      CHECK_RESULT(reader->ReadLimits(&import->memory.limits));
+      env->instance.memories.emplace_back();
+      CHECK_RESULT(host_delegate->import_memory(
+          import, &env->instance.memories.back(), callback,
+          host_delegate->user_data));
+      env_index = env->instance.memories.size() - 1;
+      break;
+    }
+
+    case ExternalKind::Global: {
+      CHECK_RESULT(reader->ReadType(&import->global.type));
+      CHECK_RESULT(reader->ReadBool(&import->global.mutable_));
+      env->globals.emplace_back(TypedValue(import->global.type),
+                                import->global.mutable_);
+      CHECK_RESULT(host_delegate->import_global(import, &env->globals.back(),
+                                                callback,
+                                                host_delegate->user_data));
+      env_index = env->globals.size() - 1;
+      break;
+    }
+  }
+
+  if (host_module->export_bindings.find_index(import->field_name) == -1) {
+    host_module->exports.emplace_back(dup_string_slice(import->field_name),
+                                      import->kind, env_index);
+    host_module->export_bindings.emplace(
+        string_slice_to_string(import->field_name),
+        Binding(host_module->exports.size() - 1));
+  }
+  return wabt::Result::Ok;
+}
+
+static wabt::Result read_memory_data(CacheReader* reader, MemoryData* data) {
+  uint64_t size;
+  uint32_t num_runs;
+  CHECK_RESULT(reader->ReadU64(&size));
+  CHECK_RESULT(reader->ReadU32(&num_runs));
+  if (size != data->size())
+    return wabt::Result::Error;
+  for (uint32_t i = 0; i < num_runs; ++i) {
+    uint64_t offset, length;
+    const uint8_t* run;
+    CHECK_RESULT(reader->ReadU64(&offset));
+    CHECK_RESULT(reader->ReadU64(&length));
+    CHECK_RESULT(reader->ReadData(&run, length));
+    if (offset > size || length > size - offset)
+      return wabt::Result::Error;
+    memcpy(data->data() + offset, run, length);
+  }
+  return wabt::Result::Ok;
+}
+
+static wabt::Result read_module(CacheReader* reader,
+                                Environment* env,
+                                const EnvironmentMark& mark,
+                                DefinedModule* module) {
+  uint32_t count;
+  CHECK_RESULT(reader->ReadU32(&count));
+  for (uint32_t i = 0; i < count; ++i) {
+    env->sigs.emplace_back();
+    FuncSignature* sig = &env->sigs.back();
+    CHECK_RESULT(reader->ReadTypes(&sig->param_types));
+    CHECK_RESULT(reader->ReadTypes(&sig->result_types));
+    intern_func_signature(env, env->sigs.size() - 1);
+  }
+
+  CHECK_RESULT(reader->ReadStringSlice(&module->name));
+  CHECK_RESULT(reader->ReadU32(&count));
+  module->imports.resize(count);
+  for (Import& import : module->imports)
+    CHECK_RESULT(read_import(reader, env, &import));
+
+  /* The imports came first, so they made the host functions, tables,
+   * memories and globals at the start of each range. */
+  CHECK_RESULT(reader->ReadU32(&count));
+  for (uint32_t i = 0; i < count; ++i) {
+    bool is_host;
+    Index func_index = mark.funcs_size + i;
+    CHECK_RESULT(reader->ReadBool(&is_host));
+    if (is_host) {
+      if (func_index >= env->funcs.size() || !env->funcs[func_index]->is_host)
+        return wabt::Result::Error;
+      continue;
+    }
+    if (func_index != env->funcs.size())
+      return wabt::Result::Error;
+    uint32_t sig_index;
+    CHECK_RESULT(reader->ReadU32(&sig_index));
+    if (sig_index >= env->sigs.size())
+      return wabt::Result::Error;
+    DefinedFunc* func = new DefinedFunc(sig_index);
+    env->funcs.emplace_back(func);
+    CHECK_RESULT(reader->ReadU32(&func->offset));
+    CHECK_RESULT(reader->ReadU32(&func->local_decl_count));
+    CHECK_RESULT(reader->ReadU32(&func->local_count));
+    CHECK_RESULT(reader->ReadU32(&func->max_stack_height));
+    CHECK_RESULT(reader->ReadTypes(&func->param_and_local_types));
+    CHECK_RESULT(reader->ReadString(&func->name));
+  }
+
+  CHECK_RESULT(reader->ReadU32(&count));
+  for (uint32_t i = 0; i < count; ++i) {
+    Limits limits;
+    uint32_t num_entries;
+    CHECK_RESULT(reader->ReadLimits(&limits));
+    CHECK_RESULT(reader->ReadU32(&num_entries));
+    Index table_index = mark.tables_size + i;
+    if (table_index > env->instance.tables.size())
+      return wabt::Result::Error;
+    if (table_index == env->instance.tables.size())
+      env->instance.tables.emplace_back(limits);
+    Table* table = &env->instance.tables[table_index];
+    table->entries.resize(num_entries);
+    for (TableEntry& entry : table->entries) {
+      CHECK_RESULT(reader->ReadU32(&entry.func_index));
+      if (entry.func_index == kInvalidIndex) {
+        entry.sig_id = kInvalidIndex;
+      } else if (entry.func_index < env->funcs.size()) {
+        entry.sig_id = env->sigs[env->funcs[entry.func_index]->sig_index].id;
+      } else {
+        return wabt::Result::Error;
+      }
+    }
+  }
+
+  CHECK_RESULT(reader->ReadU32(&count));
+  for (uint32_t i = 0; i < count; ++i) {
+    Limits page_limits;
+    CHECK_RESULT(reader->ReadLimits(&page_limits));
+    Index memory_index = mark.memories_size + i;
+    if (memory_index > env->instance.memories.size())
+      return wabt::Result::Error;
+    if (memory_index == env->instance.memories.size())
+      env->instance.memories.emplace_back(page_limits);
+    CHECK_RESULT(
+        read_memory_data(reader, &env->instance.memories[memory_index].data));
+  }
+
+  CHECK_RESULT(reader->ReadU32(&count));
+  for (uint32_t i = 0; i < count; ++i) {
+    TypedValue typed_value;
+    bool mutable_;
+    CHECK_RESULT(reader->ReadType(&typed_value.type));
+    CHECK_RESULT(reader->ReadU64(&typed_value.value.i64));
+    CHECK_RESULT(reader->ReadBool(&mutable_));
+    Index global_index = mark.globals_size + i;
+    if (global_index > env->globals.size())
+      return wabt::Result::Error;
+    if (global_index == env->globals.size())
+      env->globals.emplace_back();
+    env->globals[global_index].typed_value = typed_value;
+    env->globals[global_index].mutable_ = mutable_;
+  }
+
+  CHECK_RESULT(reader->ReadU32(&count));
+  for (uint32_t i = 0; i < count; ++i) {
+    StringSlice name;
+    uint8_t kind;
+    uint32_t index;
+    CHECK_RESULT(reader->ReadStringSlice(&name));
+    module->exports.emplace_back(name, ExternalKind::Func, kInvalidIndex);
+    CHECK_RESULT(reader->ReadU8(&kind));
+    CHECK_RESULT(reader->ReadU32(&index));
+    if (kind > static_cast<uint8_t>(ExternalKind::Last))
+      return wabt::Result::Error;
+    module->exports.back().kind = static_cast<ExternalKind>(kind);
+    module->exports.back().index = index;
+    module->export_bindings.emplace(string_slice_to_string(name),
+                                    Binding(module->exports.size() - 1));
+  }
+  module->export_bindings.freeze();
+
+  CHECK_RESULT(reader->ReadU32(&module->memory_index));
+  CHECK_RESULT(reader->ReadU32(&module->table_index));
+  CHECK_RESULT(reader->ReadU32(&module->start_func_index));
+
+  uint64_t istream_size;
+  const uint8_t* istream;
+  CHECK_RESULT(reader->ReadU64(&istream_size));
+  CHECK_RESULT(reader->ReadData(&istream, istream_size));
+  std::vector<uint8_t>& data = env->istream->data;
+  data.insert(data.end(), istream, istream + istream_size);
+  module->istream_end = data.size();
+  return wabt::Result::Ok;
+}
+
+static wabt::Result read_module_cache_data(const uint8_t* data,
+                                           size_t size,
+                                           uint64_t key,
+                                           Environment* env,
+                                           DefinedModule** out_module) {
+  CacheReader header(data, size);
+  const uint8_t* magic;
+  uint32_t version;
+  uint64_t file_key, payload_size, payload_hash;
+  CHECK_RESULT(header.ReadData(&magic, sizeof(kCacheMagic)));
+  CHECK_RESULT(header.ReadU32(&version));
+  CHECK_RESULT(header.ReadU64(&file_key));
+  CHECK_RESULT(header.ReadU64(&payload_size));
+  CHECK_RESULT(header.ReadU64(&payload_hash));
+  const uint8_t* payload;
+  CHECK_RESULT(header.ReadData(&payload, payload_size));
+  if (memcmp(magic, kCacheMagic, sizeof(kCacheMagic)) != 0 ||
+      version != kCacheVersion || file_key != key || !header.at_end() ||
+      hash_bytes(kHashOffsetBasis, payload, payload_size) != payload_hash) {
+    return wabt::Result::Error;
+  }
+
+  /* The istream offsets and Environment indexes in the file are only right
+   * if the Environment is as it was when the module was loaded. */
+  EnvironmentMark mark = mark_environment(env);
+  CacheReader reader(payload, payload_size);
+  EnvironmentMark file_mark;
+  CHECK_RESULT(read_mark(&reader, &file_mark));
+  bool register_machine;
+  CHECK_RESULT(reader.ReadBool(&register_machine));
+  if (!can_add_module_code(env, register_machine))
+    return wabt::Result::Error;
+  if (file_mark.modules_size != mark.modules_size ||
+      file_mark.sigs_size != mark.sigs_size ||
+      file_mark.funcs_size != mark.funcs_size ||
+      file_mark.memories_size != mark.memories_size ||
+      file_mark.tables_size != mark.tables_size ||
+      file_mark.globals_size != mark.globals_size ||
+      file_mark.istream_size != mark.istream_size) {
+    return wabt::Result::Error;
+  }
+
+  DefinedModule* module = new DefinedModule(mark.istream_size);
+  env->modules.emplace_back(module);
+  if (WABT_FAILED(read_module(&reader, env, mark, module)) ||
+      !reader.at_end()) {
+    reset_environment_to_mark(env, mark);
+    return wabt::Result::Error;
+  }
+  init_new_global_values(env);
+  env->register_machine = register_machine;
+  *out_module = module;
+  return wabt::Result::Ok;
+}
+
+}  // namespace
+
+uint64_t get_module_cache_key(const void* data,
+                              size_t size,
+                              const ReadBinaryInterpreterOptions* options) {
+  uint64_t hash = kHashOffsetBasis;
+  hash = hash_bytes(hash, s_istream_opcodes, sizeof(s_istream_opcodes));
+  hash = hash_bytes(hash, &options->register_machine,
+                    sizeof(options->register_machine));
+  hash = hash_bytes(hash, &options->frame_locals,
+                    sizeof(options->frame_locals));
+  hash = hash_bytes(hash, &size, sizeof(size));
+  return hash_bytes(hash, data, size);
+}
+
+wabt::Result write_module_cache(const char* filename,
+                                uint64_t key,
+                                Environment* env,
+                                const EnvironmentMark& mark,
+                                DefinedModule* module) {
+  /* Only host imports can be made again when the file is read. */
+  if (module->lazy)
+    return wabt::Result::Error;
+  for (const Import& import : module->imports) {
+    if (!find_host_module(env, import.module_name))
+      return wabt::Result::Error;
+  }
+
+  CacheWriter payload;
+  write_module(&payload, env, mark, module);
+
+  CacheWriter header;
+  header.WriteData(kCacheMagic, sizeof(kCacheMagic));
+  header.WriteU32(kCacheVersion);
+  header.WriteU64(key);
+  header.WriteU64(payload.buffer.size());
+  header.WriteU64(
+      hash_bytes(kHashOffsetBasis, payload.buffer.data(), payload.buffer.size()));
+
+  /* Write to a temporary file and rename it, so another process reading the
+   * cache never sees a partly written file. */
+  std::string temp_filename = std::string(filename) + ".tmp";
+#if HAVE_UNISTD_H
+  temp_filename += std::to_string(getpid());
+#endif
+  FILE* file = fopen(temp_filename.c_str(), "wb");
+  if (!file)
+    return wabt::Result::Error;
+  bool ok = fwrite(header.buffer.data(), header.buffer.size(), 1, file) == 1 &&
+            fwrite(payload.buffer.data(), payload.buffer.size(), 1, file) == 1;
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(temp_filename.c_str(), filename) != 0) {
+    remove(temp_filename.c_str());
+    return wabt::Result::Error;
+  }
+  return wabt::Result::Ok;
+}
+
+wabt::Result read_module_cache(const char* filename,
+                               uint64_t key,
+                               Environment* env,
+                               DefinedModule** out_module) {
+#if HAVE_MMAP
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return wabt::Result::Error;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return wabt::Result::Error;
+  }
+  size_t size = st.st_size;
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return wabt::Result::Error;
+  wabt::Result result = read_module_cache_data(
+      static_cast<const uint8_t*>(data), size, key, env, out_module);
+  munmap(data, size);
+  return result;
+#else
+  FILE* file = fopen(filename, "rb");
+  if (!file)
+    return wabt::Result::Error;
+  std::vector<uint8_t> data;
+  uint8_t buffer[4096];
+  size_t read_size;
+  while ((read_size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    data.insert(data.end(), buffer, buffer + read_size);
+  fclose(file);
+  return read_module_cache_data(data.data(), data.size(), key, env,
+                                out_module);
+#endif
+}
+
+}  // namespace interpreter
+}  // namespace wabt
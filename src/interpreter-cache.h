@@ -0,0 +1,66 @@
+/*
+ * Copyright 2017 WebAssembly Community Group participants
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WABT_INTERPRETER_CACHE_H_
+#define WABT_INTERPRETER_CACHE_H_
+
+#include <stdint.h>
+
+#include "interpreter.h"
+
+namespace wabt {
+
+struct ReadBinaryInterpreterOptions;
+
+namespace interpreter {
+
+/* A module cache file holds everything that loading a module added to an
+ * Environment: its signatures, functions, tables, memories and globals after
+ * the elem and data segments were applied, its imports and exports, and its
+ * code in the istream. Loading it again skips reading, validating and
+ * compiling the binary. Host imports are bound again by the host module's
+ * import delegate. Modules that import from other wasm modules, or were
+ * loaded with lazy compilation, can't be cached. */
+
+/* Returns the key of the cache file of the module in |data|, loaded with
+ * |options|. The key also covers the istream opcodes of this interpreter, so
+ * a cache file written by an interpreter with different opcodes doesn't
+ * match; other changes to the istream encoding bump the file's version. */
+uint64_t get_module_cache_key(const void* data,
+                              size_t size,
+                              const ReadBinaryInterpreterOptions* options);
+
+/* Writes |module|, which was loaded into |env| after |mark| was taken, to the
+ * cache file |filename|. */
+::wabt::Result write_module_cache(const char* filename,
+                                  uint64_t key,
+                                  Environment* env,
+                                  const EnvironmentMark& mark,
+                                  DefinedModule* module);
+
+/* Loads the module in the cache file |filename|. This fails, leaving |env| as
+ * it was, if the file doesn't exist or is damaged, if it was written with a
+ * different key, or if |env| isn't in the same state as when the module was
+ * loaded to write the file. */
+::wabt::Result read_module_cache(const char* filename,
+                                 uint64_t key,
+                                 Environment* env,
+                                 DefinedModule** out_module);
+
+}  // namespace interpreter
+}  // namespace wabt
+
+#endif /* WABT_INTERPRETER_CACHE_H_ */
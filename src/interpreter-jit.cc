@@ -0,0 +1,962 @@
+/*
+ * Copyright 2017 WebAssembly Community Group participants
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* A baseline JIT for the interpreter.
+ *
+ * Each instruction of a function's istream is translated to a fixed template
+ * of x86-64 code. The code works directly on the thread's value stack and
+ * call stack, so the stacks look exactly as they would if the function had
+ * been interpreted, and traps are checked at the same points as in
+ * run_interpreter. Instructions that the JIT doesn't handle (floating point
+ * arithmetic, br_table, call_indirect, host calls and memory size operations)
+ * make jit_compile fail, and the function stays in the interpreter. */
+
+#include "interpreter-jit.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#if WABT_INTERPRETER_JIT
+#include <sys/mman.h>
+#endif
+
+#include "binary-reader-interpreter.h"
+
+namespace wabt {
+namespace interpreter {
+
+#if WABT_INTERPRETER_JIT
+
+namespace {
+
+struct JitMemory {
+  char* data;
+  uint64_t size;
+};
+
+/* The state shared by run_jit_code and the compiled code. The entry stub
+ * loads the stack pointers into registers, and stores them back when the
+ * function returns or traps. */
+struct JitFrame {
+  Value* value_stack_top;
+  Value* value_stack_end;
+  IstreamOffset* call_stack_top;
+  IstreamOffset* call_stack_end;
+  Value* global_values;
+  JitMemory* memories;
+  uint64_t fuel;
+  std::atomic<bool>* interrupt;
+  uint32_t result;
+};
+
+/* The compiled code reads the interrupt flag as a plain byte. */
+static_assert(sizeof(std::atomic<bool>) == 1, "atomic<bool> must be a byte");
+
+typedef void (*JitEntryStub)(JitFrame* frame, void* code);
+
+enum Reg {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+/* These hold state for all of the compiled code, so they're all
+ * callee-saved. */
+static const Reg kValueStackTop = RBX;
+static const Reg kCallStackTop = R13;
+static const Reg kFrame = R14;
+/* rsp just before the entry stub called into the compiled code; a trap
+ * resets rsp from here, which unwinds every compiled frame at once. */
+static const Reg kTrapStack = R15;
+
+enum Cond {
+  kBelow = 0x2,
+  kAboveEqual = 0x3,
+  kEqual = 0x4,
+  kNotEqual = 0x5,
+  kBelowEqual = 0x6,
+  kAbove = 0x7,
+  kLess = 0xc,
+  kGreaterEqual = 0xd,
+  kLessEqual = 0xe,
+  kGreater = 0xf,
+};
+
+/* ModRM reg field values selecting the operation of the group opcodes. */
+enum {
+  kGroupAdd = 0,
+  kGroupOr = 1,
+  kGroupAnd = 4,
+  kGroupSub = 5,
+  kGroupXor = 6,
+  kGroupCmp = 7,
+};
+
+enum {
+  kShiftRol = 0,
+  kShiftRor = 1,
+  kShiftShl = 4,
+  kShiftShr = 5,
+  kShiftSar = 7,
+};
+
+/* Depths and counts from the istream become 32-bit displacements, scaled by
+ * sizeof(Value); anything larger isn't compiled. */
+static const uint32_t kMaxSlots = 0x0fffffff;
+
+static void* map_code(const std::vector<uint8_t>& code) {
+  void* mapping = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    return nullptr;
+  memcpy(mapping, code.data(), code.size());
+  if (mprotect(mapping, code.size(), PROT_READ | PROT_EXEC) != 0) {
+    munmap(mapping, code.size());
+    return nullptr;
+  }
+  return mapping;
+}
+
+class Assembler {
+ public:
+  const std::vector<uint8_t>& code() const { return code_; }
+  size_t offset() const { return code_.size(); }
+
+  void Emit8(uint8_t value) { code_.push_back(value); }
+
+  void Emit32(uint32_t value) {
+    for (int i = 0; i < 4; ++i)
+      Emit8(value >> (i * 8));
+  }
+
+  void Emit64(uint64_t value) {
+    Emit32(value);
+    Emit32(value >> 32);
+  }
+
+  void Patch32(size_t offset, uint32_t value) {
+    for (int i = 0; i < 4; ++i)
+      code_[offset + i] = value >> (i * 8);
+  }
+
+  /* Points the rel32 at |offset| to |target|. */
+  void PatchRel32(size_t offset, size_t target) {
+    Patch32(offset, static_cast<uint32_t>(target - (offset + 4)));
+  }
+
+  void EmitRex(bool wide, int reg, int index, int base) {
+    uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) >> 1) |
+                  ((index & 8) >> 2) | ((base & 8) >> 3);
+    if (rex != 0x40)
+      Emit8(rex);
+  }
+
+  /* Emits a one byte opcode, or a two byte opcode starting with 0x0f. */
+  void EmitOp(uint32_t op) {
+    if (op > 0xff)
+      Emit8(op >> 8);
+    Emit8(op);
+  }
+
+  /* op reg, rm */
+  void EmitRR(bool wide, uint32_t op, int reg, Reg rm) {
+    EmitRex(wide, reg, 0, rm);
+    EmitOp(op);
+    Emit8(0xc0 | ((reg & 7) << 3) | (rm & 7));
+  }
+
+  /* op reg, [base + disp] */
+  void EmitRM(bool wide, uint32_t op, int reg, Reg base, int32_t disp) {
+    EmitRex(wide, reg, 0, base);
+    EmitOp(op);
+    Emit8(0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+      Emit8(0x24);
+    Emit32(disp);
+  }
+
+  /* op reg, [base + index] */
+  void EmitRMIndex(bool wide, uint32_t op, int reg, Reg base, Reg index) {
+    assert((base & 7) != RBP && index != RSP);
+    EmitRex(wide, reg, index, base);
+    EmitOp(op);
+    Emit8(0x04 | ((reg & 7) << 3));
+    Emit8(((index & 7) << 3) | (base & 7));
+  }
+
+  /* op rm, imm32, where |group| selects the operation */
+  void EmitRI(bool wide, int group, Reg rm, uint32_t imm) {
+    EmitRR(wide, 0x81, group, rm);
+    Emit32(imm);
+  }
+
+  void EmitMovImm(Reg reg, uint64_t imm) {
+    if (imm <= UINT32_MAX) {
+      EmitRex(false, 0, 0, reg);
+      Emit8(0xb8 + (reg & 7));
+      Emit32(imm);
+    } else {
+      EmitRex(true, 0, 0, reg);
+      Emit8(0xb8 + (reg & 7));
+      Emit64(imm);
+    }
+  }
+
+  void EmitPush(Reg reg) {
+    EmitRex(false, 0, 0, reg);
+    Emit8(0x50 + (reg & 7));
+  }
+
+  void EmitPop(Reg reg) {
+    EmitRex(false, 0, 0, reg);
+    Emit8(0x58 + (reg & 7));
+  }
+
+  void EmitRet() { Emit8(0xc3); }
+
+  /* Emits a jump with a zero displacement, and returns the offset of the
+   * displacement to patch. */
+  size_t EmitJmp() {
+    Emit8(0xe9);
+    Emit32(0);
+    return offset() - 4;
+  }
+
+  size_t EmitJcc(Cond cond) {
+    Emit8(0x0f);
+    Emit8(0x80 | cond);
+    Emit32(0);
+    return offset() - 4;
+  }
+
+  void Bind(size_t rel32_offset) { PatchRel32(rel32_offset, offset()); }
+
+ private:
+  std::vector<uint8_t> code_;
+};
+
+/* The stub that run_jit_code calls to enter compiled code. */
+static JitEntryStub get_entry_stub() {
+  static JitEntryStub s_entry_stub;
+  static std::once_flag s_once;
+  std::call_once(s_once, []() {
+    Assembler a;
+    a.EmitPush(RBP);
+    a.EmitPush(RBX);
+    a.EmitPush(R12);
+    a.EmitPush(R13);
+    a.EmitPush(R14);
+    a.EmitPush(R15);
+    /* Keep rsp 16-byte aligned at the call. */
+    a.EmitRI(true, kGroupSub, RSP, 8);
+    a.EmitRR(true, 0x89, RDI, kFrame);
+    a.EmitRM(true, 0x8b, kValueStackTop, kFrame,
+             offsetof(JitFrame, value_stack_top));
+    a.EmitRM(true, 0x8b, kCallStackTop, kFrame,
+             offsetof(JitFrame, call_stack_top));
+    a.EmitRR(true, 0x89, RSP, kTrapStack);
+    a.EmitRR(false, 0xff, 2, RSI); /* call rsi */
+    a.EmitRM(true, 0x89, kValueStackTop, kFrame,
+             offsetof(JitFrame, value_stack_top));
+    a.EmitRM(true, 0x89, kCallStackTop, kFrame,
+             offsetof(JitFrame, call_stack_top));
+    a.EmitRI(true, kGroupAdd, RSP, 8);
+    a.EmitPop(R15);
+    a.EmitPop(R14);
+    a.EmitPop(R13);
+    a.EmitPop(R12);
+    a.EmitPop(RBX);
+    a.EmitPop(RBP);
+    a.EmitRet();
+    s_entry_stub = reinterpret_cast<JitEntryStub>(map_code(a.code()));
+  });
+  return s_entry_stub;
+}
+
+class JitCompiler : private Assembler {
+ public:
+  typedef std::unordered_map<IstreamOffset, DefinedFunc*> FuncMap;
+
+  JitCompiler(Environment* env, const FuncMap* funcs_by_offset)
+      : env_(env), funcs_by_offset_(funcs_by_offset) {}
+
+  /* Appends the code for |func|, and adds the functions it calls to
+   * |callees|. Returns false if |func| can't be compiled. */
+  bool CompileFunction(DefinedFunc* func, std::vector<DefinedFunc*>* callees);
+
+  /* Copies the code to executable memory, and sets jit_code for each
+   * function. */
+  bool Finish();
+
+ private:
+  uint32_t ReadU32(IstreamOffset* pc) {
+    uint32_t value;
+    memcpy(&value, istream() + *pc, sizeof(value));
+    *pc += sizeof(value);
+    return value;
+  }
+
+  uint64_t ReadU64(IstreamOffset* pc) {
+    uint64_t value;
+    memcpy(&value, istream() + *pc, sizeof(value));
+    *pc += sizeof(value);
+    return value;
+  }
+
+  const uint8_t* istream() const { return env_->istream->data.data(); }
+
+  static int32_t SlotDisp(uint32_t depth) {
+    return -static_cast<int32_t>(depth * sizeof(Value));
+  }
+
+  void EmitLoadSlot(bool wide, Reg reg, uint32_t depth) {
+    EmitRM(wide, 0x8b, reg, kValueStackTop, SlotDisp(depth));
+  }
+
+  void EmitStoreSlot(bool wide, Reg reg, uint32_t depth) {
+    EmitRM(wide, 0x89, reg, kValueStackTop, SlotDisp(depth));
+  }
+
+  void EmitAdjustStack(int slots) {
+    uint32_t size = static_cast<uint32_t>(slots < 0 ? -slots : slots) *
+                    sizeof(Value);
+    if (slots > 0)
+      EmitRI(true, kGroupAdd, kValueStackTop, size);
+    else if (slots < 0)
+      EmitRI(true, kGroupSub, kValueStackTop, size);
+  }
+
+  void EmitTrapIf(Cond cond, Result result) {
+    trap_fixups_.emplace_back(EmitJcc(cond), result);
+  }
+
+  void EmitTrap(Result result) {
+    trap_fixups_.emplace_back(EmitJmp(), result);
+  }
+
+  /* The same checks as charge_fuel in the interpreter. A compiled function
+   * that runs out of fuel or is interrupted unwinds like a trap, so unlike an
+   * interpreted one it can't be resumed. */
+  void EmitChargeFuel(uint32_t cost) {
+    EmitRM(true, 0x8b, RAX, kFrame, offsetof(JitFrame, interrupt));
+    EmitRM(false, 0x80, kGroupCmp, RAX, 0);
+    Emit8(0);
+    EmitTrapIf(kNotEqual, Result::Interrupted);
+    EmitRM(true, 0x81, kGroupCmp, kFrame, offsetof(JitFrame, fuel));
+    Emit32(cost);
+    EmitTrapIf(kBelow, Result::FuelExhausted);
+    EmitRM(true, 0x81, kGroupSub, kFrame, offsetof(JitFrame, fuel));
+    Emit32(cost);
+  }
+
+  /* eax = cond ? 1 : 0 */
+  void EmitSetcc(Cond cond) {
+    EmitRR(false, 0x0f90 | cond, 0, RAX);
+    EmitRR(false, 0x0fb6, RAX, RAX);
+  }
+
+  void EmitBinop(bool wide, uint32_t op) {
+    EmitLoadSlot(wide, RAX, 2);
+    EmitRM(wide, op, RAX, kValueStackTop, SlotDisp(1));
+    EmitStoreSlot(wide, RAX, 2);
+    EmitAdjustStack(-1);
+  }
+
+  void EmitShift(bool wide, int shift) {
+    EmitLoadSlot(false, RCX, 1);
+    EmitLoadSlot(wide, RAX, 2);
+    EmitRR(wide, 0xd3, shift, RAX);
+    EmitStoreSlot(wide, RAX, 2);
+    EmitAdjustStack(-1);
+  }
+
+  void EmitCompare(bool wide, Cond cond) {
+    EmitLoadSlot(wide, RAX, 2);
+    EmitRM(wide, 0x3b, RAX, kValueStackTop, SlotDisp(1));
+    EmitSetcc(cond);
+    EmitStoreSlot(false, RAX, 2);
+    EmitAdjustStack(-1);
+  }
+
+  void EmitEqz(bool wide) {
+    EmitRM(wide, 0x81, kGroupCmp, kValueStackTop, SlotDisp(1));
+    Emit32(0);
+    EmitSetcc(kEqual);
+    EmitStoreSlot(false, RAX, 1);
+  }
+
+  void EmitDivRem(bool wide, bool is_signed, bool is_rem) {
+    EmitLoadSlot(wide, RCX, 1);
+    EmitRR(wide, 0x85, RCX, RCX);
+    EmitTrapIf(kEqual, Result::TrapIntegerDivideByZero);
+    EmitLoadSlot(wide, RAX, 2);
+    if (is_signed) {
+      /* INT_MIN / -1 overflows, and INT_MIN % -1 is 0; idiv faults on
+       * both. */
+      EmitRI(wide, kGroupCmp, RCX, 0xffffffff);
+      size_t not_minus_one = EmitJcc(kNotEqual);
+      size_t done = 0;
+      if (is_rem) {
+        EmitRR(false, 0x31, RDX, RDX);
+        done = EmitJmp();
+      } else if (wide) {
+        EmitMovImm(RDX, 0x8000000000000000ULL);
+        EmitRR(true, 0x39, RDX, RAX);
+        EmitTrapIf(kEqual, Result::TrapIntegerOverflow);
+      } else {
+        EmitRI(false, kGroupCmp, RAX, 0x80000000);
+        EmitTrapIf(kEqual, Result::TrapIntegerOverflow);
+      }
+      Bind(not_minus_one);
+      if (wide)
+        Emit8(0x48);
+      Emit8(0x99); /* cdq/cqo */
+      EmitRR(wide, 0xf7, 7, RCX);
+      if (is_rem)
+        Bind(done);
+    } else {
+      EmitRR(false, 0x31, RDX, RDX);
+      EmitRR(wide, 0xf7, 6, RCX);
+    }
+    EmitStoreSlot(wide, is_rem ? RDX : RAX, 2);
+    EmitAdjustStack(-1);
+  }
+
+  /* Adds the offset immediate to the address in rax, checks the access
+   * against the memory's size, and loads the memory's base into rdx. */
+  void EmitEffectiveAddress(Index memory_index,
+                            uint32_t offset,
+                            uint32_t access_size) {
+    int32_t memory_disp = memory_index * sizeof(JitMemory);
+    if (offset) {
+      EmitMovImm(RDX, offset);
+      EmitRR(true, 0x01, RDX, RAX);
+    }
+    EmitRM(true, 0x8b, RCX, kFrame, offsetof(JitFrame, memories));
+#if !WABT_INTERPRETER_GUARD_PAGES
+    EmitRM(true, 0x8d, RDX, RAX, access_size);
+    EmitRM(true, 0x3b, RDX, RCX, memory_disp + offsetof(JitMemory, size));
+    EmitTrapIf(kAbove, Result::TrapMemoryAccessOutOfBounds);
+#endif
+    EmitRM(true, 0x8b, RDX, RCX, memory_disp + offsetof(JitMemory, data));
+  }
+
+  /* Loads from the address at |depth|, and pushes the result if |push|, or
+   * replaces the address otherwise. */
+  void EmitLoad(IstreamOffset* pc,
+                bool wide,
+                uint32_t op,
+                uint32_t access_size,
+                uint32_t depth,
+                bool push) {
+    Index memory_index = ReadU32(pc);
+    if (push)
+      depth = ReadU32(pc);
+    uint32_t offset = ReadU32(pc);
+    EmitLoadSlot(false, RAX, depth);
+    EmitEffectiveAddress(memory_index, offset, access_size);
+    EmitRMIndex(wide, op, RAX, RDX, RAX);
+    /* The narrower loads zero-extend to 64 bits, so the whole value can be
+     * stored regardless of type. */
+    if (push) {
+      EmitStoreSlot(true, RAX, 0);
+      EmitAdjustStack(1);
+    } else {
+      EmitStoreSlot(true, RAX, 1);
+    }
+  }
+
+  void EmitStore(IstreamOffset* pc, uint32_t access_size) {
+    Index memory_index = ReadU32(pc);
+    uint32_t offset = ReadU32(pc);
+    EmitLoadSlot(false, RAX, 2);
+    EmitEffectiveAddress(memory_index, offset, access_size);
+    EmitLoadSlot(true, RCX, 1);
+    switch (access_size) {
+      case 1:
+        EmitRMIndex(false, 0x88, RCX, RDX, RAX);
+        break;
+      case 2:
+        Emit8(0x66);
+        EmitRMIndex(false, 0x89, RCX, RDX, RAX);
+        break;
+      default:
+        EmitRMIndex(access_size == 8, 0x89, RCX, RDX, RAX);
+        break;
+    }
+    EmitAdjustStack(-2);
+  }
+
+  Environment* env_;
+  const FuncMap* funcs_by_offset_;
+  std::vector<std::pair<DefinedFunc*, size_t>> entries_;
+  std::vector<std::pair<size_t, Result>> trap_fixups_;
+};
+
+bool JitCompiler::CompileFunction(DefinedFunc* func,
+                                  std::vector<DefinedFunc*>* callees) {
+  /* The native offset of each instruction, and the branches to patch once
+   * they are all known. */
+  std::unordered_map<IstreamOffset, size_t> native_offsets;
+  std::vector<std::pair<size_t, IstreamOffset>> branch_fixups;
+
+  size_t istream_size = env_->istream->data.size();
+  IstreamOffset pc = func->offset;
+  /* The function ends at a return that no branch jumps past. */
+  IstreamOffset max_branch_target = pc;
+  bool done = false;
+  entries_.emplace_back(func, offset());
+
+  while (!done) {
+    if (pc >= istream_size)
+      return false;
+
+    native_offsets[pc] = offset();
+    Opcode opcode = static_cast<Opcode>(istream()[pc++]);
+    switch (opcode) {
+      case Opcode::Alloca: {
+        uint32_t local_count = ReadU32(&pc);
+        uint32_t max_stack_height = ReadU32(&pc);
+        uint32_t fuel_cost = ReadU32(&pc);
+        uint64_t slots = static_cast<uint64_t>(local_count) + max_stack_height;
+        /* The cost is compared as a sign-extended imm32. */
+        if (slots > kMaxSlots || fuel_cost > INT32_MAX)
+          return false;
+        EmitChargeFuel(fuel_cost);
+        EmitRM(true, 0x8b, RAX, kFrame, offsetof(JitFrame, value_stack_end));
+        EmitRR(true, 0x29, kValueStackTop, RAX);
+        EmitRI(true, kGroupCmp, RAX, slots * sizeof(Value));
+        EmitTrapIf(kBelow, Result::TrapValueStackExhausted);
+        if (local_count <= 8) {
+          for (uint32_t i = 0; i < local_count; ++i) {
+            EmitRM(true, 0xc7, 0, kValueStackTop, i * sizeof(Value));
+            Emit32(0);
+          }
+        } else {
+          EmitRR(true, 0x89, kValueStackTop, RDI);
+          EmitMovImm(RCX, local_count);
+          EmitRR(false, 0x31, RAX, RAX);
+          Emit8(0xf3); /* rep stosq */
+          Emit8(0x48);
+          Emit8(0xab);
+        }
+        EmitAdjustStack(local_count);
+        break;
+      }
+
+      case Opcode::ChargeFuel: {
+        uint32_t fuel_cost = ReadU32(&pc);
+        if (fuel_cost > INT32_MAX)
+          return false;
+        EmitChargeFuel(fuel_cost);
+        break;
+      }
+
+      case Opcode::Br:
+      case Opcode::BrIf:
+      case Opcode::BrUnless: {
+        IstreamOffset target = ReadU32(&pc);
+        if (target > max_branch_target)
+          max_branch_target = target;
+        size_t fixup;
+        if (opcode == Opcode::Br) {
+          fixup = EmitJmp();
+        } else {
+          EmitLoadSlot(false, RAX, 1);
+          EmitAdjustStack(-1);
+          EmitRR(false, 0x85, RAX, RAX);
+          fixup = EmitJcc(opcode == Opcode::BrIf ? kNotEqual : kEqual);
+        }
+        branch_fixups.emplace_back(fixup, target);
+        break;
+      }
+
+      case Opcode::Return:
+        EmitRet();
+        done = pc > max_branch_target;
+        break;
+
+      case Opcode::Unreachable:
+        EmitTrap(Result::TrapUnreachable);
+        break;
+
+      case Opcode::Call: {
+        IstreamOffset target = ReadU32(&pc);
+        auto iter = funcs_by_offset_->find(target);
+        if (iter == funcs_by_offset_->end())
+          return false;
+        DefinedFunc* callee = iter->second;
+        callees->push_back(callee);
+        /* Push a call stack entry like the interpreter does, so the call
+         * depth is limited the same way. */
+        EmitRM(true, 0x3b, kCallStackTop, kFrame,
+               offsetof(JitFrame, call_stack_end));
+        EmitTrapIf(kAboveEqual, Result::TrapCallStackExhausted);
+        EmitRI(true, kGroupAdd, kCallStackTop, sizeof(IstreamOffset));
+        EmitMovImm(RAX, reinterpret_cast<uint64_t>(&callee->jit_code));
+        EmitRM(true, 0x8b, RAX, RAX, 0);
+        EmitRR(false, 0xff, 2, RAX); /* call rax */
+        EmitRI(true, kGroupSub, kCallStackTop, sizeof(IstreamOffset));
+        break;
+      }
+
+      case Opcode::Drop:
+        EmitAdjustStack(-1);
+        break;
+
+      case Opcode::DropKeep: {
+        uint32_t drop = ReadU32(&pc);
+        uint8_t keep = istream()[pc++];
+        if (drop > kMaxSlots)
+          return false;
+        if (keep) {
+          EmitLoadSlot(true, RAX, 1);
+          EmitStoreSlot(true, RAX, drop + 1);
+        }
+        EmitAdjustStack(-static_cast<int>(drop));
+        break;
+      }
+
+      case Opcode::Select:
+        EmitLoadSlot(true, RAX, 3);
+        EmitLoadSlot(true, RCX, 2);
+        EmitLoadSlot(false, RDX, 1);
+        EmitRR(false, 0x85, RDX, RDX);
+        EmitRR(true, 0x0f44, RAX, RCX); /* cmove rax, rcx */
+        EmitStoreSlot(true, RAX, 3);
+        EmitAdjustStack(-2);
+        break;
+
+      case Opcode::I32Const:
+      case Opcode::F32Const:
+        EmitRM(false, 0xc7, 0, kValueStackTop, 0);
+        Emit32(ReadU32(&pc));
+        EmitAdjustStack(1);
+        break;
+
+      case Opcode::I64Const:
+      case Opcode::F64Const:
+        EmitMovImm(RAX, ReadU64(&pc));
+        EmitStoreSlot(true, RAX, 0);
+        EmitAdjustStack(1);
+        break;
+
+      case Opcode::GetGlobal:
+      case Opcode::SetGlobal: {
+        Index index = ReadU32(&pc);
+        assert(index < env_->globals.size());
+        if (index > kMaxSlots)
+          return false;
+        int32_t disp = index * sizeof(Value);
+        EmitRM(true, 0x8b, RCX, kFrame, offsetof(JitFrame, global_values));
+        if (opcode == Opcode::GetGlobal) {
+          EmitRM(true, 0x8b, RAX, RCX, disp);
+          EmitStoreSlot(true, RAX, 0);
+          EmitAdjustStack(1);
+        } else {
+          EmitLoadSlot(true, RAX, 1);
+          EmitRM(true, 0x89, RAX, RCX, disp);
+          EmitAdjustStack(-1);
+        }
+        break;
+      }
+
+      case Opcode::GetLocal:
+      case Opcode::SetLocal:
+      case Opcode::TeeLocal: {
+        uint32_t depth = ReadU32(&pc);
+        if (depth > kMaxSlots)
+          return false;
+        if (opcode == Opcode::GetLocal) {
+          EmitLoadSlot(true, RAX, depth);
+          EmitStoreSlot(true, RAX, 0);
+          EmitAdjustStack(1);
+        } else {
+          EmitLoadSlot(true, RAX, 1);
+          /* set_local's depth is counted after popping the value. */
+          bool is_set = opcode == Opcode::SetLocal;
+          EmitStoreSlot(true, RAX, is_set ? depth + 1 : depth);
+          if (is_set)
+            EmitAdjustStack(-1);
+        }
+        break;
+      }
+
+      case Opcode::I32Load8S:
+        EmitLoad(&pc, false, 0x0fbe, 1, 1, false);
+        break;
+      case Opcode::I32Load8U:
+      case Opcode::I64Load8U:
+        EmitLoad(&pc, false, 0x0fb6, 1, 1, false);
+        break;
+      case Opcode::I32Load16S:
+        EmitLoad(&pc, false, 0x0fbf, 2, 1, false);
+        break;
+      case Opcode::I32Load16U:
+      case Opcode::I64Load16U:
+        EmitLoad(&pc, false, 0x0fb7, 2, 1, false);
+        break;
+      case Opcode::I64Load8S:
+        EmitLoad(&pc, true, 0x0fbe, 1, 1, false);
+        break;
+      case Opcode::I64Load16S:
+        EmitLoad(&pc, true, 0x0fbf, 2, 1, false);
+        break;
+      case Opcode::I64Load32S:
+        EmitLoad(&pc, true, 0x63, 4, 1, false);
+        break;
+      case Opcode::I32Load:
+      case Opcode::F32Load:
+      case Opcode::I64Load32U:
+        EmitLoad(&pc, false, 0x8b, 4, 1, false);
+        break;
+      case Opcode::I64Load:
+      case Opcode::F64Load:
+        EmitLoad(&pc, true, 0x8b, 8, 1, false);
+        break;
+      case Opcode::I32LoadLocal:
+        EmitLoad(&pc, false, 0x8b, 4, 0, true);
+        break;
+
+      case Opcode::I32Store8:
+      case Opcode::I64Store8:
+        EmitStore(&pc, 1);
+        break;
+      case Opcode::I32Store16:
+      case Opcode::I64Store16:
+        EmitStore(&pc, 2);
+        break;
+      case Opcode::I32Store:
+      case Opcode::I64Store32:
+      case Opcode::F32Store:
+        EmitStore(&pc, 4);
+        break;
+      case Opcode::I64Store:
+      case Opcode::F64Store:
+        EmitStore(&pc, 8);
+        break;
+
+#define BINOP_CASES(type, wide)                                        \
+  case Opcode::type##Add: EmitBinop(wide, 0x03); break;                \
+  case Opcode::type##Sub: EmitBinop(wide, 0x2b); break;                \
+  case Opcode::type##Mul: EmitBinop(wide, 0x0faf); break;              \
+  case Opcode::type##And: EmitBinop(wide, 0x23); break;                \
+  case Opcode::type##Or: EmitBinop(wide, 0x0b); break;                 \
+  case Opcode::type##Xor: EmitBinop(wide, 0x33); break;                \
+  case Opcode::type##Shl: EmitShift(wide, kShiftShl); break;           \
+  case Opcode::type##ShrS: EmitShift(wide, kShiftSar); break;          \
+  case Opcode::type##ShrU: EmitShift(wide, kShiftShr); break;          \
+  case Opcode::type##Rotl: EmitShift(wide, kShiftRol); break;          \
+  case Opcode::type##Rotr: EmitShift(wide, kShiftRor); break;          \
+  case Opcode::type##DivS: EmitDivRem(wide, true, false); break;       \
+  case Opcode::type##DivU: EmitDivRem(wide, false, false); break;      \
+  case Opcode::type##RemS: EmitDivRem(wide, true, true); break;        \
+  case Opcode::type##RemU: EmitDivRem(wide, false, true); break;       \
+  case Opcode::type##Eq: EmitCompare(wide, kEqual); break;             \
+  case Opcode::type##Ne: EmitCompare(wide, kNotEqual); break;          \
+  case Opcode::type##LtS: EmitCompare(wide, kLess); break;             \
+  case Opcode::type##LeS: EmitCompare(wide, kLessEqual); break;        \
+  case Opcode::type##GtS: EmitCompare(wide, kGreater); break;          \
+  case Opcode::type##GeS: EmitCompare(wide, kGreaterEqual); break;     \
+  case Opcode::type##LtU: EmitCompare(wide, kBelow); break;            \
+  case Opcode::type##LeU: EmitCompare(wide, kBelowEqual); break;       \
+  case Opcode::type##GtU: EmitCompare(wide, kAbove); break;            \
+  case Opcode::type##GeU: EmitCompare(wide, kAboveEqual); break;       \
+  case Opcode::type##Eqz: EmitEqz(wide); break;
+
+      BINOP_CASES(I32, false)
+      BINOP_CASES(I64, true)
+#undef BINOP_CASES
+
+      case Opcode::I32WrapI64:
+      case Opcode::I32ReinterpretF32:
+      case Opcode::I64ReinterpretF64:
+      case Opcode::F32ReinterpretI32:
+      case Opcode::F64ReinterpretI64:
+        /* The bits of the value don't change. */
+        break;
+
+      case Opcode::I64ExtendSI32:
+        EmitRM(true, 0x63, RAX, kValueStackTop, SlotDisp(1));
+        EmitStoreSlot(true, RAX, 1);
+        break;
+
+      case Opcode::I64ExtendUI32:
+        EmitLoadSlot(false, RAX, 1);
+        EmitStoreSlot(true, RAX, 1);
+        break;
+
+      case Opcode::I32AddLocalLocal:
+      case Opcode::I32AddLocalConst: {
+        uint32_t depth = ReadU32(&pc);
+        uint32_t rhs = ReadU32(&pc);
+        EmitLoadSlot(false, RAX, depth);
+        if (opcode == Opcode::I32AddLocalLocal)
+          EmitRM(false, 0x03, RAX, kValueStackTop, SlotDisp(rhs));
+        else
+          EmitRI(false, kGroupAdd, RAX, rhs);
+        EmitStoreSlot(false, RAX, 0);
+        EmitAdjustStack(1);
+        break;
+      }
+
+      default:
+        return false;
+    }
+  }
+
+  for (const std::pair<size_t, IstreamOffset>& fixup : branch_fixups) {
+    auto iter = native_offsets.find(fixup.second);
+    if (iter == native_offsets.end())
+      return false;
+    PatchRel32(fixup.first, iter->second);
+  }
+  return true;
+}
+
+bool JitCompiler::Finish() {
+  /* Each kind of trap gets one stub, which stores the result and unwinds to
+   * the entry stub. */
+  std::unordered_map<int, size_t> trap_stubs;
+  for (const std::pair<size_t, Result>& fixup : trap_fixups_) {
+    int result = static_cast<int>(fixup.second);
+    auto iter = trap_stubs.find(result);
+    if (iter == trap_stubs.end()) {
+      iter = trap_stubs.emplace(result, offset()).first;
+      EmitRM(false, 0xc7, 0, kFrame, offsetof(JitFrame, result));
+      Emit32(result);
+      EmitRM(true, 0x8d, RSP, kTrapStack, -8);
+      EmitRet();
+    }
+    PatchRel32(fixup.first, iter->second);
+  }
+
+  char* mapping = static_cast<char*>(map_code(code()));
+  if (!mapping)
+    return false;
+  env_->jit_mappings.emplace_back(mapping, code().size());
+  for (const std::pair<DefinedFunc*, size_t>& entry : entries_)
+    entry.first->jit_code = mapping + entry.second;
+  return true;
+}
+
+}  // namespace
+
+bool jit_compile(Environment* env, DefinedFunc* func) {
+  if (func->jit_code)
+    return true;
+  /* only stack code is translated */
+  if (env->register_machine)
+    return false;
+
+  /* Threads sharing the environment may try to compile at the same time. */
+  static std::mutex s_mutex;
+  std::lock_guard<std::mutex> lock(s_mutex);
+  if (func->jit_code)
+    return true;
+  if (func->jit_failed || !get_entry_stub())
+    return false;
+
+  /* Calls to a lazily compiled function may go to its stub or to its body. */
+  JitCompiler::FuncMap funcs_by_offset;
+  for (const std::unique_ptr<Func>& other : env->funcs) {
+    if (other->is_host)
+      continue;
+    DefinedFunc* defined = other->as_defined();
+    if (defined->offset != kInvalidIstreamOffset)
+      funcs_by_offset[defined->offset] = defined;
+    if (defined->lazy_module)
+      funcs_by_offset[defined->lazy_stub_offset] = defined;
+  }
+
+  /* Compile everything |func| can call at once, so compiled code only ever
+   * calls compiled code. */
+  JitCompiler compiler(env, &funcs_by_offset);
+  std::vector<DefinedFunc*> worklist = {func};
+  std::unordered_set<DefinedFunc*> queued = {func};
+  while (!worklist.empty()) {
+    DefinedFunc* next = worklist.back();
+    worklist.pop_back();
+    std::vector<DefinedFunc*> callees;
+    if (WABT_FAILED(compile_lazy_function(env, next)) ||
+        !compiler.CompileFunction(next, &callees)) {
+      func->jit_failed = true;
+      return false;
+    }
+    for (DefinedFunc* callee : callees) {
+      if (!callee->jit_code && queued.insert(callee).second)
+        worklist.push_back(callee);
+    }
+  }
+
+  if (!compiler.Finish()) {
+    func->jit_failed = true;
+    return false;
+  }
+  return true;
+}
+
+Result run_jit_code(Thread* thread, DefinedFunc* func) {
+  /* Compiled code can't grow a memory, but the interpreter may have since the
+   * last call, so the table is filled every time. It's kept between calls so
+   * that calling compiled code doesn't allocate. */
+  static thread_local std::vector<JitMemory> s_memories;
+  Instance* instance = thread->instance;
+  s_memories.clear();
+  for (Memory& memory : instance->memories)
+    s_memories.push_back({memory.data.data(), memory.data.size()});
+
+  JitFrame frame;
+  frame.value_stack_top = thread->value_stack_top;
+  frame.value_stack_end = thread->value_stack_end;
+  frame.call_stack_top = thread->call_stack_top;
+  frame.call_stack_end = thread->call_stack_end;
+  frame.global_values = instance->global_values.data();
+  frame.memories = s_memories.data();
+  frame.fuel = thread->fuel;
+  frame.interrupt = &thread->interrupt;
+  frame.result = static_cast<uint32_t>(Result::Ok);
+  get_entry_stub()(&frame, func->jit_code);
+
+  thread->value_stack_top = frame.value_stack_top;
+  thread->call_stack_top = frame.call_stack_top;
+  thread->fuel = frame.fuel;
+  Result result = static_cast<Result>(frame.result);
+  if (result == Result::Interrupted)
+    thread->interrupt.store(false, std::memory_order_relaxed);
+  return result;
+}
+
+#else /* !WABT_INTERPRETER_JIT */
+
+bool jit_compile(Environment* env, DefinedFunc* func) {
+  return false;
+}
+
+Result run_jit_code(Thread* thread, DefinedFunc* func) {
+  assert(!"jit_compile never succeeds without the JIT");
+  return Result::Ok;
+}
+
+#endif /* WABT_INTERPRETER_JIT */
+
+}  // namespace interpreter
+}  // namespace wabt
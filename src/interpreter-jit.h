@@ -0,0 +1,32 @@
+/*
+ * Copyright 2017 WebAssembly Community Group participants
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WABT_INTERPRETER_JIT_H_
+#define WABT_INTERPRETER_JIT_H_
+
+#include "interpreter.h"
+
+namespace wabt {
+namespace interpreter {
+
+/* Enters the machine code of a function compiled by jit_compile. Memory
+ * faults aren't handled here; use jit_call instead. */
+Result run_jit_code(Thread* thread, DefinedFunc* func);
+
+}  // namespace interpreter
+}  // namespace wabt
+
+#endif /* WABT_INTERPRETER_JIT_H_ */
@@ -0,0 +1,183 @@
+/*
+ * Copyright 2017 WebAssembly Community Group participants
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "interpreter-trace.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#if HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "stream.h"
+
+namespace wabt {
+namespace interpreter {
+
+namespace {
+
+static const char kTraceMagic[16] = "wabt-interp-trc";
+/* Bump this when the layout of the trace file changes. */
+static const uint32_t kTraceVersion = 1;
+/* The largest capacity, so the file is at most 48GiB. */
+static const uint32_t kMaxTraceCapacity = 1U << 31;
+
+WABT_STATIC_ASSERT(sizeof(TraceHeader) % sizeof(uint64_t) == 0);
+WABT_STATIC_ASSERT(sizeof(TraceRecord) % sizeof(uint64_t) == 0);
+
+static size_t get_trace_file_size(uint32_t capacity) {
+  return sizeof(TraceHeader) + static_cast<size_t>(capacity) *
+                                   sizeof(TraceRecord);
+}
+
+}  // namespace
+
+TraceBuffer::TraceBuffer()
+    : header(nullptr),
+      records(nullptr),
+      mask(0),
+      mapped_size(0),
+      filename(nullptr) {}
+
+wabt::Result open_trace_buffer(const char* filename,
+                               uint32_t capacity,
+                               IstreamOffset istream_size,
+                               TraceBuffer* out_buffer) {
+  uint32_t rounded_capacity = 1;
+  while (rounded_capacity < capacity && rounded_capacity < kMaxTraceCapacity)
+    rounded_capacity <<= 1;
+  size_t size = get_trace_file_size(rounded_capacity);
+
+  void* data = nullptr;
+#if HAVE_MMAP
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return wabt::Result::Error;
+  if (ftruncate(fd, size) == 0) {
+    data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+      data = nullptr;
+  }
+  close(fd);
+  if (!data)
+    return wabt::Result::Error;
+  out_buffer->mapped_size = size;
+#else
+  FILE* file = fopen(filename, "wb");
+  if (!file)
+    return wabt::Result::Error;
+  fclose(file);
+  out_buffer->storage.resize(size / sizeof(uint64_t));
+  data = out_buffer->storage.data();
+#endif
+
+  out_buffer->header = static_cast<TraceHeader*>(data);
+  out_buffer->records = reinterpret_cast<TraceRecord*>(out_buffer->header + 1);
+  out_buffer->mask = rounded_capacity - 1;
+  out_buffer->filename = filename;
+
+  TraceHeader* header = out_buffer->header;
+  memcpy(header->magic, kTraceMagic, sizeof(header->magic));
+  header->version = kTraceVersion;
+  header->capacity = rounded_capacity;
+  header->count = 0;
+  header->istream_size = istream_size;
+  header->unused = 0;
+  return wabt::Result::Ok;
+}
+
+wabt::Result close_trace_buffer(TraceBuffer* buffer) {
+  wabt::Result result = wabt::Result::Ok;
+  if (buffer->mapped_size) {
+#if HAVE_MMAP
+    munmap(buffer->header, buffer->mapped_size);
+#endif
+  } else if (buffer->header) {
+    FILE* file = fopen(buffer->filename, "wb");
+    size_t size = get_trace_file_size(buffer->header->capacity);
+    bool ok = file && fwrite(buffer->header, size, 1, file) == 1;
+    if (file)
+      ok = fclose(file) == 0 && ok;
+    if (!ok)
+      result = wabt::Result::Error;
+  }
+  *buffer = TraceBuffer();
+  return result;
+}
+
+wabt::Result decode_trace(const char* filename,
+                          Environment* env,
+                          Stream* stream) {
+  char* data;
+  size_t size;
+  if (WABT_FAILED(read_file(filename, &data, &size)))
+    return wabt::Result::Error;
+
+  wabt::Result result = wabt::Result::Error;
+  TraceHeader header;
+  const uint8_t* istream = env->istream->data.data();
+  IstreamOffset istream_size = env->istream->data.size();
+  if (size >= sizeof(header)) {
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, kTraceMagic, sizeof(header.magic)) == 0 &&
+        header.version == kTraceVersion && header.capacity != 0 &&
+        (header.capacity & (header.capacity - 1)) == 0 &&
+        size == get_trace_file_size(header.capacity) &&
+        header.istream_size == istream_size) {
+      result = wabt::Result::Ok;
+    }
+  }
+
+  if (WABT_SUCCEEDED(result)) {
+    uint64_t first = 0;
+    if (header.count > header.capacity) {
+      first = header.count - header.capacity;
+      stream->Writef("... %" PRIu64 " earlier instructions\n", first);
+    }
+    const uint8_t* records = reinterpret_cast<const uint8_t*>(data) +
+                             sizeof(TraceHeader);
+    for (uint64_t i = first; i < header.count; ++i) {
+      TraceRecord record;
+      memcpy(&record,
+             records + (i & (header.capacity - 1)) * sizeof(TraceRecord),
+             sizeof(record));
+      if (record.pc >= istream_size || istream[record.pc] != record.opcode) {
+        result = wabt::Result::Error;
+        break;
+      }
+      stream->Writef("#%u. V:%-3u", record.call_stack_depth,
+                     record.value_stack_depth);
+      if (record.value_stack_depth)
+        stream->Writef(" top:0x%-16" PRIx64, record.top.i64);
+      else
+        stream->Writef("%23s", "");
+      stream->Writef(" |");
+      disassemble(env, stream, record.pc, record.pc + 1);
+    }
+  }
+  delete[] data;
+  return result;
+}
+
+}  // namespace interpreter
+}  // namespace wabt
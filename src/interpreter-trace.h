@@ -0,0 +1,100 @@
+/*
+ * Copyright 2017 WebAssembly Community Group participants
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WABT_INTERPRETER_TRACE_H_
+#define WABT_INTERPRETER_TRACE_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "interpreter.h"
+
+namespace wabt {
+
+class Stream;
+
+namespace interpreter {
+
+/* A binary trace file starts with a TraceHeader, followed by |capacity|
+ * TraceRecords. The records are a ring buffer: the record of the Nth
+ * instruction run is at index N % capacity, so the file holds the last
+ * |capacity| instructions. */
+struct TraceHeader {
+  char magic[16];
+  uint32_t version;
+  /* a power of two */
+  uint32_t capacity;
+  /* the number of instructions run, including the ones that were
+   * overwritten */
+  uint64_t count;
+  /* the size of the istream the trace was written for */
+  uint32_t istream_size;
+  uint32_t unused;
+};
+
+/* The state of the thread before it ran an instruction. */
+struct TraceRecord {
+  IstreamOffset pc;
+  uint32_t value_stack_depth;
+  uint32_t call_stack_depth;
+  /* the opcode at |pc|, to check that the trace matches the istream */
+  uint8_t opcode;
+  uint8_t unused[3];
+  /* the top of the value stack, if it isn't empty */
+  Value top;
+};
+
+/* Set as Thread::trace to have run_interpreter append a TraceRecord before
+ * each instruction it runs. The file is mapped into memory when that is
+ * supported, so the records written before a crash aren't lost; otherwise
+ * they are written when the buffer is closed. */
+struct TraceBuffer {
+  TraceBuffer();
+
+  TraceHeader* header;
+  TraceRecord* records;
+  /* capacity - 1 */
+  uint64_t mask;
+  /* the size of the mapping of the file, or 0 if it isn't mapped */
+  size_t mapped_size;
+  /* holds the header and records when the file isn't mapped */
+  std::vector<uint64_t> storage;
+  const char* filename;
+};
+
+/* Creates the trace file |filename| with room for |capacity| records, rounded
+ * up to a power of two, for running the code in an istream of
+ * |istream_size| bytes. */
+::wabt::Result open_trace_buffer(const char* filename,
+                                 uint32_t capacity,
+                                 IstreamOffset istream_size,
+                                 TraceBuffer* out_buffer);
+
+/* Finishes writing the trace file. */
+::wabt::Result close_trace_buffer(TraceBuffer* buffer);
+
+/* Writes the instructions recorded in the trace file |filename| to |stream|,
+ * oldest first, disassembled from the istream of |env|. The modules in |env|
+ * have to be loaded the same way as when the trace was written. */
+::wabt::Result decode_trace(const char* filename,
+                            Environment* env,
+                            Stream* stream);
+
+}  // namespace interpreter
+}  // namespace wabt
+
+#endif /* WABT_INTERPRETER_TRACE_H_ */
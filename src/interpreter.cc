@@ -17,11 +17,33 @@
 #include "interpreter.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <cinttypes>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
 #include <vector>
 
+#if HAVE_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if HAVE_MEMFD_CREATE
+#include <fcntl.h>
+#endif
+
+#if WABT_INTERPRETER_GUARD_PAGES
+#include <setjmp.h>
+#include <signal.h>
+#endif
+
+#include "binary-reader-interpreter.h"
+#include "interpreter-jit.h"
+#include "interpreter-trace.h"
 #include "stream.h"
 
 namespace wabt {
@@ -45,15 +67,183 @@ static const char* get_opcode_name(Opcode opcode) {
   return s_opcode_name[static_cast<int>(opcode)];
 }
 
+#if WABT_INTERPRETER_GUARD_PAGES
+/* Any i32 address plus i32 offset is less than 8GiB; the extra page catches
+ * accesses that start just before that and run past it. */
+static const uint64_t kMemoryReservationSize = (1ULL << 33) + WABT_PAGE_SIZE;
+#endif
+
+static const uint64_t kMaxMemorySize =
+    static_cast<uint64_t>(WABT_MAX_PAGES) * WABT_PAGE_SIZE;
+
+#if HAVE_MMAP
+static size_t round_up_to_system_page_size(size_t size) {
+  static const size_t s_page_size = sysconf(_SC_PAGESIZE);
+  return (size + s_page_size - 1) & ~(s_page_size - 1);
+}
+#endif
+
+/* Nothing is reserved until the first resize, so a memory that is only
+ * default-constructed (e.g. before an import fills it in) costs no mapping. */
+MemoryData::MemoryData() : max_size_(kMaxMemorySize) {}
+
+MemoryData::MemoryData(size_t size, uint64_t max_size) : max_size_(max_size) {
+#if WABT_INTERPRETER_GUARD_PAGES
+  if (!Reserve(kMemoryReservationSize))
+    WABT_FATAL("Unable to reserve address space for memory.\n");
+#endif
+  if (!resize(size))
+    WABT_FATAL("Memory allocation failure.\n");
+}
+
+MemoryData::MemoryData(MemoryData&& other) noexcept {
+  *this = std::move(other);
+}
+
+MemoryData& MemoryData::operator=(MemoryData&& other) noexcept {
+  std::swap(data_, other.data_);
+  std::swap(size_, other.size_);
+  std::swap(reserved_size_, other.reserved_size_);
+  std::swap(max_size_, other.max_size_);
+  return *this;
+}
+
+MemoryData::~MemoryData() {
+#if HAVE_MMAP
+  if (reserved_size_) {
+    munmap(data_, reserved_size_);
+    return;
+  }
+#endif
+#if !WABT_INTERPRETER_GUARD_PAGES
+  free(data_);
+#endif
+}
+
+bool MemoryData::Reserve(uint64_t size) {
+#if HAVE_MMAP
+  if (size == 0 || size > SIZE_MAX)
+    return false;
+  size_t reserved_size = round_up_to_system_page_size(size);
+  void* data = mmap(nullptr, reserved_size, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (data == MAP_FAILED)
+    return false;
+  data_ = static_cast<char*>(data);
+  reserved_size_ = reserved_size;
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool MemoryData::resize(size_t new_size) {
+#if HAVE_MMAP
+  if (!reserved_size_ && !data_) {
+#if WABT_INTERPRETER_GUARD_PAGES
+    /* The whole reservation is needed, since accesses aren't bounds
+     * checked. */
+    if (!Reserve(kMemoryReservationSize))
+      return false;
+#else
+    /* If this fails, fall back to allocating from the heap below. */
+    Reserve(max_size_);
+#endif
+  }
+
+  if (reserved_size_) {
+    /* wasm memory sizes are always a multiple of WABT_PAGE_SIZE, so rounding
+     * to the system page size doesn't make anything else accessible. */
+    size_t old_mapped_size = round_up_to_system_page_size(size_);
+    size_t new_mapped_size = round_up_to_system_page_size(new_size);
+    if (new_mapped_size > reserved_size_)
+      return false;
+
+    if (new_mapped_size > old_mapped_size) {
+      if (mprotect(data_ + old_mapped_size, new_mapped_size - old_mapped_size,
+                   PROT_READ | PROT_WRITE) != 0) {
+        return false;
+      }
+    } else if (new_mapped_size < old_mapped_size) {
+      /* Replace the pages rather than just protecting them, so they are
+       * zeroed if the memory grows again. */
+      void* data = mmap(data_ + new_mapped_size,
+                        old_mapped_size - new_mapped_size, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                        -1, 0);
+      if (data == MAP_FAILED)
+        return false;
+    }
+    size_ = new_size;
+    return true;
+  }
+#endif
+
+#if WABT_INTERPRETER_GUARD_PAGES
+  return false;
+#else
+  /* calloc gets large blocks from the kernel as demand-zero pages, so only
+   * the pages that are used are ever touched. Growing uses realloc, which
+   * can move those pages without copying them, so only the new part has to
+   * be cleared. */
+  size_t alloc_size = std::max<size_t>(new_size, 1);
+  char* data = static_cast<char*>(data_ ? realloc(data_, alloc_size)
+                                        : calloc(alloc_size, 1));
+  if (!data)
+    return false;
+  if (data_ && new_size > size_)
+    memset(data + size_, 0, new_size - size_);
+  data_ = data;
+  size_ = new_size;
+  return true;
+#endif
+}
+
+#if WABT_INTERPRETER_GUARD_PAGES
+bool MemoryData::IsReservedAddress(const void* address) const {
+  const char* p = static_cast<const char*>(address);
+  return reserved_size_ && p >= data_ && p < data_ + reserved_size_;
+}
+#endif
+
+#if HAVE_MEMFD_CREATE
+bool MemoryData::MapCopyOnWrite(int fd, size_t size) {
+  if (!reserved_size_ || size < size_ ||
+      round_up_to_system_page_size(size) > reserved_size_) {
+    return false;
+  }
+  if (size != 0) {
+    void* data = mmap(data_, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (data == MAP_FAILED)
+      WABT_FATAL("Unable to map memory snapshot.\n");
+  }
+  size_ = size;
+  return true;
+}
+#endif
+
 Environment::Environment() : istream(new OutputBuffer()) {}
 
+Environment::~Environment() {
+#if HAVE_MMAP
+  for (const std::pair<void*, size_t>& mapping : jit_mappings)
+    munmap(mapping.first, mapping.second);
+#endif
+}
+
 Thread::Thread()
     : env(nullptr),
+      instance(nullptr),
       value_stack_top(nullptr),
       value_stack_end(nullptr),
       call_stack_top(nullptr),
       call_stack_end(nullptr),
-      pc(0) {}
+      frame(nullptr),
+      pc(0),
+      fuel(UINT64_MAX),
+      interrupt(false),
+      trace(nullptr) {}
 
 Import::Import() : kind(ExternalKind::Func) {
   WABT_ZERO_MEMORY(module_name);
@@ -142,42 +332,70 @@ EnvironmentMark mark_environment(Environment* env) {
   mark.modules_size = env->modules.size();
   mark.sigs_size = env->sigs.size();
   mark.funcs_size = env->funcs.size();
-  mark.memories_size = env->memories.size();
-  mark.tables_size = env->tables.size();
+  mark.memories_size = env->instance.memories.size();
+  mark.tables_size = env->instance.tables.size();
   mark.globals_size = env->globals.size();
   mark.istream_size = env->istream->data.size();
   return mark;
 }
 
 void reset_environment_to_mark(Environment* env, EnvironmentMark mark) {
-  /* Destroy entries in the binding hash. */
-  for (size_t i = mark.modules_size; i < env->modules.size(); ++i) {
-    const StringSlice* name = &env->modules[i]->name;
-    if (!string_slice_is_empty(name))
-      env->module_bindings.erase(string_slice_to_string(*name));
-  }
-
-  /* registered_module_bindings maps from an arbitrary name to a module index,
-   * so we have to iterate through the entire table to find entries to remove.
-   */
-  auto iter = env->registered_module_bindings.begin();
-  while (iter != env->registered_module_bindings.end()) {
-    if (iter->second.index >= static_cast<int>(mark.modules_size))
-      iter = env->registered_module_bindings.erase(iter);
-    else
-      ++iter;
-  }
+  /* Destroy entries in the binding hashes. Both map names to module indexes,
+   * and registered_module_bindings can have any name for a module, so remove
+   * the bindings by index. */
+  auto is_after_mark = [mark](const BindingHash::value_type& binding) {
+    return binding.second.index >= static_cast<int>(mark.modules_size);
+  };
+  env->module_bindings.erase_if(is_after_mark);
+  env->registered_module_bindings.erase_if(is_after_mark);
 
   env->modules.erase(env->modules.begin() + mark.modules_size,
                      env->modules.end());
   env->sigs.erase(env->sigs.begin() + mark.sigs_size, env->sigs.end());
+  auto sig_iter = env->sig_ids.begin();
+  while (sig_iter != env->sig_ids.end()) {
+    if (sig_iter->second >= mark.sigs_size)
+      sig_iter = env->sig_ids.erase(sig_iter);
+    else
+      ++sig_iter;
+  }
   env->funcs.erase(env->funcs.begin() + mark.funcs_size, env->funcs.end());
-  env->memories.erase(env->memories.begin() + mark.memories_size,
-                      env->memories.end());
-  env->tables.erase(env->tables.begin() + mark.tables_size, env->tables.end());
+  Instance* instance = &env->instance;
+  instance->memories.erase(instance->memories.begin() + mark.memories_size,
+                           instance->memories.end());
+  instance->tables.erase(instance->tables.begin() + mark.tables_size,
+                         instance->tables.end());
   env->globals.erase(env->globals.begin() + mark.globals_size,
                      env->globals.end());
+  if (instance->global_values.size() > mark.globals_size)
+    instance->global_values.resize(mark.globals_size);
   env->istream->data.resize(mark.istream_size);
+
+  /* Functions that were compiled lazily after the mark lost their code, so
+   * turn their branches back into stubs. */
+  for (Index i = 0; i < env->funcs.size(); ++i) {
+    Func* func = env->funcs[i].get();
+    if (func->is_host)
+      continue;
+    DefinedFunc* defined = func->as_defined();
+    if (defined->lazy_module && defined->offset >= mark.istream_size) {
+      uint8_t* stub = &env->istream->data[defined->lazy_stub_offset];
+      stub[0] = static_cast<uint8_t>(Opcode::CompileFunc);
+      memcpy(stub + 1, &i, sizeof(Index));
+      defined->offset = defined->lazy_stub_offset;
+      defined->param_and_local_types.clear();
+    }
+  }
+}
+
+bool can_add_module_code(const Environment* env, bool register_machine) {
+  if (env->register_machine == register_machine)
+    return true;
+  for (const std::unique_ptr<Module>& module : env->modules) {
+    if (!module->is_host)
+      return false;
+  }
+  return true;
 }
 
 HostModule* append_host_module(Environment* env, StringSlice name) {
@@ -188,17 +406,186 @@ HostModule* append_host_module(Environment* env, StringSlice name) {
   return module;
 }
 
+#if WITH_OPCODE_COUNTS
+OpcodeCounts::OpcodeCounts() : last_opcode(-1) {
+  WABT_ZERO_MEMORY(opcodes);
+  WABT_ZERO_MEMORY(pairs);
+  WABT_ZERO_MEMORY(branches_taken);
+  WABT_ZERO_MEMORY(branches_not_taken);
+}
+
+void write_opcode_counts(const OpcodeCounts* counts, Stream* stream) {
+  for (int i = 0; i < kOpcodeCount; ++i) {
+    if (counts->opcodes[i]) {
+      stream->Writef("opcode %s %" PRIu64 "\n",
+                     get_opcode_name(static_cast<Opcode>(i)),
+                     counts->opcodes[i]);
+    }
+  }
+  for (int i = 0; i < kOpcodeCount; ++i) {
+    for (int j = 0; j < kOpcodeCount; ++j) {
+      if (counts->pairs[i][j]) {
+        stream->Writef("pair %s %s %" PRIu64 "\n",
+                       get_opcode_name(static_cast<Opcode>(i)),
+                       get_opcode_name(static_cast<Opcode>(j)),
+                       counts->pairs[i][j]);
+      }
+    }
+  }
+  for (int i = 0; i < kOpcodeCount; ++i) {
+    if (counts->branches_taken[i] || counts->branches_not_taken[i]) {
+      stream->Writef("branch %s %" PRIu64 " %" PRIu64 "\n",
+                     get_opcode_name(static_cast<Opcode>(i)),
+                     counts->branches_taken[i], counts->branches_not_taken[i]);
+    }
+  }
+}
+#endif
+
 void init_thread(Environment* env, Thread* thread, ThreadOptions* options) {
   thread->value_stack.resize(options->value_stack_size);
   thread->call_stack.resize(options->call_stack_size);
   thread->env = env;
+  thread->instance = &env->instance;
   thread->value_stack_top = thread->value_stack.data();
   thread->value_stack_end =
       thread->value_stack.data() + thread->value_stack.size();
   thread->call_stack_top = thread->call_stack.data();
   thread->call_stack_end =
       thread->call_stack.data() + thread->call_stack.size();
+  thread->frame = thread->value_stack.data();
   thread->pc = options->pc;
+#if WITH_OPCODE_COUNTS
+  thread->opcode_counts.reset(new OpcodeCounts());
+#endif
+}
+
+void init_new_global_values(Environment* env) {
+  std::vector<Value>* global_values = &env->instance.global_values;
+  size_t size = global_values->size();
+  global_values->resize(env->globals.size());
+  for (size_t i = size; i < env->globals.size(); ++i)
+    (*global_values)[i] = env->globals[i].typed_value.value;
+}
+
+void init_instance(const Environment* env, Instance* instance) {
+  instance->memories.clear();
+  instance->memories.reserve(env->instance.memories.size());
+  for (const Memory& memory : env->instance.memories) {
+    instance->memories.emplace_back(memory.page_limits);
+    MemoryData* data = &instance->memories.back().data;
+    if (!data->resize(memory.data.size()))
+      WABT_FATAL("Memory allocation failure.\n");
+    std::copy(memory.data.data(), memory.data.data() + memory.data.size(),
+              data->data());
+  }
+  instance->tables = env->instance.tables;
+  instance->global_values = env->instance.global_values;
+}
+
+InstanceSnapshot::~InstanceSnapshot() {
+#if HAVE_MEMFD_CREATE
+  for (const MemoryImage& image : memories) {
+    if (image.fd != -1)
+      close(image.fd);
+  }
+#endif
+}
+
+#if HAVE_MEMFD_CREATE
+/* Blocks of a memory image that are all zero aren't written, so they stay
+ * holes in the file and don't use any memory. */
+static const size_t kMemoryImageBlockSize = 4096;
+
+static bool is_zero_block(const char* data, size_t size) {
+  return data[0] == 0 && memcmp(data, data + 1, size - 1) == 0;
+}
+
+/* Returns a sealed memfd holding the |size| bytes at |data|, or -1 if one
+ * couldn't be made. */
+static int create_memory_image(const char* data, size_t size) {
+  if (size == 0)
+    return -1;
+  int fd = memfd_create("wasm-memory", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+    return -1;
+  bool ok = ftruncate(fd, size) == 0;
+  for (size_t offset = 0; ok && offset < size;
+       offset += kMemoryImageBlockSize) {
+    size_t block_size = std::min(kMemoryImageBlockSize, size - offset);
+    if (is_zero_block(data + offset, block_size))
+      continue;
+    ok = pwrite(fd, data + offset, block_size, offset) ==
+         static_cast<ssize_t>(block_size);
+  }
+  /* Instances map the image directly, so it must never change. */
+  ok = ok && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+                                        F_SEAL_WRITE | F_SEAL_SEAL) == 0;
+  if (!ok) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool read_memory_image(int fd, char* data, size_t size) {
+  size_t offset = 0;
+  while (offset < size) {
+    ssize_t bytes = pread(fd, data + offset, size - offset, offset);
+    if (bytes <= 0)
+      return false;
+    offset += bytes;
+  }
+  return true;
+}
+#endif
+
+void snapshot_instance(const Instance* instance, InstanceSnapshot* snapshot) {
+  assert(snapshot->memories.empty());
+  snapshot->memories.reserve(instance->memories.size());
+  for (const Memory& memory : instance->memories) {
+    InstanceSnapshot::MemoryImage image;
+    image.page_limits = memory.page_limits;
+    image.size = memory.data.size();
+    image.fd = -1;
+#if HAVE_MEMFD_CREATE
+    image.fd = create_memory_image(memory.data.data(), image.size);
+#endif
+    if (image.fd == -1) {
+      image.data.assign(memory.data.data(),
+                        memory.data.data() + memory.data.size());
+    }
+    snapshot->memories.push_back(std::move(image));
+  }
+  snapshot->tables = instance->tables;
+  snapshot->global_values = instance->global_values;
+}
+
+void init_instance_from_snapshot(const InstanceSnapshot* snapshot,
+                                 Instance* instance) {
+  instance->memories.clear();
+  instance->memories.reserve(snapshot->memories.size());
+  for (const InstanceSnapshot::MemoryImage& image : snapshot->memories) {
+    instance->memories.emplace_back(image.page_limits);
+    MemoryData* data = &instance->memories.back().data;
+#if HAVE_MEMFD_CREATE
+    if (image.fd != -1) {
+      if (data->MapCopyOnWrite(image.fd, image.size))
+        continue;
+      /* The memory isn't in a reservation, so copy the image instead. */
+      if (!data->resize(image.size) ||
+          !read_memory_image(image.fd, data->data(), image.size)) {
+        WABT_FATAL("Memory allocation failure.\n");
+      }
+      continue;
+    }
+#endif
+    if (!data->resize(image.size))
+      WABT_FATAL("Memory allocation failure.\n");
+    std::copy(image.data.begin(), image.data.end(), data->data());
+  }
+  instance->tables = snapshot->tables;
+  instance->global_values = snapshot->global_values;
 }
 
 Result push_thread_value(Thread* thread, Value value) {
@@ -215,6 +602,72 @@ Export* get_export_by_name(Module* module, const StringSlice* name) {
   return &module->exports[field_index];
 }
 
+Result prepare_call(Environment* env,
+                    Module* module,
+                    const StringSlice* name,
+                    PreparedCall* out_call) {
+  Export* export_ = get_export_by_name(module, name);
+  if (!export_)
+    return Result::UnknownExport;
+  if (export_->kind != ExternalKind::Func)
+    return Result::ExportKindMismatch;
+
+  Func* func = env->funcs[export_->index].get();
+  const FuncSignature* sig = &env->sigs[func->sig_index];
+  out_call->func = func;
+  out_call->num_params = sig->param_types.size();
+  out_call->num_results = sig->result_types.size();
+  return Result::Ok;
+}
+
+Result run_prepared_calls(Thread* thread,
+                          const PreparedCall* call,
+                          size_t count,
+                          const Value* const* args,
+                          Value* const* results,
+                          size_t* out_count) {
+  Value* base = thread->value_stack_top;
+  IstreamOffset* call_stack_return_top = thread->call_stack_top;
+  Result result = Result::Ok;
+  size_t num_returned = 0;
+  /* The arguments and results are copied without checking the stack each
+   * time. */
+  if (static_cast<size_t>(thread->value_stack_end - base) <
+      std::max(call->num_params, call->num_results)) {
+    result = Result::TrapValueStackExhausted;
+  }
+
+  for (; result == Result::Ok && num_returned < count; ++num_returned) {
+    for (Index i = 0; i < call->num_params; ++i)
+      base[i] = args[i][num_returned];
+    thread->value_stack_top = base + call->num_params;
+
+    if (call->func->is_host) {
+      result = call_host(thread, call->func->as_host());
+    } else {
+      DefinedFunc* func = call->func->as_defined();
+      if (func->jit_code) {
+        result = jit_call(thread, func);
+      } else {
+        thread->pc = func->offset;
+        result = run_interpreter(thread, call_stack_return_top);
+        if (result == Result::Returned)
+          result = Result::Ok;
+      }
+    }
+    if (result != Result::Ok)
+      break;
+
+    for (Index i = 0; i < call->num_results; ++i)
+      results[i][num_returned] = base[i];
+  }
+
+  thread->value_stack_top = base;
+  thread->call_stack_top = call_stack_return_top;
+  *out_count = num_returned;
+  return result;
+}
+
 /* 3 32222222 222...00
  * 1 09876543 210...10
  * -------------------
@@ -474,21 +927,21 @@ DEFINE_BITCAST(bitcast_u64_to_f64, uint64_t, double)
   TRAP_IF(thread->value_stack_top >= thread->value_stack_end, \
           ValueStackExhausted)
 
-#define PUSH_NEG_1_AND_BREAK_IF(cond) \
-  if (WABT_UNLIKELY(cond)) {          \
-    PUSH_I32(-1);                     \
-    break;                            \
+#define PUSH_NEG_1_AND_NEXT_IF(cond) \
+  if (WABT_UNLIKELY(cond)) {         \
+    PUSH_I32(-1);                    \
+    NEXT();                          \
   }
 
+/* Pushes are unchecked; the alloca at the start of every function checks
+ * that there is room for the function's maximum stack height. */
 #define PUSH(v)                         \
   do {                                  \
-    CHECK_STACK();                      \
     (*thread->value_stack_top++) = (v); \
   } while (0)
 
 #define PUSH_TYPE(type, v)                                \
   do {                                                    \
-    CHECK_STACK();                                        \
     (*thread->value_stack_top++).TYPE_FIELD_NAME_##type = \
         static_cast<VALUE_TYPE_##type>(v);                \
   } while (0)
@@ -515,6 +968,134 @@ DEFINE_BITCAST(bitcast_u64_to_f64, uint64_t, double)
 
 #define GOTO(offset) pc = &istream[offset]
 
+/* Compiling a function lazily appends to the istream, which can move it. This
+ * can happen in a CompileFunc, or in a host call that runs the interpreter. */
+#define RELOAD_ISTREAM()                 \
+  do {                                   \
+    IstreamOffset offset = pc - istream; \
+    istream = env->istream->data.data(); \
+    pc = &istream[offset];               \
+  } while (0)
+
+/* When the compiler supports labels-as-values, every handler in
+ * run_interpreter also gets a label, and dispatches directly to the next
+ * handler through s_dispatch_table instead of going back through the switch.
+ * The switch is still used to dispatch the first instruction. */
+#if WITH_COMPUTED_GOTO && (COMPILER_IS_CLANG || COMPILER_IS_GNU)
+#define WABT_USE_COMPUTED_GOTO 1
+#else
+#define WABT_USE_COMPUTED_GOTO 0
+#endif
+
+#if WABT_USE_COMPUTED_GOTO
+typedef std::array<const void*, 256> DispatchTable;
+
+/* |handlers| holds one label address per opcode, in interpreter-opcode.def
+ * order. Each loop keeps the result in a function-local static, so it is
+ * built once, on the loop's first call. */
+static DispatchTable make_dispatch_table(const void* invalid,
+                                         const void* const* handlers) {
+  DispatchTable table;
+  table.fill(invalid);
+  size_t i = 0;
+#define WABT_OPCODE(rtype, type1, type2, mem_size, code, Name, text) \
+  table[code] = handlers[i++];
+#include "interpreter-opcode.def"
+#undef WABT_OPCODE
+  return table;
+}
+
+#define CASE(name) \
+  case Opcode::name: \
+  op_##name
+#define NEXT()                              \
+  do {                                      \
+    if (single_step)                        \
+      goto exit_loop;                       \
+    COUNT_OPCODE(static_cast<Opcode>(*pc)); \
+    TRACE_INSTR();                          \
+    goto* s_dispatch_table[*pc++];          \
+  } while (0)
+#else
+#define CASE(name) case Opcode::name
+#define NEXT() break
+#endif
+
+/* Fuel and the interrupt flag are only checked here, at function entry and
+ * at the top of each loop, so straight-line code doesn't pay for them. */
+static Result charge_fuel(Thread* thread, uint32_t cost) {
+  if (WABT_UNLIKELY(thread->interrupt.load(std::memory_order_relaxed))) {
+    thread->interrupt.store(false, std::memory_order_relaxed);
+    return Result::Interrupted;
+  }
+  if (WABT_UNLIKELY(thread->fuel < cost))
+    return Result::FuelExhausted;
+  thread->fuel -= cost;
+  return Result::Ok;
+}
+
+/* On failure, the thread stops at |op_pc| so that it charges again when it
+ * is resumed. */
+#define CHARGE_FUEL(cost, op_pc)               \
+  do {                                         \
+    result = charge_fuel(thread, cost);        \
+    if (WABT_UNLIKELY(result != Result::Ok)) { \
+      pc = (op_pc);                            \
+      goto exit_loop;                          \
+    }                                          \
+  } while (0)
+
+#if WITH_OPCODE_COUNTS
+static void count_opcode(OpcodeCounts* counts, Opcode opcode) {
+  int index = static_cast<int>(opcode);
+  counts->opcodes[index]++;
+  if (counts->last_opcode >= 0)
+    counts->pairs[counts->last_opcode][index]++;
+  counts->last_opcode = index;
+}
+
+static void count_branch(OpcodeCounts* counts, Opcode opcode, bool taken) {
+  int index = static_cast<int>(opcode);
+  if (taken)
+    counts->branches_taken[index]++;
+  else
+    counts->branches_not_taken[index]++;
+}
+
+#define COUNT_OPCODE(opcode) count_opcode(opcode_counts, opcode)
+#define COUNT_BRANCH(name, taken) \
+  count_branch(opcode_counts, Opcode::name, taken)
+#else
+#define COUNT_OPCODE(opcode)
+#define COUNT_BRANCH(name, taken)
+#endif
+
+/* Only the instantiations of the loops used for Thread::trace
+ * record anything, so the others don't pay for it. */
+#define TRACE_INSTR()                                 \
+  do {                                                \
+    if (trace)                                        \
+      trace_instr(thread, trace_buffer, istream, pc); \
+  } while (0)
+
+static WABT_INLINE void trace_instr(const Thread* thread,
+                                    TraceBuffer* buffer,
+                                    const uint8_t* istream,
+                                    const uint8_t* pc) {
+  TraceRecord* record =
+      &buffer->records[buffer->header->count++ & buffer->mask];
+  record->pc = pc - istream;
+  record->value_stack_depth =
+      thread->value_stack_top - thread->value_stack.data();
+  record->call_stack_depth =
+      thread->call_stack_top - thread->call_stack.data();
+  record->opcode = *pc;
+  if (record->value_stack_depth)
+    record->top = thread->value_stack_top[-1];
+  else
+    record->top.i64 = 0;
+}
+
 #define PUSH_CALL()                                           \
   do {                                                        \
     TRAP_IF(thread->call_stack_top >= thread->call_stack_end, \
@@ -526,29 +1107,41 @@ DEFINE_BITCAST(bitcast_u64_to_f64, uint64_t, double)
 
 #define GET_MEMORY(var)               \
   Index memory_index = read_u32(&pc); \
-  Memory* var = &env->memories[memory_index]
-
-#define LOAD(type, mem_type)                                              \
+  Memory* var = &instance->memories[memory_index]
+
+/* With guard pages, an out of bounds access faults instead; see
+ * run_interpreter. */
+#if WABT_INTERPRETER_GUARD_PAGES
+#define CHECK_MEMORY_ACCESS(memory, offset, access_size) (void)0
+#else
+#define CHECK_MEMORY_ACCESS(memory, offset, access_size)    \
+  TRAP_IF((offset) + (access_size) > (memory)->data.size(), \
+          MemoryAccessOutOfBounds)
+#endif
+
+#define LOAD_FROM(type, mem_type, base)                                   \
   do {                                                                    \
     GET_MEMORY(memory);                                                   \
-    uint64_t offset = static_cast<uint64_t>(POP_I32()) + read_u32(&pc);   \
+    VALUE_TYPE_I32 base_value = (base);                                   \
+    uint64_t offset = static_cast<uint64_t>(base_value) + read_u32(&pc);  \
     MEM_TYPE_##mem_type value;                                            \
-    TRAP_IF(offset + sizeof(value) > memory->data.size(),                 \
-            MemoryAccessOutOfBounds);                                     \
-    void* src = memory->data.data() + static_cast<IstreamOffset>(offset); \
+    CHECK_MEMORY_ACCESS(memory, offset, sizeof(value));                   \
+    void* src = memory->data.data() + static_cast<size_t>(offset);        \
     memcpy(&value, src, sizeof(MEM_TYPE_##mem_type));                     \
     PUSH_##type(static_cast<MEM_TYPE_EXTEND_##type##_##mem_type>(value)); \
   } while (0)
 
+#define LOAD(type, mem_type) LOAD_FROM(type, mem_type, POP_I32())
+
 #define STORE(type, mem_type)                                             \
   do {                                                                    \
     GET_MEMORY(memory);                                                   \
     VALUE_TYPE_##type value = POP_##type();                               \
-    uint64_t offset = static_cast<uint64_t>(POP_I32()) + read_u32(&pc);   \
+    VALUE_TYPE_I32 base_value = POP_I32();                                \
+    uint64_t offset = static_cast<uint64_t>(base_value) + read_u32(&pc);  \
     MEM_TYPE_##mem_type src = static_cast<MEM_TYPE_##mem_type>(value);    \
-    TRAP_IF(offset + sizeof(src) > memory->data.size(),                   \
-            MemoryAccessOutOfBounds);                                     \
-    void* dst = memory->data.data() + static_cast<IstreamOffset>(offset); \
+    CHECK_MEMORY_ACCESS(memory, offset, sizeof(src));                     \
+    void* dst = memory->data.data() + static_cast<size_t>(offset);        \
     memcpy(dst, &src, sizeof(MEM_TYPE_##mem_type));                       \
   } while (0)
 
@@ -729,27 +1322,31 @@ static WABT_INLINE uint64_t read_u64(const uint8_t** pc) {
   return result;
 }
 
-static WABT_INLINE void read_table_entry_at(const uint8_t* pc,
-                                            IstreamOffset* out_offset,
-                                            uint32_t* out_drop,
-                                            uint8_t* out_keep) {
-  *out_offset = read_u32_at(pc + WABT_TABLE_ENTRY_OFFSET_OFFSET);
-  *out_drop = read_u32_at(pc + WABT_TABLE_ENTRY_DROP_OFFSET);
-  *out_keep = *(pc + WABT_TABLE_ENTRY_KEEP_OFFSET);
+void intern_func_signature(Environment* env, Index sig_index) {
+  FuncSignature* sig = &env->sigs[sig_index];
+  auto key = std::make_pair(sig->param_types, sig->result_types);
+  sig->id = env->sig_ids.emplace(std::move(key), sig_index).first->second;
 }
 
 bool func_signatures_are_equal(Environment* env,
                                Index sig_index_0,
                                Index sig_index_1) {
-  if (sig_index_0 == sig_index_1)
-    return true;
-  FuncSignature* sig_0 = &env->sigs[sig_index_0];
-  FuncSignature* sig_1 = &env->sigs[sig_index_1];
-  return sig_0->param_types == sig_1->param_types &&
-         sig_0->result_types == sig_1->result_types;
+  return env->sigs[sig_index_0].id == env->sigs[sig_index_1].id;
 }
 
-Result call_host(Thread* thread, HostFunc* func) {
+#if WABT_INTERPRETER_GUARD_PAGES
+/* The instance being run on this thread, and where to jump if an access to
+ * one of its memories faults. */
+static thread_local Instance* s_fault_instance;
+static thread_local sigjmp_buf* s_fault_jmp_buf;
+static struct sigaction s_old_sigsegv_action;
+static struct sigaction s_old_sigbus_action;
+#endif
+
+static Result call_host_func(Thread* thread, HostFunc* func) {
+  if (func->trampoline)
+    return func->trampoline(thread, func);
+
   FuncSignature* sig = &thread->env->sigs[func->sig_index];
 
   size_t num_params = sig->param_types.size();
@@ -771,913 +1368,1137 @@ Result call_host(Thread* thread, HostFunc* func) {
 
   for (size_t i = 0; i < num_results; ++i) {
     TRAP_IF(results[i].type != sig->result_types[i], HostResultTypeMismatch);
+    CHECK_STACK();
     PUSH(results[i].value);
   }
 
   return Result::Ok;
 }
 
-Result run_interpreter(Thread* thread,
-                       int num_instructions,
-                       IstreamOffset* call_stack_return_top) {
+Result call_host(Thread* thread, HostFunc* func) {
+#if WABT_INTERPRETER_GUARD_PAGES
+  /* A fault in host code isn't a trap: jumping out of it would skip the
+   * destructors of its frames. So the host function runs as if the
+   * interpreter weren't running, and a fault is handled by the previous
+   * handler. */
+  Instance* old_fault_instance = s_fault_instance;
+  sigjmp_buf* old_fault_jmp_buf = s_fault_jmp_buf;
+  s_fault_instance = nullptr;
+  s_fault_jmp_buf = nullptr;
+  Result result = call_host_func(thread, func);
+  s_fault_instance = old_fault_instance;
+  s_fault_jmp_buf = old_fault_jmp_buf;
+  return result;
+#else
+  return call_host_func(thread, func);
+#endif
+}
+
+#if WABT_INTERPRETER_GUARD_PAGES
+
+static void on_memory_fault(int signal, siginfo_t* info, void* context) {
+  if (s_fault_instance && s_fault_jmp_buf) {
+    for (const Memory& memory : s_fault_instance->memories) {
+      if (memory.data.IsReservedAddress(info->si_addr))
+        siglongjmp(*s_fault_jmp_buf, 1);
+    }
+  }
+
+  /* This isn't an interpreter memory access, so pass it on to the previous
+   * handler. This handler stays installed for later traps. */
+  const struct sigaction* old_action =
+      signal == SIGSEGV ? &s_old_sigsegv_action : &s_old_sigbus_action;
+  if (old_action->sa_flags & SA_SIGINFO) {
+    old_action->sa_sigaction(signal, info, context);
+  } else if (old_action->sa_handler != SIG_DFL &&
+             old_action->sa_handler != SIG_IGN) {
+    old_action->sa_handler(signal);
+  } else {
+    /* Ignoring a fault would just raise it again, so both mean the default
+     * action. A fault is raised again when this returns, and kills the
+     * process; a signal that was sent has to be raised again. */
+    struct sigaction default_action;
+    memset(&default_action, 0, sizeof(default_action));
+    default_action.sa_handler = SIG_DFL;
+    sigemptyset(&default_action.sa_mask);
+    sigaction(signal, &default_action, nullptr);
+    if (info->si_code <= 0)
+      raise(signal);
+  }
+}
+
+static void install_memory_fault_handler() {
+  static std::once_flag s_once;
+  std::call_once(s_once, []() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = on_memory_fault;
+    /* The handler doesn't return when it jumps back to run_interpreter, so
+     * don't block the signal while it runs. */
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &s_old_sigsegv_action);
+    sigaction(SIGBUS, &action, &s_old_sigbus_action);
+  });
+}
+
+#endif
+
+/* Calls |run|, turning a fault in one of the thread's memories into
+ * TrapMemoryAccessOutOfBounds when guard pages are used. */
+template <typename F>
+static Result run_with_memory_fault_handler(Thread* thread, F run) {
+#if WABT_INTERPRETER_GUARD_PAGES
+  install_memory_fault_handler();
+
+  /* Save the previous state, in case a host function runs the interpreter
+   * recursively. */
+  Instance* old_fault_instance = s_fault_instance;
+  sigjmp_buf* old_fault_jmp_buf = s_fault_jmp_buf;
+  sigjmp_buf fault_jmp_buf;
+  if (sigsetjmp(fault_jmp_buf, 0)) {
+    /* Jumped here from on_memory_fault. thread->pc isn't updated, but the
+     * thread can't continue after a trap anyway. */
+    s_fault_instance = old_fault_instance;
+    s_fault_jmp_buf = old_fault_jmp_buf;
+    return Result::TrapMemoryAccessOutOfBounds;
+  }
+
+  s_fault_instance = thread->instance;
+  s_fault_jmp_buf = &fault_jmp_buf;
+  Result result = run();
+  s_fault_instance = old_fault_instance;
+  s_fault_jmp_buf = old_fault_jmp_buf;
+  return result;
+#else
+  return run();
+#endif
+}
+
+template <bool single_step, bool trace>
+static Result run_interpreter_loop(Thread* thread,
+                                   IstreamOffset* call_stack_return_top);
+template <bool single_step, bool trace>
+static Result run_register_loop(Thread* thread,
+                                IstreamOffset* call_stack_return_top);
+
+Result run_interpreter(Thread* thread, IstreamOffset* call_stack_return_top) {
+  return run_with_memory_fault_handler(thread, [&]() {
+    if (thread->env->register_machine) {
+      return thread->trace ? run_register_loop<false, true>(
+                                 thread, call_stack_return_top)
+                           : run_register_loop<false, false>(
+                                 thread, call_stack_return_top);
+    }
+    return thread->trace ? run_interpreter_loop<false, true>(
+                               thread, call_stack_return_top)
+                         : run_interpreter_loop<false, false>(
+                               thread, call_stack_return_top);
+  });
+}
+
+Result step_interpreter(Thread* thread, IstreamOffset* call_stack_return_top) {
+  return run_with_memory_fault_handler(thread, [&]() {
+    if (thread->env->register_machine) {
+      return thread->trace ? run_register_loop<true, true>(
+                                 thread, call_stack_return_top)
+                           : run_register_loop<true, false>(
+                                 thread, call_stack_return_top);
+    }
+    return thread->trace ? run_interpreter_loop<true, true>(
+                               thread, call_stack_return_top)
+                         : run_interpreter_loop<true, false>(
+                               thread, call_stack_return_top);
+  });
+}
+
+Result jit_call(Thread* thread, DefinedFunc* func) {
+  assert(func->jit_code);
+  return run_with_memory_fault_handler(
+      thread, [&]() { return run_jit_code(thread, func); });
+}
+
+template <bool single_step, bool trace>
+static Result run_interpreter_loop(Thread* thread,
+                                   IstreamOffset* call_stack_return_top) {
   Result result = Result::Ok;
   assert(call_stack_return_top < thread->call_stack_end);
 
   Environment* env = thread->env;
+  Instance* instance = thread->instance;
 
   const uint8_t* istream = env->istream->data.data();
   const uint8_t* pc = &istream[thread->pc];
-  for (int i = 0; i < num_instructions; ++i) {
+
+#if WABT_USE_COMPUTED_GOTO
+  static const void* const s_handlers[] = {
+#define WABT_OPCODE(rtype, type1, type2, mem_size, code, Name, text) \
+  &&op_##Name,
+#include "interpreter-opcode.def"
+#undef WABT_OPCODE
+  };
+  static const DispatchTable s_dispatch_table =
+      make_dispatch_table(&&op_Invalid, s_handlers);
+#endif
+
+#if WITH_OPCODE_COUNTS
+  OpcodeCounts* opcode_counts = thread->opcode_counts.get();
+#endif
+  TraceBuffer* trace_buffer = thread->trace;
+
+  do {
+    TRACE_INSTR();
     Opcode opcode = static_cast<Opcode>(*pc++);
+    COUNT_OPCODE(opcode);
     switch (opcode) {
-      case Opcode::Select: {
-        VALUE_TYPE_I32 cond = POP_I32();
-        Value false_ = POP();
-        Value true_ = POP();
-        PUSH(cond ? true_ : false_);
-        break;
-      }
-
-      case Opcode::Br:
+      CASE(Br):
         GOTO(read_u32(&pc));
-        break;
+        NEXT();
 
-      case Opcode::BrIf: {
+      CASE(BrIf): {
         IstreamOffset new_pc = read_u32(&pc);
-        if (POP_I32())
+        VALUE_TYPE_I32 cond = POP_I32();
+        COUNT_BRANCH(BrIf, cond);
+        if (cond)
           GOTO(new_pc);
-        break;
+        NEXT();
       }
 
-      case Opcode::BrTable: {
+      CASE(BrTable): {
         Index num_targets = read_u32(&pc);
         IstreamOffset table_offset = read_u32(&pc);
+        uint32_t drop_count = read_u32(&pc);
+        uint8_t keep_count = *pc++;
         VALUE_TYPE_I32 key = POP_I32();
-        IstreamOffset key_offset =
-            (key >= num_targets ? num_targets : key) * WABT_TABLE_ENTRY_SIZE;
-        const uint8_t* entry = istream + table_offset + key_offset;
-        IstreamOffset new_pc;
-        uint32_t drop_count;
-        uint8_t keep_count;
-        read_table_entry_at(entry, &new_pc, &drop_count, &keep_count);
+        Index index = key >= num_targets ? num_targets : key;
+        const uint8_t* offsets = istream + table_offset;
         DROP_KEEP(drop_count, keep_count);
-        GOTO(new_pc);
-        break;
+        GOTO(read_u32_at(offsets + index * sizeof(IstreamOffset)));
+        NEXT();
       }
 
-      case Opcode::Return:
+      CASE(BrTableDropKeep): {
+        Index num_targets = read_u32(&pc);
+        IstreamOffset table_offset = read_u32(&pc);
+        VALUE_TYPE_I32 key = POP_I32();
+        Index index = key >= num_targets ? num_targets : key;
+        const uint8_t* offsets = istream + table_offset;
+        const uint8_t* drop_counts =
+            offsets + (num_targets + 1) * sizeof(IstreamOffset);
+        const uint8_t* keep_counts =
+            drop_counts + (num_targets + 1) * sizeof(uint32_t);
+        DROP_KEEP(read_u32_at(drop_counts + index * sizeof(uint32_t)),
+                  keep_counts[index]);
+        GOTO(read_u32_at(offsets + index * sizeof(IstreamOffset)));
+        NEXT();
+      }
+
+      CASE(Return):
         if (thread->call_stack_top == call_stack_return_top) {
           result = Result::Returned;
           goto exit_loop;
         }
         GOTO(POP_CALL());
-        break;
+        NEXT();
 
-      case Opcode::Unreachable:
+      CASE(Unreachable):
         TRAP(Unreachable);
-        break;
-
-      case Opcode::I32Const:
-        PUSH_I32(read_u32(&pc));
-        break;
-
-      case Opcode::I64Const:
-        PUSH_I64(read_u64(&pc));
-        break;
-
-      case Opcode::F32Const:
-        PUSH_F32(read_u32(&pc));
-        break;
-
-      case Opcode::F64Const:
-        PUSH_F64(read_u64(&pc));
-        break;
-
-      case Opcode::GetGlobal: {
-        Index index = read_u32(&pc);
-        assert(index < env->globals.size());
-        PUSH(env->globals[index].typed_value.value);
-        break;
-      }
-
-      case Opcode::SetGlobal: {
-        Index index = read_u32(&pc);
-        assert(index < env->globals.size());
-        env->globals[index].typed_value.value = POP();
-        break;
-      }
+        NEXT();
 
-      case Opcode::GetLocal: {
+      CASE(GetLocal): {
         Value value = PICK(read_u32(&pc));
         PUSH(value);
-        break;
+        NEXT();
       }
 
-      case Opcode::SetLocal: {
+      CASE(SetLocal): {
         Value value = POP();
         PICK(read_u32(&pc)) = value;
-        break;
+        NEXT();
       }
 
-      case Opcode::TeeLocal:
+      CASE(TeeLocal):
         PICK(read_u32(&pc)) = TOP();
-        break;
+        NEXT();
 
-      case Opcode::Call: {
+      CASE(Call): {
         IstreamOffset offset = read_u32(&pc);
         PUSH_CALL();
         GOTO(offset);
-        break;
+        NEXT();
       }
 
-      case Opcode::CallIndirect: {
+      CASE(CallIndirect): {
         Index table_index = read_u32(&pc);
-        Table* table = &env->tables[table_index];
-        Index sig_index = read_u32(&pc);
+        Table* table = &instance->tables[table_index];
+        Index sig_id = read_u32(&pc);
         VALUE_TYPE_I32 entry_index = POP_I32();
-        TRAP_IF(entry_index >= table->func_indexes.size(), UndefinedTableIndex);
-        Index func_index = table->func_indexes[entry_index];
-        TRAP_IF(func_index == kInvalidIndex, UninitializedTableElement);
-        Func* func = env->funcs[func_index].get();
-        TRAP_UNLESS(func_signatures_are_equal(env, func->sig_index, sig_index),
-                    IndirectCallSignatureMismatch);
+        TRAP_IF(entry_index >= table->entries.size(), UndefinedTableIndex);
+        const TableEntry& entry = table->entries[entry_index];
+        TRAP_IF(entry.func_index == kInvalidIndex, UninitializedTableElement);
+        TRAP_UNLESS(entry.sig_id == sig_id, IndirectCallSignatureMismatch);
+        Func* func = env->funcs[entry.func_index].get();
         if (func->is_host) {
-          call_host(thread, func->as_host());
+          result = call_host(thread, func->as_host());
+          if (WABT_UNLIKELY(result != Result::Ok))
+            return result;
+          RELOAD_ISTREAM();
         } else {
           PUSH_CALL();
           GOTO(func->as_defined()->offset);
         }
-        break;
+        NEXT();
       }
 
-      case Opcode::CallHost: {
+      CASE(CallHost): {
         Index func_index = read_u32(&pc);
-        call_host(thread, env->funcs[func_index]->as_host());
-        break;
+        result = call_host(thread, env->funcs[func_index]->as_host());
+        if (WABT_UNLIKELY(result != Result::Ok))
+          return result;
+        RELOAD_ISTREAM();
+        NEXT();
       }
 
-      case Opcode::I32Load8S:
-        LOAD(I32, I8);
-        break;
-
-      case Opcode::I32Load8U:
-        LOAD(I32, U8);
-        break;
+      CASE(CompileFunc): {
+        DefinedFunc* func = env->funcs[read_u32(&pc)]->as_defined();
+        if (WABT_FAILED(compile_lazy_function(env, func)))
+          return Result::InvalidFunction;
+        RELOAD_ISTREAM();
+        GOTO(func->offset);
+        NEXT();
+      }
 
-      case Opcode::I32Load16S:
-        LOAD(I32, I16);
-        break;
+#include "interpreter-handlers.inc"
 
-      case Opcode::I32Load16U:
-        LOAD(I32, U16);
-        break;
+      CASE(Alloca): {
+        const uint8_t* op_pc = pc - 1;
+        Value* old_value_stack_top = thread->value_stack_top;
+        uint32_t local_count = read_u32(&pc);
+        uint32_t max_stack_height = read_u32(&pc);
+        CHARGE_FUEL(read_u32(&pc), op_pc);
+        TRAP_IF(static_cast<size_t>(thread->value_stack_end -
+                                    old_value_stack_top) <
+                    static_cast<size_t>(local_count) + max_stack_height,
+                ValueStackExhausted);
+        thread->value_stack_top += local_count;
+        memset(old_value_stack_top, 0,
+               (thread->value_stack_top - old_value_stack_top) * sizeof(Value));
+        NEXT();
+      }
 
-      case Opcode::I64Load8S:
-        LOAD(I64, I8);
-        break;
+      CASE(BrUnless): {
+        IstreamOffset new_pc = read_u32(&pc);
+        VALUE_TYPE_I32 cond = POP_I32();
+        COUNT_BRANCH(BrUnless, !cond);
+        if (!cond)
+          GOTO(new_pc);
+        NEXT();
+      }
 
-      case Opcode::I64Load8U:
-        LOAD(I64, U8);
-        break;
+      CASE(Drop):
+        (void)POP();
+        NEXT();
 
-      case Opcode::I64Load16S:
-        LOAD(I64, I16);
-        break;
+      CASE(I32AddLocalLocal): {
+        VALUE_TYPE_I32 lhs = PICK(read_u32(&pc)).i32;
+        VALUE_TYPE_I32 rhs = PICK(read_u32(&pc)).i32;
+        PUSH_I32(lhs + rhs);
+        NEXT();
+      }
 
-      case Opcode::I64Load16U:
-        LOAD(I64, U16);
-        break;
+      CASE(I32AddLocalConst): {
+        VALUE_TYPE_I32 lhs = PICK(read_u32(&pc)).i32;
+        VALUE_TYPE_I32 rhs = read_u32(&pc);
+        PUSH_I32(lhs + rhs);
+        NEXT();
+      }
 
-      case Opcode::I64Load32S:
-        LOAD(I64, I32);
-        break;
+      CASE(I32LoadLocal):
+        LOAD_FROM(I32, U32, PICK(read_u32(&pc)).i32);
+        NEXT();
 
-      case Opcode::I64Load32U:
-        LOAD(I64, U32);
-        break;
+      CASE(DropKeep): {
+        uint32_t drop_count = read_u32(&pc);
+        uint8_t keep_count = *pc++;
+        DROP_KEEP(drop_count, keep_count);
+        NEXT();
+      }
 
-      case Opcode::I32Load:
-        LOAD(I32, U32);
-        break;
+      CASE(ChargeFuel): {
+        const uint8_t* op_pc = pc - 1;
+        CHARGE_FUEL(read_u32(&pc), op_pc);
+        NEXT();
+      }
 
-      case Opcode::I64Load:
-        LOAD(I64, U64);
-        break;
+      CASE(FrameAlloca): {
+        const uint8_t* op_pc = pc - 1;
+        Value* old_value_stack_top = thread->value_stack_top;
+        uint32_t local_count = read_u32(&pc);
+        uint32_t max_stack_height = read_u32(&pc);
+        CHARGE_FUEL(read_u32(&pc), op_pc);
+        uint32_t param_count = read_u32(&pc);
+        /* The caller's frame is saved in the slot above the locals. */
+        TRAP_IF(static_cast<size_t>(thread->value_stack_end -
+                                    old_value_stack_top) <
+                    static_cast<size_t>(local_count) + max_stack_height + 1,
+                ValueStackExhausted);
+        memset(old_value_stack_top, 0, local_count * sizeof(Value));
+        thread->value_stack_top += local_count;
+        PUSH_I32(thread->frame - thread->value_stack.data());
+        thread->frame = old_value_stack_top - param_count;
+        NEXT();
+      }
 
-      case Opcode::F32Load:
-        LOAD(F32, F32);
-        break;
+      CASE(FrameGetLocal):
+        PUSH(thread->frame[read_u32(&pc)]);
+        NEXT();
 
-      case Opcode::F64Load:
-        LOAD(F64, F64);
-        break;
+      CASE(FrameSetLocal): {
+        Value value = POP();
+        thread->frame[read_u32(&pc)] = value;
+        NEXT();
+      }
 
-      case Opcode::I32Store8:
-        STORE(I32, U8);
-        break;
+      CASE(FrameTeeLocal):
+        thread->frame[read_u32(&pc)] = TOP();
+        NEXT();
 
-      case Opcode::I32Store16:
-        STORE(I32, U16);
-        break;
-
-      case Opcode::I64Store8:
-        STORE(I64, U8);
-        break;
-
-      case Opcode::I64Store16:
-        STORE(I64, U16);
-        break;
-
-      case Opcode::I64Store32:
-        STORE(I64, U32);
-        break;
-
-      case Opcode::I32Store:
-        STORE(I32, U32);
-        break;
-
-      case Opcode::I64Store:
-        STORE(I64, U64);
-        break;
-
-      case Opcode::F32Store:
-        STORE(F32, F32);
-        break;
-
-      case Opcode::F64Store:
-        STORE(F64, F64);
-        break;
-
-      case Opcode::CurrentMemory: {
-        GET_MEMORY(memory);
-        PUSH_I32(memory->page_limits.initial);
-        break;
-      }
-
-      case Opcode::GrowMemory: {
-        GET_MEMORY(memory);
-        uint32_t old_page_size = memory->page_limits.initial;
-        VALUE_TYPE_I32 grow_pages = POP_I32();
-        uint32_t new_page_size = old_page_size + grow_pages;
-        uint32_t max_page_size = memory->page_limits.has_max
-                                     ? memory->page_limits.max
-                                     : WABT_MAX_PAGES;
-        PUSH_NEG_1_AND_BREAK_IF(new_page_size > max_page_size);
-        PUSH_NEG_1_AND_BREAK_IF(
-            static_cast<uint64_t>(new_page_size) * WABT_PAGE_SIZE > UINT32_MAX);
-        memory->data.resize(new_page_size * WABT_PAGE_SIZE);
-        memory->page_limits.initial = new_page_size;
-        PUSH_I32(old_page_size);
-        break;
+      CASE(FrameReturn): {
+        Value* frame = thread->frame;
+        thread->frame = thread->value_stack.data() + frame[read_u32(&pc)].i32;
+        uint32_t drop_count = read_u32(&pc);
+        uint8_t keep_count = *pc++;
+        DROP_KEEP(drop_count, keep_count);
+        if (thread->call_stack_top == call_stack_return_top) {
+          result = Result::Returned;
+          goto exit_loop;
+        }
+        GOTO(POP_CALL());
+        NEXT();
       }
 
-      case Opcode::I32Add:
-        BINOP(I32, I32, +);
-        break;
-
-      case Opcode::I32Sub:
-        BINOP(I32, I32, -);
-        break;
-
-      case Opcode::I32Mul:
-        BINOP(I32, I32, *);
-        break;
-
-      case Opcode::I32DivS:
-        BINOP_DIV_S(I32);
-        break;
-
-      case Opcode::I32DivU:
-        BINOP_DIV_REM_U(I32, /);
-        break;
-
-      case Opcode::I32RemS:
-        BINOP_REM_S(I32);
-        break;
-
-      case Opcode::I32RemU:
-        BINOP_DIV_REM_U(I32, %);
-        break;
-
-      case Opcode::I32And:
-        BINOP(I32, I32, &);
-        break;
-
-      case Opcode::I32Or:
-        BINOP(I32, I32, |);
-        break;
-
-      case Opcode::I32Xor:
-        BINOP(I32, I32, ^);
-        break;
-
-      case Opcode::I32Shl:
-        BINOP_SHIFT(I32, <<, UNSIGNED);
-        break;
-
-      case Opcode::I32ShrU:
-        BINOP_SHIFT(I32, >>, UNSIGNED);
-        break;
-
-      case Opcode::I32ShrS:
-        BINOP_SHIFT(I32, >>, SIGNED);
-        break;
-
-      case Opcode::I32Eq:
-        BINOP(I32, I32, ==);
-        break;
-
-      case Opcode::I32Ne:
-        BINOP(I32, I32, !=);
-        break;
-
-      case Opcode::I32LtS:
-        BINOP_SIGNED(I32, I32, <);
-        break;
+      CASE(Nop):
+        NEXT();
+
+      /* register code only, or shouldn't ever execute these */
+      CASE(RegI32AddImm):
+      CASE(RegI32SubImm):
+      CASE(RegI32MulImm):
+      CASE(RegI32AndImm):
+      CASE(RegI32OrImm):
+      CASE(RegI32XorImm):
+      CASE(RegI32ShlImm):
+      CASE(RegI32ShrSImm):
+      CASE(RegI32ShrUImm):
+      CASE(Move):
+      CASE(Block):
+      CASE(Loop):
+      CASE(If):
+      CASE(Else):
+      CASE(End):
+      CASE(Data):
+      CASE(Invalid_0x06):
+      CASE(Invalid_0x07):
+      CASE(Invalid_0x08):
+      CASE(Invalid_0x09):
+      CASE(Invalid_0x0A):
+      CASE(Invalid_0x12):
+      CASE(Invalid_0x13):
+      CASE(Invalid_0x14):
+      CASE(Invalid_0x15):
+      CASE(Invalid_0x16):
+      CASE(Invalid_0x17):
+      CASE(Invalid_0x18):
+      CASE(Invalid_0x19):
+      CASE(Invalid_0x1c):
+      CASE(Invalid_0x1d):
+      CASE(Invalid_0x1e):
+      CASE(Invalid_0x1f):
+      CASE(Invalid_0x25):
+      CASE(Invalid_0x26):
+      CASE(Invalid_0x27):
+      default:
+#if WABT_USE_COMPUTED_GOTO
+      op_Invalid:
+#endif
+        assert(0);
+        NEXT();
+    }
+  } while (!single_step);
 
-      case Opcode::I32LeS:
-        BINOP_SIGNED(I32, I32, <=);
-        break;
+exit_loop:
+  thread->pc = pc - istream;
+  return result;
+}
 
-      case Opcode::I32LtU:
-        BINOP(I32, I32, <);
-        break;
+/* Register code reads the operands of an instruction from the registers of the
+ * current frame, which start at |fp|: the params, the locals, the caller's
+ * frame, then a register for each slot of the function's value stack. Each
+ * POP and PUSH in interpreter-handlers.inc reads the index of its register
+ * from the istream. The value stack top is only set at calls, where the
+ * callee's frame starts at the args, and at returns, where the results are. */
+#undef PUSH
+#undef PUSH_TYPE
+#undef POP
+#define PUSH(v) fp[read_u32(&pc)] = (v)
+#define PUSH_TYPE(type, v)                             \
+  fp[read_u32(&pc)].TYPE_FIELD_NAME_##type =           \
+      static_cast<VALUE_TYPE_##type>(v)
+#define POP() (fp[read_u32(&pc)])
+
+#define REGISTER_BINOP_IMM(op)          \
+  do {                                  \
+    VALUE_TYPE_I32 lhs = POP_I32();     \
+    VALUE_TYPE_I32 rhs = read_u32(&pc); \
+    PUSH_I32(lhs op rhs);               \
+  } while (0)
 
-      case Opcode::I32LeU:
-        BINOP(I32, I32, <=);
-        break;
+#define REGISTER_BINOP_SHIFT_IMM(op, sign)                                \
+  do {                                                                    \
+    VALUE_TYPE_I32 lhs = POP_I32();                                       \
+    VALUE_TYPE_I32 rhs = read_u32(&pc);                                   \
+    PUSH_I32(BITCAST_I32_TO_##sign(lhs) op(rhs& SHIFT_MASK_I32));         \
+  } while (0)
 
-      case Opcode::I32GtS:
-        BINOP_SIGNED(I32, I32, >);
-        break;
+template <bool single_step, bool trace>
+static Result run_register_loop(Thread* thread,
+                                IstreamOffset* call_stack_return_top) {
+  Result result = Result::Ok;
+  assert(call_stack_return_top < thread->call_stack_end);
 
-      case Opcode::I32GeS:
-        BINOP_SIGNED(I32, I32, >=);
-        break;
+  Environment* env = thread->env;
+  Instance* instance = thread->instance;
 
-      case Opcode::I32GtU:
-        BINOP(I32, I32, >);
-        break;
+  const uint8_t* istream = env->istream->data.data();
+  const uint8_t* pc = &istream[thread->pc];
+  Value* fp = thread->frame;
 
-      case Opcode::I32GeU:
-        BINOP(I32, I32, >=);
-        break;
+#if WABT_USE_COMPUTED_GOTO
+  static const void* const s_handlers[] = {
+#define WABT_OPCODE(rtype, type1, type2, mem_size, code, Name, text) \
+  &&op_##Name,
+#include "interpreter-opcode.def"
+#undef WABT_OPCODE
+  };
+  static const DispatchTable s_dispatch_table =
+      make_dispatch_table(&&op_Invalid, s_handlers);
+#endif
+
+#if WITH_OPCODE_COUNTS
+  OpcodeCounts* opcode_counts = thread->opcode_counts.get();
+#endif
+  TraceBuffer* trace_buffer = thread->trace;
+
+  do {
+    TRACE_INSTR();
+    Opcode opcode = static_cast<Opcode>(*pc++);
+    COUNT_OPCODE(opcode);
+    switch (opcode) {
+      CASE(Br):
+        GOTO(read_u32(&pc));
+        NEXT();
 
-      case Opcode::I32Clz: {
-        VALUE_TYPE_I32 value = POP_I32();
-        PUSH_I32(value != 0 ? wabt_clz_u32(value) : 32);
-        break;
+      CASE(BrIf): {
+        IstreamOffset new_pc = read_u32(&pc);
+        VALUE_TYPE_I32 cond = POP_I32();
+        COUNT_BRANCH(BrIf, cond);
+        if (cond)
+          GOTO(new_pc);
+        NEXT();
       }
 
-      case Opcode::I32Ctz: {
-        VALUE_TYPE_I32 value = POP_I32();
-        PUSH_I32(value != 0 ? wabt_ctz_u32(value) : 32);
-        break;
+      CASE(BrUnless): {
+        IstreamOffset new_pc = read_u32(&pc);
+        VALUE_TYPE_I32 cond = POP_I32();
+        COUNT_BRANCH(BrUnless, !cond);
+        if (!cond)
+          GOTO(new_pc);
+        NEXT();
       }
 
-      case Opcode::I32Popcnt: {
-        VALUE_TYPE_I32 value = POP_I32();
-        PUSH_I32(wabt_popcount_u32(value));
-        break;
+      CASE(BrTable): {
+        VALUE_TYPE_I32 key = POP_I32();
+        Index num_targets = read_u32(&pc);
+        IstreamOffset table_offset = read_u32(&pc);
+        Index index = key >= num_targets ? num_targets : key;
+        const uint8_t* offsets = istream + table_offset;
+        GOTO(read_u32_at(offsets + index * sizeof(IstreamOffset)));
+        NEXT();
       }
 
-      case Opcode::I32Eqz: {
-        VALUE_TYPE_I32 value = POP_I32();
-        PUSH_I32(value == 0);
-        break;
+      CASE(Return): {
+        /* The caller's frame is read first, since the result can be copied
+         * over it when the function has no params or locals. */
+        Value* caller_fp = thread->value_stack.data() + fp[read_u32(&pc)].i32;
+        Index src = read_u32(&pc);
+        thread->value_stack_top = fp;
+        if (src != kInvalidIndex)
+          *thread->value_stack_top++ = fp[src];
+        fp = caller_fp;
+        if (thread->call_stack_top == call_stack_return_top) {
+          result = Result::Returned;
+          goto exit_loop;
+        }
+        GOTO(POP_CALL());
+        NEXT();
       }
 
-      case Opcode::I64Add:
-        BINOP(I64, I64, +);
-        break;
-
-      case Opcode::I64Sub:
-        BINOP(I64, I64, -);
-        break;
-
-      case Opcode::I64Mul:
-        BINOP(I64, I64, *);
-        break;
-
-      case Opcode::I64DivS:
-        BINOP_DIV_S(I64);
-        break;
-
-      case Opcode::I64DivU:
-        BINOP_DIV_REM_U(I64, /);
-        break;
-
-      case Opcode::I64RemS:
-        BINOP_REM_S(I64);
-        break;
-
-      case Opcode::I64RemU:
-        BINOP_DIV_REM_U(I64, %);
-        break;
-
-      case Opcode::I64And:
-        BINOP(I64, I64, &);
-        break;
-
-      case Opcode::I64Or:
-        BINOP(I64, I64, |);
-        break;
-
-      case Opcode::I64Xor:
-        BINOP(I64, I64, ^);
-        break;
-
-      case Opcode::I64Shl:
-        BINOP_SHIFT(I64, <<, UNSIGNED);
-        break;
-
-      case Opcode::I64ShrU:
-        BINOP_SHIFT(I64, >>, UNSIGNED);
-        break;
-
-      case Opcode::I64ShrS:
-        BINOP_SHIFT(I64, >>, SIGNED);
-        break;
-
-      case Opcode::I64Eq:
-        BINOP(I32, I64, ==);
-        break;
-
-      case Opcode::I64Ne:
-        BINOP(I32, I64, !=);
-        break;
-
-      case Opcode::I64LtS:
-        BINOP_SIGNED(I32, I64, <);
-        break;
-
-      case Opcode::I64LeS:
-        BINOP_SIGNED(I32, I64, <=);
-        break;
-
-      case Opcode::I64LtU:
-        BINOP(I32, I64, <);
-        break;
-
-      case Opcode::I64LeU:
-        BINOP(I32, I64, <=);
-        break;
-
-      case Opcode::I64GtS:
-        BINOP_SIGNED(I32, I64, >);
-        break;
-
-      case Opcode::I64GeS:
-        BINOP_SIGNED(I32, I64, >=);
-        break;
-
-      case Opcode::I64GtU:
-        BINOP(I32, I64, >);
-        break;
-
-      case Opcode::I64GeU:
-        BINOP(I32, I64, >=);
-        break;
-
-      case Opcode::I64Clz: {
-        VALUE_TYPE_I64 value = POP_I64();
-        PUSH_I64(value != 0 ? wabt_clz_u64(value) : 64);
-        break;
-      }
+      CASE(Unreachable):
+        TRAP(Unreachable);
+        NEXT();
 
-      case Opcode::I64Ctz: {
-        VALUE_TYPE_I64 value = POP_I64();
-        PUSH_I64(value != 0 ? wabt_ctz_u64(value) : 64);
-        break;
+      CASE(Call): {
+        IstreamOffset offset = read_u32(&pc);
+        thread->value_stack_top = fp + read_u32(&pc);
+        PUSH_CALL();
+        GOTO(offset);
+        NEXT();
       }
 
-      case Opcode::I64Popcnt: {
-        VALUE_TYPE_I64 value = POP_I64();
-        PUSH_I64(wabt_popcount_u64(value));
-        break;
+      CASE(CallIndirect): {
+        Index table_index = read_u32(&pc);
+        Table* table = &instance->tables[table_index];
+        Index sig_id = read_u32(&pc);
+        VALUE_TYPE_I32 entry_index = POP_I32();
+        thread->value_stack_top = fp + read_u32(&pc);
+        TRAP_IF(entry_index >= table->entries.size(), UndefinedTableIndex);
+        const TableEntry& entry = table->entries[entry_index];
+        TRAP_IF(entry.func_index == kInvalidIndex, UninitializedTableElement);
+        TRAP_UNLESS(entry.sig_id == sig_id, IndirectCallSignatureMismatch);
+        Func* func = env->funcs[entry.func_index].get();
+        if (func->is_host) {
+          thread->frame = fp;
+          result = call_host(thread, func->as_host());
+          if (WABT_UNLIKELY(result != Result::Ok))
+            return result;
+          RELOAD_ISTREAM();
+        } else {
+          PUSH_CALL();
+          GOTO(func->as_defined()->offset);
+        }
+        NEXT();
       }
 
-      case Opcode::F32Add:
-        BINOP_FLOAT(F32, +);
-        break;
-
-      case Opcode::F32Sub:
-        BINOP_FLOAT(F32, -);
-        break;
-
-      case Opcode::F32Mul:
-        BINOP_FLOAT(F32, *);
-        break;
-
-      case Opcode::F32Div:
-        BINOP_FLOAT_DIV(F32);
-        break;
-
-      case Opcode::F32Min:
-        MINMAX_FLOAT(F32, MIN);
-        break;
-
-      case Opcode::F32Max:
-        MINMAX_FLOAT(F32, MAX);
-        break;
-
-      case Opcode::F32Abs:
-        TOP().f32_bits &= ~F32_SIGN_MASK;
-        break;
-
-      case Opcode::F32Neg:
-        TOP().f32_bits ^= F32_SIGN_MASK;
-        break;
-
-      case Opcode::F32Copysign: {
-        VALUE_TYPE_F32 rhs = POP_F32();
-        VALUE_TYPE_F32 lhs = POP_F32();
-        PUSH_F32((lhs & ~F32_SIGN_MASK) | (rhs & F32_SIGN_MASK));
-        break;
+      CASE(CallHost): {
+        Index func_index = read_u32(&pc);
+        thread->value_stack_top = fp + read_u32(&pc);
+        /* the host function can run the interpreter, which starts at the
+         * thread's frame */
+        thread->frame = fp;
+        result = call_host(thread, env->funcs[func_index]->as_host());
+        if (WABT_UNLIKELY(result != Result::Ok))
+          return result;
+        RELOAD_ISTREAM();
+        NEXT();
       }
 
-      case Opcode::F32Ceil:
-        UNOP_FLOAT(F32, ceilf);
-        break;
-
-      case Opcode::F32Floor:
-        UNOP_FLOAT(F32, floorf);
-        break;
-
-      case Opcode::F32Trunc:
-        UNOP_FLOAT(F32, truncf);
-        break;
-
-      case Opcode::F32Nearest:
-        UNOP_FLOAT(F32, nearbyintf);
-        break;
-
-      case Opcode::F32Sqrt:
-        UNOP_FLOAT(F32, sqrtf);
-        break;
-
-      case Opcode::F32Eq:
-        BINOP_FLOAT_COMPARE(F32, ==);
-        break;
-
-      case Opcode::F32Ne:
-        BINOP_FLOAT_COMPARE(F32, !=);
-        break;
-
-      case Opcode::F32Lt:
-        BINOP_FLOAT_COMPARE(F32, <);
-        break;
-
-      case Opcode::F32Le:
-        BINOP_FLOAT_COMPARE(F32, <=);
-        break;
-
-      case Opcode::F32Gt:
-        BINOP_FLOAT_COMPARE(F32, >);
-        break;
-
-      case Opcode::F32Ge:
-        BINOP_FLOAT_COMPARE(F32, >=);
-        break;
-
-      case Opcode::F64Add:
-        BINOP_FLOAT(F64, +);
-        break;
-
-      case Opcode::F64Sub:
-        BINOP_FLOAT(F64, -);
-        break;
-
-      case Opcode::F64Mul:
-        BINOP_FLOAT(F64, *);
-        break;
-
-      case Opcode::F64Div:
-        BINOP_FLOAT_DIV(F64);
-        break;
-
-      case Opcode::F64Min:
-        MINMAX_FLOAT(F64, MIN);
-        break;
-
-      case Opcode::F64Max:
-        MINMAX_FLOAT(F64, MAX);
-        break;
-
-      case Opcode::F64Abs:
-        TOP().f64_bits &= ~F64_SIGN_MASK;
-        break;
-
-      case Opcode::F64Neg:
-        TOP().f64_bits ^= F64_SIGN_MASK;
-        break;
-
-      case Opcode::F64Copysign: {
-        VALUE_TYPE_F64 rhs = POP_F64();
-        VALUE_TYPE_F64 lhs = POP_F64();
-        PUSH_F64((lhs & ~F64_SIGN_MASK) | (rhs & F64_SIGN_MASK));
-        break;
+      CASE(CompileFunc): {
+        DefinedFunc* func = env->funcs[read_u32(&pc)]->as_defined();
+        if (WABT_FAILED(compile_lazy_function(env, func)))
+          return Result::InvalidFunction;
+        RELOAD_ISTREAM();
+        GOTO(func->offset);
+        NEXT();
       }
 
-      case Opcode::F64Ceil:
-        UNOP_FLOAT(F64, ceil);
-        break;
-
-      case Opcode::F64Floor:
-        UNOP_FLOAT(F64, floor);
-        break;
-
-      case Opcode::F64Trunc:
-        UNOP_FLOAT(F64, trunc);
-        break;
-
-      case Opcode::F64Nearest:
-        UNOP_FLOAT(F64, nearbyint);
-        break;
-
-      case Opcode::F64Sqrt:
-        UNOP_FLOAT(F64, sqrt);
-        break;
-
-      case Opcode::F64Eq:
-        BINOP_FLOAT_COMPARE(F64, ==);
-        break;
-
-      case Opcode::F64Ne:
-        BINOP_FLOAT_COMPARE(F64, !=);
-        break;
-
-      case Opcode::F64Lt:
-        BINOP_FLOAT_COMPARE(F64, <);
-        break;
-
-      case Opcode::F64Le:
-        BINOP_FLOAT_COMPARE(F64, <=);
-        break;
-
-      case Opcode::F64Gt:
-        BINOP_FLOAT_COMPARE(F64, >);
-        break;
-
-      case Opcode::F64Ge:
-        BINOP_FLOAT_COMPARE(F64, >=);
-        break;
-
-      case Opcode::I32TruncSF32: {
-        VALUE_TYPE_F32 value = POP_F32();
-        TRAP_IF(is_nan_f32(value), InvalidConversionToInteger);
-        TRAP_UNLESS(is_in_range_i32_trunc_s_f32(value), IntegerOverflow);
-        PUSH_I32(static_cast<int32_t>(BITCAST_TO_F32(value)));
-        break;
-      }
+#include "interpreter-handlers.inc"
 
-      case Opcode::I32TruncSF64: {
-        VALUE_TYPE_F64 value = POP_F64();
-        TRAP_IF(is_nan_f64(value), InvalidConversionToInteger);
-        TRAP_UNLESS(is_in_range_i32_trunc_s_f64(value), IntegerOverflow);
-        PUSH_I32(static_cast<int32_t>(BITCAST_TO_F64(value)));
-        break;
+      CASE(Move): {
+        Value value = POP();
+        PUSH(value);
+        NEXT();
       }
 
-      case Opcode::I32TruncUF32: {
-        VALUE_TYPE_F32 value = POP_F32();
-        TRAP_IF(is_nan_f32(value), InvalidConversionToInteger);
-        TRAP_UNLESS(is_in_range_i32_trunc_u_f32(value), IntegerOverflow);
-        PUSH_I32(static_cast<uint32_t>(BITCAST_TO_F32(value)));
-        break;
-      }
+      CASE(RegI32AddImm):
+        REGISTER_BINOP_IMM(+);
+        NEXT();
 
-      case Opcode::I32TruncUF64: {
-        VALUE_TYPE_F64 value = POP_F64();
-        TRAP_IF(is_nan_f64(value), InvalidConversionToInteger);
-        TRAP_UNLESS(is_in_range_i32_trunc_u_f64(value), IntegerOverflow);
-        PUSH_I32(static_cast<uint32_t>(BITCAST_TO_F64(value)));
-        break;
-      }
+      CASE(RegI32SubImm):
+        REGISTER_BINOP_IMM(-);
+        NEXT();
 
-      case Opcode::I32WrapI64: {
-        VALUE_TYPE_I64 value = POP_I64();
-        PUSH_I32(static_cast<uint32_t>(value));
-        break;
-      }
+      CASE(RegI32MulImm):
+        REGISTER_BINOP_IMM(*);
+        NEXT();
 
-      case Opcode::I64TruncSF32: {
-        VALUE_TYPE_F32 value = POP_F32();
-        TRAP_IF(is_nan_f32(value), InvalidConversionToInteger);
-        TRAP_UNLESS(is_in_range_i64_trunc_s_f32(value), IntegerOverflow);
-        PUSH_I64(static_cast<int64_t>(BITCAST_TO_F32(value)));
-        break;
-      }
+      CASE(RegI32AndImm):
+        REGISTER_BINOP_IMM(&);
+        NEXT();
 
-      case Opcode::I64TruncSF64: {
-        VALUE_TYPE_F64 value = POP_F64();
-        TRAP_IF(is_nan_f64(value), InvalidConversionToInteger);
-        TRAP_UNLESS(is_in_range_i64_trunc_s_f64(value), IntegerOverflow);
-        PUSH_I64(static_cast<int64_t>(BITCAST_TO_F64(value)));
-        break;
-      }
+      CASE(RegI32OrImm):
+        REGISTER_BINOP_IMM(|);
+        NEXT();
 
-      case Opcode::I64TruncUF32: {
-        VALUE_TYPE_F32 value = POP_F32();
-        TRAP_IF(is_nan_f32(value), InvalidConversionToInteger);
-        TRAP_UNLESS(is_in_range_i64_trunc_u_f32(value), IntegerOverflow);
-        PUSH_I64(static_cast<uint64_t>(BITCAST_TO_F32(value)));
-        break;
-      }
+      CASE(RegI32XorImm):
+        REGISTER_BINOP_IMM(^);
+        NEXT();
 
-      case Opcode::I64TruncUF64: {
-        VALUE_TYPE_F64 value = POP_F64();
-        TRAP_IF(is_nan_f64(value), InvalidConversionToInteger);
-        TRAP_UNLESS(is_in_range_i64_trunc_u_f64(value), IntegerOverflow);
-        PUSH_I64(static_cast<uint64_t>(BITCAST_TO_F64(value)));
-        break;
-      }
+      CASE(RegI32ShlImm):
+        REGISTER_BINOP_SHIFT_IMM(<<, UNSIGNED);
+        NEXT();
 
-      case Opcode::I64ExtendSI32: {
-        VALUE_TYPE_I32 value = POP_I32();
-        PUSH_I64(static_cast<int64_t>(BITCAST_I32_TO_SIGNED(value)));
-        break;
-      }
+      CASE(RegI32ShrSImm):
+        REGISTER_BINOP_SHIFT_IMM(>>, SIGNED);
+        NEXT();
 
-      case Opcode::I64ExtendUI32: {
-        VALUE_TYPE_I32 value = POP_I32();
-        PUSH_I64(static_cast<uint64_t>(value));
-        break;
-      }
+      CASE(RegI32ShrUImm):
+        REGISTER_BINOP_SHIFT_IMM(>>, UNSIGNED);
+        NEXT();
 
-      case Opcode::F32ConvertSI32: {
-        VALUE_TYPE_I32 value = POP_I32();
-        PUSH_F32(
-            BITCAST_FROM_F32(static_cast<float>(BITCAST_I32_TO_SIGNED(value))));
-        break;
+      CASE(ChargeFuel): {
+        const uint8_t* op_pc = pc - 1;
+        CHARGE_FUEL(read_u32(&pc), op_pc);
+        NEXT();
       }
 
-      case Opcode::F32ConvertUI32: {
-        VALUE_TYPE_I32 value = POP_I32();
-        PUSH_F32(BITCAST_FROM_F32(static_cast<float>(value)));
-        break;
+      CASE(FrameAlloca): {
+        const uint8_t* op_pc = pc - 1;
+        uint32_t local_count = read_u32(&pc);
+        uint32_t max_stack_height = read_u32(&pc);
+        CHARGE_FUEL(read_u32(&pc), op_pc);
+        Value* new_fp = thread->value_stack_top - read_u32(&pc);
+        Value* locals = thread->value_stack_top;
+        /* the locals, the caller's frame and the temporaries */
+        TRAP_IF(static_cast<size_t>(thread->value_stack_end - locals) <
+                    static_cast<size_t>(local_count) + max_stack_height + 1,
+                ValueStackExhausted);
+        memset(locals, 0, local_count * sizeof(Value));
+        locals[local_count].i32 = fp - thread->value_stack.data();
+        fp = new_fp;
+        thread->value_stack_top = locals + local_count + 1 + max_stack_height;
+        NEXT();
       }
 
-      case Opcode::F32ConvertSI64: {
-        VALUE_TYPE_I64 value = POP_I64();
-        PUSH_F32(
-            BITCAST_FROM_F32(static_cast<float>(BITCAST_I64_TO_SIGNED(value))));
-        break;
-      }
+      CASE(Nop):
+        NEXT();
+
+      /* stack code only, or shouldn't ever execute these */
+      CASE(BrTableDropKeep):
+      CASE(GetLocal):
+      CASE(SetLocal):
+      CASE(TeeLocal):
+      CASE(Alloca):
+      CASE(Drop):
+      CASE(DropKeep):
+      CASE(I32AddLocalLocal):
+      CASE(I32AddLocalConst):
+      CASE(I32LoadLocal):
+      CASE(FrameGetLocal):
+      CASE(FrameSetLocal):
+      CASE(FrameTeeLocal):
+      CASE(FrameReturn):
+      CASE(Block):
+      CASE(Loop):
+      CASE(If):
+      CASE(Else):
+      CASE(End):
+      CASE(Data):
+      CASE(Invalid_0x06):
+      CASE(Invalid_0x07):
+      CASE(Invalid_0x08):
+      CASE(Invalid_0x09):
+      CASE(Invalid_0x0A):
+      CASE(Invalid_0x12):
+      CASE(Invalid_0x13):
+      CASE(Invalid_0x14):
+      CASE(Invalid_0x15):
+      CASE(Invalid_0x16):
+      CASE(Invalid_0x17):
+      CASE(Invalid_0x18):
+      CASE(Invalid_0x19):
+      CASE(Invalid_0x1c):
+      CASE(Invalid_0x1d):
+      CASE(Invalid_0x1e):
+      CASE(Invalid_0x1f):
+      CASE(Invalid_0x25):
+      CASE(Invalid_0x26):
+      CASE(Invalid_0x27):
+      default:
+#if WABT_USE_COMPUTED_GOTO
+      op_Invalid:
+#endif
+        assert(0);
+        NEXT();
+    }
+  } while (!single_step);
 
-      case Opcode::F32ConvertUI64: {
-        VALUE_TYPE_I64 value = POP_I64();
-        PUSH_F32(BITCAST_FROM_F32(wabt_convert_uint64_to_float(value)));
-        break;
-      }
+exit_loop:
+  thread->pc = pc - istream;
+  thread->frame = fp;
+  return result;
+}
 
-      case Opcode::F32DemoteF64: {
-        VALUE_TYPE_F64 value = POP_F64();
-        if (WABT_LIKELY(is_in_range_f64_demote_f32(value))) {
-          PUSH_F32(BITCAST_FROM_F32(static_cast<float>(BITCAST_TO_F64(value))));
-        } else if (is_in_range_f64_demote_f32_round_to_f32_max(value)) {
-          PUSH_F32(F32_MAX);
-        } else if (is_in_range_f64_demote_f32_round_to_neg_f32_max(value)) {
-          PUSH_F32(F32_NEG_MAX);
-        } else {
-          uint32_t sign = (value >> 32) & F32_SIGN_MASK;
-          uint32_t tag = 0;
-          if (IS_NAN_F64(value)) {
-            tag = F32_QUIET_NAN_BIT |
-                  ((value >> (F64_SIG_BITS - F32_SIG_BITS)) & F32_SIG_MASK);
-          }
-          PUSH_F32(sign | F32_INF | tag);
-        }
-        break;
-      }
+/* Writes the register code instruction at |pc|, with each operand as the
+ * register it is in, and returns the offset of the next one. */
+static IstreamOffset write_register_instr(Stream* stream,
+                                          const uint8_t* istream,
+                                          IstreamOffset offset) {
+  const uint8_t* pc = &istream[offset];
+  Opcode opcode = static_cast<Opcode>(*pc++);
+  const char* name = get_opcode_name(opcode);
+  switch (opcode) {
+    case Opcode::Select: {
+      uint32_t cond = read_u32(&pc);
+      uint32_t false_ = read_u32(&pc);
+      uint32_t true_ = read_u32(&pc);
+      stream->Writef("%s r%u, r%u, r%u => r%u\n", name, true_, false_, cond,
+                     read_u32(&pc));
+      break;
+    }
 
-      case Opcode::F32ReinterpretI32: {
-        VALUE_TYPE_I32 value = POP_I32();
-        PUSH_F32(value);
-        break;
-      }
+    case Opcode::Br:
+      stream->Writef("%s @%u\n", name, read_u32(&pc));
+      break;
 
-      case Opcode::F64ConvertSI32: {
-        VALUE_TYPE_I32 value = POP_I32();
-        PUSH_F64(BITCAST_FROM_F64(
-            static_cast<double>(BITCAST_I32_TO_SIGNED(value))));
-        break;
-      }
+    case Opcode::BrIf:
+    case Opcode::BrUnless: {
+      uint32_t target = read_u32(&pc);
+      stream->Writef("%s @%u, r%u\n", name, target, read_u32(&pc));
+      break;
+    }
 
-      case Opcode::F64ConvertUI32: {
-        VALUE_TYPE_I32 value = POP_I32();
-        PUSH_F64(BITCAST_FROM_F64(static_cast<double>(value)));
-        break;
-      }
+    case Opcode::BrTable: {
+      uint32_t key = read_u32(&pc);
+      Index num_targets = read_u32(&pc);
+      stream->Writef("%s r%u, $#%" PRIindex ", table:$%u\n", name, key,
+                     num_targets, read_u32(&pc));
+      break;
+    }
 
-      case Opcode::F64ConvertSI64: {
-        VALUE_TYPE_I64 value = POP_I64();
-        PUSH_F64(BITCAST_FROM_F64(
-            static_cast<double>(BITCAST_I64_TO_SIGNED(value))));
-        break;
-      }
+    case Opcode::Return: {
+      uint32_t frame_slot = read_u32(&pc);
+      uint32_t src = read_u32(&pc);
+      if (src == kInvalidIndex)
+        stream->Writef("%s $%u\n", name, frame_slot);
+      else
+        stream->Writef("%s $%u, r%u\n", name, frame_slot, src);
+      break;
+    }
 
-      case Opcode::F64ConvertUI64: {
-        VALUE_TYPE_I64 value = POP_I64();
-        PUSH_F64(BITCAST_FROM_F64(wabt_convert_uint64_to_double(value)));
-        break;
-      }
+    case Opcode::Nop:
+    case Opcode::Unreachable:
+      stream->Writef("%s\n", name);
+      break;
 
-      case Opcode::F64PromoteF32: {
-        VALUE_TYPE_F32 value = POP_F32();
-        PUSH_F64(BITCAST_FROM_F64(static_cast<double>(BITCAST_TO_F32(value))));
-        break;
-      }
+    case Opcode::Call: {
+      uint32_t target = read_u32(&pc);
+      stream->Writef("%s @%u, r%u\n", name, target, read_u32(&pc));
+      break;
+    }
 
-      case Opcode::F64ReinterpretI64: {
-        VALUE_TYPE_I64 value = POP_I64();
-        PUSH_F64(value);
-        break;
-      }
+    case Opcode::CallIndirect: {
+      Index table_index = read_u32(&pc);
+      uint32_t sig = read_u32(&pc);
+      uint32_t key = read_u32(&pc);
+      stream->Writef("%s $%" PRIindex ":%u, r%u, r%u\n", name, table_index,
+                     sig, key, read_u32(&pc));
+      break;
+    }
 
-      case Opcode::I32ReinterpretF32: {
-        VALUE_TYPE_F32 value = POP_F32();
-        PUSH_I32(value);
-        break;
-      }
+    case Opcode::CallHost: {
+      uint32_t func_index = read_u32(&pc);
+      stream->Writef("%s $%u, r%u\n", name, func_index, read_u32(&pc));
+      break;
+    }
 
-      case Opcode::I64ReinterpretF64: {
-        VALUE_TYPE_F64 value = POP_F64();
-        PUSH_I64(value);
-        break;
-      }
+    case Opcode::ChargeFuel:
+    case Opcode::CompileFunc:
+      stream->Writef("%s $%u\n", name, read_u32(&pc));
+      break;
 
-      case Opcode::I32Rotr:
-        BINOP_ROT(I32, RIGHT);
-        break;
+    case Opcode::FrameAlloca: {
+      uint32_t local_count = read_u32(&pc);
+      uint32_t max_stack_height = read_u32(&pc);
+      uint32_t fuel_cost = read_u32(&pc);
+      uint32_t param_count = read_u32(&pc);
+      stream->Writef("%s $%u, $%u, $%u, $%u\n", name, local_count,
+                     max_stack_height, fuel_cost, param_count);
+      break;
+    }
 
-      case Opcode::I32Rotl:
-        BINOP_ROT(I32, LEFT);
-        break;
+    case Opcode::I32Const:
+    case Opcode::F32Const: {
+      uint32_t value = read_u32(&pc);
+      if (opcode == Opcode::I32Const)
+        stream->Writef("%s $%u", name, value);
+      else
+        stream->Writef("%s $%g", name, bitcast_u32_to_f32(value));
+      stream->Writef(" => r%u\n", read_u32(&pc));
+      break;
+    }
 
-      case Opcode::I64Rotr:
-        BINOP_ROT(I64, RIGHT);
-        break;
+    case Opcode::I64Const:
+    case Opcode::F64Const: {
+      uint64_t value = read_u64(&pc);
+      if (opcode == Opcode::I64Const)
+        stream->Writef("%s $%" PRIu64, name, value);
+      else
+        stream->Writef("%s $%g", name, bitcast_u64_to_f64(value));
+      stream->Writef(" => r%u\n", read_u32(&pc));
+      break;
+    }
 
-      case Opcode::I64Rotl:
-        BINOP_ROT(I64, LEFT);
-        break;
+    case Opcode::GetGlobal:
+    case Opcode::CurrentMemory: {
+      uint32_t index = read_u32(&pc);
+      stream->Writef("%s $%u => r%u\n", name, index, read_u32(&pc));
+      break;
+    }
 
-      case Opcode::I64Eqz: {
-        VALUE_TYPE_I64 value = POP_I64();
-        PUSH_I64(value == 0);
-        break;
-      }
+    case Opcode::SetGlobal: {
+      uint32_t index = read_u32(&pc);
+      stream->Writef("%s $%u, r%u\n", name, index, read_u32(&pc));
+      break;
+    }
 
-      case Opcode::Alloca: {
-        Value* old_value_stack_top = thread->value_stack_top;
-        thread->value_stack_top += read_u32(&pc);
-        CHECK_STACK();
-        memset(old_value_stack_top, 0,
-               (thread->value_stack_top - old_value_stack_top) * sizeof(Value));
-        break;
-      }
+    case Opcode::GrowMemory: {
+      Index memory_index = read_u32(&pc);
+      uint32_t pages = read_u32(&pc);
+      stream->Writef("%s $%" PRIindex ":r%u => r%u\n", name, memory_index,
+                     pages, read_u32(&pc));
+      break;
+    }
 
-      case Opcode::BrUnless: {
-        IstreamOffset new_pc = read_u32(&pc);
-        if (!POP_I32())
-          GOTO(new_pc);
-        break;
-      }
+    case Opcode::Move: {
+      uint32_t src = read_u32(&pc);
+      stream->Writef("%s r%u => r%u\n", name, src, read_u32(&pc));
+      break;
+    }
 
-      case Opcode::Drop:
-        (void)POP();
-        break;
+    case Opcode::RegI32AddImm:
+    case Opcode::RegI32SubImm:
+    case Opcode::RegI32MulImm:
+    case Opcode::RegI32AndImm:
+    case Opcode::RegI32OrImm:
+    case Opcode::RegI32XorImm:
+    case Opcode::RegI32ShlImm:
+    case Opcode::RegI32ShrSImm:
+    case Opcode::RegI32ShrUImm: {
+      uint32_t lhs = read_u32(&pc);
+      uint32_t imm = read_u32(&pc);
+      stream->Writef("%s r%u, $%u => r%u\n", name, lhs, imm, read_u32(&pc));
+      break;
+    }
 
-      case Opcode::DropKeep: {
-        uint32_t drop_count = read_u32(&pc);
-        uint8_t keep_count = *pc++;
-        DROP_KEEP(drop_count, keep_count);
-        break;
+    case Opcode::Data: {
+      /* the only data in register code is the table of a br_table, which
+       * only holds the offsets */
+      uint32_t num_bytes = read_u32(&pc);
+      stream->Writef("%s $%u\n", name, num_bytes);
+      const uint8_t* end = pc + num_bytes;
+      IstreamOffset table_offset = pc - istream;
+      table_offset = (table_offset + WABT_TABLE_ALIGNMENT - 1) &
+                     ~(WABT_TABLE_ALIGNMENT - 1);
+      const uint8_t* offsets = istream + table_offset;
+      for (Index i = 0; offsets + (i + 1) * sizeof(IstreamOffset) <= end;
+           ++i) {
+        stream->Writef("%4" PRIzd "| ",
+                       offsets + i * sizeof(IstreamOffset) - istream);
+        stream->Writef("  entry %" PRIindex ": offset: %u\n", i,
+                       read_u32_at(offsets + i * sizeof(IstreamOffset)));
       }
+      pc = end;
+      break;
+    }
 
-      case Opcode::Data:
-        /* shouldn't ever execute this */
-        assert(0);
-        break;
+    case Opcode::I32Load8S:
+    case Opcode::I32Load8U:
+    case Opcode::I32Load16S:
+    case Opcode::I32Load16U:
+    case Opcode::I64Load8S:
+    case Opcode::I64Load8U:
+    case Opcode::I64Load16S:
+    case Opcode::I64Load16U:
+    case Opcode::I64Load32S:
+    case Opcode::I64Load32U:
+    case Opcode::I32Load:
+    case Opcode::I64Load:
+    case Opcode::F32Load:
+    case Opcode::F64Load: {
+      Index memory_index = read_u32(&pc);
+      uint32_t addr = read_u32(&pc);
+      uint32_t addr_offset = read_u32(&pc);
+      stream->Writef("%s $%" PRIindex ":r%u+$%u => r%u\n", name,
+                     memory_index, addr, addr_offset, read_u32(&pc));
+      break;
+    }
 
-      case Opcode::Nop:
-        break;
+    case Opcode::I32Store8:
+    case Opcode::I32Store16:
+    case Opcode::I32Store:
+    case Opcode::I64Store8:
+    case Opcode::I64Store16:
+    case Opcode::I64Store32:
+    case Opcode::I64Store:
+    case Opcode::F32Store:
+    case Opcode::F64Store: {
+      Index memory_index = read_u32(&pc);
+      uint32_t value = read_u32(&pc);
+      uint32_t addr = read_u32(&pc);
+      stream->Writef("%s $%" PRIindex ":r%u+$%u, r%u\n", name, memory_index,
+                     addr, read_u32(&pc), value);
+      break;
+    }
 
-      default:
-        assert(0);
-        break;
+    case Opcode::I32Add:
+    case Opcode::I32Sub:
+    case Opcode::I32Mul:
+    case Opcode::I32DivS:
+    case Opcode::I32DivU:
+    case Opcode::I32RemS:
+    case Opcode::I32RemU:
+    case Opcode::I32And:
+    case Opcode::I32Or:
+    case Opcode::I32Xor:
+    case Opcode::I32Shl:
+    case Opcode::I32ShrU:
+    case Opcode::I32ShrS:
+    case Opcode::I32Eq:
+    case Opcode::I32Ne:
+    case Opcode::I32LtS:
+    case Opcode::I32LeS:
+    case Opcode::I32LtU:
+    case Opcode::I32LeU:
+    case Opcode::I32GtS:
+    case Opcode::I32GeS:
+    case Opcode::I32GtU:
+    case Opcode::I32GeU:
+    case Opcode::I32Rotr:
+    case Opcode::I32Rotl:
+    case Opcode::F32Add:
+    case Opcode::F32Sub:
+    case Opcode::F32Mul:
+    case Opcode::F32Div:
+    case Opcode::F32Min:
+    case Opcode::F32Max:
+    case Opcode::F32Copysign:
+    case Opcode::F32Eq:
+    case Opcode::F32Ne:
+    case Opcode::F32Lt:
+    case Opcode::F32Le:
+    case Opcode::F32Gt:
+    case Opcode::F32Ge:
+    case Opcode::I64Add:
+    case Opcode::I64Sub:
+    case Opcode::I64Mul:
+    case Opcode::I64DivS:
+    case Opcode::I64DivU:
+    case Opcode::I64RemS:
+    case Opcode::I64RemU:
+    case Opcode::I64And:
+    case Opcode::I64Or:
+    case Opcode::I64Xor:
+    case Opcode::I64Shl:
+    case Opcode::I64ShrU:
+    case Opcode::I64ShrS:
+    case Opcode::I64Eq:
+    case Opcode::I64Ne:
+    case Opcode::I64LtS:
+    case Opcode::I64LeS:
+    case Opcode::I64LtU:
+    case Opcode::I64LeU:
+    case Opcode::I64GtS:
+    case Opcode::I64GeS:
+    case Opcode::I64GtU:
+    case Opcode::I64GeU:
+    case Opcode::I64Rotr:
+    case Opcode::I64Rotl:
+    case Opcode::F64Add:
+    case Opcode::F64Sub:
+    case Opcode::F64Mul:
+    case Opcode::F64Div:
+    case Opcode::F64Min:
+    case Opcode::F64Max:
+    case Opcode::F64Copysign:
+    case Opcode::F64Eq:
+    case Opcode::F64Ne:
+    case Opcode::F64Lt:
+    case Opcode::F64Le:
+    case Opcode::F64Gt:
+    case Opcode::F64Ge:
+    {
+      uint32_t rhs = read_u32(&pc);
+      uint32_t lhs = read_u32(&pc);
+      stream->Writef("%s r%u, r%u => r%u\n", name, lhs, rhs, read_u32(&pc));
+      break;
     }
-  }
 
-exit_loop:
-  thread->pc = pc - istream;
-  return result;
+    case Opcode::I32Clz:
+    case Opcode::I32Ctz:
+    case Opcode::I32Popcnt:
+    case Opcode::I32Eqz:
+    case Opcode::I64Clz:
+    case Opcode::I64Ctz:
+    case Opcode::I64Popcnt:
+    case Opcode::I64Eqz:
+    case Opcode::F32Abs:
+    case Opcode::F32Neg:
+    case Opcode::F32Ceil:
+    case Opcode::F32Floor:
+    case Opcode::F32Trunc:
+    case Opcode::F32Nearest:
+    case Opcode::F32Sqrt:
+    case Opcode::F64Abs:
+    case Opcode::F64Neg:
+    case Opcode::F64Ceil:
+    case Opcode::F64Floor:
+    case Opcode::F64Trunc:
+    case Opcode::F64Nearest:
+    case Opcode::F64Sqrt:
+    case Opcode::I32TruncSF32:
+    case Opcode::I32TruncUF32:
+    case Opcode::I64TruncSF32:
+    case Opcode::I64TruncUF32:
+    case Opcode::F64PromoteF32:
+    case Opcode::I32ReinterpretF32:
+    case Opcode::I32TruncSF64:
+    case Opcode::I32TruncUF64:
+    case Opcode::I64TruncSF64:
+    case Opcode::I64TruncUF64:
+    case Opcode::F32DemoteF64:
+    case Opcode::I64ReinterpretF64:
+    case Opcode::I32WrapI64:
+    case Opcode::F32ConvertSI64:
+    case Opcode::F32ConvertUI64:
+    case Opcode::F64ConvertSI64:
+    case Opcode::F64ConvertUI64:
+    case Opcode::F64ReinterpretI64:
+    case Opcode::I64ExtendSI32:
+    case Opcode::I64ExtendUI32:
+    case Opcode::F32ConvertSI32:
+    case Opcode::F32ConvertUI32:
+    case Opcode::F32ReinterpretI32:
+    case Opcode::F64ConvertSI32:
+    case Opcode::F64ConvertUI32:
+    {
+      uint32_t src = read_u32(&pc);
+      stream->Writef("%s r%u => r%u\n", name, src, read_u32(&pc));
+      break;
+    }
+
+    default:
+      /* stack code only */
+      assert(0);
+      break;
+  }
+  return pc - istream;
 }
 
 void trace_pc(Thread* thread, Stream* stream) {
   const uint8_t* istream = thread->env->istream->data.data();
   const uint8_t* pc = &istream[thread->pc];
+  if (thread->env->register_machine) {
+    /* Register code has no value stack to show, so this shows where the
+     * frame is. */
+    size_t call_stack_depth =
+        thread->call_stack_top - thread->call_stack.data();
+    stream->Writef("#%" PRIzd ". %4u: F:%-3" PRIzd "| ", call_stack_depth,
+                   thread->pc,
+                   static_cast<size_t>(thread->frame -
+                                       thread->value_stack.data()));
+    write_register_instr(stream, istream, thread->pc);
+    return;
+  }
   size_t value_stack_depth =
       thread->value_stack_top - thread->value_stack.data();
   size_t call_stack_depth = thread->call_stack_top - thread->call_stack.data();
@@ -1703,6 +2524,16 @@ void trace_pc(Thread* thread, Stream* stream) {
       break;
 
     case Opcode::BrTable: {
+      Index num_targets = read_u32_at(pc);
+      IstreamOffset table_offset = read_u32_at(pc + 4);
+      VALUE_TYPE_I32 key = TOP().i32;
+      stream->Writef("%s %u, $#%" PRIindex ", table:$%u, $%u $%u\n",
+                     get_opcode_name(opcode), key, num_targets, table_offset,
+                     read_u32_at(pc + 8), *(pc + 12));
+      break;
+    }
+
+    case Opcode::BrTableDropKeep: {
       Index num_targets = read_u32_at(pc);
       IstreamOffset table_offset = read_u32_at(pc + 4);
       VALUE_TYPE_I32 key = TOP().i32;
@@ -2002,9 +2833,39 @@ void trace_pc(Thread* thread, Stream* stream) {
       break;
 
     case Opcode::Alloca:
+      stream->Writef("%s $%u, $%u, $%u\n", get_opcode_name(opcode),
+                     read_u32_at(pc), read_u32_at(pc + 4), read_u32_at(pc + 8));
+      break;
+
+    case Opcode::ChargeFuel:
+      stream->Writef("%s $%u\n", get_opcode_name(opcode), read_u32_at(pc));
+      break;
+
+    case Opcode::CompileFunc:
+      stream->Writef("%s $%u\n", get_opcode_name(opcode), read_u32_at(pc));
+      break;
+
+    case Opcode::FrameAlloca:
+      stream->Writef("%s $%u, $%u, $%u, $%u\n", get_opcode_name(opcode),
+                     read_u32_at(pc), read_u32_at(pc + 4), read_u32_at(pc + 8),
+                     read_u32_at(pc + 12));
+      break;
+
+    case Opcode::FrameGetLocal:
       stream->Writef("%s $%u\n", get_opcode_name(opcode), read_u32_at(pc));
       break;
 
+    case Opcode::FrameSetLocal:
+    case Opcode::FrameTeeLocal:
+      stream->Writef("%s $%u, %u\n", get_opcode_name(opcode), read_u32_at(pc),
+                     TOP().i32);
+      break;
+
+    case Opcode::FrameReturn:
+      stream->Writef("%s $%u, $%u $%u\n", get_opcode_name(opcode),
+                     read_u32_at(pc), read_u32_at(pc + 4), *(pc + 8));
+      break;
+
     case Opcode::BrUnless:
       stream->Writef("%s @%u, %u\n", get_opcode_name(opcode), read_u32_at(pc),
                      TOP().i32);
@@ -2015,6 +2876,30 @@ void trace_pc(Thread* thread, Stream* stream) {
                      *(pc + 4));
       break;
 
+    case Opcode::I32AddLocalLocal: {
+      uint32_t lhs_depth = read_u32_at(pc);
+      uint32_t rhs_depth = read_u32_at(pc + 4);
+      stream->Writef("%s $%u, $%u (%u, %u)\n", get_opcode_name(opcode),
+                     lhs_depth, rhs_depth, PICK(lhs_depth).i32,
+                     PICK(rhs_depth).i32);
+      break;
+    }
+
+    case Opcode::I32AddLocalConst: {
+      uint32_t depth = read_u32_at(pc);
+      stream->Writef("%s $%u, $%u (%u)\n", get_opcode_name(opcode), depth,
+                     read_u32_at(pc + 4), PICK(depth).i32);
+      break;
+    }
+
+    case Opcode::I32LoadLocal: {
+      Index memory_index = read_u32(&pc);
+      uint32_t depth = read_u32(&pc);
+      stream->Writef("%s $%" PRIindex ":$%u(%u)+$%u\n", get_opcode_name(opcode),
+                     memory_index, depth, PICK(depth).i32, read_u32_at(pc));
+      break;
+    }
+
     case Opcode::Data:
       /* shouldn't ever execute this */
       assert(0);
@@ -2036,7 +2921,18 @@ void disassemble(Environment* env,
     return;
   to = std::min<IstreamOffset>(to, env->istream->data.size());
   const uint8_t* istream = env->istream->data.data();
+  if (env->register_machine) {
+    for (IstreamOffset offset = from; offset < to;) {
+      stream->Writef("%4u| ", offset);
+      offset = write_register_instr(stream, istream, offset);
+    }
+    return;
+  }
   const uint8_t* pc = &istream[from];
+  /* the shape of the table in the data that follows a br_table */
+  Index num_table_entries = 0;
+  IstreamOffset table_offset = kInvalidIstreamOffset;
+  bool table_has_drop_keep = false;
 
   while (static_cast<IstreamOffset>(pc - istream) < to) {
     stream->Writef("%4" PRIzd "| ", pc - istream);
@@ -2056,11 +2952,20 @@ void disassemble(Environment* env,
                        read_u32(&pc));
         break;
 
-      case Opcode::BrTable: {
+      case Opcode::BrTable:
+      case Opcode::BrTableDropKeep: {
         Index num_targets = read_u32(&pc);
-        IstreamOffset table_offset = read_u32(&pc);
-        stream->Writef("%s %%[-1], $#%" PRIindex ", table:$%u\n",
+        num_table_entries = num_targets + 1;
+        table_offset = read_u32(&pc);
+        table_has_drop_keep = opcode == Opcode::BrTableDropKeep;
+        stream->Writef("%s %%[-1], $#%" PRIindex ", table:$%u",
                        get_opcode_name(opcode), num_targets, table_offset);
+        if (!table_has_drop_keep) {
+          uint32_t drop = read_u32(&pc);
+          uint8_t keep = *pc++;
+          stream->Writef(", $%u $%u", drop, keep);
+        }
+        stream->Writef("\n");
         break;
       }
 
@@ -2295,10 +3200,49 @@ void disassemble(Environment* env,
         break;
       }
 
-      case Opcode::Alloca:
+      case Opcode::Alloca: {
+        uint32_t local_count = read_u32(&pc);
+        uint32_t max_stack_height = read_u32(&pc);
+        uint32_t fuel_cost = read_u32(&pc);
+        stream->Writef("%s $%u, $%u, $%u\n", get_opcode_name(opcode),
+                       local_count, max_stack_height, fuel_cost);
+        break;
+      }
+
+      case Opcode::ChargeFuel:
+      case Opcode::CompileFunc:
         stream->Writef("%s $%u\n", get_opcode_name(opcode), read_u32(&pc));
         break;
 
+      case Opcode::FrameAlloca: {
+        uint32_t local_count = read_u32(&pc);
+        uint32_t max_stack_height = read_u32(&pc);
+        uint32_t fuel_cost = read_u32(&pc);
+        uint32_t param_count = read_u32(&pc);
+        stream->Writef("%s $%u, $%u, $%u, $%u\n", get_opcode_name(opcode),
+                       local_count, max_stack_height, fuel_cost, param_count);
+        break;
+      }
+
+      case Opcode::FrameGetLocal:
+        stream->Writef("%s $%u\n", get_opcode_name(opcode), read_u32(&pc));
+        break;
+
+      case Opcode::FrameSetLocal:
+      case Opcode::FrameTeeLocal:
+        stream->Writef("%s $%u, %%[-1]\n", get_opcode_name(opcode),
+                       read_u32(&pc));
+        break;
+
+      case Opcode::FrameReturn: {
+        uint32_t frame_slot = read_u32(&pc);
+        uint32_t drop = read_u32(&pc);
+        uint8_t keep = *pc++;
+        stream->Writef("%s $%u, $%u $%u\n", get_opcode_name(opcode),
+                       frame_slot, drop, keep);
+        break;
+      }
+
       case Opcode::BrUnless:
         stream->Writef("%s @%u, %%[-1]\n", get_opcode_name(opcode),
                        read_u32(&pc));
@@ -2311,29 +3255,50 @@ void disassemble(Environment* env,
         break;
       }
 
+      case Opcode::I32AddLocalLocal:
+      case Opcode::I32AddLocalConst: {
+        uint32_t lhs = read_u32(&pc);
+        uint32_t rhs = read_u32(&pc);
+        stream->Writef("%s $%u, $%u\n", get_opcode_name(opcode), lhs, rhs);
+        break;
+      }
+
+      case Opcode::I32LoadLocal: {
+        Index memory_index = read_u32(&pc);
+        uint32_t depth = read_u32(&pc);
+        stream->Writef("%s $%" PRIindex ":$%u+$%u\n", get_opcode_name(opcode),
+                       memory_index, depth, read_u32(&pc));
+        break;
+      }
+
       case Opcode::Data: {
         uint32_t num_bytes = read_u32(&pc);
         stream->Writef("%s $%u\n", get_opcode_name(opcode), num_bytes);
+        const uint8_t* end = pc + num_bytes;
         /* for now, the only reason this is emitted is for br_table, so display
          * it as a list of table entries */
-        if (num_bytes % WABT_TABLE_ENTRY_SIZE == 0) {
-          Index num_entries = num_bytes / WABT_TABLE_ENTRY_SIZE;
-          for (Index i = 0; i < num_entries; ++i) {
-            stream->Writef("%4" PRIzd "| ", pc - istream);
-            IstreamOffset offset;
-            uint32_t drop;
-            uint8_t keep;
-            read_table_entry_at(pc, &offset, &drop, &keep);
-            stream->Writef("  entry %" PRIindex
-                           ": offset: %u drop: %u keep: %u\n",
-                           i, offset, drop, keep);
-            pc += WABT_TABLE_ENTRY_SIZE;
+        if (table_offset != kInvalidIstreamOffset &&
+            istream + table_offset >= pc && istream + table_offset < end) {
+          const uint8_t* offsets = istream + table_offset;
+          const uint8_t* drop_counts =
+              offsets + num_table_entries * sizeof(IstreamOffset);
+          const uint8_t* keep_counts =
+              drop_counts + num_table_entries * sizeof(uint32_t);
+          for (Index i = 0; i < num_table_entries; ++i) {
+            stream->Writef("%4" PRIzd "| ",
+                           offsets + i * sizeof(IstreamOffset) - istream);
+            stream->Writef("  entry %" PRIindex ": offset: %u", i,
+                           read_u32_at(offsets + i * sizeof(IstreamOffset)));
+            if (table_has_drop_keep) {
+              stream->Writef(" drop: %u keep: %u",
+                             read_u32_at(drop_counts + i * sizeof(uint32_t)),
+                             keep_counts[i]);
+            }
+            stream->Writef("\n");
           }
-        } else {
-          /* just skip those data bytes */
-          pc += num_bytes;
         }
-
+        table_offset = kInvalidIstreamOffset;
+        pc = end;
         break;
       }
 
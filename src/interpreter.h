@@ -19,7 +19,13 @@
 
 #include <stdint.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <map>
 #include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "common.h"
@@ -62,6 +68,12 @@ namespace interpreter {
   V(TrapHostResultTypeMismatch, "host result type mismatch")                \
   /* we called an import function, but it didn't complete succesfully */    \
   V(TrapHostTrapped, "host function trapped")                               \
+  /* the thread ran out of fuel; it can be resumed after adding more */     \
+  V(FuelExhausted, "fuel exhausted")                                        \
+  /* the thread's interrupt flag was set; it can be resumed */              \
+  V(Interrupted, "interrupted")                                             \
+  /* a function compiled on its first call failed to validate */            \
+  V(InvalidFunction, "invalid function")                                    \
   /* we attempted to call a function with the an argument list that doesn't \
    * match the function signature */                                        \
   V(ArgumentTypeMismatch, "argument type mismatch")                         \
@@ -79,18 +91,16 @@ enum class Result {
 typedef uint32_t IstreamOffset;
 static const IstreamOffset kInvalidIstreamOffset = ~0;
 
-// A table entry has the following packed layout:
+// The table of a br_table with N targets and a default target is stored as
+// parallel arrays, starting at an offset aligned to WABT_TABLE_ALIGNMENT:
 //
-//   struct {
-//     IstreamOffset offset;
-//     uint32_t drop_count;
-//     uint8_t keep_count;
-//   };
-#define WABT_TABLE_ENTRY_SIZE \
-  (sizeof(IstreamOffset) + sizeof(uint32_t) + sizeof(uint8_t))
-#define WABT_TABLE_ENTRY_OFFSET_OFFSET 0
-#define WABT_TABLE_ENTRY_DROP_OFFSET sizeof(uint32_t)
-#define WABT_TABLE_ENTRY_KEEP_OFFSET (sizeof(IstreamOffset) + sizeof(uint32_t))
+//   IstreamOffset offsets[N + 1];
+//   uint32_t drop_counts[N + 1];  /* br_table.drop_keep only */
+//   uint8_t keep_counts[N + 1];   /* br_table.drop_keep only */
+//
+// A br_table whose targets all drop and keep the same number of values holds
+// the counts as immediates instead.
+#define WABT_TABLE_ALIGNMENT sizeof(IstreamOffset)
 
 enum class Opcode {
 /* push space on the value stack for N entries */
@@ -100,30 +110,115 @@ enum class Opcode {
 #undef WABT_OPCODE
 
   First = static_cast<int>(::wabt::Opcode::First),
-  Last = DropKeep,
+  Last = BrTableDropKeep,
 };
 static const int kOpcodeCount = WABT_ENUM_COUNT(Opcode);
 
 struct FuncSignature {
+  FuncSignature() : id(kInvalidIndex) {}
+
   std::vector<Type> param_types;
   std::vector<Type> result_types;
+  /* the index of the first signature in the Environment with the same types,
+   * so two signatures are equal if their ids are; set by
+   * intern_func_signature */
+  Index id;
+};
+
+/* A table element. The id of the function's signature is stored with it so
+ * call_indirect can check it without loading the function. */
+struct TableEntry {
+  TableEntry() : func_index(kInvalidIndex), sig_id(kInvalidIndex) {}
+
+  Index func_index;
+  Index sig_id;
 };
 
 struct Table {
   explicit Table(const Limits& limits)
-      : limits(limits), func_indexes(limits.initial, kInvalidIndex) {}
+      : limits(limits), entries(limits.initial) {}
 
   Limits limits;
-  std::vector<Index> func_indexes;
+  std::vector<TableEntry> entries;
+};
+
+/* When guard pages are used, memory accesses aren't bounds checked. Instead,
+ * each memory reserves enough address space for any i32 address plus offset,
+ * and only the accessible size is mapped readable and writable. An access past
+ * that faults, and the fault is turned into TrapMemoryAccessOutOfBounds by
+ * run_interpreter. */
+#if WITH_MEMORY_GUARD_PAGES && HAVE_MMAP && HAVE_SIGACTION && \
+    SIZEOF_SIZE_T >= 8
+#define WABT_INTERPRETER_GUARD_PAGES 1
+#else
+#define WABT_INTERPRETER_GUARD_PAGES 0
+#endif
+
+/* The baseline JIT emits x86-64 code for the System V calling convention. */
+#if WITH_JIT && HAVE_MMAP && defined(__x86_64__) && !defined(_WIN32)
+#define WABT_INTERPRETER_JIT 1
+#else
+#define WABT_INTERPRETER_JIT 0
+#endif
+
+/* The storage for a linear memory. This has the same interface as the
+ * std::vector<char> it replaces, but resize can fail and returns false.
+ *
+ * Where mmap is available, the address space for the maximum size of the
+ * memory is reserved on the first resize, and resizing only changes how much
+ * of it is readable and writable. Growing never copies, pointers into the
+ * memory stay valid, and the kernel zeroes new pages lazily. If the
+ * reservation fails (e.g. in a 32-bit process), this falls back to a calloc'd
+ * block, which is also zeroed lazily for large memories. */
+class MemoryData {
+ public:
+  MemoryData();
+  MemoryData(size_t size, uint64_t max_size);
+  MemoryData(const MemoryData&) = delete;
+  MemoryData(MemoryData&&) noexcept;
+  MemoryData& operator=(const MemoryData&) = delete;
+  MemoryData& operator=(MemoryData&&) noexcept;
+  ~MemoryData();
+
+  char* data() { return data_; }
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  bool resize(size_t new_size);
+
+  char& operator[](size_t index) { return data_[index]; }
+  const char& operator[](size_t index) const { return data_[index]; }
+
+#if WABT_INTERPRETER_GUARD_PAGES
+  /* whether |address| is in the address space reserved for this memory */
+  bool IsReservedAddress(const void* address) const;
+#endif
+
+#if HAVE_MEMFD_CREATE
+  /* Maps the first |size| bytes of the file |fd| over the start of the
+   * memory, copy-on-write, and makes that the memory's size. Returns false if
+   * the memory isn't in a reservation, or |size| is less than its size. */
+  bool MapCopyOnWrite(int fd, size_t size);
+#endif
+
+ private:
+  bool Reserve(uint64_t size);
+
+  char* data_ = nullptr;
+  size_t size_ = 0;
+  size_t reserved_size_ = 0;
+  uint64_t max_size_ = 0;
 };
 
 struct Memory {
   Memory() { WABT_ZERO_MEMORY(page_limits); }
   explicit Memory(const Limits& limits)
-      : page_limits(limits), data(limits.initial * WABT_PAGE_SIZE) {}
+      : page_limits(limits),
+        data(limits.initial * WABT_PAGE_SIZE,
+             (limits.has_max ? limits.max : WABT_MAX_PAGES) *
+                 static_cast<uint64_t>(WABT_PAGE_SIZE)) {}
 
   Limits page_limits;
-  std::vector<char> data;
+  MemoryData data;
 };
 
 union Value {
@@ -142,6 +237,8 @@ struct TypedValue {
   Value value;
 };
 
+/* The type of a global and the value it was initialized with. While code
+ * runs, the current value is in Instance::global_values. */
 struct Global {
   Global() : mutable_(false), import_index(kInvalidIndex) {}
   Global(const TypedValue& typed_value, bool mutable_)
@@ -176,6 +273,8 @@ struct Import {
 };
 
 struct Func;
+struct Thread;
+struct TraceBuffer;
 
 typedef Result (*HostFuncCallback)(const struct HostFunc* func,
                                    const FuncSignature* sig,
@@ -185,6 +284,12 @@ typedef Result (*HostFuncCallback)(const struct HostFunc* func,
                                    TypedValue* out_results,
                                    void* user_data);
 
+/* Called instead of a HostFuncCallback for functions bound with
+ * bind_host_func; it takes the params from the value stack and pushes the
+ * result itself. */
+typedef Result (*HostFuncTrampoline)(Thread* thread,
+                                     const struct HostFunc* func);
+
 struct Func {
   WABT_DISALLOW_COPY_AND_ASSIGN(Func);
   Func(Index sig_index, bool is_host)
@@ -203,12 +308,42 @@ struct DefinedFunc : Func {
       : Func(sig_index, false),
         offset(kInvalidIstreamOffset),
         local_decl_count(0),
-        local_count(0) {}
+        local_count(0),
+        max_stack_height(0),
+        call_count(0),
+        jit_code(nullptr),
+        jit_failed(false),
+        lazy_module(nullptr),
+        lazy_func_index(kInvalidIndex),
+        lazy_stub_offset(kInvalidIstreamOffset) {}
+
+  /* whether calls still go through the stub that compiles the function */
+  bool is_lazy_stub() const {
+    return lazy_module && offset == lazy_stub_offset;
+  }
 
   IstreamOffset offset;
   Index local_decl_count;
   Index local_count;
+  /* the maximum number of operands on the value stack, not including params
+   * and locals; this is checked once in the function's alloca. */
+  Index max_stack_height;
   std::vector<Type> param_and_local_types;
+  /* the number of times the function has been called from outside the
+   * interpreter, used to decide when to compile it */
+  std::atomic<uint32_t> call_count;
+  /* the entry point of the function's machine code, set by jit_compile */
+  std::atomic<void*> jit_code;
+  /* whether jit_compile has already failed for this function */
+  bool jit_failed;
+  /* from the names section, if the module had one and it was read */
+  std::string name;
+  /* For a function of a module loaded with lazy compilation, the module and
+   * the function's index in it. Until the function is compiled by
+   * compile_lazy_function, |offset| is the stub at |lazy_stub_offset|. */
+  struct DefinedModule* lazy_module;
+  Index lazy_func_index;
+  IstreamOffset lazy_stub_offset;
 };
 
 struct HostFunc : Func {
@@ -217,12 +352,20 @@ struct HostFunc : Func {
            Index sig_index)
       : Func(sig_index, true),
         module_name(module_name),
-        field_name(field_name) {}
+        field_name(field_name),
+        callback(nullptr),
+        user_data(nullptr),
+        trampoline(nullptr),
+        native_func(nullptr) {}
 
   StringSlice module_name;
   StringSlice field_name;
   HostFuncCallback callback;
   void* user_data;
+  /* if set, used instead of |callback| */
+  HostFuncTrampoline trampoline;
+  /* the C++ function called by |trampoline| */
+  void (*native_func)();
 };
 
 DefinedFunc* Func::as_defined() {
@@ -290,13 +433,35 @@ struct Module {
   bool is_host;
 };
 
+/* What's needed to compile the functions of a module loaded with
+ * ReadBinaryInterpreterOptions::lazy_compile when they're first called: a
+ * copy of the module's binary, and how its indexes map to the
+ * Environment's. */
+struct LazyModule {
+  std::vector<uint8_t> binary;
+  /* where the body of each function defined by the module starts */
+  std::vector<Offset> body_offsets;
+  std::vector<Index> sig_index_mapping;
+  std::vector<Index> func_index_mapping;
+  std::vector<Index> global_index_mapping;
+  std::vector<bool> constant_globals;
+  Index num_func_imports;
+  Index num_global_imports;
+  bool register_machine;
+  bool frame_locals;
+};
+
 struct DefinedModule : Module {
   explicit DefinedModule(size_t istream_start);
 
   std::vector<Import> imports;
   Index start_func_index; /* kInvalidIndex if not defined */
+  /* The code of the functions compiled when the module was loaded. Functions
+   * compiled lazily are appended to the end of the istream instead. */
   size_t istream_start;
   size_t istream_end;
+  /* set if the module was loaded with lazy compilation */
+  std::unique_ptr<LazyModule> lazy;
 };
 
 struct HostModule : Module {
@@ -326,31 +491,118 @@ struct EnvironmentMark {
   size_t istream_size;
 };
 
+/* The mutable state of the modules in an Environment: their memories, tables
+ * and globals. Loading a module initializes its state in the Environment's
+ * own instance. Threads can run the same code concurrently if each one has
+ * its own copy, made by init_instance or init_instance_from_snapshot after
+ * the modules are loaded. */
+struct Instance {
+  std::vector<Memory> memories;
+  std::vector<Table> tables;
+  /* the current value of each of Environment::globals */
+  std::vector<Value> global_values;
+};
+
+/* The state of an Instance, saved so that new instances can be made from it
+ * without running data segments, element segments or start functions again.
+ * Where memfd_create is available, each memory's contents are kept in a
+ * sealed memfd that new instances map MAP_PRIVATE, so a page is only copied
+ * when an instance writes to it. */
+struct InstanceSnapshot {
+  struct MemoryImage {
+    Limits page_limits;
+    size_t size;
+    /* the memfd holding the contents, or -1 if they are in |data| */
+    int fd;
+    std::vector<char> data;
+  };
+
+  InstanceSnapshot() = default;
+  InstanceSnapshot(const InstanceSnapshot&) = delete;
+  InstanceSnapshot& operator=(const InstanceSnapshot&) = delete;
+  ~InstanceSnapshot();
+
+  std::vector<MemoryImage> memories;
+  std::vector<Table> tables;
+  std::vector<Value> global_values;
+};
+
+/* The code of the loaded modules, which doesn't change while it runs. */
 struct Environment {
   Environment();
+  ~Environment();
+
+  /* the memories, tables and globals made by loading the modules */
+  Instance instance;
 
   std::vector<std::unique_ptr<Module>> modules;
   std::vector<FuncSignature> sigs;
+  /* maps the param and result types of each distinct signature to its id */
+  std::map<std::pair<std::vector<Type>, std::vector<Type>>, Index> sig_ids;
   std::vector<std::unique_ptr<Func>> funcs;
-  std::vector<Memory> memories;
-  std::vector<Table> tables;
   std::vector<Global> globals;
   std::unique_ptr<OutputBuffer> istream;
   BindingHash module_bindings;
   BindingHash registered_module_bindings;
+  /* Set if the modules were loaded with
+   * ReadBinaryInterpreterOptions::register_machine, so the istream holds
+   * register code, which run_interpreter runs with the register loop. */
+  bool register_machine = false;
+  /* the executable mappings holding functions compiled by jit_compile */
+  std::vector<std::pair<void*, size_t>> jit_mappings;
+};
+
+#if WITH_OPCODE_COUNTS
+/* How often each opcode ran, counted by run_interpreter. Opcodes are indexed
+ * by their value. */
+struct OpcodeCounts {
+  OpcodeCounts();
+
+  uint64_t opcodes[kOpcodeCount];
+  /* pairs[a][b] is the number of times b ran right after a */
+  uint64_t pairs[kOpcodeCount][kOpcodeCount];
+  /* for br_if and br_unless */
+  uint64_t branches_taken[kOpcodeCount];
+  uint64_t branches_not_taken[kOpcodeCount];
+  /* the opcode that ran last, or -1 */
+  int last_opcode;
 };
+#endif
 
 struct Thread {
   Thread();
 
   Environment* env;
+  /* the memories, tables and globals the thread uses; &env->instance by
+   * default */
+  Instance* instance;
   std::vector<Value> value_stack;
   std::vector<IstreamOffset> call_stack;
   Value* value_stack_top;
   Value* value_stack_end;
   IstreamOffset* call_stack_top;
   IstreamOffset* call_stack_end;
+  /* The params of the running function, followed by its locals, in register
+   * code and in a function compiled with frame_locals. frame_alloca sets it
+   * on entry and return or frame_return restores the caller's; other
+   * functions leave it alone. */
+  Value* frame;
   IstreamOffset pc;
+  /* Decreased by the cost of each function on entry, and of each loop body
+   * on every iteration; the cost is the number of instructions in it, not
+   * counting nested loops. When there isn't enough left, the thread stops
+   * with FuelExhausted before running the function or iteration. */
+  uint64_t fuel;
+  /* Set by another thread (or a signal handler) to stop this one with
+   * Interrupted at its next function entry or loop iteration. It is cleared
+   * when the thread stops. */
+  std::atomic<bool> interrupt;
+  /* If set, run_interpreter records each instruction in it before running
+   * it; see interpreter-trace.h. */
+  TraceBuffer* trace;
+#if WITH_OPCODE_COUNTS
+  std::unique_ptr<OpcodeCounts> opcode_counts;
+#endif
 };
 
 // TODO(binji): Remove and use default constructor.
@@ -370,6 +622,8 @@ bool is_canonical_nan_f32(uint32_t f32_bits);
 bool is_canonical_nan_f64(uint64_t f64_bits);
 bool is_arithmetic_nan_f32(uint32_t f32_bits);
 bool is_arithmetic_nan_f64(uint64_t f64_bits);
+/* Sets the id of the signature |sig_index|, once its types are known. */
+void intern_func_signature(Environment* env, Index sig_index);
 bool func_signatures_are_equal(Environment* env,
                                Index sig_index_0,
                                Index sig_index_1);
@@ -378,14 +632,44 @@ bool func_signatures_are_equal(Environment* env,
 void destroy_environment(Environment* env);
 EnvironmentMark mark_environment(Environment* env);
 void reset_environment_to_mark(Environment* env, EnvironmentMark mark);
+/* Whether a module compiled to register code, or to stack code if
+ * |register_machine| is false, can be added to |env|: the code of all of its
+ * modules is run by the same loop. */
+bool can_add_module_code(const Environment* env, bool register_machine);
+/* Sets the value of each global added to |env| since this was last called to
+ * the value it was initialized with. Called when a module is loaded. */
+void init_new_global_values(Environment* env);
 HostModule* append_host_module(Environment* env, StringSlice name);
 void init_thread(Environment* env, Thread* thread, ThreadOptions* options);
+void init_instance(const Environment* env, Instance* instance);
+void snapshot_instance(const Instance* instance, InstanceSnapshot* snapshot);
+void init_instance_from_snapshot(const InstanceSnapshot* snapshot,
+                                 Instance* instance);
 Result push_thread_value(Thread* thread, Value value);
 void destroy_thread(Thread* thread);
 Result call_host(Thread* thread, HostFunc* func);
-Result run_interpreter(Thread* thread,
-                       int num_instructions,
-                       IstreamOffset* call_stack_return_top);
+/* Runs the thread until the function that was called when the call stack
+ * top was |call_stack_return_top| returns, or until it traps or stops. A
+ * thread that stopped with FuelExhausted or Interrupted can be resumed by
+ * calling this again. */
+Result run_interpreter(Thread* thread, IstreamOffset* call_stack_return_top);
+/* Like run_interpreter, but runs a single instruction; returns Ok if the
+ * thread should continue. */
+Result step_interpreter(Thread* thread, IstreamOffset* call_stack_return_top);
+/* Compiles |func|, and every function it calls directly, to machine code.
+ * Returns false if the JIT isn't supported, if the environment holds register
+ * code, or if one of the functions uses an instruction the JIT doesn't handle;
+ * the function then keeps running in the interpreter. */
+bool jit_compile(Environment* env, DefinedFunc* func);
+/* Runs a function compiled by jit_compile to completion, with its arguments
+ * on the value stack. Traps produce the same results as run_interpreter. */
+Result jit_call(Thread* thread, DefinedFunc* func);
+#if WITH_OPCODE_COUNTS
+/* Writes one line per nonzero count: "opcode NAME COUNT",
+ * "pair NAME NAME COUNT" or "branch NAME TAKEN NOT_TAKEN". This is the
+ * format read by wasm-opcodecnt --dynamic. */
+void write_opcode_counts(const OpcodeCounts* counts, Stream* stream);
+#endif
 void trace_pc(Thread* thread, Stream* stream);
 void disassemble(Environment* env,
                  Stream* stream,
@@ -395,6 +679,200 @@ void disassemble_module(Environment* env, Stream* stream, Module* module);
 
 Export* get_export_by_name(Module* module, const StringSlice* name);
 
+/* An exported function resolved by prepare_call, so that run_prepared_calls
+ * can call it many times without looking it up or checking the types of its
+ * arguments each time. The types are those of the function's signature. */
+struct PreparedCall {
+  Func* func;
+  Index num_params;
+  Index num_results;
+};
+
+/* Resolves the function that |module| exports as |name|. Returns
+ * UnknownExport or ExportKindMismatch if there isn't one. */
+Result prepare_call(Environment* env,
+                    Module* module,
+                    const StringSlice* name,
+                    PreparedCall* out_call);
+/* Calls |call| |count| times on |thread|, in the interpreter or as compiled
+ * by jit_compile. The arguments and results are columnar: argument i of call
+ * n is args[i][n], and result i of call n is stored to results[i][n]. Stops
+ * at the first call that traps or stops, and returns why; |out_count| is set
+ * to the number of calls that returned. The calls share the thread's fuel,
+ * and the stacks are left as they were. */
+Result run_prepared_calls(Thread* thread,
+                          const PreparedCall* call,
+                          size_t count,
+                          const Value* const* args,
+                          Value* const* results,
+                          size_t* out_count);
+
+/* How a C++ type used by a host function bound with bind_host_func is passed
+ * as a wasm value. */
+template <typename T>
+struct HostValueTraits;
+
+template <>
+struct HostValueTraits<uint32_t> {
+  static Type type() { return Type::I32; }
+  static uint32_t from_value(Value value) { return value.i32; }
+  static Value to_value(uint32_t x) {
+    Value value;
+    value.i32 = x;
+    return value;
+  }
+};
+
+template <>
+struct HostValueTraits<int32_t> {
+  static Type type() { return Type::I32; }
+  static int32_t from_value(Value value) {
+    return static_cast<int32_t>(value.i32);
+  }
+  static Value to_value(int32_t x) {
+    return HostValueTraits<uint32_t>::to_value(static_cast<uint32_t>(x));
+  }
+};
+
+template <>
+struct HostValueTraits<uint64_t> {
+  static Type type() { return Type::I64; }
+  static uint64_t from_value(Value value) { return value.i64; }
+  static Value to_value(uint64_t x) {
+    Value value;
+    value.i64 = x;
+    return value;
+  }
+};
+
+template <>
+struct HostValueTraits<int64_t> {
+  static Type type() { return Type::I64; }
+  static int64_t from_value(Value value) {
+    return static_cast<int64_t>(value.i64);
+  }
+  static Value to_value(int64_t x) {
+    return HostValueTraits<uint64_t>::to_value(static_cast<uint64_t>(x));
+  }
+};
+
+template <>
+struct HostValueTraits<float> {
+  static Type type() { return Type::F32; }
+  static float from_value(Value value) {
+    float x;
+    memcpy(&x, &value.f32_bits, sizeof(x));
+    return x;
+  }
+  static Value to_value(float x) {
+    Value value;
+    memcpy(&value.f32_bits, &x, sizeof(x));
+    return value;
+  }
+};
+
+template <>
+struct HostValueTraits<double> {
+  static Type type() { return Type::F64; }
+  static double from_value(Value value) {
+    double x;
+    memcpy(&x, &value.f64_bits, sizeof(x));
+    return x;
+  }
+  static Value to_value(double x) {
+    Value value;
+    memcpy(&value.f64_bits, &x, sizeof(x));
+    return value;
+  }
+};
+
+template <size_t... Indexes>
+struct HostArgIndexes {};
+
+template <size_t N, size_t... Indexes>
+struct MakeHostArgIndexes : MakeHostArgIndexes<N - 1, N - 1, Indexes...> {};
+
+template <size_t... Indexes>
+struct MakeHostArgIndexes<0, Indexes...> {
+  typedef HostArgIndexes<Indexes...> type;
+};
+
+/* Calls a host function of type R(Args...) with the arguments at |args|, and
+ * pushes its result. */
+template <typename R, typename... Args>
+struct TypedHostCall {
+  typedef R (*NativeFunc)(Args...);
+
+  static bool results_match(const FuncSignature* sig) {
+    return sig->result_types.size() == 1 &&
+           sig->result_types[0] == HostValueTraits<R>::type();
+  }
+
+  template <size_t... Indexes>
+  static Result call(Thread* thread,
+                     NativeFunc native_func,
+                     const Value* args,
+                     HostArgIndexes<Indexes...>) {
+    R result = native_func(HostValueTraits<Args>::from_value(args[Indexes])...);
+    if (thread->value_stack_top >= thread->value_stack_end)
+      return Result::TrapValueStackExhausted;
+    *thread->value_stack_top++ = HostValueTraits<R>::to_value(result);
+    return Result::Ok;
+  }
+};
+
+template <typename... Args>
+struct TypedHostCall<void, Args...> {
+  typedef void (*NativeFunc)(Args...);
+
+  static bool results_match(const FuncSignature* sig) {
+    return sig->result_types.empty();
+  }
+
+  template <size_t... Indexes>
+  static Result call(Thread* thread,
+                     NativeFunc native_func,
+                     const Value* args,
+                     HostArgIndexes<Indexes...>) {
+    native_func(HostValueTraits<Args>::from_value(args[Indexes])...);
+    return Result::Ok;
+  }
+};
+
+/* The HostFuncTrampoline for a host function of type R(Args...). The
+ * arguments are read straight from the value stack, so nothing is
+ * allocated. */
+template <typename R, typename... Args>
+Result typed_host_trampoline(Thread* thread, const HostFunc* func) {
+  typedef TypedHostCall<R, Args...> Call;
+  Value* args = thread->value_stack_top - sizeof...(Args);
+  thread->value_stack_top = args;
+  return Call::call(
+      thread, reinterpret_cast<typename Call::NativeFunc>(func->native_func),
+      args, typename MakeHostArgIndexes<sizeof...(Args)>::type());
+}
+
+/* Makes calls to |func| call |native_func| directly, converting between wasm
+ * values and its C++ params and result as described by HostValueTraits.
+ * Returns false if its C++ type doesn't match |sig|. */
+template <typename R, typename... Args>
+bool bind_host_func(HostFunc* func,
+                    const FuncSignature* sig,
+                    R (*native_func)(Args...)) {
+  const Type param_types[] = {HostValueTraits<Args>::type()..., Type::Void};
+  if (sig->param_types.size() != sizeof...(Args) ||
+      !std::equal(sig->param_types.begin(), sig->param_types.end(),
+                  param_types) ||
+      !TypedHostCall<R, Args...>::results_match(sig)) {
+    return false;
+  }
+  func->callback = nullptr;
+  func->user_data = nullptr;
+  func->trampoline = typed_host_trampoline<R, Args...>;
+  func->native_func = reinterpret_cast<void (*)()>(native_func);
+  return true;
+}
+
 }  // namespace interpreter
 }  // namespace wabt
 
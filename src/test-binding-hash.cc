@@ -0,0 +1,158 @@
+/*
+ * Copyright 2017 WebAssembly Community Group participants
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "gtest/gtest.h"
+
+#include "binding-hash.h"
+
+#include <string>
+#include <vector>
+
+using namespace wabt;
+
+namespace {
+
+std::string name_of(int i) {
+  return "name" + std::to_string(i);
+}
+
+void on_duplicate(const BindingHash::value_type& a,
+                  const BindingHash::value_type& b,
+                  void* user_data) {
+  auto duplicates = static_cast<std::vector<std::pair<int, int>>*>(user_data);
+  duplicates->emplace_back(a.second.index, b.second.index);
+}
+
+}  // namespace
+
+TEST(binding_hash, empty) {
+  BindingHash hash;
+  ASSERT_TRUE(hash.empty());
+  ASSERT_EQ(-1, hash.find_index(string_view("a")));
+  ASSERT_TRUE(hash.find(string_view("")) == nullptr);
+}
+
+TEST(binding_hash, find_index) {
+  BindingHash hash;
+  for (int i = 0; i < 1000; ++i)
+    hash.emplace(name_of(i), Binding(i));
+  ASSERT_EQ(1000U, hash.size());
+  for (int i = 0; i < 1000; ++i)
+    ASSERT_EQ(i, hash.find_index(string_view(name_of(i))));
+  ASSERT_EQ(-1, hash.find_index(string_view(name_of(1000))));
+}
+
+TEST(binding_hash, find_index_string_slice) {
+  BindingHash hash;
+  hash.emplace("foo", Binding(1));
+  std::string text = "foobar";
+  StringSlice slice;
+  slice.start = text.data();
+  slice.length = 3;
+  ASSERT_EQ(1, hash.find_index(slice));
+  slice.length = 6;
+  ASSERT_EQ(-1, hash.find_index(slice));
+}
+
+TEST(binding_hash, duplicates_find_newest) {
+  BindingHash hash;
+  hash.emplace("a", Binding(0));
+  hash.emplace("b", Binding(1));
+  hash.emplace("a", Binding(2));
+  ASSERT_EQ(2, hash.find_index(string_view("a")));
+  ASSERT_EQ(1, hash.find_index(string_view("b")));
+}
+
+TEST(binding_hash, iterates_in_insertion_order) {
+  BindingHash hash;
+  for (int i = 0; i < 100; ++i)
+    hash.emplace(name_of(99 - i), Binding(i));
+  int i = 0;
+  for (const BindingHash::value_type& binding : hash) {
+    ASSERT_EQ(name_of(99 - i), binding.first);
+    ASSERT_EQ(i, binding.second.index);
+    ++i;
+  }
+  ASSERT_EQ(100, i);
+}
+
+TEST(binding_hash, erase) {
+  BindingHash hash;
+  hash.emplace("a", Binding(0));
+  hash.emplace("b", Binding(1));
+  hash.emplace("a", Binding(2));
+  hash.erase(string_view("a"));
+  ASSERT_EQ(1U, hash.size());
+  ASSERT_EQ(-1, hash.find_index(string_view("a")));
+  ASSERT_EQ(1, hash.find_index(string_view("b")));
+}
+
+TEST(binding_hash, erase_if) {
+  BindingHash hash;
+  for (int i = 0; i < 100; ++i)
+    hash.emplace(name_of(i % 10), Binding(i));
+  hash.erase_if([](const BindingHash::value_type& binding) {
+    return binding.second.index >= 50;
+  });
+  ASSERT_EQ(50U, hash.size());
+  for (int i = 0; i < 10; ++i)
+    ASSERT_EQ(40 + i, hash.find_index(string_view(name_of(i))));
+}
+
+TEST(binding_hash, freeze) {
+  BindingHash hash;
+  for (int i = 0; i < 5000; ++i)
+    hash.emplace(name_of(i), Binding(i));
+  hash.emplace(name_of(0), Binding(5000));
+  ASSERT_TRUE(hash.freeze());
+  ASSERT_EQ(5000, hash.find_index(string_view(name_of(0))));
+  for (int i = 1; i < 5000; ++i)
+    ASSERT_EQ(i, hash.find_index(string_view(name_of(i))));
+  ASSERT_EQ(-1, hash.find_index(string_view(name_of(5000))));
+}
+
+TEST(binding_hash, emplace_after_freeze) {
+  BindingHash hash;
+  for (int i = 0; i < 10; ++i)
+    hash.emplace(name_of(i), Binding(i));
+  ASSERT_TRUE(hash.freeze());
+  hash.emplace(name_of(10), Binding(10));
+  for (int i = 0; i <= 10; ++i)
+    ASSERT_EQ(i, hash.find_index(string_view(name_of(i))));
+}
+
+TEST(binding_hash, find_duplicates) {
+  BindingHash hash;
+  Location loc;
+  WABT_ZERO_MEMORY(loc);
+  loc.line = 3;
+  hash.emplace("a", Binding(loc, 0));
+  loc.line = 1;
+  hash.emplace("b", Binding(loc, 1));
+  loc.line = 2;
+  hash.emplace("a", Binding(loc, 2));
+  loc.line = 4;
+  hash.emplace("b", Binding(loc, 3));
+  hash.emplace("c", Binding(loc, 4));
+
+  std::vector<std::pair<int, int>> duplicates;
+  hash.find_duplicates(on_duplicate, &duplicates);
+  /* Each duplicate is reported with the first binding of its name in the
+   * file. */
+  ASSERT_EQ(2U, duplicates.size());
+  ASSERT_EQ(std::make_pair(2, 0), duplicates[0]);
+  ASSERT_EQ(std::make_pair(1, 3), duplicates[1]);
+}
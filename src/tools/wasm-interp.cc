@@ -16,21 +16,32 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cinttypes>
+#include <climits>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <map>
 #include <memory>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "binary-error-handler.h"
 #include "binary-reader-interpreter.h"
 #include "binary-reader.h"
 #include "interpreter.h"
+#include "interpreter-cache.h"
+#include "interpreter-trace.h"
 #include "literal.h"
 #include "option-parser.h"
 #include "stream.h"
 
-#define INSTRUCTION_QUANTUM 1000
+#if HAVE_SIGACTION
+#include <sys/time.h>
+#endif
+
 #define PROGRAM_NAME "wasm-interp"
 
 using namespace wabt;
@@ -44,10 +55,34 @@ static int s_verbose;
 static const char* s_infile;
 static ReadBinaryOptions s_read_binary_options =
     WABT_READ_BINARY_OPTIONS_DEFAULT;
+static ReadBinaryInterpreterOptions s_read_binary_interpreter_options =
+    WABT_READ_BINARY_INTERPRETER_OPTIONS_DEFAULT;
 static ThreadOptions s_thread_options = WABT_INTERPRETER_THREAD_OPTIONS_DEFAULT;
 static bool s_trace;
+static const char* s_binary_trace_filename;
+/* the number of instructions the --binary-trace buffer holds */
+static uint32_t s_binary_trace_size = 1024 * 1024;
+static const char* s_decode_trace_filename;
 static bool s_spec;
 static bool s_run_all_exports;
+/* the number of times --run-all-exports calls each exported function */
+static uint32_t s_repeat = 1;
+static bool s_jit;
+/* the number of calls an exported function runs in the interpreter before
+ * it is compiled */
+static uint32_t s_jit_threshold = 100;
+static int s_threads = 1;
+/* the fuel each exported function call starts with */
+static uint64_t s_fuel = UINT64_MAX;
+/* the number of times an exported function that runs out of fuel is given
+ * s_fuel more and resumed */
+static uint32_t s_refuel;
+static const char* s_cache_dir;
+static bool s_profile;
+static const char* s_profile_samples_filename;
+#if WITH_OPCODE_COUNTS
+static const char* s_opcode_counts_filename;
+#endif
 
 static std::unique_ptr<FileStream> s_log_stream;
 static std::unique_ptr<FileStream> s_stdout_stream;
@@ -66,8 +101,27 @@ enum {
   FLAG_VALUE_STACK_SIZE,
   FLAG_CALL_STACK_SIZE,
   FLAG_TRACE,
+  FLAG_BINARY_TRACE,
+  FLAG_BINARY_TRACE_SIZE,
+  FLAG_DECODE_TRACE,
   FLAG_SPEC,
   FLAG_RUN_ALL_EXPORTS,
+  FLAG_REPEAT,
+  FLAG_REGISTER_MACHINE,
+  FLAG_FRAME_LOCALS,
+  FLAG_LAZY_COMPILE,
+  FLAG_COMPILE_THREADS,
+  FLAG_CACHE_DIR,
+  FLAG_JIT,
+  FLAG_JIT_THRESHOLD,
+  FLAG_THREADS,
+  FLAG_PROFILE,
+  FLAG_PROFILE_SAMPLES,
+#if WITH_OPCODE_COUNTS
+  FLAG_OPCODE_COUNTS,
+#endif
+  FLAG_FUEL,
+  FLAG_REFUEL,
   NUM_FLAGS
 };
 
@@ -85,6 +139,49 @@ static const char s_description[] =
     "  # parse test.wasm, run the exported functions and trace the output\n"
     "  $ wasm-interp test.wasm --run-all-exports --trace\n"
     "\n"
+    "  # run the exported functions of test.wasm, recording the last\n"
+    "  # instructions run in trace.bin, then print them\n"
+    "  $ wasm-interp test.wasm --run-all-exports --binary-trace=trace.bin\n"
+    "  $ wasm-interp test.wasm --decode-trace=trace.bin\n"
+    "\n"
+    "  # parse test.wasm and run its exported functions as register code,\n"
+    "  # with every value on the stack in a register\n"
+    "  $ wasm-interp test.wasm --run-all-exports --register-machine\n"
+    "\n"
+    "  # parse test.wasm and run its exported functions, addressing locals\n"
+    "  # through a frame pointer\n"
+    "  $ wasm-interp test.wasm --run-all-exports --frame-locals\n"
+    "\n"
+    "  # parse test.wasm and run its exported functions, compiling each one\n"
+    "  # to machine code on its first call\n"
+    "  $ wasm-interp test.wasm --run-all-exports --jit --jit-threshold=0\n"
+    "\n"
+    "  # parse test.wasm and run its exported functions, compiling each\n"
+    "  # function only when it is first called\n"
+    "  $ wasm-interp test.wasm --run-all-exports --lazy-compile\n"
+    "\n"
+    "  # parse test.wasm, compiling its functions on 8 threads at once, and\n"
+    "  # run its exported functions\n"
+    "  $ wasm-interp test.wasm --run-all-exports --compile-threads=8\n"
+    "\n"
+    "  # run the exported functions of test.wasm, and save the compiled\n"
+    "  # module in cache/ so the next run can skip compiling it\n"
+    "  $ wasm-interp test.wasm --run-all-exports --cache-dir=cache\n"
+    "\n"
+    "  # parse test.wasm and run its exported functions on 8 threads at\n"
+    "  # once, each with its own memories, tables and globals\n"
+    "  $ wasm-interp test.wasm --run-all-exports --threads=8\n"
+    "\n"
+    "  # parse test.wasm, run its exported functions, print how many times\n"
+    "  # each function was called and how many instructions it ran, and\n"
+    "  # write sampled call stacks to test.folded for a flamegraph\n"
+    "  $ wasm-interp test.wasm --run-all-exports --profile \\\n"
+    "        --profile-samples=test.folded\n"
+    "\n"
+    "  # parse test.wasm and run its exported functions, stopping each one\n"
+    "  # after about a million instructions\n"
+    "  $ wasm-interp test.wasm --run-all-exports --fuel=1000000\n"
+    "\n"
     "  # parse test.json and run the spec tests\n"
     "  $ wasm-interp test.json --spec\n"
     "\n"
@@ -101,10 +198,61 @@ static Option s_options[] = {
     {FLAG_CALL_STACK_SIZE, 'C', "call-stack-size", "SIZE", YEP,
      "size in frames of the call stack"},
     {FLAG_TRACE, 't', "trace", nullptr, NOPE, "trace execution"},
+    {FLAG_BINARY_TRACE, 0, "binary-trace", "FILENAME", YEP,
+     "record the instructions run in a ring buffer in FILENAME, without "
+     "slowing execution down as much as --trace"},
+    {FLAG_BINARY_TRACE_SIZE, 0, "binary-trace-size", "N", YEP,
+     "keep the last N instructions in the --binary-trace buffer, rounded up "
+     "to a power of two. the default is 1048576"},
+    {FLAG_DECODE_TRACE, 0, "decode-trace", "FILENAME", YEP,
+     "print the instructions recorded by --binary-trace in FILENAME instead "
+     "of running the module, which has to be loaded with the same options"},
     {FLAG_SPEC, 0, "spec", nullptr, NOPE,
      "run spec tests (input file should be .json)"},
     {FLAG_RUN_ALL_EXPORTS, 0, "run-all-exports", nullptr, NOPE,
      "run all the exported functions, in order. useful for testing"},
+    {FLAG_REPEAT, 0, "repeat", "N", YEP,
+     "call each exported function N times in one batch with --run-all-exports, "
+     "passing n as each argument of the nth call (from 0), and print the last "
+     "call"},
+    {FLAG_REGISTER_MACHINE, 0, "register-machine", nullptr, NOPE,
+     "lower each function to three-address code that keeps its params, "
+     "locals and temporaries in registers, and run it in a separate loop"},
+    {FLAG_FRAME_LOCALS, 0, "frame-locals", nullptr, NOPE,
+     "address params and locals at fixed offsets from a frame pointer "
+     "instead of at depths in the value stack"},
+    {FLAG_LAZY_COMPILE, 0, "lazy-compile", nullptr, NOPE,
+     "compile each function on its first call instead of when the module is "
+     "loaded. invalid functions are only reported when they are called"},
+    {FLAG_COMPILE_THREADS, 0, "compile-threads", "N", YEP,
+     "compile the functions on N threads at once when the module is loaded"},
+    {FLAG_CACHE_DIR, 0, "cache-dir", "DIR", YEP,
+     "load the compiled module from DIR if it was cached there, or cache it "
+     "there after compiling it"},
+    {FLAG_JIT, 0, "jit", nullptr, NOPE,
+     "compile exported functions to machine code once they are hot"},
+    {FLAG_JIT_THRESHOLD, 0, "jit-threshold", "N", YEP,
+     "number of calls before an exported function is compiled"},
+    {FLAG_THREADS, 0, "threads", "N", YEP,
+     "with --run-all-exports, run the exports on N threads at once"},
+    {FLAG_PROFILE, 0, "profile", nullptr, NOPE,
+     "print call and instruction counts for each function"},
+    {FLAG_PROFILE_SAMPLES, 0, "profile-samples", "FILENAME", YEP,
+     "sample the call stack on SIGPROF and write it to FILENAME as folded "
+     "stacks"},
+#if WITH_OPCODE_COUNTS
+    {FLAG_OPCODE_COUNTS, 0, "opcode-counts", "FILENAME", YEP,
+     "write the opcodes, opcode pairs and branches run to FILENAME, for "
+     "wasm-opcodecnt --dynamic"},
+#endif
+    {FLAG_FUEL, 0, "fuel", "N", YEP,
+     "stop each exported function after it runs about N instructions. fuel "
+     "is only charged on function entry and on each loop iteration, for the "
+     "whole function or loop body at once, so a branch out of a body still "
+     "pays for all of it"},
+    {FLAG_REFUEL, 0, "refuel", "N", YEP,
+     "when an exported function runs out of fuel, give it --fuel more and "
+     "resume it where it stopped, up to N times"},
 };
 WABT_STATIC_ASSERT(NUM_FLAGS == WABT_ARRAY_SIZE(s_options));
 
@@ -137,6 +285,20 @@ static void on_option(struct OptionParser* parser,
       s_trace = true;
       break;
 
+    case FLAG_BINARY_TRACE:
+      s_binary_trace_filename = argument;
+      break;
+
+    case FLAG_BINARY_TRACE_SIZE:
+      s_binary_trace_size = strtoul(argument, nullptr, 10);
+      if (s_binary_trace_size < 1)
+        WABT_FATAL("--binary-trace-size must be at least 1.\n");
+      break;
+
+    case FLAG_DECODE_TRACE:
+      s_decode_trace_filename = argument;
+      break;
+
     case FLAG_SPEC:
       s_spec = true;
       break;
@@ -144,6 +306,113 @@ static void on_option(struct OptionParser* parser,
     case FLAG_RUN_ALL_EXPORTS:
       s_run_all_exports = true;
       break;
+
+    case FLAG_REPEAT:
+      s_repeat = strtoul(argument, nullptr, 10);
+      if (s_repeat < 1)
+        WABT_FATAL("--repeat must be at least 1.\n");
+      break;
+
+    case FLAG_REGISTER_MACHINE:
+      s_read_binary_interpreter_options.register_machine = true;
+      break;
+
+    case FLAG_FRAME_LOCALS:
+      s_read_binary_interpreter_options.frame_locals = true;
+      break;
+
+    case FLAG_LAZY_COMPILE:
+      s_read_binary_interpreter_options.lazy_compile = true;
+      break;
+
+    case FLAG_COMPILE_THREADS: {
+      char* end;
+      errno = 0;
+      long threads = strtol(argument, &end, 10);
+      if (end == argument || *end != '\0' || errno || threads < 1 ||
+          threads > INT_MAX) {
+        WABT_FATAL(
+            "--compile-threads must be a number of threads, at least 1.\n");
+      }
+      s_read_binary_interpreter_options.compile_threads = threads;
+      break;
+    }
+
+    case FLAG_CACHE_DIR:
+      s_cache_dir = argument;
+      break;
+
+    case FLAG_JIT:
+      s_jit = true;
+      break;
+
+    case FLAG_JIT_THRESHOLD: {
+      char* end;
+      errno = 0;
+      unsigned long threshold = strtoul(argument, &end, 10);
+      if (end == argument || *end != '\0' || argument[0] == '-' || errno ||
+          threshold > UINT32_MAX) {
+        WABT_FATAL("--jit-threshold must be a number of calls.\n");
+      }
+      s_jit_threshold = threshold;
+      break;
+    }
+
+    case FLAG_THREADS: {
+      char* end;
+      errno = 0;
+      long threads = strtol(argument, &end, 10);
+      if (end == argument || *end != '\0' || errno || threads < 1 ||
+          threads > INT_MAX) {
+        WABT_FATAL("--threads must be a number of threads, at least 1.\n");
+      }
+      s_threads = threads;
+      break;
+    }
+
+    case FLAG_PROFILE:
+      s_profile = true;
+      s_read_binary_options.read_debug_names = true;
+      break;
+
+    case FLAG_PROFILE_SAMPLES:
+#if HAVE_SIGACTION
+      s_profile_samples_filename = argument;
+      s_read_binary_options.read_debug_names = true;
+#else
+      WABT_FATAL("--profile-samples isn't supported on this platform.\n");
+#endif
+      break;
+
+#if WITH_OPCODE_COUNTS
+    case FLAG_OPCODE_COUNTS:
+      s_opcode_counts_filename = argument;
+      break;
+#endif
+
+    case FLAG_FUEL: {
+      char* end;
+      errno = 0;
+      unsigned long long fuel = strtoull(argument, &end, 10);
+      if (end == argument || *end != '\0' || argument[0] == '-' || errno ||
+          fuel < 1) {
+        WABT_FATAL("--fuel must be a number of instructions, at least 1.\n");
+      }
+      s_fuel = fuel;
+      break;
+    }
+
+    case FLAG_REFUEL: {
+      char* end;
+      errno = 0;
+      unsigned long refuel = strtoul(argument, &end, 10);
+      if (end == argument || *end != '\0' || argument[0] == '-' || errno ||
+          refuel > UINT32_MAX) {
+        WABT_FATAL("--refuel must be a number of times.\n");
+      }
+      s_refuel = refuel;
+      break;
+    }
   }
 }
 
@@ -169,6 +438,61 @@ static void parse_options(int argc, char** argv) {
   if (s_spec && s_run_all_exports)
     WABT_FATAL("--spec and --run-all-exports are incompatible.\n");
 
+  if (s_threads > 1 && (!s_run_all_exports || s_trace))
+    WABT_FATAL("--threads requires --run-all-exports, without --trace.\n");
+
+  /* The batch doesn't step through the calls, so it can't trace or profile
+   * them. */
+  if (s_repeat > 1 && (!s_run_all_exports || s_threads > 1 || s_trace ||
+                       s_profile || s_profile_samples_filename)) {
+    WABT_FATAL(
+        "--repeat requires --run-all-exports, without --threads, --trace or "
+        "--profile.\n");
+  }
+
+  /* A binary trace holds istream offsets, so it can only be decoded against
+   * the same istream. Lazy compilation appends to it as the code runs, and
+   * the spec tests load many modules. */
+  if ((s_binary_trace_filename || s_decode_trace_filename) &&
+      (s_spec || s_threads > 1 ||
+       s_read_binary_interpreter_options.lazy_compile)) {
+    WABT_FATAL(
+        "--binary-trace and --decode-trace can't be used with --spec, "
+        "--threads or --lazy-compile.\n");
+  }
+
+  /* The profiler follows the interpreter's pc, so it can't see into compiled
+   * code or other threads. */
+  if ((s_profile || s_profile_samples_filename) &&
+      (s_spec || s_jit || s_threads > 1)) {
+    WABT_FATAL("--profile can't be used with --spec, --jit or --threads.\n");
+  }
+
+  /* Compiled code unwinds when it runs out of fuel, so it can't be resumed,
+   * and the batch stops at the first call that doesn't return. */
+  if (s_refuel && (s_jit || s_repeat > 1))
+    WABT_FATAL("--refuel can't be used with --jit or --repeat.\n");
+
+  /* The JIT translates stack code. */
+  if (s_jit && s_read_binary_interpreter_options.register_machine)
+    WABT_FATAL("--register-machine can't be used with --jit.\n");
+
+  /* Lazy compilation grows the istream while the code runs, so only one
+   * thread can run it. The spec tests expect invalid modules to fail to
+   * load, and the profiler needs every function's code up front. */
+  if (s_read_binary_interpreter_options.lazy_compile &&
+      (s_spec || s_threads > 1 || s_profile || s_profile_samples_filename)) {
+    WABT_FATAL(
+        "--lazy-compile can't be used with --spec, --threads or --profile.\n");
+  }
+
+  /* The spec tests import from the modules they load, and a lazily compiled
+   * module still needs its binary, so neither can be cached. */
+  if (s_cache_dir &&
+      (s_spec || s_read_binary_interpreter_options.lazy_compile)) {
+    WABT_FATAL("--cache-dir can't be used with --spec or --lazy-compile.\n");
+  }
+
   if (!s_infile) {
     print_help(&parser, PROGRAM_NAME);
     WABT_FATAL("No filename given.\n");
@@ -271,17 +595,250 @@ static void print_call(StringSlice module_name,
   }
 }
 
+/* The state of --profile and --profile-samples. */
+struct FuncProfile {
+  FuncProfile()
+      : calls(0),
+        self_instructions(0),
+        inclusive_instructions(0),
+        active_frames(0),
+        inclusive_start(0) {}
+
+  uint64_t calls;
+  uint64_t self_instructions;
+  /* includes the instructions run by the functions it calls */
+  uint64_t inclusive_instructions;
+  /* the number of frames of the function on the call stack, and the value of
+   * Profile::instructions when the outermost one was entered */
+  Index active_frames;
+  uint64_t inclusive_start;
+};
+
+struct Profile {
+  /* the istream offset and environment index of each defined function,
+   * sorted by offset */
+  std::vector<std::pair<IstreamOffset, Index>> func_offsets;
+  std::vector<std::string> func_names;
+  std::vector<FuncProfile> funcs;
+  /* the function of each frame on the call stack, innermost last */
+  std::vector<Index> stack;
+  uint64_t instructions = 0;
+  /* the number of samples taken in each call stack, keyed by the names of
+   * its functions joined by ';', outermost first */
+  std::map<std::string, uint64_t> samples;
+};
+
+static Profile s_profile_state;
+/* the thread the SIGPROF handler interrupts to take a sample */
+static Thread* s_profile_thread;
+
+/* Samples are taken this often, in microseconds of CPU time. */
+#define PROFILE_SAMPLE_INTERVAL 1000
+
+static void init_profile(Environment* env) {
+  Profile* profile = &s_profile_state;
+  profile->func_names.resize(env->funcs.size());
+  profile->funcs.resize(env->funcs.size());
+  for (Index i = 0; i < env->funcs.size(); ++i) {
+    Func* func = env->funcs[i].get();
+    if (func->is_host) {
+      HostFunc* host_func = func->as_host();
+      profile->func_names[i] =
+          string_slice_to_string(host_func->module_name) + "." +
+          string_slice_to_string(host_func->field_name);
+      continue;
+    }
+
+    DefinedFunc* defined_func = func->as_defined();
+    if (defined_func->offset != kInvalidIstreamOffset)
+      profile->func_offsets.emplace_back(defined_func->offset, i);
+    profile->func_names[i] = defined_func->name;
+  }
+  std::sort(profile->func_offsets.begin(), profile->func_offsets.end());
+
+  /* Functions without a debug name are named by their export, if any. */
+  for (const std::unique_ptr<Module>& module : env->modules) {
+    for (const Export& export_ : module->exports) {
+      if (export_.kind == ExternalKind::Func &&
+          profile->func_names[export_.index].empty()) {
+        profile->func_names[export_.index] =
+            string_slice_to_string(export_.name);
+      }
+    }
+  }
+
+  for (Index i = 0; i < env->funcs.size(); ++i) {
+    if (profile->func_names[i].empty())
+      profile->func_names[i] = "func[" + std::to_string(i) + "]";
+  }
+}
+
+/* Returns the environment index of the defined function containing |offset|.
+ */
+static Index get_profile_func_index(IstreamOffset offset) {
+  const auto& func_offsets = s_profile_state.func_offsets;
+  auto iter = std::upper_bound(func_offsets.begin(), func_offsets.end(),
+                               std::make_pair(offset, kInvalidIndex));
+  assert(iter != func_offsets.begin());
+  return (iter - 1)->second;
+}
+
+static void profile_enter(Index func_index) {
+  Profile* profile = &s_profile_state;
+  FuncProfile* func = &profile->funcs[func_index];
+  func->calls++;
+  if (func->active_frames++ == 0)
+    func->inclusive_start = profile->instructions;
+  profile->stack.push_back(func_index);
+}
+
+static void profile_leave() {
+  Profile* profile = &s_profile_state;
+  FuncProfile* func = &profile->funcs[profile->stack.back()];
+  if (--func->active_frames == 0)
+    func->inclusive_instructions += profile->instructions - func->inclusive_start;
+  profile->stack.pop_back();
+}
+
+/* Adds a sample of the frames above |call_stack_return_top|. Each entry on the
+ * call stack is a return address, so it is in the function that made the
+ * call. */
+static void profile_sample(Thread* thread,
+                           IstreamOffset* call_stack_return_top) {
+  Profile* profile = &s_profile_state;
+  std::string stack;
+  for (IstreamOffset* entry = call_stack_return_top;
+       entry < thread->call_stack_top; ++entry) {
+    stack += profile->func_names[get_profile_func_index(*entry)];
+    stack += ';';
+  }
+  stack += profile->func_names[get_profile_func_index(thread->pc)];
+  profile->samples[stack]++;
+}
+
+#if HAVE_SIGACTION
+/* the SIGPROF action and profiling timer from before the sampler started */
+static struct sigaction s_old_sigprof_action;
+static struct itimerval s_old_profile_timer;
+
+/* The thread stops with Interrupted at its next function entry or loop
+ * iteration, where run_defined_function takes the sample and resumes it. */
+static void on_profile_timer(int signal) {
+  s_profile_thread->interrupt.store(true, std::memory_order_relaxed);
+}
+
+static void start_profile_sampler(Thread* thread) {
+  s_profile_thread = thread;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_profile_timer;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, &s_old_sigprof_action);
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = PROFILE_SAMPLE_INTERVAL;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, &s_old_profile_timer);
+}
+
+/* Disarms the timer before restoring the old action, so a late SIGPROF
+ * can't reach an action that doesn't expect it, then restores the old timer
+ * (normally disarmed too) and clears an interrupt that arrived after the
+ * last sample. */
+static void stop_profile_sampler() {
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, nullptr);
+  sigaction(SIGPROF, &s_old_sigprof_action, nullptr);
+  setitimer(ITIMER_PROF, &s_old_profile_timer, nullptr);
+  s_profile_thread->interrupt.store(false, std::memory_order_relaxed);
+  s_profile_thread = nullptr;
+}
+
+static void write_profile_samples() {
+  FileStream stream(s_profile_samples_filename);
+  if (!stream.is_open()) {
+    fprintf(stderr, "unable to write profile samples to \"%s\"\n",
+            s_profile_samples_filename);
+    return;
+  }
+  for (const auto& pair : s_profile_state.samples)
+    stream.Writef("%s %" PRIu64 "\n", pair.first.c_str(), pair.second);
+}
+#endif
+
+static void print_profile() {
+  const Profile* profile = &s_profile_state;
+  std::vector<Index> func_indexes;
+  for (Index i = 0; i < profile->funcs.size(); ++i) {
+    if (profile->funcs[i].calls)
+      func_indexes.push_back(i);
+  }
+  std::stable_sort(func_indexes.begin(), func_indexes.end(),
+                   [profile](Index lhs, Index rhs) {
+                     return profile->funcs[lhs].self_instructions >
+                            profile->funcs[rhs].self_instructions;
+                   });
+
+  printf("profile: %" PRIu64 " instructions\n", profile->instructions);
+  printf("%10s %12s %12s  %s\n", "calls", "self", "inclusive", "function");
+  for (Index i : func_indexes) {
+    const FuncProfile& func = profile->funcs[i];
+    printf("%10" PRIu64 " %12" PRIu64 " %12" PRIu64 "  %s\n", func.calls,
+           func.self_instructions, func.inclusive_instructions,
+           profile->func_names[i].c_str());
+  }
+}
+
 static interpreter::Result run_defined_function(Thread* thread,
                                                 IstreamOffset offset) {
   thread->pc = offset;
   interpreter::Result iresult = interpreter::Result::Ok;
-  int quantum = s_trace ? 1 : INSTRUCTION_QUANTUM;
+  /* --profile counts the instructions of each function by stepping through
+   * them one at a time, like --trace. */
+  bool step = s_trace || s_profile;
   IstreamOffset* call_stack_return_top = thread->call_stack_top;
-  while (iresult == interpreter::Result::Ok) {
+  size_t profile_stack_size = s_profile_state.stack.size();
+  uint32_t refuel = s_refuel;
+  if (s_profile)
+    profile_enter(get_profile_func_index(offset));
+  while (true) {
     if (s_trace)
       trace_pc(thread, s_stdout_stream.get());
-    iresult = run_interpreter(thread, quantum, call_stack_return_top);
+    if (s_profile) {
+      IstreamOffset* call_stack_top = thread->call_stack_top;
+      FuncProfile* func = &s_profile_state.funcs[s_profile_state.stack.back()];
+      iresult = step_interpreter(thread, call_stack_return_top);
+      /* A thread that stops charging fuel hasn't run the instruction yet. */
+      if (iresult != interpreter::Result::Interrupted &&
+          iresult != interpreter::Result::FuelExhausted) {
+        s_profile_state.instructions++;
+        func->self_instructions++;
+      }
+      if (thread->call_stack_top > call_stack_top)
+        profile_enter(get_profile_func_index(thread->pc));
+      else if (thread->call_stack_top < call_stack_top)
+        profile_leave();
+    } else if (step) {
+      iresult = step_interpreter(thread, call_stack_return_top);
+    } else {
+      iresult = run_interpreter(thread, call_stack_return_top);
+    }
+
+    if (iresult == interpreter::Result::Interrupted &&
+        s_profile_samples_filename) {
+      profile_sample(thread, call_stack_return_top);
+    } else if (iresult == interpreter::Result::FuelExhausted && refuel > 0) {
+      refuel--;
+      thread->fuel = s_fuel;
+    } else if (iresult != interpreter::Result::Ok) {
+      break;
+    }
   }
+  while (s_profile_state.stack.size() > profile_stack_size)
+    profile_leave();
   if (iresult != interpreter::Result::Returned)
     return iresult;
   /* use OK instead of RETURNED for consistency */
@@ -332,10 +889,20 @@ static interpreter::Result run_function(Thread* thread,
   FuncSignature* sig = &thread->env->sigs[sig_index];
 
   interpreter::Result iresult = push_args(thread, sig, args);
+  thread->fuel = s_fuel;
   if (iresult == interpreter::Result::Ok) {
-    iresult = func->is_host
-                  ? call_host(thread, func->as_host())
-                  : run_defined_function(thread, func->as_defined()->offset);
+    if (func->is_host) {
+      iresult = call_host(thread, func->as_host());
+    } else {
+      DefinedFunc* defined_func = func->as_defined();
+      /* Tier up once the function is hot; tracing needs the interpreter. */
+      if (s_jit && !s_trace && !thread->trace &&
+          defined_func->call_count++ >= s_jit_threshold)
+        jit_compile(thread->env, defined_func);
+      iresult = defined_func->jit_code
+                    ? jit_call(thread, defined_func)
+                    : run_defined_function(thread, defined_func->offset);
+    }
     if (iresult == interpreter::Result::Ok)
       copy_results(thread, sig, out_results);
   }
@@ -400,25 +967,181 @@ static interpreter::Result get_global_export_by_name(
   if (export_->kind != ExternalKind::Global)
     return interpreter::Result::ExportKindMismatch;
 
-  Global* global = &thread->env->globals[export_->index];
+  Type type = thread->env->globals[export_->index].typed_value.type;
   out_results->clear();
-  out_results->push_back(global->typed_value);
+  out_results->push_back(
+      TypedValue(type, thread->instance->global_values[export_->index]));
   return interpreter::Result::Ok;
 }
 
+/* Returns the argument of type |type| that call |n| of a --repeat batch
+ * passes: |n| itself, converted to that type. */
+static Value get_repeat_argument(Type type, uint32_t n) {
+  Value value;
+  switch (type) {
+    case Type::I32:
+      value.i32 = n;
+      break;
+
+    case Type::I64:
+      value.i64 = n;
+      break;
+
+    case Type::F32: {
+      float f32 = n;
+      memcpy(&value.f32_bits, &f32, sizeof(float));
+      break;
+    }
+
+    case Type::F64: {
+      double f64 = n;
+      memcpy(&value.f64_bits, &f64, sizeof(double));
+      break;
+    }
+
+    default:
+      assert(0);
+      break;
+  }
+  return value;
+}
+
+/* Calls the exported function s_repeat times in one batch, passing n as each
+ * argument of call n, and returns the arguments and results of the last
+ * call. */
+static interpreter::Result run_export_repeatedly(
+    Thread* thread,
+    Module* module,
+    const Export* export_,
+    std::vector<TypedValue>* out_args,
+    std::vector<TypedValue>* out_results) {
+  out_args->clear();
+  out_results->clear();
+  PreparedCall call;
+  interpreter::Result iresult =
+      prepare_call(thread->env, module, &export_->name, &call);
+  if (iresult != interpreter::Result::Ok)
+    return iresult;
+  const FuncSignature* sig = &thread->env->sigs[call.func->sig_index];
+
+  if (s_jit && !thread->trace && !call.func->is_host) {
+    DefinedFunc* defined_func = call.func->as_defined();
+    defined_func->call_count += s_repeat;
+    if (defined_func->call_count > s_jit_threshold)
+      jit_compile(thread->env, defined_func);
+  }
+
+  std::vector<std::vector<Value>> arg_columns(call.num_params,
+                                              std::vector<Value>(s_repeat));
+  std::vector<const Value*> args;
+  for (Index i = 0; i < call.num_params; ++i) {
+    for (uint32_t n = 0; n < s_repeat; ++n)
+      arg_columns[i][n] = get_repeat_argument(sig->param_types[i], n);
+    args.push_back(arg_columns[i].data());
+  }
+  std::vector<std::vector<Value>> result_columns(
+      call.num_results, std::vector<Value>(s_repeat));
+  std::vector<Value*> results;
+  for (std::vector<Value>& column : result_columns)
+    results.push_back(column.data());
+  size_t count;
+  thread->fuel = s_fuel;
+  iresult = run_prepared_calls(thread, &call, s_repeat, args.data(),
+                               results.data(), &count);
+
+  for (Index i = 0; i < call.num_params; ++i)
+    out_args->emplace_back(sig->param_types[i], arg_columns[i].back());
+  if (iresult == interpreter::Result::Ok) {
+    for (Index i = 0; i < call.num_results; ++i)
+      out_results->emplace_back(sig->result_types[i], result_columns[i].back());
+  }
+  return iresult;
+}
+
 static void run_all_exports(Module* module,
                             Thread* thread,
                             RunVerbosity verbose) {
   std::vector<TypedValue> args;
   std::vector<TypedValue> results;
   for (const Export& export_ : module->exports) {
-    interpreter::Result iresult = run_export(thread, &export_, args, &results);
+    interpreter::Result iresult =
+        s_repeat > 1
+            ? run_export_repeatedly(thread, module, &export_, &args, &results)
+            : run_export(thread, &export_, args, &results);
     if (verbose == RunVerbosity::Verbose) {
       print_call(empty_string_slice(), export_.name, args, results, iresult);
     }
   }
 }
 
+static bool typed_values_are_equal(const std::vector<TypedValue>& lhs,
+                                   const std::vector<TypedValue>& rhs) {
+  if (lhs.size() != rhs.size())
+    return false;
+  for (size_t i = 0; i < lhs.size(); ++i) {
+    if (lhs[i].type != rhs[i].type)
+      return false;
+    /* Only the low 32 bits of a 32-bit value are meaningful. */
+    bool is_64 = lhs[i].type == Type::I64 || lhs[i].type == Type::F64;
+    if (is_64 ? lhs[i].value.i64 != rhs[i].value.i64
+              : lhs[i].value.i32 != rhs[i].value.i32)
+      return false;
+  }
+  return true;
+}
+
+/* Runs all the exports on s_threads threads at once, each with its own copy
+ * of the environment's memories, tables and globals, made from a snapshot so
+ * that pages are only copied when a thread writes to them. The results from
+ * the first thread are printed, and the others are checked against them. */
+static void run_all_exports_on_threads(Environment* env, Module* module) {
+  struct ExportRun {
+    Instance instance;
+    Thread thread;
+    std::vector<interpreter::Result> iresults;
+    std::vector<std::vector<TypedValue>> results;
+  };
+
+  InstanceSnapshot snapshot;
+  snapshot_instance(&env->instance, &snapshot);
+  std::vector<ExportRun> runs(s_threads);
+  for (ExportRun& run : runs) {
+    init_instance_from_snapshot(&snapshot, &run.instance);
+    init_thread(env, &run.thread, &s_thread_options);
+    run.thread.instance = &run.instance;
+  }
+
+  std::vector<std::thread> threads;
+  for (ExportRun& run : runs) {
+    threads.emplace_back([&run, module]() {
+      std::vector<TypedValue> args;
+      std::vector<TypedValue> results;
+      for (const Export& export_ : module->exports) {
+        run.iresults.push_back(
+            run_export(&run.thread, &export_, args, &results));
+        run.results.push_back(results);
+      }
+    });
+  }
+  for (std::thread& thread : threads)
+    thread.join();
+
+  std::vector<TypedValue> args;
+  for (size_t i = 0; i < module->exports.size(); ++i) {
+    print_call(empty_string_slice(), module->exports[i].name, args,
+               runs[0].results[i], runs[0].iresults[i]);
+  }
+  for (size_t i = 1; i < runs.size(); ++i) {
+    for (size_t j = 0; j < module->exports.size(); ++j) {
+      if (runs[i].iresults[j] != runs[0].iresults[j] ||
+          !typed_values_are_equal(runs[i].results[j], runs[0].results[j])) {
+        printf("thread %" PRIzd ": results differ from thread 0\n", i);
+        break;
+      }
+    }
+  }
+}
+
 static wabt::Result read_module(const char* module_filename,
                                 Environment* env,
                                 BinaryErrorHandler* error_handler,
@@ -431,8 +1154,32 @@ static wabt::Result read_module(const char* module_filename,
 
   result = read_file(module_filename, &data, &size);
   if (WABT_SUCCEEDED(result)) {
-    result = read_binary_interpreter(env, data, size, &s_read_binary_options,
-                                     error_handler, out_module);
+    uint64_t cache_key = 0;
+    std::string cache_filename;
+    if (s_cache_dir) {
+      cache_key = get_module_cache_key(data, size,
+                                       &s_read_binary_interpreter_options);
+      char key_string[17];
+      wabt_snprintf(key_string, sizeof(key_string), "%016" PRIx64, cache_key);
+      cache_filename = std::string(s_cache_dir) + "/" + key_string + ".cache";
+    }
+
+    if (s_cache_dir && WABT_SUCCEEDED(read_module_cache(cache_filename.c_str(),
+                                                        cache_key, env,
+                                                        out_module))) {
+      result = wabt::Result::Ok;
+    } else {
+      EnvironmentMark mark = mark_environment(env);
+      result = read_binary_interpreter(env, data, size, &s_read_binary_options,
+                                       &s_read_binary_interpreter_options,
+                                       error_handler, out_module);
+      /* If the cache can't be written, the next run just compiles the module
+       * again. */
+      if (WABT_SUCCEEDED(result) && s_cache_dir) {
+        write_module_cache(cache_filename.c_str(), cache_key, env, mark,
+                           *out_module);
+      }
+    }
 
     if (WABT_SUCCEEDED(result)) {
       if (s_verbose)
@@ -463,6 +1210,46 @@ static interpreter::Result default_host_callback(const HostFunc* func,
   return interpreter::Result::Ok;
 }
 
+/* Prints a call to one of the typed spectest.print_* functions, in the same
+ * format as default_host_callback. */
+template <typename... Args>
+static void print_typed_host_call(const char* field_name, Args... args) {
+  const TypedValue values[] = {
+      TypedValue(HostValueTraits<Args>::type(),
+                 HostValueTraits<Args>::to_value(args))...};
+  printf("called host spectest.%s(", field_name);
+  for (size_t i = 0; i < sizeof...(Args); ++i) {
+    print_typed_value(&values[i]);
+    if (i != sizeof...(Args) - 1)
+      printf(", ");
+  }
+  printf(") =>\n");
+}
+
+static void spectest_print_i32(int32_t value) {
+  print_typed_host_call("print_i32", value);
+}
+
+static void spectest_print_i64(int64_t value) {
+  print_typed_host_call("print_i64", value);
+}
+
+static void spectest_print_f32(float value) {
+  print_typed_host_call("print_f32", value);
+}
+
+static void spectest_print_f64(double value) {
+  print_typed_host_call("print_f64", value);
+}
+
+static void spectest_print_i32_f32(int32_t value0, float value1) {
+  print_typed_host_call("print_i32_f32", value0, value1);
+}
+
+static void spectest_print_f64_f64(double value0, double value1) {
+  print_typed_host_call("print_f64_f64", value0, value1);
+}
+
 #define PRIimport "\"" PRIstringslice "." PRIstringslice "\""
 #define PRINTF_IMPORT_ARG(x)                    \
   WABT_PRINTF_STRING_SLICE_ARG((x).module_name) \
@@ -479,14 +1266,36 @@ static wabt::Result spectest_import_func(Import* import,
                                          FuncSignature* sig,
                                          PrintErrorCallback callback,
                                          void* user_data) {
-  if (string_slice_eq_cstr(&import->field_name, "print")) {
-    func->as_host()->callback = default_host_callback;
+  HostFunc* host_func = func->as_host();
+  const StringSlice* name = &import->field_name;
+  bool bound;
+  if (string_slice_eq_cstr(name, "print")) {
+    host_func->callback = default_host_callback;
     return wabt::Result::Ok;
+  } else if (string_slice_eq_cstr(name, "print_i32")) {
+    bound = bind_host_func(host_func, sig, spectest_print_i32);
+  } else if (string_slice_eq_cstr(name, "print_i64")) {
+    bound = bind_host_func(host_func, sig, spectest_print_i64);
+  } else if (string_slice_eq_cstr(name, "print_f32")) {
+    bound = bind_host_func(host_func, sig, spectest_print_f32);
+  } else if (string_slice_eq_cstr(name, "print_f64")) {
+    bound = bind_host_func(host_func, sig, spectest_print_f64);
+  } else if (string_slice_eq_cstr(name, "print_i32_f32")) {
+    bound = bind_host_func(host_func, sig, spectest_print_i32_f32);
+  } else if (string_slice_eq_cstr(name, "print_f64_f64")) {
+    bound = bind_host_func(host_func, sig, spectest_print_f64_f64);
   } else {
     print_error(callback, "unknown host function import " PRIimport,
                 PRINTF_IMPORT_ARG(*import));
     return wabt::Result::Error;
   }
+
+  if (!bound) {
+    print_error(callback, "bad signature for host function import " PRIimport,
+                PRINTF_IMPORT_ARG(*import));
+    return wabt::Result::Error;
+  }
+  return wabt::Result::Ok;
 }
 
 static wabt::Result spectest_import_table(Import* import,
@@ -581,14 +1390,72 @@ static wabt::Result read_and_run_module(const char* module_filename) {
   init_environment(&env);
   init_thread(&env, &thread, &s_thread_options);
   result = read_module(module_filename, &env, &error_handler, &module);
+  if (WABT_SUCCEEDED(result) && s_decode_trace_filename) {
+    result = decode_trace(s_decode_trace_filename, &env,
+                          s_stdout_stream.get());
+    if (WABT_FAILED(result)) {
+      fprintf(stderr,
+              "unable to decode trace \"%s\"; it may be damaged, or written "
+              "for a different module\n",
+              s_decode_trace_filename);
+    }
+    return result;
+  }
+
+  TraceBuffer trace_buffer;
+  if (WABT_SUCCEEDED(result) && s_binary_trace_filename) {
+    result = open_trace_buffer(s_binary_trace_filename, s_binary_trace_size,
+                               env.istream->data.size(), &trace_buffer);
+    if (WABT_SUCCEEDED(result))
+      thread.trace = &trace_buffer;
+    else
+      fprintf(stderr, "unable to create trace \"%s\"\n",
+              s_binary_trace_filename);
+  }
+
   if (WABT_SUCCEEDED(result)) {
+    if (s_profile || s_profile_samples_filename)
+      init_profile(&env);
+#if HAVE_SIGACTION
+    if (s_profile_samples_filename)
+      start_profile_sampler(&thread);
+#endif
+
     interpreter::Result iresult = run_start_function(&thread, module);
     if (iresult == interpreter::Result::Ok) {
-      if (s_run_all_exports)
-        run_all_exports(module, &thread, RunVerbosity::Verbose);
+      if (s_run_all_exports) {
+        if (s_threads > 1)
+          run_all_exports_on_threads(&env, module);
+        else
+          run_all_exports(module, &thread, RunVerbosity::Verbose);
+      }
     } else {
       print_interpreter_result("error running start function", iresult);
     }
+
+#if HAVE_SIGACTION
+    if (s_profile_samples_filename) {
+      stop_profile_sampler();
+      write_profile_samples();
+    }
+#endif
+    if (s_profile)
+      print_profile();
+#if WITH_OPCODE_COUNTS
+    if (s_opcode_counts_filename) {
+      FileStream stream(s_opcode_counts_filename);
+      if (stream.is_open()) {
+        write_opcode_counts(thread.opcode_counts.get(), &stream);
+      } else {
+        fprintf(stderr, "unable to write opcode counts to \"%s\"\n",
+                s_opcode_counts_filename);
+      }
+    }
+#endif
+    if (thread.trace && WABT_FAILED(close_trace_buffer(&trace_buffer))) {
+      fprintf(stderr, "unable to write trace \"%s\"\n",
+              s_binary_trace_filename);
+    }
   }
   return result;
 }
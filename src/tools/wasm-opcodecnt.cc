@@ -20,6 +20,10 @@
 #include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
 
 #include "binary-reader.h"
 #include "binary-reader-opcnt.h"
@@ -38,6 +42,7 @@ static const char* s_infile;
 static const char* s_outfile;
 static size_t s_cutoff = 0;
 static const char* s_separator = ": ";
+static bool s_dynamic;
 
 static ReadBinaryOptions s_read_binary_options =
     WABT_READ_BINARY_OPTIONS_DEFAULT;
@@ -53,6 +58,7 @@ enum {
   FLAG_OUTPUT,
   FLAG_CUTOFF,
   FLAG_SEPARATOR,
+  FLAG_DYNAMIC,
   NUM_FLAGS
 };
 
@@ -62,7 +68,12 @@ static const char s_description[] =
     "\n"
     "examples:\n"
     "  # parse binary file test.wasm and write pcode dist file test.dist\n"
-    "  $ wasm-opcodecnt test.wasm -o test.dist\n";
+    "  $ wasm-opcodecnt test.wasm -o test.dist\n"
+    "\n"
+    "  # count the opcodes run by test.wasm's exports, using a wasm-interp\n"
+    "  # built WITH_OPCODE_COUNTS\n"
+    "  $ wasm-interp test.wasm --run-all-exports --opcode-counts=test.counts\n"
+    "  $ wasm-opcodecnt --dynamic test.counts\n";
 
 static Option s_options[] = {
     {FLAG_VERBOSE, 'v', "verbose", nullptr, NOPE,
@@ -73,7 +84,10 @@ static Option s_options[] = {
     {FLAG_CUTOFF, 'c', "cutoff", "N", YEP,
      "cutoff for reporting counts less than N"},
     {FLAG_SEPARATOR, 's', "separator", "SEPARATOR", YEP,
-     "Separator text between element and count when reporting counts"}};
+     "Separator text between element and count when reporting counts"},
+    {FLAG_DYNAMIC, 'd', "dynamic", nullptr, NOPE,
+     "read opcode counts written by wasm-interp --opcode-counts instead of a "
+     "wasm file"}};
 
 WABT_STATIC_ASSERT(NUM_FLAGS == WABT_ARRAY_SIZE(s_options));
 
@@ -103,6 +117,10 @@ static void on_option(struct OptionParser* parser,
     case FLAG_SEPARATOR:
       s_separator = argument;
       break;
+
+    case FLAG_DYNAMIC:
+      s_dynamic = true;
+      break;
   }
 }
 
@@ -284,6 +302,129 @@ static void display_sorted_int_pair_counter_vector(
                                   display_second_fcn, opcode_name);
 }
 
+/* Counts of the opcodes run by wasm-interp. The opcodes are interpreter
+ * opcodes, so they are kept by name; IntCounter values index
+ * s_dynamic_opcode_names. */
+struct BranchCounter {
+  BranchCounter(intmax_t value, size_t taken, size_t not_taken)
+      : value(value), taken(taken), not_taken(not_taken) {}
+
+  intmax_t value;
+  size_t taken;
+  size_t not_taken;
+};
+
+struct DynamicOpcntData {
+  IntCounterVector opcode_vec;
+  IntPairCounterVector opcode_pair_vec;
+  std::vector<BranchCounter> branch_vec;
+};
+
+static std::vector<std::string> s_dynamic_opcode_names;
+static std::map<std::string, intmax_t> s_dynamic_opcode_values;
+
+static intmax_t get_dynamic_opcode_value(const char* name) {
+  auto iter = s_dynamic_opcode_values.find(name);
+  if (iter != s_dynamic_opcode_values.end())
+    return iter->second;
+  intmax_t value = s_dynamic_opcode_names.size();
+  s_dynamic_opcode_names.push_back(name);
+  s_dynamic_opcode_values.emplace(name, value);
+  return value;
+}
+
+static void display_dynamic_opcode_name(FILE* out, intmax_t value) {
+  fprintf(out, "%s", s_dynamic_opcode_names[value].c_str());
+}
+
+static int dynamic_opcode_counter_gt(const IntCounter& counter_1,
+                                     const IntCounter& counter_2) {
+  if (counter_1.count != counter_2.count)
+    return counter_1.count > counter_2.count;
+  return s_dynamic_opcode_names[counter_1.value] <
+         s_dynamic_opcode_names[counter_2.value];
+}
+
+static Result read_dynamic_opcnt(const char* data,
+                                 size_t size,
+                                 DynamicOpcntData* out_data) {
+  std::string text(data, size);
+  size_t line_start = 0;
+  int line_number = 1;
+  while (line_start < text.size()) {
+    size_t line_end = text.find('\n', line_start);
+    if (line_end == std::string::npos)
+      line_end = text.size();
+    std::string line = text.substr(line_start, line_end - line_start);
+    line_start = line_end + 1;
+
+    char name_1[64];
+    char name_2[64];
+    uint64_t count_1;
+    uint64_t count_2;
+    if (line.empty()) {
+      /* skip */
+    } else if (sscanf(line.c_str(), "opcode %63s %" SCNu64, name_1,
+                      &count_1) == 2) {
+      out_data->opcode_vec.emplace_back(get_dynamic_opcode_value(name_1),
+                                        count_1);
+    } else if (sscanf(line.c_str(), "pair %63s %63s %" SCNu64, name_1, name_2,
+                      &count_1) == 3) {
+      out_data->opcode_pair_vec.emplace_back(get_dynamic_opcode_value(name_1),
+                                             get_dynamic_opcode_value(name_2),
+                                             count_1);
+    } else if (sscanf(line.c_str(), "branch %63s %" SCNu64 " %" SCNu64, name_1,
+                      &count_1, &count_2) == 3) {
+      out_data->branch_vec.emplace_back(get_dynamic_opcode_value(name_1),
+                                        count_1, count_2);
+    } else {
+      fprintf(stderr, "%s:%d: unexpected line in opcode counts\n", s_infile,
+              line_number);
+      return Result::Error;
+    }
+    ++line_number;
+  }
+  return Result::Ok;
+}
+
+static void display_branch_counter_vector(
+    FILE* out,
+    const char* title,
+    const std::vector<BranchCounter>& vec) {
+  if (vec.size() == 0)
+    return;
+
+  std::vector<BranchCounter> filtered_vec;
+  for (const BranchCounter& counter : vec) {
+    if (counter.taken + counter.not_taken < s_cutoff)
+      continue;
+    filtered_vec.push_back(counter);
+  }
+  std::sort(filtered_vec.begin(), filtered_vec.end(),
+            [](const BranchCounter& counter_1, const BranchCounter& counter_2) {
+              return counter_1.taken + counter_1.not_taken >
+                     counter_2.taken + counter_2.not_taken;
+            });
+  fprintf(out, "%s\n", title);
+  for (const BranchCounter& counter : filtered_vec) {
+    size_t total = counter.taken + counter.not_taken;
+    display_dynamic_opcode_name(out, counter.value);
+    fprintf(out, "%s%" PRIzd " taken, %" PRIzd " not taken (%.1f%% taken)\n",
+            s_separator, counter.taken, counter.not_taken,
+            total ? 100.0 * counter.taken / total : 0.0);
+  }
+}
+
+static void display_dynamic_opcnt(FILE* out, const DynamicOpcntData& data) {
+  display_sorted_int_counter_vector(out, "Opcode counts:", data.opcode_vec,
+                                    dynamic_opcode_counter_gt,
+                                    display_dynamic_opcode_name, nullptr);
+  display_sorted_int_pair_counter_vector(
+      out, "\nOpcode pair counts:", data.opcode_pair_vec, int_pair_counter_gt,
+      display_dynamic_opcode_name, display_dynamic_opcode_name, nullptr);
+  display_branch_counter_vector(out, "\nBranches:", data.branch_vec);
+}
+
 int ProgramMain(int argc, char** argv) {
   init_stdio();
   parse_options(argc, argv);
@@ -303,7 +444,12 @@ int ProgramMain(int argc, char** argv) {
       ERROR("fopen \"%s\" failed, errno=%d\n", s_outfile, errno);
     result = Result::Error;
   }
-  if (WABT_SUCCEEDED(result)) {
+  if (WABT_SUCCEEDED(result) && s_dynamic) {
+    DynamicOpcntData opcnt_data;
+    result = read_dynamic_opcnt(data, size, &opcnt_data);
+    if (WABT_SUCCEEDED(result))
+      display_dynamic_opcnt(out, opcnt_data);
+  } else if (WABT_SUCCEEDED(result)) {
     OpcntData opcnt_data;
     result = read_binary_opcnt(data, size, &s_read_binary_options, &opcnt_data);
     if (WABT_SUCCEEDED(result)) {
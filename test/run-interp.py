@@ -17,6 +17,7 @@
 
 import argparse
 import os
+import shutil
 import subprocess
 import sys
 
@@ -45,7 +46,30 @@ def main(args):
                       action='store_true')
   parser.add_argument('--run-all-exports', action='store_true')
   parser.add_argument('--spec', action='store_true')
+  parser.add_argument('--repeat', metavar='N')
   parser.add_argument('-t', '--trace', action='store_true')
+  parser.add_argument('--register-machine', action='store_true')
+  parser.add_argument('--frame-locals', action='store_true')
+  parser.add_argument('--lazy-compile', action='store_true')
+  parser.add_argument('--compile-threads', metavar='N')
+  parser.add_argument('--cache', help='run the module twice with an empty '
+                      + '--cache-dir, so the second run loads it from the '
+                      + 'cache.', action='store_true')
+  parser.add_argument('--binary-trace-size', metavar='N',
+                      help='run the module with --binary-trace, keeping the '
+                      + 'last N instructions, then print the trace with '
+                      + '--decode-trace.')
+  parser.add_argument('--jit', action='store_true')
+  parser.add_argument('--jit-threshold', metavar='N')
+  parser.add_argument('--threads', metavar='N')
+  parser.add_argument('--profile', action='store_true')
+  parser.add_argument('--profile-samples', action='store_true',
+                      help='print the call stacks that got at least a tenth '
+                      'of the samples taken by --profile-samples.')
+  parser.add_argument('--fuel', metavar='N')
+  parser.add_argument('--refuel', metavar='N')
+  parser.add_argument('--debug-names', action='store_true')
+  parser.add_argument('--no-check', action='store_true')
   parser.add_argument('file', help='test file.')
   options = parser.parse_args(args)
 
@@ -55,6 +79,8 @@ def main(args):
   wast2wasm.AppendOptionalArgs({
       '-v': options.verbose,
       '--spec': options.spec,
+      '--debug-names': options.debug_names,
+      '--no-check': options.no_check,
   })
 
   wasm_interp = utils.Executable(
@@ -64,7 +90,18 @@ def main(args):
       '-v': options.verbose,
       '--run-all-exports': options.run_all_exports,
       '--spec': options.spec,
+      '--repeat': options.repeat,
       '--trace': options.trace,
+      '--register-machine': options.register_machine,
+      '--frame-locals': options.frame_locals,
+      '--lazy-compile': options.lazy_compile,
+      '--compile-threads': options.compile_threads,
+      '--jit': options.jit,
+      '--jit-threshold': options.jit_threshold,
+      '--threads': options.threads,
+      '--profile': options.profile,
+      '--fuel': options.fuel,
+      '--refuel': options.refuel,
   })
 
   wast2wasm.verbose = options.print_cmd
@@ -74,7 +111,32 @@ def main(args):
     new_ext = '.json' if options.spec else '.wasm'
     out_file = utils.ChangeDir(utils.ChangeExt(options.file, new_ext), out_dir)
     wast2wasm.RunWithArgs(options.file, '-o', out_file)
-    wasm_interp.RunWithArgs(out_file)
+    if options.cache:
+      cache_dir = utils.ChangeExt(out_file, '-cache')
+      if os.path.exists(cache_dir):
+        shutil.rmtree(cache_dir)
+      os.makedirs(cache_dir)
+      wasm_interp.RunWithArgs(out_file, '--cache-dir=' + cache_dir)
+      wasm_interp.RunWithArgs(out_file, '--cache-dir=' + cache_dir)
+    elif options.binary_trace_size:
+      trace_file = utils.ChangeExt(out_file, '.trace')
+      wasm_interp.RunWithArgs(out_file, '--binary-trace=' + trace_file,
+                              '--binary-trace-size=' +
+                              options.binary_trace_size)
+      wasm_interp.RunWithArgs(out_file, '--decode-trace=' + trace_file)
+    elif options.profile_samples:
+      # Which stacks are sampled depends on timing, so only print the ones
+      # that most of the time was spent in.
+      samples_file = utils.ChangeExt(out_file, '.folded')
+      wasm_interp.RunWithArgs(out_file, '--profile-samples=' + samples_file)
+      with open(samples_file) as f:
+        samples = [line.rsplit(' ', 1) for line in f.read().splitlines()]
+      total = sum(int(count) for _, count in samples)
+      for stack, count in sorted(samples):
+        if int(count) * 10 >= total:
+          sys.stdout.write(stack + '\n')
+    else:
+      wasm_interp.RunWithArgs(out_file)
 
   return 0
 
@@ -42,6 +42,10 @@ def main(args):
                       action='store_false')
   parser.add_argument('--print-cmd', help='print the commands that are run.',
                       action='store_true')
+  parser.add_argument('--dynamic',
+                      help='the test file holds opcode counts written by '
+                      'wasm-interp --opcode-counts, not a wast file.',
+                      action='store_true')
   parser.add_argument('file', help='test file.')
   options = parser.parse_args(args)
 
@@ -59,6 +63,10 @@ def main(args):
   wast2wasm.verbose = options.print_cmd
   wasm_opcodecnt.verbose = options.print_cmd
 
+  if options.dynamic:
+    wasm_opcodecnt.RunWithArgs('--dynamic', options.file)
+    return 0
+
   with utils.TempDirectory(options.out_dir, 'run-opcodecnt-') as out_dir:
     out_file = utils.ChangeDir(utils.ChangeExt(options.file, '.wasm'), out_dir)
     wast2wasm.RunWithArgs(options.file, '-o', out_file)